@@ -69,13 +69,8 @@
 # define BAN_EVENT_LIST_MAXSZ	512
 #endif
 
-/* This "headroom" is for cases where many concurrent processes are
- * incrementing the index, possibly past the MAXSZs above.  We thus allocate
- * some headroom for them, to mitigate/avoid array out-of-bounds faults.
- */
-#ifndef BAN_LIST_HEADROOMSZ
-# define BAN_LIST_HEADROOMSZ	10
-#endif
+/* Upper bound on the number of entries configurable via BanTable. */
+#define BAN_TABLE_MAX_ENTRIES	16777216
 
 /* From src/main.c */
 extern pid_t mpid;
@@ -101,9 +96,20 @@ struct ban_entry {
 #define BAN_TYPE_USER		3
 
 struct ban_list {
-  struct ban_entry bl_entries[BAN_LIST_MAXSZ + BAN_LIST_HEADROOMSZ];
   unsigned int bl_listlen;
   unsigned int bl_next_slot;
+
+  /* Number of entry slots, and of hash index buckets (a power of two). */
+  unsigned int bl_maxsz;
+  unsigned int bl_nbuckets;
+
+  /* Number of index buckets marked as deleted; these are reclaimed by
+   * rebuilding the index.
+   */
+  unsigned int bl_ndeleted;
+
+  /* Earliest expiry time of any ban, or zero if no bans expire. */
+  time_t bl_next_expires;
 };
 
 struct ban_event_entry {
@@ -139,16 +145,52 @@ struct ban_event_entry {
 #define BAN_EV_TYPE_EMPTY_PASSWORD		19
 
 struct ban_event_list {
-  struct ban_event_entry bel_entries[BAN_EVENT_LIST_MAXSZ + BAN_LIST_HEADROOMSZ];
   unsigned int bel_listlen;
   unsigned int bel_next_slot;
+  unsigned int bel_maxsz;
+  unsigned int bel_nbuckets;
+  unsigned int bel_ndeleted;
+
+  /* Earliest end of any expiring event window, or zero if none expire. */
+  time_t bel_next_expires;
 };
 
+/* The shm segment holds a struct ban_data, followed by the ban entries, the
+ * event entries, and then the hash indexes for the ban and event entries.
+ * The ban index is keyed on the type and name of a ban (so that bans for
+ * the same name on different vhosts share a probe sequence), and the event
+ * index on the type, server ID, and source of an event.  Each index bucket
+ * holds the entry's slot number plus one, or one of the markers below.
+ */
 struct ban_data {
+  uint32_t bd_magic;
+  uint32_t bd_version;
+
+  /* Bumped by the process holding the write lock before and after it changes
+   * the lists; an odd value means an update is in progress.  This lets the
+   * per-connection ban checks read the lists without taking the lock.
+   */
+  volatile unsigned int bd_seqno;
+
   struct ban_list bans;
   struct ban_event_list events;
 };
 
+#define BAN_DATA_MAGIC		0x42414e44
+#define BAN_DATA_VERSION	2
+
+#define BAN_INDEX_EMPTY		((uint32_t) 0)
+#define BAN_INDEX_DELETED	((uint32_t) -1)
+
+#if defined(__GNUC__)
+# define BAN_MEMORY_BARRIER()	__sync_synchronize()
+#else
+# define BAN_MEMORY_BARRIER()
+#endif /* __GNUC__ */
+
+/* Number of times to retry a lock-free read before taking the lock. */
+#define BAN_SEQLOCK_MAX_ATTEMPTS	100
+
 /* Tracks whether we have already seen the client connect, so that we only
  * generate the 'client-connect-rate' event once, even in the face of multiple
  * HOST commands.
@@ -156,6 +198,15 @@ struct ban_data {
 static int ban_client_connected = FALSE;
 
 static struct ban_data *ban_lists = NULL;
+
+/* The entry arrays and indexes in the shm, located using ban_data_map(). */
+static struct ban_entry *ban_entries = NULL;
+static struct ban_event_entry *ban_event_entries = NULL;
+static uint32_t *ban_index = NULL;
+static uint32_t *ban_event_index = NULL;
+
+/* Number of nested ban_lock_shm() locks held by this process. */
+static unsigned int ban_nlocks = 0;
 static int ban_engine = -1;
 
 /* Track whether "BanEngine on" was EVER seen in the configuration; see
@@ -168,6 +219,8 @@ static char *ban_log = NULL;
 static char *ban_message = NULL;
 static int ban_shmid = -1;
 static char *ban_table = NULL;
+static unsigned int ban_table_nbans = BAN_LIST_MAXSZ;
+static unsigned int ban_table_nevents = BAN_EVENT_LIST_MAXSZ;
 static pr_fh_t *ban_tabfh = NULL;
 static int ban_timerno = -1;
 
@@ -792,11 +845,86 @@ static int ban_cache_entry_set(pool *p, struct ban_cache_entry *bce) {
 /* Functions for marshalling key/value data to/from local cache,
  * i.e. SysV shm.
  */
+/* Returns the number of index buckets to use for a list of the given size;
+ * the index is kept at most half full, so that probe sequences stay short.
+ */
+static unsigned int ban_index_nbuckets(unsigned int maxsz) {
+  unsigned int nbuckets = 16;
+
+  while (nbuckets < (maxsz * 2)) {
+    nbuckets *= 2;
+  }
+
+  return nbuckets;
+}
+
+static size_t ban_data_size(unsigned int nbans, unsigned int nevents) {
+  return sizeof(struct ban_data) +
+    (nbans * sizeof(struct ban_entry)) +
+    (nevents * sizeof(struct ban_event_entry)) +
+    ((ban_index_nbuckets(nbans) + ban_index_nbuckets(nevents)) *
+      sizeof(uint32_t));
+}
+
+/* Points the entry array and index pointers at their locations in the
+ * given shm.
+ */
+static void ban_data_map(struct ban_data *data) {
+  char *ptr;
+
+  ptr = ((char *) data) + sizeof(struct ban_data);
+  ban_entries = (struct ban_entry *) ptr;
+
+  ptr += (data->bans.bl_maxsz * sizeof(struct ban_entry));
+  ban_event_entries = (struct ban_event_entry *) ptr;
+
+  ptr += (data->events.bel_maxsz * sizeof(struct ban_event_entry));
+  ban_index = (uint32_t *) ptr;
+
+  ptr += (data->bans.bl_nbuckets * sizeof(uint32_t));
+  ban_event_index = (uint32_t *) ptr;
+}
+
+/* Checks that an existing shm, e.g. one left by an earlier version of this
+ * module, has the layout we expect.
+ */
+static int ban_data_valid(int shmid, struct ban_data *data) {
+  struct shmid_ds ds;
+
+  memset(&ds, 0, sizeof(ds));
+  if (shmctl(shmid, IPC_STAT, &ds) < 0) {
+    return FALSE;
+  }
+
+  if (ds.shm_segsz < sizeof(struct ban_data) ||
+      data->bd_magic != BAN_DATA_MAGIC ||
+      data->bd_version != BAN_DATA_VERSION) {
+    return FALSE;
+  }
+
+  if (data->bans.bl_maxsz == 0 ||
+      data->bans.bl_maxsz > BAN_TABLE_MAX_ENTRIES ||
+      data->bans.bl_nbuckets != ban_index_nbuckets(data->bans.bl_maxsz) ||
+      data->events.bel_maxsz == 0 ||
+      data->events.bel_maxsz > BAN_TABLE_MAX_ENTRIES ||
+      data->events.bel_nbuckets != ban_index_nbuckets(data->events.bel_maxsz)) {
+    return FALSE;
+  }
+
+  if (ban_data_size(data->bans.bl_maxsz, data->events.bel_maxsz) >
+      ds.shm_segsz) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 static struct ban_data *ban_get_shm(pr_fh_t *tabfh) {
   int shmid;
   int shm_existed = FALSE;
   struct ban_data *data = NULL;
   key_t key;
+  size_t datasz;
 
   /* If we already have a shmid, no need to do anything. */
   if (ban_shmid >= 0) {
@@ -816,11 +944,13 @@ static struct ban_data *ban_get_shm(pr_fh_t *tabfh) {
     return NULL;
   }
 
+  datasz = ban_data_size(ban_table_nbans, ban_table_nevents);
+
   /* Try first using IPC_CREAT|IPC_EXCL, to check if there is an existing
    * shm for this key.  If there is, try again, using a flag of zero.
    */
 
-  shmid = shmget(key, sizeof(struct ban_data), IPC_CREAT|IPC_EXCL|0666);
+  shmid = shmget(key, datasz, IPC_CREAT|IPC_EXCL|0666);
   if (shmid < 0) {
 
     if (errno == EEXIST) {
@@ -835,7 +965,8 @@ static struct ban_data *ban_get_shm(pr_fh_t *tabfh) {
 
   /* Attach to the shm. */
   data = (struct ban_data *) shmat(shmid, NULL, 0);
-  if (data == NULL) {
+  if (data == NULL ||
+      data == (struct ban_data *) -1) {
     int xerrno = errno;
 
     (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
@@ -845,6 +976,53 @@ static struct ban_data *ban_get_shm(pr_fh_t *tabfh) {
     return NULL;
   }
 
+  if (shm_existed &&
+      ban_data_valid(shmid, data) == FALSE) {
+    int res;
+
+    /* An existing shm which is not laid out as we expect is most likely
+     * left over from an earlier version of this module; replace it.
+     */
+    (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+      "existing shmid %d for BanTable '%s' has unexpected layout, replacing it",
+      shmid, tabfh->fh_path);
+
+    (void) shmdt((void *) data);
+
+    PRIVS_ROOT
+    res = shmctl(shmid, IPC_RMID, NULL);
+    PRIVS_RELINQUISH
+
+    if (res < 0) {
+      int xerrno = errno;
+
+      (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+        "error removing shmid %d: %s", shmid, strerror(xerrno));
+
+      errno = xerrno;
+      return NULL;
+    }
+
+    shmid = shmget(key, datasz, IPC_CREAT|IPC_EXCL|0666);
+    if (shmid < 0) {
+      return NULL;
+    }
+
+    data = (struct ban_data *) shmat(shmid, NULL, 0);
+    if (data == NULL ||
+        data == (struct ban_data *) -1) {
+      int xerrno = errno;
+
+      (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+        "unable to attach to shm: %s", strerror(xerrno));
+
+      errno = xerrno;
+      return NULL;
+    }
+
+    shm_existed = FALSE;
+  }
+
   if (!shm_existed) {
 
     /* Make sure the memory is initialized. */
@@ -853,23 +1031,39 @@ static struct ban_data *ban_get_shm(pr_fh_t *tabfh) {
         "error write-locking shm: %s", strerror(errno));
     }
 
-    memset(data, '\0', sizeof(struct ban_data));
+    memset(data, '\0', datasz);
+    data->bd_magic = BAN_DATA_MAGIC;
+    data->bd_version = BAN_DATA_VERSION;
+    data->bans.bl_maxsz = ban_table_nbans;
+    data->bans.bl_nbuckets = ban_index_nbuckets(ban_table_nbans);
+    data->events.bel_maxsz = ban_table_nevents;
+    data->events.bel_nbuckets = ban_index_nbuckets(ban_table_nevents);
 
     if (ban_lock_shm(LOCK_UN) < 0) {
       (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
         "error unlocking shm: %s", strerror(errno));
     }
+
+  } else if (data->bans.bl_maxsz != ban_table_nbans ||
+             data->events.bel_maxsz != ban_table_nevents) {
+    (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+      "existing shmid %d for BanTable '%s' holds %u bans, %u events; "
+      "restart the daemon for configured sizes to take effect", shmid,
+      tabfh->fh_path, data->bans.bl_maxsz, data->events.bel_maxsz);
   }
 
+  ban_data_map(data);
+
   ban_shmid = shmid;
   (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
-    "obtained shmid %d for BanTable '%s'", ban_shmid, tabfh->fh_path);
+    "obtained shmid %d for BanTable '%s' (%u bans, %u events)", ban_shmid,
+    tabfh->fh_path, data->bans.bl_maxsz, data->events.bel_maxsz);
 
   return data;
 }
 
 static int ban_lock_shm(int flags) {
-  static unsigned int ban_nlocks = 0;
+  static int ban_lock_excl = FALSE;
 
 #ifndef HAVE_FLOCK
   int lock_flag;
@@ -887,6 +1081,26 @@ static int ban_lock_shm(int flags) {
     return 0;
   }
 
+  /* Only the outermost unlock actually releases the lock. */
+  if (ban_nlocks > 1 &&
+      (flags & LOCK_UN)) {
+    ban_nlocks--;
+    return 0;
+  }
+
+  if ((flags & LOCK_UN) &&
+      ban_lock_excl == TRUE) {
+    /* Done writing; an even sequence number tells lock-free readers that the
+     * lists are consistent again.
+     */
+    if (ban_lists != NULL) {
+      BAN_MEMORY_BARRIER();
+      ban_lists->bd_seqno++;
+    }
+
+    ban_lock_excl = FALSE;
+  }
+
 #ifdef HAVE_FLOCK
   while (flock(ban_tabfh->fh_fd, flags) < 0) {
     if (errno == EINTR) {
@@ -896,16 +1110,6 @@ static int ban_lock_shm(int flags) {
 
     return -1;
   }
-
-  if ((flags & LOCK_SH) ||
-      (flags & LOCK_EX)) {
-    ban_nlocks++;
-
-  } else if (flags & LOCK_UN) {
-    ban_nlocks--;
-  }
-
-  return 0;
 #else
   lock_flag = F_SETLKW;
 
@@ -937,23 +1141,34 @@ static int ban_lock_shm(int flags) {
 
     return -1;
   }
+#endif /* HAVE_FLOCK */
 
   if ((flags & LOCK_SH) ||
       (flags & LOCK_EX)) {
     ban_nlocks++;
 
+    if ((flags & LOCK_EX) &&
+        ban_lists != NULL) {
+      /* An odd sequence number tells lock-free readers that an update is in
+       * progress.  A writer which died mid-update may have left the number
+       * odd already.
+       */
+      ban_lists->bd_seqno += (ban_lists->bd_seqno % 2 == 0) ? 1 : 2;
+      BAN_MEMORY_BARRIER();
+      ban_lock_excl = TRUE;
+    }
+
   } else if (flags & LOCK_UN) {
     ban_nlocks--;
   }
 
   return 0;
-#endif /* HAVE_FLOCK */
 }
 
 static int ban_disconnect_class(const char *class) {
   pr_scoreboard_entry_t *score = NULL;
   unsigned char kicked_class = FALSE;
-  unsigned int nclients = 0;
+  unsigned int count = 0, nclients = 0;
   pid_t session_pid;
 
   if (!class) {
@@ -961,6 +1176,16 @@ static int ban_disconnect_class(const char *class) {
     return -1;
   }
 
+  /* If the scoreboard counts show no sessions to disconnect, there is no
+   * need to read through the scoreboard.
+   */
+  if (pr_scoreboard_count_get(PR_SCORE_COUNT_CLASS, NULL, NULL, NULL, class,
+      &count) == 0 &&
+      count == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
   /* Iterate through the scoreboard, and send a SIGTERM to each
    * PID whose class matches the given class.  Make sure that we exclude
    * our own PID from that list; our own termination is handled elsewhere.
@@ -1017,7 +1242,7 @@ static int ban_disconnect_class(const char *class) {
 static int ban_disconnect_host(const char *host) {
   pr_scoreboard_entry_t *score = NULL;
   unsigned char kicked_host = FALSE;
-  unsigned int nclients = 0;
+  unsigned int count = 0, nclients = 0;
   pid_t session_pid;
 
   if (!host) {
@@ -1025,6 +1250,16 @@ static int ban_disconnect_host(const char *host) {
     return -1;
   }
 
+  /* If the scoreboard counts show no sessions to disconnect, there is no
+   * need to read through the scoreboard.
+   */
+  if (pr_scoreboard_count_get(PR_SCORE_COUNT_HOST, NULL, host, NULL, NULL,
+      &count) == 0 &&
+      count == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
   /* Iterate through the scoreboard, and send a SIGTERM to each
    * PID whose address matches the given host.  Make sure that we exclude
    * our own PID from that list; our own termination is handled elsewhere.
@@ -1081,7 +1316,7 @@ static int ban_disconnect_host(const char *host) {
 static int ban_disconnect_user(const char *user) {
   pr_scoreboard_entry_t *score = NULL;
   unsigned char kicked_user = FALSE;
-  unsigned int nclients = 0;
+  unsigned int count = 0, nclients = 0;
   pid_t session_pid;
 
   if (!user) {
@@ -1089,6 +1324,16 @@ static int ban_disconnect_user(const char *user) {
     return -1;
   }
 
+  /* If the scoreboard counts show no sessions to disconnect, there is no
+   * need to read through the scoreboard.
+   */
+  if (pr_scoreboard_count_get(PR_SCORE_COUNT_USER, NULL, NULL, user, NULL,
+      &count) == 0 &&
+      count == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
   /* Iterate through the scoreboard, and send a SIGTERM to each
    * PID whose name matches the given user name.  Make sure that we exclude
    * our own PID from that list; our own termination is handled elsewhere.
@@ -1199,6 +1444,97 @@ static void ban_send_message(pool *p, const char *user,
  */
 
 /* Add an entry to the ban list. */
+/* FNV-1a, over the type, server ID, and name of a ban or event entry.  Bans
+ * are hashed with a server ID of zero.
+ */
+static uint32_t ban_hash(unsigned int type, unsigned int sid,
+    const char *name) {
+  register unsigned int i;
+  uint32_t h = 2166136261U;
+  size_t namelen;
+
+  h = (h ^ (type & 0xff)) * 16777619U;
+
+  for (i = 0; i < sizeof(sid); i++) {
+    h = (h ^ ((sid >> (i * 8)) & 0xff)) * 16777619U;
+  }
+
+  /* Entries hold at most BAN_STRING_MAXSZ-1 characters of the name. */
+  namelen = strlen(name);
+  if (namelen >= BAN_STRING_MAXSZ) {
+    namelen = BAN_STRING_MAXSZ - 1;
+  }
+
+  for (i = 0; i < namelen; i++) {
+    h = (h ^ (unsigned char) name[i]) * 16777619U;
+  }
+
+  return h;
+}
+
+static void ban_index_add(uint32_t *index, unsigned int nbuckets,
+    unsigned int *ndeleted, uint32_t h, unsigned int slot) {
+  register unsigned int i;
+  uint32_t mask = nbuckets - 1;
+
+  for (i = 0; i < nbuckets; i++) {
+    uint32_t *bucket;
+
+    bucket = &(index[(h + i) & mask]);
+    if (*bucket == BAN_INDEX_EMPTY ||
+        *bucket == BAN_INDEX_DELETED) {
+      if (*bucket == BAN_INDEX_DELETED) {
+        (*ndeleted)--;
+      }
+
+      *bucket = slot + 1;
+      return;
+    }
+  }
+}
+
+static void ban_index_remove(uint32_t *index, unsigned int nbuckets,
+    unsigned int *ndeleted, uint32_t h, unsigned int slot) {
+  register unsigned int i;
+  uint32_t mask = nbuckets - 1;
+
+  for (i = 0; i < nbuckets; i++) {
+    uint32_t *bucket;
+
+    bucket = &(index[(h + i) & mask]);
+    if (*bucket == BAN_INDEX_EMPTY) {
+      return;
+    }
+
+    if (*bucket == slot + 1) {
+      *bucket = BAN_INDEX_DELETED;
+      (*ndeleted)++;
+      return;
+    }
+  }
+}
+
+/* Rebuilds the ban index, reclaiming deleted buckets.  The caller must hold
+ * the write lock.
+ */
+static void ban_list_reindex(void) {
+  register unsigned int i;
+
+  memset(ban_index, 0, ban_lists->bans.bl_nbuckets * sizeof(uint32_t));
+  ban_lists->bans.bl_ndeleted = 0;
+
+  for (i = 0; i < ban_lists->bans.bl_maxsz; i++) {
+    if (ban_entries[i].be_type != 0) {
+      ban_index_add(ban_index, ban_lists->bans.bl_nbuckets,
+        &(ban_lists->bans.bl_ndeleted),
+        ban_hash(ban_entries[i].be_type, 0, ban_entries[i].be_name), i);
+    }
+  }
+
+  pr_trace_msg(trace_channel, 9, "rebuilt index for %u bans",
+    ban_lists->bans.bl_listlen);
+}
+
 static int ban_list_add(pool *p, unsigned int type, unsigned int sid,
     const char *name, const char *reason, time_t lasts,
     const char *rule_message) {
@@ -1218,11 +1554,11 @@ static int ban_list_add(pool *p, unsigned int type, unsigned int sid,
 
     pr_signals_handle();
 
-    if (ban_lists->bans.bl_next_slot >= BAN_LIST_MAXSZ) {
+    if (ban_lists->bans.bl_next_slot >= ban_lists->bans.bl_maxsz) {
       ban_lists->bans.bl_next_slot = 0;
     }
 
-    be = &(ban_lists->bans.bl_entries[ban_lists->bans.bl_next_slot]);
+    be = &(ban_entries[ban_lists->bans.bl_next_slot]);
     if (be->be_type == 0) {
       be->be_type = type;
       be->be_sid = sid;
@@ -1236,22 +1572,29 @@ static int ban_list_add(pool *p, unsigned int type, unsigned int sid,
         sstrncpy(be->be_message, rule_message, sizeof(be->be_message));
       }
 
+      ban_index_add(ban_index, ban_lists->bans.bl_nbuckets,
+        &(ban_lists->bans.bl_ndeleted), ban_hash(type, 0, be->be_name),
+        ban_lists->bans.bl_next_slot);
+
+      if (be->be_expires != 0 &&
+          (ban_lists->bans.bl_next_expires == 0 ||
+           be->be_expires < ban_lists->bans.bl_next_expires)) {
+        ban_lists->bans.bl_next_expires = be->be_expires;
+      }
+
       switch (type) {
         case BAN_TYPE_USER:
-          pr_event_generate("mod_ban.ban-user",
-            ban_lists->bans.bl_entries[ban_lists->bans.bl_next_slot].be_name);
+          pr_event_generate("mod_ban.ban-user", be->be_name);
           ban_disconnect_user(name);
           break;
 
         case BAN_TYPE_HOST:
-          pr_event_generate("mod_ban.ban-host",
-            ban_lists->bans.bl_entries[ban_lists->bans.bl_next_slot].be_name);
+          pr_event_generate("mod_ban.ban-host", be->be_name);
           ban_disconnect_host(name);
           break;
 
         case BAN_TYPE_CLASS:
-          pr_event_generate("mod_ban.ban-class",
-            ban_lists->bans.bl_entries[ban_lists->bans.bl_next_slot].be_name);
+          pr_event_generate("mod_ban.ban-class", be->be_name);
           ban_disconnect_class(name);
           break;
       }
@@ -1271,7 +1614,8 @@ static int ban_list_add(pool *p, unsigned int type, unsigned int sid,
          * started.
          */
         (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
-          "maximum number of ban slots (%u) already in use", BAN_LIST_MAXSZ);
+          "maximum number of ban slots (%u) already in use",
+          ban_lists->bans.bl_maxsz);
 
         errno = ENOSPC;
         res = -1;
@@ -1316,11 +1660,105 @@ static int ban_list_add(pool *p, unsigned int type, unsigned int sid,
   return res;
 }
 
+/* Looks up a ban of the given type and name which applies to the given
+ * server ID, using the index.  If found, returns the slot of the ban, and
+ * copies its client-displayable message (if any) into the given buffer.
+ * The caller must either hold a lock, or be prepared for inconsistent
+ * results (see ban_list_lookup()).
+ */
+static int ban_list_find(unsigned int type, unsigned int sid,
+    const char *name, char *message, size_t messagesz) {
+  register unsigned int i;
+  unsigned int maxsz, nbuckets;
+  uint32_t h, mask;
+
+  maxsz = ban_lists->bans.bl_maxsz;
+  nbuckets = ban_lists->bans.bl_nbuckets;
+  mask = nbuckets - 1;
+  h = ban_hash(type, 0, name);
+
+  for (i = 0; i < nbuckets; i++) {
+    uint32_t slot;
+    struct ban_entry *be;
+
+    slot = ban_index[(h + i) & mask];
+    if (slot == BAN_INDEX_EMPTY) {
+      break;
+    }
+
+    if (slot == BAN_INDEX_DELETED ||
+        slot > maxsz) {
+      continue;
+    }
+
+    be = &(ban_entries[slot - 1]);
+    if (be->be_type == type &&
+        (be->be_sid == 0 || be->be_sid == sid) &&
+        strncmp(be->be_name, name, sizeof(be->be_name)) == 0) {
+      if (message != NULL) {
+        sstrncpy(message, be->be_message, messagesz);
+      }
+
+      return (int) (slot - 1);
+    }
+  }
+
+  return -1;
+}
+
+/* Looks up a ban via ban_list_find().  If this process does not already
+ * hold the lock, the lookup is done without locking; the sequence number
+ * tells us whether the lists changed while we were reading them, in which
+ * case we try again.  Only if writers keep interfering do we take the lock.
+ */
+static int ban_list_lookup(unsigned int type, unsigned int sid,
+    const char *name, char *message, size_t messagesz) {
+  register unsigned int attempt;
+  int res;
+
+  if (ban_nlocks > 0) {
+    return ban_list_find(type, sid, name, message, messagesz);
+  }
+
+  for (attempt = 0; attempt < BAN_SEQLOCK_MAX_ATTEMPTS; attempt++) {
+    unsigned int seqno;
+
+    seqno = ban_lists->bd_seqno;
+    if (seqno % 2 != 0) {
+      /* Update in progress. */
+      continue;
+    }
+
+    BAN_MEMORY_BARRIER();
+    res = ban_list_find(type, sid, name, message, messagesz);
+    BAN_MEMORY_BARRIER();
+
+    if (ban_lists->bd_seqno == seqno) {
+      return res;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 9,
+    "unable to read ban list without locking, locking");
+
+  if (ban_lock_shm(LOCK_SH) < 0) {
+    (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+      "error read-locking shm: %s", strerror(errno));
+    return -1;
+  }
+
+  res = ban_list_find(type, sid, name, message, messagesz);
+  ban_lock_shm(LOCK_UN);
+
+  return res;
+}
+
 /* Check if a ban of the specified type, for the given server ID and name,
  * is present in the ban list.
  *
  * If the caller provides a `message' pointer, then if a ban exists, that
- * pointer will point to any custom client-displayable message.
+ * pointer will point to any custom client-displayable message, allocated
+ * from the given pool.
  */
 static int ban_list_exists(pool *p, unsigned int type, unsigned int sid,
     const char *name, char **message) {
@@ -1331,23 +1769,19 @@ static int ban_list_exists(pool *p, unsigned int type, unsigned int sid,
   }
 
   if (ban_lists->bans.bl_listlen) {
-    register unsigned int i = 0;
-
-    for (i = 0; i < BAN_LIST_MAXSZ; i++) {
-      pr_signals_handle();
+    char rule_message[BAN_STRING_MAXSZ];
 
-      if (ban_lists->bans.bl_entries[i].be_type == type &&
-          (ban_lists->bans.bl_entries[i].be_sid == 0 ||
-           ban_lists->bans.bl_entries[i].be_sid == sid) &&
-          strcmp(ban_lists->bans.bl_entries[i].be_name, name) == 0) {
-
-        if (message != NULL &&
-            strlen(ban_lists->bans.bl_entries[i].be_message) > 0) {
-          *message = ban_lists->bans.bl_entries[i].be_message;
-        }
+    memset(rule_message, '\0', sizeof(rule_message));
+    if (ban_list_lookup(type, sid, name, rule_message,
+        sizeof(rule_message)) >= 0) {
 
-        return 0;
+      if (message != NULL &&
+          p != NULL &&
+          strlen(rule_message) > 0) {
+        *message = pstrdup(p, rule_message);
       }
+
+      return 0;
     }
   }
 
@@ -1442,8 +1876,37 @@ static int ban_list_exists(pool *p, unsigned int type, unsigned int sid,
   return -1;
 }
 
+/* Removes the ban in the given slot.  The caller must hold the write lock. */
+static void ban_list_remove_slot(unsigned int slot) {
+  struct ban_entry *be;
+
+  be = &(ban_entries[slot]);
+
+  switch (be->be_type) {
+    case BAN_TYPE_USER:
+      pr_event_generate("mod_ban.permit-user", be->be_name);
+      break;
+
+    case BAN_TYPE_HOST:
+      pr_event_generate("mod_ban.permit-host", be->be_name);
+      break;
+
+    case BAN_TYPE_CLASS:
+      pr_event_generate("mod_ban.permit-class", be->be_name);
+      break;
+  }
+
+  ban_index_remove(ban_index, ban_lists->bans.bl_nbuckets,
+    &(ban_lists->bans.bl_ndeleted), ban_hash(be->be_type, 0, be->be_name),
+    slot);
+
+  memset(be, '\0', sizeof(struct ban_entry));
+  ban_lists->bans.bl_listlen--;
+}
+
 static int ban_list_remove(pool *p, unsigned int type, unsigned int sid,
     const char *name) {
+  int removed = FALSE;
 
   if (ban_lists == NULL) {
     errno = EPERM;
@@ -1459,54 +1922,70 @@ static int ban_list_remove(pool *p, unsigned int type, unsigned int sid,
   if (ban_lists->bans.bl_listlen) {
     register unsigned int i = 0;
 
-    for (i = 0; i < BAN_LIST_MAXSZ; i++) {
-      pr_signals_handle();
+    if (name != NULL) {
+      unsigned int maxsz, nbuckets;
+      uint32_t h, mask;
 
-      if (ban_lists->bans.bl_entries[i].be_type == type &&
-          (sid == 0 || ban_lists->bans.bl_entries[i].be_sid == sid) &&
-          (name ? strcmp(ban_lists->bans.bl_entries[i].be_name, name) == 0 :
-           TRUE)) {
+      /* All bans for this type and name, whatever their server ID, share
+       * the same probe sequence in the index.
+       */
+      maxsz = ban_lists->bans.bl_maxsz;
+      nbuckets = ban_lists->bans.bl_nbuckets;
+      mask = nbuckets - 1;
+      h = ban_hash(type, 0, name);
 
-        switch (type) {
-          case BAN_TYPE_USER:
-            pr_event_generate("mod_ban.permit-user",
-              ban_lists->bans.bl_entries[i].be_name);
-            break;
+      for (i = 0; i < nbuckets; i++) {
+        uint32_t slot;
+        struct ban_entry *be;
 
-          case BAN_TYPE_HOST:
-            pr_event_generate("mod_ban.permit-host",
-              ban_lists->bans.bl_entries[i].be_name);
-            break;
+        slot = ban_index[(h + i) & mask];
+        if (slot == BAN_INDEX_EMPTY) {
+          break;
+        }
 
-          case BAN_TYPE_CLASS:
-            pr_event_generate("mod_ban.permit-class",
-              ban_lists->bans.bl_entries[i].be_name);
-            break;
+        if (slot == BAN_INDEX_DELETED ||
+            slot > maxsz) {
+          continue;
         }
 
-        memset(&(ban_lists->bans.bl_entries[i]), '\0',
-          sizeof(struct ban_entry)); 
+        be = &(ban_entries[slot - 1]);
+        if (be->be_type == type &&
+            (sid == 0 || be->be_sid == sid) &&
+            strncmp(be->be_name, name, sizeof(be->be_name)) == 0) {
+          ban_list_remove_slot(slot - 1);
+          removed = TRUE;
+
+          /* If sid is zero, then it means the caller wants to remove the
+           * given name/type combination for all SIDs.
+           */
+          if (sid != 0) {
+            break;
+          }
+        }
+      }
 
-        ban_lists->bans.bl_listlen--;
+    } else {
+      /* A null name means that the caller wants to remove all names for the
+       * given type/SID combination.
+       */
+      for (i = 0; i < ban_lists->bans.bl_maxsz; i++) {
+        pr_signals_handle();
 
-        /* If name is null, it means the caller wants to remove all
-         * names for the given type/SID combination.
-         *
-         * If name is not null, but sid is zero, then it means the caller
-         * wants to remove the given name/type combination for all SIDs.
-         *
-         * Thus we only want to return here if sid is non-zero and name
-         * is not null.
-         */
-        if (sid != 0 &&
-            name != NULL) {
-          return 0;
+        if (ban_entries[i].be_type == type &&
+            (sid == 0 || ban_entries[i].be_sid == sid)) {
+          ban_list_remove_slot(i);
+          removed = TRUE;
         }
       }
     }
+
+    if (ban_lists->bans.bl_ndeleted > (ban_lists->bans.bl_nbuckets / 4)) {
+      ban_list_reindex();
+    }
   }
 
-  if (sid == 0 ||
+  if (removed == TRUE ||
+      sid == 0 ||
       name == NULL) {
     return 0;
   }
@@ -1517,7 +1996,7 @@ static int ban_list_remove(pool *p, unsigned int type, unsigned int sid,
 
 /* Remove all expired bans from the list. */
 static void ban_list_expire(void) {
-  time_t now = time(NULL);
+  time_t next_expires = 0, now = time(NULL);
   register unsigned int i = 0;
 
   if (ban_lists == NULL ||
@@ -1525,26 +2004,43 @@ static void ban_list_expire(void) {
     return;
   }
 
-  for (i = 0; i < BAN_LIST_MAXSZ; i++) {
+  /* This is checked for every connection; avoid scanning the list (and
+   * locking) until the earliest expiry time has passed.
+   */
+  if (ban_lists->bans.bl_next_expires == 0 ||
+      ban_lists->bans.bl_next_expires > now) {
+    return;
+  }
+
+  if (ban_lock_shm(LOCK_EX) < 0) {
+    (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+      "error write-locking shm: %s", strerror(errno));
+    return;
+  }
+
+  for (i = 0; i < ban_lists->bans.bl_maxsz; i++) {
     pr_signals_handle();
 
-    if (ban_lists->bans.bl_entries[i].be_type &&
-        ban_lists->bans.bl_entries[i].be_expires &&
-        !(ban_lists->bans.bl_entries[i].be_expires > now)) {
+    if (ban_entries[i].be_type &&
+        ban_entries[i].be_expires &&
+        !(ban_entries[i].be_expires > now)) {
       char *ban_desc, *ban_name;
       int ban_type;
       pool *tmp_pool;
 
-      ban_type = ban_lists->bans.bl_entries[i].be_type;
-      ban_name = ban_lists->bans.bl_entries[i].be_name;
+      tmp_pool = make_sub_pool(ban_pool ? ban_pool : session.pool);
+
+      ban_type = ban_entries[i].be_type;
+
+      /* Copy the name, as removing the entry clears it. */
+      ban_name = pstrdup(tmp_pool, ban_entries[i].be_name);
 
       (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
         "ban for %s '%s' has expired (%lu seconds ago)",
         ban_type == BAN_TYPE_USER ? "user" : 
           ban_type == BAN_TYPE_HOST ? "host" : "class", ban_name,
-        (unsigned long) now - ban_lists->bans.bl_entries[i].be_expires);
+        (unsigned long) now - ban_entries[i].be_expires);
 
-      tmp_pool = make_sub_pool(ban_pool ? ban_pool : session.pool);
       ban_desc = pstrcat(tmp_pool,
         ban_type == BAN_TYPE_USER ? "USER:" :
           ban_type == BAN_TYPE_HOST ? "HOST:" : "CLASS:", ban_name, NULL);
@@ -1552,8 +2048,17 @@ static void ban_list_expire(void) {
 
       ban_list_remove(tmp_pool, ban_type, 0, ban_name);
       destroy_pool(tmp_pool);
+
+    } else if (ban_entries[i].be_type &&
+               ban_entries[i].be_expires &&
+               (next_expires == 0 ||
+                ban_entries[i].be_expires < next_expires)) {
+      next_expires = ban_entries[i].be_expires;
     }
   }
+
+  ban_lists->bans.bl_next_expires = next_expires;
+  ban_lock_shm(LOCK_UN);
 }
 
 static const char *ban_event_entry_typestr(unsigned int type) {
@@ -1619,6 +2124,31 @@ static const char *ban_event_entry_typestr(unsigned int type) {
   return NULL;
 }
 
+/* Rebuilds the event index, reclaiming deleted buckets.  The caller must
+ * hold the write lock.
+ */
+static void ban_event_list_reindex(void) {
+  register unsigned int i;
+
+  memset(ban_event_index, 0,
+    ban_lists->events.bel_nbuckets * sizeof(uint32_t));
+  ban_lists->events.bel_ndeleted = 0;
+
+  for (i = 0; i < ban_lists->events.bel_maxsz; i++) {
+    struct ban_event_entry *bee;
+
+    bee = &(ban_event_entries[i]);
+    if (bee->bee_type != 0) {
+      ban_index_add(ban_event_index, ban_lists->events.bel_nbuckets,
+        &(ban_lists->events.bel_ndeleted),
+        ban_hash(bee->bee_type, bee->bee_sid, bee->bee_src), i);
+    }
+  }
+
+  pr_trace_msg(trace_channel, 9, "rebuilt index for %u ban events",
+    ban_lists->events.bel_listlen);
+}
+
 /* Add an entry to the ban event list. */
 static int ban_event_list_add(unsigned int type, unsigned int sid,
     const char *src, unsigned int max, time_t window, time_t expires) {
@@ -1638,11 +2168,11 @@ static int ban_event_list_add(unsigned int type, unsigned int sid,
 
     pr_signals_handle();
 
-    if (ban_lists->events.bel_next_slot >= BAN_EVENT_LIST_MAXSZ) {
+    if (ban_lists->events.bel_next_slot >= ban_lists->events.bel_maxsz) {
       ban_lists->events.bel_next_slot = 0;
     }
 
-    bee = &(ban_lists->events.bel_entries[ban_lists->events.bel_next_slot]);
+    bee = &(ban_event_entries[ban_lists->events.bel_next_slot]);
 
     if (bee->bee_type == 0) {
       bee->bee_type = type;
@@ -1654,6 +2184,17 @@ static int ban_event_list_add(unsigned int type, unsigned int sid,
       bee->bee_window = window;
       bee->bee_expires = expires;
 
+      ban_index_add(ban_event_index, ban_lists->events.bel_nbuckets,
+        &(ban_lists->events.bel_ndeleted), ban_hash(type, sid, bee->bee_src),
+        ban_lists->events.bel_next_slot);
+
+      if (bee->bee_expires != 0 &&
+          (ban_lists->events.bel_next_expires == 0 ||
+           bee->bee_start + bee->bee_window <
+             ban_lists->events.bel_next_expires)) {
+        ban_lists->events.bel_next_expires = bee->bee_start + bee->bee_window;
+      }
+
       ban_lists->events.bel_next_slot++;
       ban_lists->events.bel_listlen++;
       break;
@@ -1670,7 +2211,7 @@ static int ban_event_list_add(unsigned int type, unsigned int sid,
          */
         (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
           "maximum number of ban event slots (%u) already in use",
-          BAN_EVENT_LIST_MAXSZ);
+          ban_lists->events.bel_maxsz);
 
         errno = ENOSPC;
         return -1;
@@ -1684,31 +2225,82 @@ static int ban_event_list_add(unsigned int type, unsigned int sid,
   return 0;
 }
 
+/* Returns the slot of the event entry with the given type, server ID, and
+ * source, or -1 if there is none.
+ */
+static int ban_event_list_find(unsigned int type, unsigned int sid,
+    const char *src) {
+  register unsigned int i;
+  unsigned int maxsz, nbuckets;
+  uint32_t h, mask;
+
+  maxsz = ban_lists->events.bel_maxsz;
+  nbuckets = ban_lists->events.bel_nbuckets;
+  mask = nbuckets - 1;
+  h = ban_hash(type, sid, src);
+
+  for (i = 0; i < nbuckets; i++) {
+    uint32_t slot;
+    struct ban_event_entry *bee;
+
+    slot = ban_event_index[(h + i) & mask];
+    if (slot == BAN_INDEX_EMPTY) {
+      break;
+    }
+
+    if (slot == BAN_INDEX_DELETED ||
+        slot > maxsz) {
+      continue;
+    }
+
+    bee = &(ban_event_entries[slot - 1]);
+    if (bee->bee_type == type &&
+        bee->bee_sid == sid &&
+        strncmp(bee->bee_src, src, sizeof(bee->bee_src)) == 0) {
+      return (int) (slot - 1);
+    }
+  }
+
+  return -1;
+}
+
 static struct ban_event_entry *ban_event_list_get(unsigned int type,
     unsigned int sid, const char *src) {
+  int slot;
 
   if (!ban_lists)
     return NULL;
 
-  if (ban_lists->events.bel_listlen) {
-    register unsigned int i = 0;
-
-    for (i = 0; i < BAN_EVENT_LIST_MAXSZ; i++) {
-      pr_signals_handle();
+  if (ban_lists->events.bel_listlen == 0) {
+    return NULL;
+  }
 
-      if (ban_lists->events.bel_entries[i].bee_type == type &&
-          ban_lists->events.bel_entries[i].bee_sid == sid &&
-          strcmp(ban_lists->events.bel_entries[i].bee_src, src) == 0) {
-        return &(ban_lists->events.bel_entries[i]);
-      }
-    }
+  slot = ban_event_list_find(type, sid, src);
+  if (slot < 0) {
+    return NULL;
   }
 
-  return NULL;
+  return &(ban_event_entries[slot]);
+}
+
+/* Removes the event entry in the given slot.  The caller must hold the
+ * write lock.
+ */
+static void ban_event_list_remove_slot(unsigned int slot) {
+  struct ban_event_entry *bee;
+
+  bee = &(ban_event_entries[slot]);
+  ban_index_remove(ban_event_index, ban_lists->events.bel_nbuckets,
+    &(ban_lists->events.bel_ndeleted),
+    ban_hash(bee->bee_type, bee->bee_sid, bee->bee_src), slot);
+
+  memset(bee, 0, sizeof(struct ban_event_entry));
+  ban_lists->events.bel_listlen--;
 }
 
 static int ban_event_list_remove(unsigned int type, unsigned int sid,
     const char *src) {
+  int removed = FALSE;
 
   if (!ban_lists) {
     errno = EPERM;
@@ -1718,25 +2310,35 @@ static int ban_event_list_remove(unsigned int type, unsigned int sid,
   if (ban_lists->events.bel_listlen) {
     register unsigned int i = 0;
 
-    for (i = 0; i < BAN_EVENT_LIST_MAXSZ; i++) {
-      pr_signals_handle();
+    if (src != NULL) {
+      int slot;
 
-      if (ban_lists->events.bel_entries[i].bee_type == type &&
-          ban_lists->events.bel_entries[i].bee_sid == sid &&
-          (src ? strcmp(ban_lists->events.bel_entries[i].bee_src, src) == 0 :
-           TRUE)) {
-        memset(&(ban_lists->events.bel_entries[i]), 0,
-          sizeof(struct ban_event_entry));
+      slot = ban_event_list_find(type, sid, src);
+      if (slot >= 0) {
+        ban_event_list_remove_slot(slot);
+        removed = TRUE;
+      }
 
-        ban_lists->events.bel_listlen--;
+    } else {
+      for (i = 0; i < ban_lists->events.bel_maxsz; i++) {
+        pr_signals_handle();
 
-        if (src)
-          return 0;
+        if (ban_event_entries[i].bee_type == type &&
+            ban_event_entries[i].bee_sid == sid) {
+          ban_event_list_remove_slot(i);
+          removed = TRUE;
+        }
       }
     }
+
+    if (ban_lists->events.bel_ndeleted >
+        (ban_lists->events.bel_nbuckets / 4)) {
+      ban_event_list_reindex();
+    }
   }
 
-  if (src == NULL) {
+  if (removed == TRUE ||
+      src == NULL) {
     return 0;
   }
 
@@ -1746,33 +2348,56 @@ static int ban_event_list_remove(unsigned int type, unsigned int sid,
 
 static void ban_event_list_expire(void) {
   register unsigned int i = 0;
-  time_t now = time(NULL);
+  time_t next_expires = 0, now = time(NULL);
 
   if (ban_lists == NULL ||
       ban_lists->events.bel_listlen == 0) {
     return;
   }
 
-  for (i = 0; i < BAN_EVENT_LIST_MAXSZ; i++) {
-    time_t bee_end = ban_lists->events.bel_entries[i].bee_start +
-      ban_lists->events.bel_entries[i].bee_window;
+  /* Avoid scanning the list (and locking) until the earliest window end
+   * has passed.
+   */
+  if (ban_lists->events.bel_next_expires == 0 ||
+      ban_lists->events.bel_next_expires > now) {
+    return;
+  }
+
+  if (ban_lock_shm(LOCK_EX) < 0) {
+    (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+      "error write-locking shm: %s", strerror(errno));
+    return;
+  }
+
+  for (i = 0; i < ban_lists->events.bel_maxsz; i++) {
+    struct ban_event_entry *bee;
+    time_t bee_end;
 
     pr_signals_handle();
 
-    if (ban_lists->events.bel_entries[i].bee_type &&
-        ban_lists->events.bel_entries[i].bee_expires &&
+    bee = &(ban_event_entries[i]);
+    bee_end = bee->bee_start + bee->bee_window;
+
+    if (bee->bee_type &&
+        bee->bee_expires &&
         !(bee_end > now)) {
       (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
         "ban event %s entry '%s' has expired (%lu seconds ago)",
-        ban_event_entry_typestr(ban_lists->events.bel_entries[i].bee_type),
-        ban_lists->events.bel_entries[i].bee_src,
+        ban_event_entry_typestr(bee->bee_type), bee->bee_src,
         (unsigned long) now - bee_end);
 
-      ban_event_list_remove(ban_lists->events.bel_entries[i].bee_type,
-        ban_lists->events.bel_entries[i].bee_sid,
-        ban_lists->events.bel_entries[i].bee_src);
+      ban_event_list_remove(bee->bee_type, bee->bee_sid, bee->bee_src);
+
+    } else if (bee->bee_type &&
+               bee->bee_expires &&
+               (next_expires == 0 ||
+                bee_end < next_expires)) {
+      next_expires = bee_end;
     }
   }
+
+  ban_lists->events.bel_next_expires = next_expires;
+  ban_lock_shm(LOCK_UN);
 }
 
 /* Controls handlers
@@ -1850,25 +2475,25 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
   if (ban_lists->bans.bl_listlen) {
     int have_user = FALSE, have_host = FALSE, have_class = FALSE;
 
-    for (i = 0; i < BAN_LIST_MAXSZ; i++) {
-      if (ban_lists->bans.bl_entries[i].be_type == BAN_TYPE_USER) {
+    for (i = 0; i < ban_lists->bans.bl_maxsz; i++) {
+      if (ban_entries[i].be_type == BAN_TYPE_USER) {
         if (have_user == FALSE) {
           pr_ctrls_add_response(ctrl, "Banned Users:");
           have_user = TRUE;
         }
 
         pr_ctrls_add_response(ctrl, "  %s",
-          ban_lists->bans.bl_entries[i].be_name);
+          ban_entries[i].be_name);
 
         if (verbose) {
           server_rec *s;
 
           pr_ctrls_add_response(ctrl, "    Reason: %s",
-            ban_lists->bans.bl_entries[i].be_reason);
+            ban_entries[i].be_reason);
 
-          if (ban_lists->bans.bl_entries[i].be_expires) {
+          if (ban_entries[i].be_expires) {
             time_t now = time(NULL);
-            time_t then = ban_lists->bans.bl_entries[i].be_expires;
+            time_t then = ban_entries[i].be_expires;
 
             pr_ctrls_add_response(ctrl, "    Expires: %s (in %lu seconds)",
               pr_strtime3(ctrl->ctrls_tmp_pool, then, FALSE),
@@ -1878,7 +2503,7 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
             pr_ctrls_add_response(ctrl, "    Expires: never");
           }
 
-          s = ban_get_server_by_id(ban_lists->bans.bl_entries[i].be_sid);
+          s = ban_get_server_by_id(ban_entries[i].be_sid);
           if (s != NULL) {
             pr_ctrls_add_response(ctrl, "    <VirtualHost>: %s (%s#%u)",
               s->ServerName, pr_netaddr_get_ipstr(s->addr),
@@ -1888,8 +2513,8 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
       }
     }
 
-    for (i = 0; i < BAN_LIST_MAXSZ; i++) {
-      if (ban_lists->bans.bl_entries[i].be_type == BAN_TYPE_HOST) {
+    for (i = 0; i < ban_lists->bans.bl_maxsz; i++) {
+      if (ban_entries[i].be_type == BAN_TYPE_HOST) {
         if (have_host == FALSE) {
           if (have_user == TRUE) {
             pr_ctrls_add_response(ctrl, "%s", "");
@@ -1900,17 +2525,17 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
         }
 
         pr_ctrls_add_response(ctrl, "  %s",
-          ban_lists->bans.bl_entries[i].be_name);
+          ban_entries[i].be_name);
 
         if (verbose) {
           server_rec *s;
 
           pr_ctrls_add_response(ctrl, "    Reason: %s",
-            ban_lists->bans.bl_entries[i].be_reason);
+            ban_entries[i].be_reason);
 
-          if (ban_lists->bans.bl_entries[i].be_expires) {
+          if (ban_entries[i].be_expires) {
             time_t now = time(NULL);
-            time_t then = ban_lists->bans.bl_entries[i].be_expires;
+            time_t then = ban_entries[i].be_expires;
 
             pr_ctrls_add_response(ctrl, "    Expires: %s (in %lu seconds)",
               pr_strtime3(ctrl->ctrls_tmp_pool, then, FALSE),
@@ -1920,7 +2545,7 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
             pr_ctrls_add_response(ctrl, "    Expires: never");
           }
 
-          s = ban_get_server_by_id(ban_lists->bans.bl_entries[i].be_sid);
+          s = ban_get_server_by_id(ban_entries[i].be_sid);
           if (s != NULL) {
             pr_ctrls_add_response(ctrl, "    <VirtualHost>: %s (%s#%u)",
               s->ServerName, pr_netaddr_get_ipstr(s->addr),
@@ -1930,8 +2555,8 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
       }
     }
 
-    for (i = 0; i < BAN_LIST_MAXSZ; i++) {
-      if (ban_lists->bans.bl_entries[i].be_type == BAN_TYPE_CLASS) {
+    for (i = 0; i < ban_lists->bans.bl_maxsz; i++) {
+      if (ban_entries[i].be_type == BAN_TYPE_CLASS) {
         if (have_class == FALSE) {
           if (have_host == TRUE) {
             pr_ctrls_add_response(ctrl, "%s", "");
@@ -1942,17 +2567,17 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
         }
 
         pr_ctrls_add_response(ctrl, "  %s",
-          ban_lists->bans.bl_entries[i].be_name);
+          ban_entries[i].be_name);
 
         if (verbose) {
           server_rec *s;
 
           pr_ctrls_add_response(ctrl, "    Reason: %s",
-            ban_lists->bans.bl_entries[i].be_reason);
+            ban_entries[i].be_reason);
 
-          if (ban_lists->bans.bl_entries[i].be_expires) {
+          if (ban_entries[i].be_expires) {
             time_t now = time(NULL);
-            time_t then = ban_lists->bans.bl_entries[i].be_expires;
+            time_t then = ban_entries[i].be_expires;
 
             pr_ctrls_add_response(ctrl, "    Expires: %s (in %lu seconds)",
               pr_strtime3(ctrl->ctrls_tmp_pool, then, FALSE),
@@ -1962,7 +2587,7 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
             pr_ctrls_add_response(ctrl, "    Expires: never");
           }
 
-          s = ban_get_server_by_id(ban_lists->bans.bl_entries[i].be_sid);
+          s = ban_get_server_by_id(ban_entries[i].be_sid);
           if (s != NULL) {
             pr_ctrls_add_response(ctrl, "    <VirtualHost>: %s (%s#%u)",
               s->ServerName, pr_netaddr_get_ipstr(s->addr),
@@ -1985,9 +2610,9 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
       int have_banner = FALSE;
       time_t now = time(NULL);
 
-      for (i = 0; i < BAN_EVENT_LIST_MAXSZ; i++) {
+      for (i = 0; i < ban_lists->events.bel_maxsz; i++) {
         server_rec *s;
-        int type = ban_lists->events.bel_entries[i].bee_type;
+        int type = ban_event_entries[i].bee_type;
 
         switch (type) {
           case BAN_EV_TYPE_ANON_REJECT_PASSWORDS:
@@ -2017,15 +2642,15 @@ static int ban_handle_info(pr_ctrls_t *ctrl, int reqargc, char **reqargv) {
             pr_ctrls_add_response(ctrl, "  Event: %s",
               ban_event_entry_typestr(type));
             pr_ctrls_add_response(ctrl, "  Source: %s",
-              ban_lists->events.bel_entries[i].bee_src);
+              ban_event_entries[i].bee_src);
             pr_ctrls_add_response(ctrl, "    Occurrences: %u/%u",
-              ban_lists->events.bel_entries[i].bee_count_curr,
-              ban_lists->events.bel_entries[i].bee_count_max);
+              ban_event_entries[i].bee_count_curr,
+              ban_event_entries[i].bee_count_max);
             pr_ctrls_add_response(ctrl, "    Entry Expires: %lu seconds",
-              (unsigned long) ban_lists->events.bel_entries[i].bee_start +
-                ban_lists->events.bel_entries[i].bee_window - now);
+              (unsigned long) ban_event_entries[i].bee_start +
+                ban_event_entries[i].bee_window - now);
 
-            s = ban_get_server_by_id(ban_lists->events.bel_entries[i].bee_sid);
+            s = ban_get_server_by_id(ban_event_entries[i].bee_sid);
             if (s != NULL) {
               pr_ctrls_add_response(ctrl, "    <VirtualHost>: %s (%s#%u)",
                 s->ServerName, pr_netaddr_get_ipstr(s->addr),
@@ -2151,7 +2776,7 @@ static int ban_handle_ban(pr_ctrls_t *ctrl, int reqargc,
       if (ban_list_exists(ctrl->ctrls_tmp_pool, BAN_TYPE_USER, sid, reqargv[i],
           NULL) < 0) {
 
-        if (ban_lists->bans.bl_listlen < BAN_LIST_MAXSZ) {
+        if (ban_lists->bans.bl_listlen < ban_lists->bans.bl_maxsz) {
           const char *reason;
 
           reason = pstrcat(ctrl->ctrls_tmp_pool, "requested by '",
@@ -2204,7 +2829,7 @@ static int ban_handle_ban(pr_ctrls_t *ctrl, int reqargc,
       if (ban_list_exists(ctrl->ctrls_tmp_pool, BAN_TYPE_HOST, sid,
           pr_netaddr_get_ipstr(site), NULL) < 0) {
 
-        if (ban_lists->bans.bl_listlen < BAN_LIST_MAXSZ) {
+        if (ban_lists->bans.bl_listlen < ban_lists->bans.bl_maxsz) {
           ban_list_add(ctrl->ctrls_tmp_pool, BAN_TYPE_HOST, sid,
             pr_netaddr_get_ipstr(site),
             pstrcat(ctrl->ctrls_tmp_pool, "requested by '",
@@ -2248,7 +2873,7 @@ static int ban_handle_ban(pr_ctrls_t *ctrl, int reqargc,
       if (ban_list_exists(ctrl->ctrls_tmp_pool, BAN_TYPE_CLASS, sid,
           reqargv[i], NULL) < 0) {
 
-        if (ban_lists->bans.bl_listlen < BAN_LIST_MAXSZ) {
+        if (ban_lists->bans.bl_listlen < ban_lists->bans.bl_maxsz) {
           const char *reason;
 
           reason = pstrcat(ctrl->ctrls_tmp_pool, "requested by '",
@@ -2936,16 +3561,51 @@ MODRET set_banoptions(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
-/* usage: BanTable path */
+/* usage: BanTable path [bans count] [events count] */
 MODRET set_bantable(cmd_rec *cmd) {
-  CHECK_ARGS(cmd, 1);
+  register unsigned int i;
+  unsigned int nbans = BAN_LIST_MAXSZ, nevents = BAN_EVENT_LIST_MAXSZ;
+
   CHECK_CONF(cmd, CONF_ROOT);
 
+  if (cmd->argc < 2 ||
+      (cmd->argc % 2) != 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
   if (pr_fs_valid_path(cmd->argv[1]) < 0) {
     CONF_ERROR(cmd, "must be an absolute path");
   }
 
+  for (i = 2; i < cmd->argc; i += 2) {
+    char *ptr = NULL;
+    unsigned long count;
+
+    count = strtoul(cmd->argv[i+1], &ptr, 10);
+    if (ptr == NULL ||
+        *ptr != '\0' ||
+        count == 0 ||
+        count > BAN_TABLE_MAX_ENTRIES) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid ", cmd->argv[i],
+        " count: ", cmd->argv[i+1], NULL));
+    }
+
+    if (strcasecmp(cmd->argv[i], "bans") == 0) {
+      nbans = (unsigned int) count;
+
+    } else if (strcasecmp(cmd->argv[i], "events") == 0) {
+      nevents = (unsigned int) count;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown BanTable parameter: ",
+        cmd->argv[i], NULL));
+    }
+  }
+
   ban_table = pstrdup(ban_pool, cmd->argv[1]);
+  ban_table_nbans = nbans;
+  ban_table_nevents = nevents;
+
   return PR_HANDLED(cmd);
 }
 
@@ -3341,6 +4001,7 @@ static void ban_mod_unload_ev(const void *event_data, void *user_data) {
     }
 
     pr_event_unregister(&ban_module, NULL, NULL);
+    (void) pr_inet_unregister_accept_filter(&ban_module, NULL);
 
     if (ban_pool) {
       destroy_pool(ban_pool);
@@ -3658,6 +4319,67 @@ static void ban_userdefined_ev(const void *event_data, void *user_data) {
   ban_handle_event(BAN_EV_TYPE_USER_DEFINED, BAN_TYPE_HOST, ipstr, tmpl);
 }
 
+/* Accept filter
+ */
+
+/* Called by the daemon process for each newly accepted connection, so that
+ * banned hosts can be turned away without forking a session process for
+ * them.  Only host bans in the BanTable are checked here; anything which
+ * needs the session (class bans, BanCache lookups, sending a BanMessage, or
+ * <IfClass> sections turning the BanEngine off) is left to ban_sess_init().
+ */
+static int ban_accept_filter_cb(pool *p, conn_t *c, void *user_data) {
+  server_rec *s;
+  config_rec *conf;
+  const char *remote_ip;
+  char rule_message[BAN_STRING_MAXSZ];
+
+  if (ban_engine != TRUE ||
+      ban_lists == NULL ||
+      ban_message != NULL) {
+    return 0;
+  }
+
+  ban_list_expire();
+
+  if (ban_lists->bans.bl_listlen == 0) {
+    return 0;
+  }
+
+  s = pr_ipbind_get_server(c->local_addr, c->local_port);
+  if (s == NULL) {
+    return 0;
+  }
+
+  conf = find_config(s->conf, CONF_PARAM, "BanEngine", TRUE);
+  while (conf != NULL) {
+    pr_signals_handle();
+
+    if (*((int *) conf->argv[0]) != TRUE) {
+      return 0;
+    }
+
+    conf = find_config_next(conf, conf->next, CONF_PARAM, "BanEngine", TRUE);
+  }
+
+  remote_ip = pr_netaddr_get_ipstr(c->remote_addr);
+
+  memset(rule_message, '\0', sizeof(rule_message));
+  if (ban_list_lookup(BAN_TYPE_HOST, s->sid, remote_ip, rule_message,
+      sizeof(rule_message)) < 0 ||
+      strlen(rule_message) > 0) {
+    return 0;
+  }
+
+  (void) pr_log_writefile(ban_logfd, MOD_BAN_VERSION,
+    "connection from host '%s' rejected due to host ban", remote_ip);
+  pr_log_pri(PR_LOG_NOTICE, MOD_BAN_VERSION
+    ": Connection denied: host '%s' banned", remote_ip);
+
+  errno = EACCES;
+  return -1;
+}
+
 /* Initialization routines
  */
 
@@ -3691,6 +4413,12 @@ static int ban_init(void) {
   pr_event_register(&ban_module, "core.restart", ban_restart_ev, NULL);
   pr_event_register(&ban_module, "core.shutdown", ban_shutdown_ev, NULL);
 
+  if (pr_inet_register_accept_filter(&ban_module, ban_accept_filter_cb,
+      NULL) < 0) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_BAN_VERSION
+      ": error registering accept filter: %s", strerror(errno));
+  }
+
   return 0;
 }
 
@@ -86,6 +86,58 @@ static int create_dir(const char *dir) {
   return 0;
 }
 
+/* Creates the given directory, whose parent directory must already exist. */
+static int create_path_dir(pool *p, const char *path) {
+  int res;
+  cmd_rec *cmd;
+  pool *sub_pool;
+
+  /* Dispatch fake C_MKD command, e.g. for mod_quotatab */
+  sub_pool = pr_pool_create_sz(p, 64);
+  cmd = pr_cmd_alloc(sub_pool, 2, pstrdup(sub_pool, C_MKD),
+    pstrdup(sub_pool, path));
+  cmd->arg = pstrdup(cmd->pool, path);
+  cmd->cmd_class = CL_DIRS|CL_WRITE;
+
+  pr_response_clear(&resp_list);
+  pr_response_clear(&resp_err_list);
+
+  res = pr_cmd_dispatch_phase(cmd, PRE_CMD, 0);
+  if (res < 0) {
+    int xerrno = errno;
+
+    pr_log_debug(DEBUG3, MOD_COPY_VERSION
+      ": creating directory '%s' blocked by MKD handler: %s", path,
+      strerror(xerrno));
+
+    pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
+    pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
+    pr_response_clear(&resp_err_list);
+
+    destroy_pool(sub_pool);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  res = create_dir(path);
+  if (res < 0) {
+    pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
+    pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
+    pr_response_clear(&resp_err_list);
+
+    destroy_pool(sub_pool);
+    return -1;
+  }
+
+  pr_cmd_dispatch_phase(cmd, POST_CMD, 0);
+  pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
+  pr_response_clear(&resp_list);
+  destroy_pool(sub_pool);
+
+  return 0;
+}
+
 static int create_path(pool *p, const char *path) {
   struct stat st;
   char *curr_path, *dup_path; 
@@ -101,57 +153,15 @@ static int create_path(pool *p, const char *path) {
   while (dup_path &&
          *dup_path) {
     char *curr_dir;
-    int res;
-    cmd_rec *cmd;
-    pool *sub_pool;
 
     pr_signals_handle();
 
     curr_dir = strsep(&dup_path, "/");
     curr_path = pdircat(p, curr_path, curr_dir, NULL);
 
-    /* Dispatch fake C_MKD command, e.g. for mod_quotatab */
-    sub_pool = pr_pool_create_sz(p, 64);
-    cmd = pr_cmd_alloc(sub_pool, 2, pstrdup(sub_pool, C_MKD),
-      pstrdup(sub_pool, curr_path));
-    cmd->arg = pstrdup(cmd->pool, curr_path);
-    cmd->cmd_class = CL_DIRS|CL_WRITE;
-
-    pr_response_clear(&resp_list);
-    pr_response_clear(&resp_err_list);
-
-    res = pr_cmd_dispatch_phase(cmd, PRE_CMD, 0);
-    if (res < 0) {
-      int xerrno = errno;
-
-      pr_log_debug(DEBUG3, MOD_COPY_VERSION
-        ": creating directory '%s' blocked by MKD handler: %s", curr_path,
-        strerror(xerrno));
-
-      pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
-      pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
-      pr_response_clear(&resp_err_list);
-
-      destroy_pool(sub_pool);
-
-      errno = xerrno;
-      return -1;
-    }
-
-    res = create_dir(curr_path);
-    if (res < 0) {
-      pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
-      pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
-      pr_response_clear(&resp_err_list);
-
-      destroy_pool(sub_pool);
+    if (create_path_dir(p, curr_path) < 0) {
       return -1;
     }
-
-    pr_cmd_dispatch_phase(cmd, POST_CMD, 0);
-    pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
-    pr_response_clear(&resp_list);
-    destroy_pool(sub_pool);
   }
 
   return 0;
@@ -188,155 +198,150 @@ static int copy_symlink(pool *p, const char *src_path, const char *dst_path,
   return 0;
 }
 
-static int copy_dir(pool *p, const char *src_dir, const char *dst_dir,
-    int flags) {
-  DIR *dh = NULL;
-  struct dirent *dent = NULL;
-  int res = 0;
-  pool *iter_pool = NULL;
+struct copy_walk_data {
+  const char *src_dir;
+  size_t src_dirlen;
+  const char *dst_dir;
+  int flags;
+};
 
-  dh = opendir(src_dir);
-  if (dh == NULL) {
-    pr_log_pri(PR_LOG_WARNING, MOD_COPY_VERSION
-      ": error reading directory '%s': %s", src_dir, strerror(errno));
-    return -1;
+static int copy_walk_cb(pr_fs_walk_ent_t *ent, void *user_data) {
+  struct copy_walk_data *data;
+  const char *src_path, *rel_path;
+  char *dst_path;
+  struct stat st;
+  int flags;
+
+  data = user_data;
+  flags = data->flags;
+  src_path = ent->ent_path;
+
+  rel_path = src_path;
+  if (strncmp(src_path, data->src_dir, data->src_dirlen) == 0) {
+    rel_path = src_path + data->src_dirlen;
   }
 
-  while ((dent = readdir(dh)) != NULL) {
-    struct stat st;
-    char *src_path, *dst_path;
+  while (*rel_path == '/') {
+    rel_path++;
+  }
 
-    pr_signals_handle();
+  dst_path = pdircat(ent->ent_pool, data->dst_dir, rel_path, NULL);
+  memcpy(&st, &(ent->ent_st), sizeof(st));
 
-    /* Skip "." and ".." */
-    if (strncmp(dent->d_name, ".", 2) == 0 ||
-        strncmp(dent->d_name, "..", 3) == 0) {
-      continue;
-    }
+  switch (ent->ent_type) {
+    case PR_FS_WALK_ENT_DIR:
+      /* The walk is depth-first, so the parent of this directory has
+       * already been created (or checked); only this directory needs the
+       * MKD handling, rather than every one of its ancestors again.
+       */
+      pr_fs_clear_cache2(dst_path);
+      if (pr_fsio_stat(dst_path, &st) == 0) {
+        return 0;
+      }
 
-    if (iter_pool != NULL) {
-      destroy_pool(iter_pool);
-    }
+      return create_path_dir(ent->ent_pool, dst_path);
 
-    iter_pool = pr_pool_create_sz(p, 128);
-    src_path = pdircat(iter_pool, src_dir, dent->d_name, NULL);
-    dst_path = pdircat(iter_pool, dst_dir, dent->d_name, NULL);
+    case PR_FS_WALK_ENT_DIR_DONE:
+      return 0;
 
-    if (pr_fsio_lstat(src_path, &st) < 0) {
-      pr_log_debug(DEBUG3, MOD_COPY_VERSION
-        ": unable to stat '%s' (%s), skipping", src_path, strerror(errno));
-      continue;
-    }
+    default:
+      break;
+  }
 
-    /* Is this path to a directory? */
-    if (S_ISDIR(st.st_mode)) {
-      if (create_path(iter_pool, dst_path) < 0) {
-        res = -1;
-        break;
-      }
+  /* Is this path to a regular file? */
+  if (S_ISREG(st.st_mode)) {
+    cmd_rec *cmd;
 
-      if (copy_dir(iter_pool, src_path, dst_path, flags) < 0) {
-        res = -1;
-        break;
-      }
-      continue;
+    /* Dispatch fake COPY command, e.g. for mod_quotatab */
+    cmd = pr_cmd_alloc(ent->ent_pool, 4, pstrdup(ent->ent_pool, "SITE"),
+      pstrdup(ent->ent_pool, "COPY"), pstrdup(ent->ent_pool, src_path),
+      pstrdup(ent->ent_pool, dst_path));
+    cmd->arg = pstrcat(ent->ent_pool, "COPY ", src_path, " ", dst_path, NULL);
+    cmd->cmd_class = CL_WRITE;
 
-    /* Is this path to a regular file? */
-    } else if (S_ISREG(st.st_mode)) {
-      cmd_rec *cmd;
+    pr_response_clear(&resp_list);
+    pr_response_clear(&resp_err_list);
 
-      /* Dispatch fake COPY command, e.g. for mod_quotatab */
-      cmd = pr_cmd_alloc(iter_pool, 4, pstrdup(iter_pool, "SITE"),
-        pstrdup(iter_pool, "COPY"), pstrdup(iter_pool, src_path),
-        pstrdup(iter_pool, dst_path));
-      cmd->arg = pstrcat(iter_pool, "COPY ", src_path, " ", dst_path, NULL);
-      cmd->cmd_class = CL_WRITE;
+    if (pr_cmd_dispatch_phase(cmd, PRE_CMD, 0) < 0) {
+      int xerrno = errno;
 
-      pr_response_clear(&resp_list);
+      pr_log_debug(DEBUG3, MOD_COPY_VERSION
+        ": COPY of '%s' to '%s' blocked by COPY handler: %s", src_path,
+        dst_path, strerror(xerrno));
+
+      pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
+      pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
       pr_response_clear(&resp_err_list);
 
-      if (pr_cmd_dispatch_phase(cmd, PRE_CMD, 0) < 0) {
+      errno = xerrno;
+      return -1;
+
+    } else {
+      if (pr_fs_copy_file2(src_path, dst_path, flags, NULL) < 0) {
         int xerrno = errno;
 
-        pr_log_debug(DEBUG3, MOD_COPY_VERSION
-          ": COPY of '%s' to '%s' blocked by COPY handler: %s", src_path,
-          dst_path, strerror(xerrno));
+        pr_log_debug(DEBUG7, MOD_COPY_VERSION
+          ": error copying file '%s' to '%s': %s", src_path, dst_path,
+          strerror(xerrno));
 
         pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
         pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
         pr_response_clear(&resp_err_list);
 
         errno = xerrno;
-        res = -1;
-        break;
+        return -1;
 
       } else {
-        if (pr_fs_copy_file2(src_path, dst_path, flags, NULL) < 0) {
-          int xerrno = errno;
+        char *abs_path;
+        
+        pr_cmd_dispatch_phase(cmd, POST_CMD, 0);
+        pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
+        pr_response_clear(&resp_list);
 
-          pr_log_debug(DEBUG7, MOD_COPY_VERSION
-            ": error copying file '%s' to '%s': %s", src_path, dst_path,
-            strerror(xerrno));
+        /* Write a TransferLog entry as well. */
 
-          pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
-          pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
-          pr_response_clear(&resp_err_list);
+        pr_fs_clear_cache2(dst_path);
+        pr_fsio_stat(dst_path, &st);
 
-          errno = xerrno;
-          res = -1;
-          break;
+        abs_path = dir_abs_path(ent->ent_pool, dst_path, TRUE);
 
-        } else {
-          char *abs_path;
-          
-          pr_cmd_dispatch_phase(cmd, POST_CMD, 0);
-          pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
-          pr_response_clear(&resp_list);
-
-          /* Write a TransferLog entry as well. */
-
-          pr_fs_clear_cache2(dst_path);
-          pr_fsio_stat(dst_path, &st);
-
-          abs_path = dir_abs_path(p, dst_path, TRUE);
+        if (session.sf_flags & SF_ANON) {
+          xferlog_write(0, session.c->remote_name, st.st_size, abs_path,
+             (session.sf_flags & SF_ASCII ? 'a' : 'b'), 'd', 'a',
+             session.anon_user, 'c', "_");
 
-          if (session.sf_flags & SF_ANON) {
-            xferlog_write(0, session.c->remote_name, st.st_size, abs_path,
-               (session.sf_flags & SF_ASCII ? 'a' : 'b'), 'd', 'a',
-               session.anon_user, 'c', "_");
-
-          } else {
-            xferlog_write(0, session.c->remote_name, st.st_size, abs_path,
-              (session.sf_flags & SF_ASCII ? 'a' : 'b'), 'd', 'r',
-              session.user, 'c', "_");
-          }
+        } else {
+          xferlog_write(0, session.c->remote_name, st.st_size, abs_path,
+            (session.sf_flags & SF_ASCII ? 'a' : 'b'), 'd', 'r',
+            session.user, 'c', "_");
         }
       }
-
-      continue;
-
-    /* Is this path a symlink? */
-    } else if (S_ISLNK(st.st_mode)) {
-      if (copy_symlink(iter_pool, src_path, dst_path, flags) < 0) {
-        res = -1;
-        break;
-      }
-      continue;
-
-    /* All other file types are skipped */
-    } else {
-      pr_log_debug(DEBUG3, MOD_COPY_VERSION ": skipping supported file '%s'",
-        src_path);
-      continue;
     }
+
+    return 0;
   }
 
-  if (iter_pool != NULL) {
-    destroy_pool(iter_pool);
+  /* Is this path a symlink? */
+  if (S_ISLNK(st.st_mode)) {
+    return copy_symlink(ent->ent_pool, src_path, dst_path, flags);
   }
 
-  closedir(dh);
-  return res;
+  /* All other file types are skipped */
+  pr_log_debug(DEBUG3, MOD_COPY_VERSION ": skipping supported file '%s'",
+    src_path);
+  return 0;
+}
+
+static int copy_dir(pool *p, const char *src_dir, const char *dst_dir,
+    int flags) {
+  struct copy_walk_data data;
+
+  data.src_dir = src_dir;
+  data.src_dirlen = strlen(src_dir);
+  data.dst_dir = dst_dir;
+  data.flags = flags;
+
+  return pr_fs_walk(p, src_dir, copy_walk_cb, &data);
 }
 
 static int copy_paths(pool *p, const char *from, const char *to) {
@@ -98,6 +98,23 @@ static size_t deflate_rbufsz = 0;
 #define DEFLATE_NETIO_NOTE	"mod_deflate.z_stream"
 static int deflate_zerrno = 0;
 
+static unsigned long deflate_options = 0UL;
+#define DEFLATE_OPT_NO_ADAPTIVE_LEVEL	0x0001
+
+/* Per-transfer state.  When writing, the data to be compressed is sampled
+ * periodically, and the compression level adjusted to suit it: data which
+ * looks to be already compressed (or encrypted) is sent as stored blocks,
+ * rather than spending CPU on deflating it for no gain.
+ */
+#define DEFLATE_SAMPLE_INTERVAL		(1024 * 1024)
+#define DEFLATE_SAMPLE_MIN_LEN		512
+#define DEFLATE_SAMPLE_MAX_LEN		4096
+
+static int deflate_xfer_level = -1;
+static unsigned int deflate_xfer_level_changes = 0;
+static uLong deflate_xfer_next_sample = 0;
+static struct rusage deflate_xfer_rusage;
+
 static const char *trace_channel = "deflate";
 
 static const char *deflate_zstrerror(int zerrno) {
@@ -140,6 +157,112 @@ static const char *deflate_zstrerror(int zerrno) {
   return zstr;
 }
 
+/* Returns the compression level to use for the given data, based on the
+ * order-2 (collision) entropy of its byte histogram.  The entropy exceeds
+ * N bits/byte when sum(count * (count - 1)) < n * (n - 1) / 2^N, which lets
+ * us check the thresholds without floating point:
+ *
+ *  > 7.5 bits/byte (2^7.5 ~ 181): no compression, i.e. stored blocks
+ *  > 7 bits/byte (2^7 = 128): the fastest level
+ *
+ * Anything else uses the configured level.
+ */
+static int deflate_sample_level(const unsigned char *data, size_t datalen) {
+  register unsigned int i;
+  unsigned int counts[256];
+  uint64_t n, sum = 0;
+  int level;
+
+  level = deflate_compression_level;
+
+  if (datalen < DEFLATE_SAMPLE_MIN_LEN) {
+    /* Too little data to say much about it. */
+    return level;
+  }
+
+  if (datalen > DEFLATE_SAMPLE_MAX_LEN) {
+    datalen = DEFLATE_SAMPLE_MAX_LEN;
+  }
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < datalen; i++) {
+    counts[data[i]]++;
+  }
+
+  for (i = 0; i < 256; i++) {
+    sum += (uint64_t) counts[i] * (counts[i] - (counts[i] > 0 ? 1 : 0));
+  }
+
+  n = (uint64_t) datalen * (datalen - 1);
+
+  if (sum * 181 < n) {
+    level = Z_NO_COMPRESSION;
+
+  } else if (sum * 128 < n &&
+             level > Z_BEST_SPEED) {
+    level = Z_BEST_SPEED;
+  }
+
+  return level;
+}
+
+static void deflate_adapt_level(z_stream *zstrm, const unsigned char *data,
+    size_t datalen) {
+  int level, res;
+
+  deflate_xfer_next_sample = zstrm->total_in + DEFLATE_SAMPLE_INTERVAL;
+
+  level = deflate_sample_level(data, datalen);
+  if (level == deflate_xfer_level) {
+    return;
+  }
+
+  /* Any previous input has already been consumed and flushed, so there is
+   * nothing pending which would need compressing using the old parameters.
+   * Any bytes deflateParams() does emit land in the output buffer, ahead of
+   * the data to be deflated next.
+   */
+  zstrm->avail_in = 0;
+  res = deflateParams(zstrm, level, deflate_strategy);
+  if (res != Z_OK) {
+    pr_trace_msg(trace_channel, 3,
+      "write: error changing compression level from %d to %d: [%d] %s",
+      deflate_xfer_level, level, res,
+      zstrm->msg ? zstrm->msg : deflate_zstrerror(res));
+    return;
+  }
+
+  pr_trace_msg(trace_channel, 9,
+    "write: changed compression level from %d to %d after %lu bytes",
+    deflate_xfer_level, level, (unsigned long) zstrm->total_in);
+  deflate_xfer_level = level;
+  deflate_xfer_level_changes++;
+}
+
+/* Returns the CPU time, in milliseconds, used since the start of the
+ * current transfer.
+ */
+static unsigned long deflate_xfer_cpu_ms(void) {
+  struct rusage ru;
+  long secs, usecs;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0) {
+    return 0;
+  }
+
+  secs = (ru.ru_utime.tv_sec - deflate_xfer_rusage.ru_utime.tv_sec) +
+    (ru.ru_stime.tv_sec - deflate_xfer_rusage.ru_stime.tv_sec);
+  usecs = (ru.ru_utime.tv_usec - deflate_xfer_rusage.ru_utime.tv_usec) +
+    (ru.ru_stime.tv_usec - deflate_xfer_rusage.ru_stime.tv_usec);
+
+  if (secs < 0 ||
+      (secs == 0 && usecs < 0)) {
+    return 0;
+  }
+
+  return (unsigned long) ((secs * 1000) + (usecs / 1000));
+}
+
 /* NetIO callbacks
  */
 
@@ -172,13 +295,20 @@ static int deflate_netio_close_cb(pr_netio_stream_t *nstrm) {
     if (nstrm->strm_mode == PR_NETIO_IO_WR) {
       if (zstrm->total_in > 0) {
         float ratio;
+        unsigned long cpu_ms;
 
         ratio = ((float) zstrm->total_out / (float) zstrm->total_in);
+        cpu_ms = deflate_xfer_cpu_ms();
 
         (void) pr_log_writefile(deflate_logfd, MOD_DEFLATE_VERSION,
           "%s: deflated %lu bytes to %lu bytes (%0.2lf%% compression)",
           session.curr_cmd, zstrm->total_in, zstrm->total_out,
           (1.0 - ratio) * 100.0);
+        (void) pr_log_writefile(deflate_logfd, MOD_DEFLATE_VERSION,
+          "%s: used %lu.%03lu secs CPU, final level %d (%u level %s)",
+          session.curr_cmd, cpu_ms / 1000, cpu_ms % 1000, deflate_xfer_level,
+          deflate_xfer_level_changes,
+          deflate_xfer_level_changes != 1 ? "changes" : "change");
       }
 
       res = deflateEnd(zstrm);
@@ -195,6 +325,7 @@ static int deflate_netio_close_cb(pr_netio_stream_t *nstrm) {
     } else if (nstrm->strm_mode == PR_NETIO_IO_RD) {
       if (zstrm->total_in > 0) {
         float ratio;
+        unsigned long cpu_ms;
 
         ratio = ((float) zstrm->total_in / (float) zstrm->total_out);
 
@@ -202,6 +333,10 @@ static int deflate_netio_close_cb(pr_netio_stream_t *nstrm) {
           "%s: inflated %lu bytes to %lu bytes (%0.2lf%% compression)",
           session.curr_cmd, zstrm->total_in, zstrm->total_out,
           (1.0 - ratio) * 100.0);
+        cpu_ms = deflate_xfer_cpu_ms();
+        (void) pr_log_writefile(deflate_logfd, MOD_DEFLATE_VERSION,
+          "%s: used %lu.%03lu secs CPU", session.curr_cmd, cpu_ms / 1000,
+          cpu_ms % 1000);
       }
 
       res = inflateEnd(zstrm);
@@ -277,6 +412,13 @@ static pr_netio_stream_t *deflate_netio_open_cb(pr_netio_stream_t *nstrm,
     memset(deflate_zbuf_ptr, '\0', deflate_zbufsz);
     deflate_zbuf = deflate_zbuf_ptr;
 
+    deflate_xfer_level = deflate_compression_level;
+    deflate_xfer_level_changes = 0;
+    deflate_xfer_next_sample = 0;
+    if (getrusage(RUSAGE_SELF, &deflate_xfer_rusage) < 0) {
+      memset(&deflate_xfer_rusage, 0, sizeof(deflate_xfer_rusage));
+    }
+
     if (nstrm->strm_mode == PR_NETIO_IO_WR) {
       /* Initialize the zlib data for deflation. */
       res = deflateInit2(zstrm, deflate_compression_level, Z_DEFLATED,
@@ -686,6 +828,11 @@ static int deflate_netio_write_cb(pr_netio_stream_t *nstrm, char *buf,
       return -1;
     }
 
+    if (!(deflate_options & DEFLATE_OPT_NO_ADAPTIVE_LEVEL) &&
+        zstrm->total_in >= deflate_xfer_next_sample) {
+      deflate_adapt_level(zstrm, (unsigned char *) buf, buflen);
+    }
+
     /* Deflate the data to be written out. */
     zstrm->next_in = (Bytef *) buf;
     zstrm->avail_in = buflen;
@@ -829,6 +976,36 @@ MODRET set_deflatelog(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: DeflateOptions opt1 ... */
+MODRET set_deflateoptions(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  register unsigned int i = 0;
+  unsigned long opts = 0UL;
+
+  if (cmd->argc-1 == 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+
+  for (i = 1; i < cmd->argc; i++) {
+    if (strcmp(cmd->argv[i], "NoAdaptiveLevel") == 0) {
+      opts |= DEFLATE_OPT_NO_ADAPTIVE_LEVEL;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown DeflateOption '",
+        cmd->argv[i], "'", NULL));
+    }
+  }
+
+  c->argv[0] = pcalloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[0]) = opts;
+
+  return PR_HANDLED(cmd);
+}
+
 /* Command handlers
  */
 
@@ -1064,6 +1241,7 @@ static void deflate_sess_reinit_ev(const void *event_data, void *user_data) {
     deflate_sess_reinit_ev);
 
   deflate_engine = FALSE;
+  deflate_options = 0UL;
   pr_feat_remove("MODE Z");
   (void) close(deflate_logfd);
   deflate_logfd = -1;
@@ -1104,6 +1282,25 @@ static int deflate_sess_init(void) {
    */
   pr_feat_add("MODE Z");
 
+  /* Note that the runtime library may differ from the headers we were
+   * compiled against, e.g. when zlib-ng's zlib-compatible library is used
+   * in place of zlib.
+   */
+  pr_trace_msg(trace_channel, 9, "using zlib %s (compiled using zlib %s)",
+    zlibVersion(), ZLIB_VERSION);
+
+  c = find_config(main_server->conf, CONF_PARAM, "DeflateOptions", FALSE);
+  while (c != NULL) {
+    unsigned long opts = 0;
+
+    pr_signals_handle();
+
+    opts = *((unsigned long *) c->argv[0]);
+    deflate_options |= opts;
+
+    c = find_config_next(c, c->next, CONF_PARAM, "DeflateOptions", FALSE);
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "DeflateLog", FALSE);
   if (c &&
       strcasecmp(c->argv[0], "none") != 0) {
@@ -1162,6 +1359,7 @@ static int deflate_sess_init(void) {
 static conftable deflate_conftab[] = {
   { "DeflateEngine",		set_deflateengine,		NULL },
   { "DeflateLog",		set_deflatelog,			NULL },
+  { "DeflateOptions",		set_deflateoptions,		NULL },
   { NULL }
 };
 
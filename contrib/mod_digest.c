@@ -95,12 +95,12 @@ static int digest_caching = TRUE;
 static unsigned int digest_cache_max_size = DIGEST_CACHE_DEFAULT_SIZE;
 static unsigned int digest_cache_max_age = DIGEST_CACHE_DEFAULT_MAX_AGE;
 
-static EVP_MD_CTX *digest_cache_xfer_ctx = NULL;
-
 static int digest_engine = TRUE;
 static pool *digest_pool = NULL;
 
 #define DIGEST_OPT_NO_TRANSFER_CACHE		0x0001
+#define DIGEST_OPT_COMPUTE_ALL_ALGOS		0x0002
+#define DIGEST_OPT_PERSISTENT_CACHE		0x0004
 
 /* Note that the internal APIs for opportunistic caching only appeared,
  * in working order, in 1.3.6rc2.  So disable it by default for earlier
@@ -114,6 +114,11 @@ static pool *digest_pool = NULL;
 
 static unsigned long digest_opts = DIGEST_DEFAULT_OPTS;
 
+/* Extended attributes used as the persistent cache. */
+#define DIGEST_XATTR_PREFIX			"user.proftpd.digest."
+#define DIGEST_XATTR_MAX_VALSZ			256
+#define DIGEST_XATTR_CTIME_SLACK_NSEC		20000000UL
+
 /* Tables used as in-memory caches. */
 static pr_table_t *digest_crc32_tab = NULL;
 static pr_table_t *digest_md5_tab = NULL;
@@ -167,6 +172,24 @@ static xaset_t *digest_cache_keys = NULL;
 
 static unsigned long digest_algos = DIGEST_DEFAULT_ALGOS;
 
+/* The algorithms above, in the order in which they are computed when
+ * several are computed in the same pass.
+ */
+#define DIGEST_NALGOS			5
+
+static const unsigned long digest_algo_list[DIGEST_NALGOS] = {
+  DIGEST_ALGO_CRC32,
+  DIGEST_ALGO_MD5,
+  DIGEST_ALGO_SHA1,
+  DIGEST_ALGO_SHA256,
+  DIGEST_ALGO_SHA512
+};
+
+/* Digests being computed, opportunistically, for the current transfer. */
+static unsigned int digest_cache_xfer_nctxs = 0;
+static unsigned long digest_cache_xfer_algos[DIGEST_NALGOS];
+static EVP_MD_CTX *digest_cache_xfer_ctxs[DIGEST_NALGOS];
+
 static const EVP_MD *digest_hash_md = NULL;
 static unsigned long digest_hash_algo = DIGEST_ALGO_SHA1;
 
@@ -180,6 +203,11 @@ static unsigned long digest_hash_algo = DIGEST_ALGO_SHA1;
 # define DIGEST_PROGRESS_NTH_ITER	40000
 #endif
 
+/* Minimum size of the buffer used for reading files to digest. */
+#ifndef DIGEST_READ_BUFSZ
+# define DIGEST_READ_BUFSZ		(128 * 1024)
+#endif
+
 static const char *trace_channel = "digest";
 
 /* Necessary prototypes. */
@@ -236,30 +264,33 @@ static char *digest_bin2hex(pool *p, const unsigned char *buf, size_len,
  *
  *  crypto/evp/m_md2.c
  *  crypto/md2/md2.c
+ *
+ * The CRC is computed eight bytes at a time ("slice-by-8"), using eight
+ * lookup tables which are generated once per process.
  */
 
 #define CRC32_BLOCK		4
 #define CRC32_DIGEST_LENGTH	4
 #define CRC32_TABLE_SIZE	256
+#define CRC32_NTABLES		8
 
 typedef struct crc32_ctx_st {
-  uint32_t *crc32_table;
   uint32_t data;
 } CRC32_CTX;
 
-static int CRC32_Init(CRC32_CTX *ctx) {
+static uint32_t crc32_tables[CRC32_NTABLES][CRC32_TABLE_SIZE];
+static int crc32_tables_inited = FALSE;
+
+static void crc32_init_tables(void) {
   register unsigned int i;
 
+  if (crc32_tables_inited == TRUE) {
+    return;
+  }
+
   /* Initialize the lookup table.   The magic number in the loop is the official
    * polynomial used by CRC32 in PKZip.
    */
-
-  ctx->crc32_table = malloc(sizeof(uint32_t) * CRC32_TABLE_SIZE);
-  if (ctx->crc32_table == NULL) {
-    errno = ENOMEM;
-    return 0;
-  }
-
   for (i = 0; i < CRC32_TABLE_SIZE; i++) {
     register unsigned int j;
     uint32_t crc;
@@ -273,28 +304,76 @@ static int CRC32_Init(CRC32_CTX *ctx) {
       }
     }
 
-    ctx->crc32_table[i] = crc;
+    crc32_tables[0][i] = crc;
+  }
+
+  /* Each subsequent table gives the CRC of its index followed by one more
+   * zero byte than the previous table.
+   */
+  for (i = 0; i < CRC32_TABLE_SIZE; i++) {
+    register unsigned int j;
+    uint32_t crc;
+
+    crc = crc32_tables[0][i];
+    for (j = 1; j < CRC32_NTABLES; j++) {
+      crc = crc32_tables[0][crc & 0xff] ^ (crc >> 8);
+      crc32_tables[j][i] = crc;
+    }
   }
 
+  crc32_tables_inited = TRUE;
+}
+
+static int CRC32_Init(CRC32_CTX *ctx) {
+  crc32_init_tables();
+
   ctx->data = 0xffffffff;
   return 1;
 }
 
-#define CRC32(ctx, c, b) (ctx->crc32_table[((int)(c) ^ (b)) & 0xff] ^ ((c) >> 8))
-#define DOCRC(ctx, c, d)  c = CRC32(ctx, c, *d++)
+#define CRC32(c, b) (crc32_tables[0][((int)(c) ^ (b)) & 0xff] ^ ((c) >> 8))
+#define DOCRC(c, d)  c = CRC32(c, *d++)
+
+/* Read four bytes, least significant first, regardless of host byte order. */
+#define CRC32_GET_LE32(d) \
+  ((uint32_t) (d)[0] | ((uint32_t) (d)[1] << 8) | \
+   ((uint32_t) (d)[2] << 16) | ((uint32_t) (d)[3] << 24))
 
 static int CRC32_Update(CRC32_CTX *ctx, const unsigned char *data,
     size_t datasz) {
+  uint32_t crc;
 
   if (datasz == 0) {
     return 1;
   }
 
+  crc = ctx->data;
+
+  while (datasz >= 8) {
+    uint32_t lo, hi;
+
+    lo = crc ^ CRC32_GET_LE32(data);
+    hi = CRC32_GET_LE32(data + 4);
+
+    crc = crc32_tables[7][lo & 0xff] ^
+          crc32_tables[6][(lo >> 8) & 0xff] ^
+          crc32_tables[5][(lo >> 16) & 0xff] ^
+          crc32_tables[4][lo >> 24] ^
+          crc32_tables[3][hi & 0xff] ^
+          crc32_tables[2][(hi >> 8) & 0xff] ^
+          crc32_tables[1][(hi >> 16) & 0xff] ^
+          crc32_tables[0][hi >> 24];
+
+    data += 8;
+    datasz -= 8;
+  }
+
   while (datasz > 0) {
-    DOCRC(ctx, ctx->data, data);
+    DOCRC(crc, data);
     datasz--;
   }
 
+  ctx->data = crc;
   return 1;
 }
 
@@ -309,15 +388,6 @@ static int CRC32_Final(unsigned char *md, CRC32_CTX *ctx) {
   return 1;
 }
 
-static int CRC32_Free(CRC32_CTX *ctx) {
-  if (ctx->crc32_table != NULL) {
-    free(ctx->crc32_table);
-    ctx->crc32_table = NULL;
-  }
-
-  return 1;
-}
-
 static int crc32_init(EVP_MD_CTX *ctx) {
   void *md_data;
 
@@ -357,19 +427,6 @@ static int crc32_final(EVP_MD_CTX *ctx, unsigned char *md) {
   return CRC32_Final(md, md_data);
 }
 
-static int crc32_free(EVP_MD_CTX *ctx) {
-  void *md_data;
-
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
-    !defined(HAVE_LIBRESSL)
-  md_data = EVP_MD_CTX_md_data(ctx);
-#else
-  md_data = ctx->md_data;
-#endif /* prior to OpenSSL-1.1.0 */
-
-  return CRC32_Free(md_data);
-}
-
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || \
     defined(HAVE_LIBRESSL)
 static const EVP_MD crc32_md = {
@@ -381,11 +438,13 @@ static const EVP_MD crc32_md = {
   crc32_update,
   crc32_final,
   NULL,
-  crc32_free,
+  NULL,
   EVP_PKEY_NULL_method,
   CRC32_BLOCK,
   sizeof(EVP_MD *) + sizeof(CRC32_CTX)
 };
+#else
+static EVP_MD *crc32_md = NULL;
 #endif /* Older OpenSSLs */
 
 static const EVP_MD *EVP_crc32(void) {
@@ -393,18 +452,20 @@ static const EVP_MD *EVP_crc32(void) {
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
     !defined(HAVE_LIBRESSL)
-  /* XXX TODO: At some point, we also need to call EVP_MD_meth_free() on
-   * this, to avoid a resource leak.
-   */
-  md = EVP_MD_meth_new(NID_undef, NID_undef);
-  EVP_MD_meth_set_input_blocksize(md, CRC32_BLOCK);
-  EVP_MD_meth_set_result_size(md, CRC32_DIGEST_LENGTH);
-  EVP_MD_meth_set_app_datasize(md, sizeof(EVP_MD *) + sizeof(CRC32_CTX));
-  EVP_MD_meth_set_init(md, crc32_init);
-  EVP_MD_meth_set_update(md, crc32_update);
-  EVP_MD_meth_set_final(md, crc32_final);
-  EVP_MD_meth_set_cleanup(md, crc32_free);
-  EVP_MD_meth_set_flags(md, 0);
+  /* Create the method once, and reuse it for the life of the process. */
+  if (crc32_md == NULL) {
+    crc32_md = EVP_MD_meth_new(NID_undef, NID_undef);
+    EVP_MD_meth_set_input_blocksize(crc32_md, CRC32_BLOCK);
+    EVP_MD_meth_set_result_size(crc32_md, CRC32_DIGEST_LENGTH);
+    EVP_MD_meth_set_app_datasize(crc32_md,
+      sizeof(EVP_MD *) + sizeof(CRC32_CTX));
+    EVP_MD_meth_set_init(crc32_md, crc32_init);
+    EVP_MD_meth_set_update(crc32_md, crc32_update);
+    EVP_MD_meth_set_final(crc32_md, crc32_final);
+    EVP_MD_meth_set_flags(crc32_md, 0);
+  }
+
+  md = crc32_md;
 #else
   md = &crc32_md;
 #endif /* prior to OpenSSL-1.1.0 */
@@ -901,6 +962,17 @@ MODRET set_digestoptions(cmd_rec *cmd) {
     if (strcmp(cmd->argv[i], "NoTransferCache") == 0) {
       opts |= DIGEST_OPT_NO_TRANSFER_CACHE;
 
+    } else if (strcmp(cmd->argv[i], "ComputeAllAlgorithms") == 0) {
+      opts |= DIGEST_OPT_COMPUTE_ALL_ALGOS;
+
+    } else if (strcmp(cmd->argv[i], "PersistentCache") == 0) {
+#if defined(PR_USE_XATTR)
+      opts |= DIGEST_OPT_PERSISTENT_CACHE;
+#else
+      pr_log_debug(DEBUG0, "%s: PersistentCache DigestOption requires "
+        "xattr support (--enable-xattr), ignoring", (char *) cmd->argv[0]);
+#endif /* PR_USE_XATTR */
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown DigestOption '",
         cmd->argv[i], "'", NULL));
@@ -1030,9 +1102,25 @@ static int blacklisted_file(const char *path) {
   return res;
 }
 
+static void destroy_digest_ctxs(EVP_MD_CTX **pctxs, unsigned int nctxs) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
+    !defined(HAVE_LIBRESSL)
+  register unsigned int i;
+
+  for (i = 0; i < nctxs; i++) {
+    EVP_MD_CTX_free(pctxs[i]);
+  }
+#endif /* OpenSSL-1.1.0 and later */
+}
+
+/* Compute the digests, using each of the given message digests, of the
+ * given range of the file, reading that range only once.
+ */
 static int compute_digest(pool *p, const char *path, off_t start, off_t len,
-    const EVP_MD *md, unsigned char *digest, unsigned int *digest_len,
-    time_t *mtime, void (*hash_progress_cb)(const char *, off_t)) {
+    unsigned int nmds, const EVP_MD **mds, unsigned char **digests,
+    unsigned int *digest_lens, time_t *mtime,
+    void (*hash_progress_cb)(const char *, off_t)) {
+  register unsigned int i;
   int res, xerrno = 0;
   pr_fh_t *fh;
   struct stat st;
@@ -1040,9 +1128,15 @@ static int compute_digest(pool *p, const char *path, off_t start, off_t len,
   size_t bufsz, readsz, iter_count;
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || \
     defined(HAVE_LIBRESSL)
-  EVP_MD_CTX ctx;
+  EVP_MD_CTX ctxs[DIGEST_NALGOS];
 #endif /* prior to OpenSSL-1.1.0 */
-  EVP_MD_CTX *pctx;
+  EVP_MD_CTX *pctxs[DIGEST_NALGOS];
+
+  if (nmds == 0 ||
+      nmds > DIGEST_NALGOS) {
+    errno = EINVAL;
+    return -1;
+  }
 
   fh = pr_fsio_open(path, O_RDONLY);
   if (fh == NULL) {
@@ -1082,8 +1176,14 @@ static int compute_digest(pool *p, const char *path, off_t start, off_t len,
     *mtime = st.st_mtime;
   }
 
-  /* Determine the optimal block size for reading. */
-  fh->fh_iosz = bufsz = st.st_blksize;
+  /* Determine the optimal block size for reading; the filesystem's block
+   * size is usually far smaller than what we can hash efficiently.
+   */
+  bufsz = st.st_blksize;
+  if (bufsz < DIGEST_READ_BUFSZ) {
+    bufsz = DIGEST_READ_BUFSZ;
+  }
+  fh->fh_iosz = bufsz;
 
   if (pr_fsio_lseek(fh, start, SEEK_SET) == (off_t) -1) {
     xerrno = errno;
@@ -1096,24 +1196,25 @@ static int compute_digest(pool *p, const char *path, off_t start, off_t len,
     return -1;
   }
 
+  pr_fs_fadvise(PR_FH_FD(fh), start, len, PR_FS_FADVISE_SEQUENTIAL);
+
+  for (i = 0; i < nmds; i++) {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || \
     defined(HAVE_LIBRESSL)
-  pctx = &ctx;
+    pctxs[i] = &(ctxs[i]);
 #else
-  pctx = EVP_MD_CTX_new();
+    pctxs[i] = EVP_MD_CTX_new();
 #endif /* prior to OpenSSL-1.1.0 */
 
-  EVP_MD_CTX_init(pctx);
-  if (EVP_DigestInit_ex(pctx, md, NULL) != 1) {
-    pr_log_debug(DEBUG1, MOD_DIGEST_VERSION
-      ": error preparing digest context: %s", get_errors());
-    (void) pr_fsio_close(fh);
-# if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
-     !defined(HAVE_LIBRESSL)
-    EVP_MD_CTX_free(pctx);
-# endif /* OpenSSL-1.1.0 and later */
-    errno = EPERM;
-    return -1;
+    EVP_MD_CTX_init(pctxs[i]);
+    if (EVP_DigestInit_ex(pctxs[i], mds[i], NULL) != 1) {
+      pr_log_debug(DEBUG1, MOD_DIGEST_VERSION
+        ": error preparing digest context: %s", get_errors());
+      (void) pr_fsio_close(fh);
+      destroy_digest_ctxs(pctxs, i + 1);
+      errno = EPERM;
+      return -1;
+    }
   }
 
   buf = palloc(p, bufsz);
@@ -1145,9 +1246,17 @@ static int compute_digest(pool *p, const char *path, off_t start, off_t len,
       continue;
     }
 
-    if (EVP_DigestUpdate(pctx, buf, res) != 1) {
-      pr_log_debug(DEBUG1, MOD_DIGEST_VERSION
-        ": error updating digest: %s", get_errors());
+    if (res <= 0) {
+      /* EOF, or a read error; either way, we cannot read the rest. */
+      break;
+    }
+
+    /* Feed the same buffer to each digest, while it is still in cache. */
+    for (i = 0; i < nmds; i++) {
+      if (EVP_DigestUpdate(pctxs[i], buf, res) != 1) {
+        pr_log_debug(DEBUG1, MOD_DIGEST_VERSION
+          ": error updating digest: %s", get_errors());
+      }
     }
 
     len -= res;
@@ -1169,10 +1278,7 @@ static int compute_digest(pool *p, const char *path, off_t start, off_t len,
   (void) pr_fsio_close(fh);
 
   if (len != 0) {
-# if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
-     !defined(HAVE_LIBRESSL)
-    EVP_MD_CTX_free(pctx);
-# endif /* OpenSSL-1.1.0 and later */
+    destroy_digest_ctxs(pctxs, nmds);
     pr_log_debug(DEBUG3, MOD_DIGEST_VERSION
       ": failed to read all %" PR_LU " bytes of '%s' (premature EOF?)",
       (pr_off_t) len, path);
@@ -1180,22 +1286,17 @@ static int compute_digest(pool *p, const char *path, off_t start, off_t len,
     return -1;
   }
 
-  if (EVP_DigestFinal_ex(pctx, digest, digest_len) != 1) {
-    pr_log_debug(DEBUG1, MOD_DIGEST_VERSION
-      ": error finishing digest: %s", get_errors());
-# if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
-     !defined(HAVE_LIBRESSL)
-    EVP_MD_CTX_free(pctx);
-# endif /* OpenSSL-1.1.0 and later */
-    errno = EPERM;
-    return -1;
+  for (i = 0; i < nmds; i++) {
+    if (EVP_DigestFinal_ex(pctxs[i], digests[i], &(digest_lens[i])) != 1) {
+      pr_log_debug(DEBUG1, MOD_DIGEST_VERSION
+        ": error finishing digest: %s", get_errors());
+      destroy_digest_ctxs(pctxs, nmds);
+      errno = EPERM;
+      return -1;
+    }
   }
 
-# if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
-     !defined(HAVE_LIBRESSL)
-  EVP_MD_CTX_free(pctx);
-# endif /* OpenSSL-1.1.0 and later */
-
+  destroy_digest_ctxs(pctxs, nmds);
   return 0;
 }
 
@@ -1239,6 +1340,17 @@ static const EVP_MD *get_algo_md(unsigned long algo) {
   return md;
 }
 
+/* Determine the algorithms to compute, in one pass over the data, when the
+ * given algorithm is needed.
+ */
+static unsigned long get_pass_algos(unsigned long algo) {
+  if (digest_opts & DIGEST_OPT_COMPUTE_ALL_ALGOS) {
+    return (digest_algos|algo);
+  }
+
+  return algo;
+}
+
 static const char *get_algo_name(unsigned long algo, int flags) {
   const char *algo_name = "(unknown)";
 
@@ -1512,13 +1624,11 @@ static int remove_cached_digest(pool *p, unsigned long algo, const char *path,
   return 0;
 }
 
-static int add_cached_digest(pool *p, cmd_rec *cmd, unsigned long algo,
-    const char *path, time_t mtime, off_t start, size_t len,
-    const char *hex_digest) {
+static int cache_digest(pool *p, unsigned long algo, const char *path,
+    time_t mtime, off_t start, size_t len, const char *hex_digest) {
   int res;
   struct digest_cache_key *cache_key;
   pr_table_t *cache;
-  const char *algo_name;
 
   if (digest_caching == FALSE) {
     return 0;
@@ -1529,8 +1639,37 @@ static int add_cached_digest(pool *p, cmd_rec *cmd, unsigned long algo,
     return -1;
   }
 
+  if (pr_table_get(cache, get_key_for_cache(p, path, mtime, start, len),
+      NULL) != NULL) {
+    /* Already cached, e.g. computed alongside another digest. */
+    return 0;
+  }
+
   cache_key = create_cache_key(p, algo, path, mtime, start, len, hex_digest);
 
+  res = pr_table_add(cache, cache_key->key, (void *) cache_key->hex_digest, 0);
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 12,
+      "cached digest '%s' for %s digest, key '%s'", hex_digest,
+      get_algo_name(algo, 0), cache_key->key);
+  }
+
+  return res;
+}
+
+static int add_cached_digest(pool *p, cmd_rec *cmd, unsigned long algo,
+    const char *path, time_t mtime, off_t start, size_t len,
+    const char *hex_digest) {
+  const char *algo_name;
+
+  if (digest_caching == FALSE) {
+    return 0;
+  }
+
+  if (get_cache(algo) == NULL) {
+    return -1;
+  }
+
   /* Stash the algorithm name, and digest, as notes. */
   algo_name = get_algo_name(algo, 0);
   if (pr_table_add(cmd->notes, "mod_digest.algo",
@@ -1545,14 +1684,7 @@ static int add_cached_digest(pool *p, cmd_rec *cmd, unsigned long algo,
       "error adding 'mod_digest.digest' note: %s", strerror(errno));
   }
 
-  res = pr_table_add(cache, cache_key->key, (void *) cache_key->hex_digest, 0);
-  if (res == 0) {
-    pr_trace_msg(trace_channel, 12,
-      "cached digest '%s' for %s digest, key '%s'", hex_digest,
-      get_algo_name(algo, 0), cache_key->key);
-  }
-
-  return res;
+  return cache_digest(p, algo, path, mtime, start, len, hex_digest);
 }
 
 static char *get_cached_digest(pool *p, unsigned long algo, const char *path,
@@ -1617,6 +1749,278 @@ static char *get_cached_digest(pool *p, unsigned long algo, const char *path,
   return NULL;
 }
 
+/* The persistent cache stores the digests of entire files in the files'
+ * extended attributes, named "user.proftpd.digest.<algo>", with values
+ * formatted as:
+ *  "<size>:<mtime>:<inode>:<ctime>:<hex digest>"
+ *
+ * where the timestamps are "<secs>.<nsecs>".  A stored digest is used only if
+ * the file's current size, mtime and inode match, and its ctime is that left
+ * by storing the digest.  Clients can set the mtime (e.g. via MFMT), but not
+ * the inode or ctime.
+ *
+ * Setting the xattr itself changes the ctime, so the ctime stored is the one
+ * left by a first write of the value, and the current ctime may be up to
+ * DIGEST_XATTR_CTIME_SLACK_NSEC later than that (from the second write).
+ */
+static const char *get_persistent_name(pool *p, unsigned long algo) {
+  register unsigned int i;
+  char *name;
+
+  name = pstrcat(p, DIGEST_XATTR_PREFIX, get_algo_name(algo, 0), NULL);
+  for (i = sizeof(DIGEST_XATTR_PREFIX)-1; name[i]; i++) {
+    name[i] = tolower((int) name[i]);
+  }
+
+  return name;
+}
+
+static void get_persistent_nsecs(struct stat *st, unsigned long *mtime_nsec,
+    unsigned long *ctime_nsec) {
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+  *mtime_nsec = (unsigned long) st->st_mtim.tv_nsec;
+  *ctime_nsec = (unsigned long) st->st_ctim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+  *mtime_nsec = (unsigned long) st->st_mtimespec.tv_nsec;
+  *ctime_nsec = (unsigned long) st->st_ctimespec.tv_nsec;
+#else
+  *mtime_nsec = *ctime_nsec = 0;
+#endif /* No sub-second timestamps */
+}
+
+/* Returns the "<size>:<mtime>:<inode>:" part of the stored value. */
+static const char *get_persistent_prefix(pool *p, struct stat *st) {
+  char size_str[256], mtime_str[256], ino_str[256];
+  unsigned long mtime_nsec, ctime_nsec;
+
+  get_persistent_nsecs(st, &mtime_nsec, &ctime_nsec);
+
+  memset(size_str, '\0', sizeof(size_str));
+  pr_snprintf(size_str, sizeof(size_str)-1, "%" PR_LU, (pr_off_t) st->st_size);
+
+  memset(mtime_str, '\0', sizeof(mtime_str));
+  pr_snprintf(mtime_str, sizeof(mtime_str)-1, "%lu.%09lu",
+    (unsigned long) st->st_mtime, mtime_nsec);
+
+  memset(ino_str, '\0', sizeof(ino_str));
+  pr_snprintf(ino_str, sizeof(ino_str)-1, "%llu",
+    (unsigned long long) st->st_ino);
+
+  return pstrcat(p, size_str, ":", mtime_str, ":", ino_str, ":", NULL);
+}
+
+static const char *get_persistent_ctime(pool *p, struct stat *st) {
+  char ctime_str[256];
+  unsigned long mtime_nsec, ctime_nsec;
+
+  get_persistent_nsecs(st, &mtime_nsec, &ctime_nsec);
+
+  memset(ctime_str, '\0', sizeof(ctime_str));
+  pr_snprintf(ctime_str, sizeof(ctime_str)-1, "%lu.%09lu",
+    (unsigned long) st->st_ctime, ctime_nsec);
+
+  return pstrcat(p, ctime_str, ":", NULL);
+}
+
+/* Parses the stored "<secs>.<nsecs>:" ctime at the start of the given text,
+ * and checks that the file's current ctime is no more than the allowed slack
+ * after it.  Returns the length of the parsed text, or -1 if the ctime does
+ * not match.
+ */
+static int check_persistent_ctime(const char *text, struct stat *st) {
+  unsigned long secs, nsecs, mtime_nsec, ctime_nsec;
+  char *ptr = NULL;
+  const char *nsecs_text;
+
+  secs = strtoul(text, &ptr, 10);
+  if (ptr == text ||
+      *ptr != '.') {
+    return -1;
+  }
+
+  nsecs_text = ptr + 1;
+  nsecs = strtoul(nsecs_text, &ptr, 10);
+  if (ptr == nsecs_text ||
+      *ptr != ':' ||
+      nsecs >= 1000000000UL) {
+    return -1;
+  }
+
+  get_persistent_nsecs(st, &mtime_nsec, &ctime_nsec);
+
+  if ((unsigned long) st->st_ctime == secs) {
+    if (ctime_nsec < nsecs ||
+        ctime_nsec - nsecs > DIGEST_XATTR_CTIME_SLACK_NSEC) {
+      return -1;
+    }
+
+  } else if ((unsigned long) st->st_ctime == secs + 1) {
+    if ((1000000000UL - nsecs) + ctime_nsec > DIGEST_XATTR_CTIME_SLACK_NSEC) {
+      return -1;
+    }
+
+  } else {
+    return -1;
+  }
+
+  return (int) (ptr - text) + 1;
+}
+
+/* Check that the persistent cache applies to the given range, which must be
+ * the entire, unchanged file.
+ */
+static int check_persistent_range(const char *path, time_t mtime, off_t start,
+    size_t len, struct stat *st) {
+
+  if (digest_caching == FALSE ||
+      !(digest_opts & DIGEST_OPT_PERSISTENT_CACHE)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (start != 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  pr_fs_clear_cache2(path);
+  if (pr_fsio_stat(path, st) < 0) {
+    return -1;
+  }
+
+  if (st->st_mtime != mtime ||
+      (off_t) len != st->st_size) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
+static char *get_persistent_digest(pool *p, unsigned long algo,
+    const char *path, time_t mtime, off_t start, size_t len) {
+  register unsigned int i;
+  struct stat st;
+  const EVP_MD *md;
+  const char *algo_name, *name, *prefix;
+  char val[DIGEST_XATTR_MAX_VALSZ], *hex_digest;
+  ssize_t valsz;
+  size_t prefix_len, hex_len;
+  int ctime_len;
+
+  if (check_persistent_range(path, mtime, start, len, &st) < 0) {
+    return NULL;
+  }
+
+  md = get_algo_md(algo);
+  if (md == NULL) {
+    return NULL;
+  }
+
+  algo_name = get_algo_name(algo, 0);
+  name = get_persistent_name(p, algo);
+
+  valsz = pr_fsio_getxattr(p, path, name, val, sizeof(val)-1);
+  if (valsz < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 19,
+      "no persisted %s digest for path '%s': %s", algo_name, path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  val[valsz] = '\0';
+
+  prefix = get_persistent_prefix(p, &st);
+  prefix_len = strlen(prefix);
+  hex_len = EVP_MD_size(md) * 2;
+
+  ctime_len = -1;
+  if (strncmp(val, prefix, prefix_len) == 0) {
+    ctime_len = check_persistent_ctime(val + prefix_len, &st);
+  }
+
+  if (ctime_len < 0 ||
+      (size_t) valsz != (prefix_len + ctime_len + hex_len)) {
+    pr_trace_msg(trace_channel, 12,
+      "ignoring stale persisted %s digest for path '%s'", algo_name, path);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  prefix_len += ctime_len;
+
+  hex_digest = pstrdup(p, val + prefix_len);
+  for (i = 0; hex_digest[i]; i++) {
+    if (!isxdigit((int) hex_digest[i])) {
+      pr_trace_msg(trace_channel, 12,
+        "ignoring malformed persisted %s digest for path '%s'", algo_name,
+        path);
+      errno = EINVAL;
+      return NULL;
+    }
+
+    hex_digest[i] = tolower((int) hex_digest[i]);
+  }
+
+  pr_trace_msg(trace_channel, 12,
+    "using persisted digest '%s' for %s digest, path '%s'", hex_digest,
+    algo_name, path);
+  return hex_digest;
+}
+
+static int add_persistent_digest(pool *p, unsigned long algo,
+    const char *path, time_t mtime, off_t start, size_t len,
+    const char *hex_digest) {
+  register unsigned int i;
+  struct stat st;
+  const char *algo_name, *name, *prefix;
+
+  if (check_persistent_range(path, mtime, start, len, &st) < 0) {
+    /* Not an error; we only persist digests of entire files. */
+    return 0;
+  }
+
+  algo_name = get_algo_name(algo, 0);
+  name = get_persistent_name(p, algo);
+  prefix = get_persistent_prefix(p, &st);
+
+  /* The first write only sets the ctime which the second write records. */
+  for (i = 0; i < 2; i++) {
+    char *val;
+
+    val = pstrcat(p, prefix, get_persistent_ctime(p, &st), hex_digest, NULL);
+
+    if (pr_fsio_setxattr(p, path, name, val, strlen(val), 0) < 0) {
+      int xerrno = errno;
+
+      pr_trace_msg(trace_channel, 8,
+        "error persisting %s digest for path '%s': %s", algo_name, path,
+        strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+
+    pr_fs_clear_cache2(path);
+    if (pr_fsio_stat(path, &st) < 0 ||
+        strcmp(get_persistent_prefix(p, &st), prefix) != 0) {
+      /* The file changed underneath us; leave the now-stale value be. */
+      pr_trace_msg(trace_channel, 8,
+        "path '%s' changed while persisting %s digest", path, algo_name);
+      return 0;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 12,
+    "persisted digest '%s' for %s digest, path '%s'", hex_digest, algo_name,
+    path);
+  return 0;
+}
+
 static int digest_cache_expiry_cb(CALLBACK_FRAME) {
   struct digest_cache_key *cache_key;
   time_t now;
@@ -1698,14 +2102,20 @@ static int check_cache_size(cmd_rec *cmd) {
 static char *get_digest(cmd_rec *cmd, unsigned long algo, const char *path,
     time_t mtime, off_t start, size_t len, int flags,
     void (*hash_progress_cb)(const char *, off_t)) {
+  register unsigned int i;
   int res;
-  const EVP_MD *md;
-  unsigned char *digest = NULL;
-  unsigned int digest_len;
-  char *hex_digest;
+  unsigned long algos, pass_algos[DIGEST_NALGOS];
+  const EVP_MD *mds[DIGEST_NALGOS];
+  unsigned char *digests[DIGEST_NALGOS];
+  unsigned int digest_lens[DIGEST_NALGOS], nmds = 0;
+  char *hex_digest = NULL;
   const char *algo_name;
 
   hex_digest = get_cached_digest(cmd->tmp_pool, algo, path, mtime, start, len);
+  if (hex_digest == NULL) {
+    hex_digest = get_persistent_digest(cmd->tmp_pool, algo, path, mtime, start,
+      len);
+  }
 
   /* We check the cache size AFTER looking for a cached value, as part of
    * looking for a cached value involves expiring the cached values at
@@ -1741,24 +2151,79 @@ static char *get_digest(cmd_rec *cmd, unsigned long algo, const char *path,
     return hex_digest;
   }
 
-  md = get_algo_md(algo);
-  digest_len = EVP_MD_size(md);
-  digest = palloc(cmd->tmp_pool, digest_len);
+  /* Since we have to read the data anyway, compute any other digests
+   * which we are configured to compute alongside this one, and which are
+   * not already cached.
+   */
+  algos = get_pass_algos(algo);
+  for (i = 0; i < DIGEST_NALGOS; i++) {
+    unsigned long pass_algo;
+    const EVP_MD *md;
+
+    pass_algo = digest_algo_list[i];
+    if (pass_algo == 0 ||
+        !(algos & pass_algo)) {
+      continue;
+    }
+
+    if (pass_algo != algo &&
+        (get_cached_digest(cmd->tmp_pool, pass_algo, path, mtime, start,
+          len) != NULL ||
+         get_persistent_digest(cmd->tmp_pool, pass_algo, path, mtime, start,
+          len) != NULL)) {
+      continue;
+    }
+
+    md = get_algo_md(pass_algo);
+    if (md == NULL) {
+      continue;
+    }
 
-  res = compute_digest(cmd->tmp_pool, path, start, len, md, digest,
-    &digest_len, &mtime, hash_progress_cb);
+    pass_algos[nmds] = pass_algo;
+    mds[nmds] = md;
+    digest_lens[nmds] = EVP_MD_size(md);
+    digests[nmds] = palloc(cmd->tmp_pool, digest_lens[nmds]);
+    nmds++;
+  }
+
+  res = compute_digest(cmd->tmp_pool, path, start, len, nmds, mds, digests,
+    digest_lens, &mtime, hash_progress_cb);
   if (res < 0) {
     return NULL;
   }
 
-  hex_digest = pr_str_bin2hex(cmd->tmp_pool, digest, digest_len,
-    PR_STR_FL_HEX_USE_LC);
+  for (i = 0; i < nmds; i++) {
+    char *pass_hex_digest;
+
+    pass_hex_digest = pr_str_bin2hex(cmd->tmp_pool, digests[i],
+      digest_lens[i], PR_STR_FL_HEX_USE_LC);
+
+    (void) add_persistent_digest(cmd->tmp_pool, pass_algos[i], path, mtime,
+      start, len, pass_hex_digest);
+
+    if (pass_algos[i] != algo) {
+      if (cache_digest(cmd->pool, pass_algos[i], path, mtime, start, len,
+          pass_hex_digest) < 0) {
+        pr_trace_msg(trace_channel, 8,
+          "error caching %s digest for path '%s': %s",
+          get_algo_name(pass_algos[i], 0), path, strerror(errno));
+      }
+
+      continue;
+    }
+
+    hex_digest = pass_hex_digest;
+    if (add_cached_digest(cmd->pool, cmd, algo, path, mtime, start, len,
+        hex_digest) < 0) {
+      pr_trace_msg(trace_channel, 8,
+        "error caching %s digest for path '%s': %s", get_algo_name(algo, 0),
+        path, strerror(errno));
+    }
+  }
 
-  if (add_cached_digest(cmd->pool, cmd, algo, path, mtime, start, len,
-      hex_digest) < 0) {
-    pr_trace_msg(trace_channel, 8,
-      "error caching %s digest for path '%s': %s", get_algo_name(algo, 0),
-      path, strerror(errno));
+  if (hex_digest == NULL) {
+    errno = EPERM;
+    return NULL;
   }
 
   /* Stash the algorithm name, and digest, as notes. */
@@ -2213,6 +2678,65 @@ MODRET digest_opts_hash(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+static void digest_xfer_free(void) {
+  register unsigned int i;
+
+  for (i = 0; i < digest_cache_xfer_nctxs; i++) {
+    EVP_MD_CTX_destroy(digest_cache_xfer_ctxs[i]);
+    digest_cache_xfer_ctxs[i] = NULL;
+  }
+
+  digest_cache_xfer_nctxs = 0;
+}
+
+/* Prepare the digests to compute, opportunistically, for the data of the
+ * current transfer.
+ */
+static int digest_xfer_init(void) {
+  register unsigned int i;
+  unsigned long algos;
+
+  digest_xfer_free();
+
+  algos = get_pass_algos(digest_hash_algo);
+  for (i = 0; i < DIGEST_NALGOS; i++) {
+    unsigned long algo;
+    const EVP_MD *md;
+    EVP_MD_CTX *md_ctx;
+
+    algo = digest_algo_list[i];
+    if (algo == 0 ||
+        !(algos & algo)) {
+      continue;
+    }
+
+    md = get_algo_md(algo);
+    if (md == NULL) {
+      continue;
+    }
+
+    md_ctx = EVP_MD_CTX_create();
+    if (EVP_DigestInit_ex(md_ctx, md, NULL) != 1) {
+      pr_trace_msg(trace_channel, 3,
+        "error preparing %s digest: %s", get_algo_name(algo, 0),
+        get_errors());
+      EVP_MD_CTX_destroy(md_ctx);
+      continue;
+    }
+
+    digest_cache_xfer_algos[digest_cache_xfer_nctxs] = algo;
+    digest_cache_xfer_ctxs[digest_cache_xfer_nctxs] = md_ctx;
+    digest_cache_xfer_nctxs++;
+  }
+
+  if (digest_cache_xfer_nctxs == 0) {
+    errno = EPERM;
+    return -1;
+  }
+
+  return 0;
+}
+
 MODRET digest_pre_retr(cmd_rec *cmd) {
   config_rec *c;
   const char *proto;
@@ -2267,28 +2791,20 @@ MODRET digest_pre_retr(cmd_rec *cmd) {
     }
   }
 
-  digest_cache_xfer_ctx = EVP_MD_CTX_create();
-  if (EVP_DigestInit_ex(digest_cache_xfer_ctx, digest_hash_md, NULL) != 1) {
-    pr_trace_msg(trace_channel, 3,
-      "error preparing %s digest: %s", get_algo_name(digest_hash_algo, 0),
-      get_errors());
-    EVP_MD_CTX_destroy(digest_cache_xfer_ctx);
-    digest_cache_xfer_ctx = NULL;
-
-  } else {
+  if (digest_xfer_init() == 0) {
     pr_event_register(&digest_module, "core.data-write", digest_data_xfer_ev,
-      digest_cache_xfer_ctx);
+      NULL);
     pr_event_register(&digest_module, "mod_sftp.sftp.data-write",
-      digest_data_xfer_ev, digest_cache_xfer_ctx);
+      digest_data_xfer_ev, NULL);
   }
 
   return PR_DECLINED(cmd);
 }
 
 MODRET digest_log(cmd_rec *cmd) {
-  const char *algo_name;
-  unsigned char *digest;
-  unsigned int digest_len;
+  register unsigned int i;
+  const char *algo_name, *path;
+  struct stat st;
 
   if (digest_engine == FALSE) {
     return PR_DECLINED(cmd);
@@ -2313,56 +2829,66 @@ MODRET digest_log(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  if (digest_cache_xfer_ctx == NULL) {
+  if (digest_cache_xfer_nctxs == 0) {
     return PR_DECLINED(cmd);
   }
 
-  algo_name = get_algo_name(digest_hash_algo, 0);
-  digest_len = EVP_MD_size(digest_hash_md);
-  digest = palloc(cmd->tmp_pool, digest_len);
-
-  if (EVP_DigestFinal_ex(digest_cache_xfer_ctx, digest, &digest_len) != 1) {
-    pr_trace_msg(trace_channel, 1,
-      "error finishing %s digest for %s: %s", algo_name,
-      (char *) cmd->argv[0], get_errors());
+  path = session.xfer.path;
+  pr_fs_clear_cache2(path);
+  if (pr_fsio_stat(path, &st) < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error checking '%s' post-%s: %s", path, (char *) cmd->argv[0],
+      strerror(errno));
+    digest_xfer_free();
+    return PR_DECLINED(cmd);
+  }
 
-  } else {
+  for (i = 0; i < digest_cache_xfer_nctxs; i++) {
+    unsigned long algo;
+    unsigned char *digest;
+    unsigned int digest_len;
+    char *hex_digest;
     int res;
-    struct stat st;
-    const char *path;
-
-    path = session.xfer.path;
-    pr_fs_clear_cache2(path);
-    res = pr_fsio_stat(path, &st);
-    if (res == 0) {
-      char *hex_digest;
-      off_t start, len;
-      time_t mtime;
 
-      hex_digest = pr_str_bin2hex(cmd->tmp_pool, digest, digest_len,
-        PR_STR_FL_HEX_USE_LC);
+    algo = digest_cache_xfer_algos[i];
+    algo_name = get_algo_name(algo, 0);
+    digest_len = EVP_MD_CTX_size(digest_cache_xfer_ctxs[i]);
+    digest = palloc(cmd->tmp_pool, digest_len);
+
+    if (EVP_DigestFinal_ex(digest_cache_xfer_ctxs[i], digest,
+        &digest_len) != 1) {
+      pr_trace_msg(trace_channel, 1,
+        "error finishing %s digest for %s: %s", algo_name,
+        (char *) cmd->argv[0], get_errors());
+      continue;
+    }
 
-      mtime = st.st_mtime;
-      start = 0;
-      len = st.st_size;
+    hex_digest = pr_str_bin2hex(cmd->tmp_pool, digest, digest_len,
+      PR_STR_FL_HEX_USE_LC);
 
-      if (add_cached_digest(cmd->pool, cmd, digest_hash_algo, path, mtime,
-          start, len, hex_digest) < 0) {
-        pr_trace_msg(trace_channel, 8,
-          "error caching %s digest for path '%s': %s", algo_name, path,
-          strerror(errno));
-      }
+    if (algo == digest_hash_algo) {
+      res = add_cached_digest(cmd->pool, cmd, algo, path, st.st_mtime, 0,
+        st.st_size, hex_digest);
 
     } else {
-      pr_trace_msg(trace_channel, 7,
-        "error checking '%s' post-%s: %s", path, (char *) cmd->argv[0],
+      res = cache_digest(cmd->pool, algo, path, st.st_mtime, 0, st.st_size,
+        hex_digest);
+    }
+
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 8,
+        "error caching %s digest for path '%s': %s", algo_name, path,
         strerror(errno));
     }
-  }
 
-  EVP_MD_CTX_destroy(digest_cache_xfer_ctx);
-  digest_cache_xfer_ctx = NULL;
+    /* Only persist the digest if it covers all of the file's data. */
+    if (session.xfer.total_bytes == st.st_size) {
+      (void) add_persistent_digest(cmd->tmp_pool, algo, path, st.st_mtime, 0,
+        st.st_size, hex_digest);
+    }
+  }
 
+  digest_xfer_free();
   return PR_DECLINED(cmd);
 }
 
@@ -2390,10 +2916,7 @@ MODRET digest_log_err(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  if (digest_cache_xfer_ctx != NULL) {
-    EVP_MD_CTX_destroy(digest_cache_xfer_ctx);
-    digest_cache_xfer_ctx = NULL;
-  }
+  digest_xfer_free();
 
   return PR_DECLINED(cmd);
 }
@@ -2457,19 +2980,11 @@ MODRET digest_pre_appe(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  digest_cache_xfer_ctx = EVP_MD_CTX_create();
-  if (EVP_DigestInit_ex(digest_cache_xfer_ctx, digest_hash_md, NULL) != 1) {
-    pr_trace_msg(trace_channel, 3,
-      "error preparing %s digest: %s", get_algo_name(digest_hash_algo, 0),
-      get_errors());
-    EVP_MD_CTX_destroy(digest_cache_xfer_ctx);
-    digest_cache_xfer_ctx = NULL;
-
-  } else {
+  if (digest_xfer_init() == 0) {
     pr_event_register(&digest_module, "core.data-read", digest_data_xfer_ev,
-      digest_cache_xfer_ctx);
+      NULL);
     pr_event_register(&digest_module, "mod_sftp.sftp.data-read",
-      digest_data_xfer_ev, digest_cache_xfer_ctx);
+      digest_data_xfer_ev, NULL);
   }
 
   return PR_DECLINED(cmd);
@@ -2505,19 +3020,11 @@ MODRET digest_pre_stor(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  digest_cache_xfer_ctx = EVP_MD_CTX_create();
-  if (EVP_DigestInit_ex(digest_cache_xfer_ctx, digest_hash_md, NULL) != 1) {
-    pr_trace_msg(trace_channel, 3,
-      "error preparing %s digest: %s", get_algo_name(digest_hash_algo, 0),
-      get_errors());
-    EVP_MD_CTX_destroy(digest_cache_xfer_ctx);
-    digest_cache_xfer_ctx = NULL;
-
-  } else {
+  if (digest_xfer_init() == 0) {
     pr_event_register(&digest_module, "core.data-read", digest_data_xfer_ev,
-      digest_cache_xfer_ctx);
+      NULL);
     pr_event_register(&digest_module, "mod_sftp.sftp.data-read",
-      digest_data_xfer_ev, digest_cache_xfer_ctx);
+      digest_data_xfer_ev, NULL);
   }
 
   return PR_DECLINED(cmd);
@@ -2776,21 +3283,26 @@ MODRET digest_xsha512(cmd_rec *cmd) {
  */
 
 static void digest_data_xfer_ev(const void *event_data, void *user_data) {
+  register unsigned int i;
   const pr_buffer_t *pbuf;
-  EVP_MD_CTX *md_ctx;
 
-  md_ctx = user_data;
   pbuf = event_data;
 
-  if (EVP_DigestUpdate(md_ctx, pbuf->buf, pbuf->buflen) != 1) {
-    pr_trace_msg(trace_channel, 3,
-      "error updating %s digest: %s", get_algo_name(digest_hash_algo, 0),
-      get_errors());
+  for (i = 0; i < digest_cache_xfer_nctxs; i++) {
+    const char *algo_name;
 
-  } else {
-    pr_trace_msg(trace_channel, 19,
-      "updated %s digest with %lu bytes", get_algo_name(digest_hash_algo, 0),
-      (unsigned long) pbuf->buflen);
+    algo_name = get_algo_name(digest_cache_xfer_algos[i], 0);
+
+    if (EVP_DigestUpdate(digest_cache_xfer_ctxs[i], pbuf->buf,
+        pbuf->buflen) != 1) {
+      pr_trace_msg(trace_channel, 3,
+        "error updating %s digest: %s", algo_name, get_errors());
+
+    } else {
+      pr_trace_msg(trace_channel, 19,
+        "updated %s digest with %lu bytes", algo_name,
+        (unsigned long) pbuf->buflen);
+    }
   }
 }
 
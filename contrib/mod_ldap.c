@@ -224,6 +224,33 @@ static LDAP *ld = NULL;
 static array_header *cached_quota = NULL;
 static array_header *cached_ssh_pubkeys = NULL;
 
+/* LDAPCache: per-session cache of user, group, quota, and SSH public key
+ * lookups, keyed by lookup type and name/ID.  A cached entry with NULL data
+ * records a lookup which found no entry.
+ */
+struct ldap_cache_entry {
+  time_t expires;
+  void *data;
+};
+
+static int ldap_cache_engine = FALSE;
+static int ldap_cache_ttl = 0;
+static int ldap_cache_negative_ttl = 0;
+static pool *ldap_cache_pool = NULL;
+static pr_table_t *ldap_cache_tab = NULL;
+static unsigned int ldap_cache_nstored = 0;
+#define PR_LDAP_CACHE_TTL_DEFAULT		60
+
+/* When this many entries have been stored, the cache is emptied, so that the
+ * memory of expired/replaced entries is reclaimed.
+ */
+#define PR_LDAP_CACHE_MAX_STORED		4096
+
+/* Bumped whenever the connection is unbound, so that outstanding asynchronous
+ * searches can tell whether they were sent on the current connection.
+ */
+static unsigned int ldap_conn_generation = 0;
+
 /* Necessary prototypes */
 static int ldap_sess_init(void);
 static struct sasl_info *sasl_info_create(pool *, LDAP *);
@@ -246,6 +273,7 @@ static void pr_ldap_unbind(void) {
   }
 
   ld = NULL;
+  ldap_conn_generation++;
 }
 
 static void log_sasl_mechs(LDAP *conn_ld, const char *url_text) {
@@ -768,6 +796,89 @@ static LDAPMessage *pr_ldap_search(const char *basedn, const char *filter,
   return result;
 }
 
+#if LDAP_API_VERSION >= 2000
+/* Sends a search request without waiting for its results, so that other
+ * lookups can be done while the server processes it.  The results are
+ * collected using pr_ldap_search_recv().  Returns the message ID of the
+ * request, or -1 if the request could not be sent.
+ */
+static int pr_ldap_search_send(const char *basedn, const char *filter,
+    char *attrs[], int sizelimit) {
+  int msgid = -1, res;
+
+  if (ld == NULL) {
+    if (pr_ldap_connect(&ld, TRUE) < 0) {
+      return -1;
+    }
+  }
+
+  res = ldap_search_ext(ld, basedn, ldap_search_scope, filter, attrs, 0,
+    NULL, NULL, &ldap_querytimeout_tv, sizelimit, &msgid);
+  if (res != LDAP_SUCCESS) {
+    (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+      "error sending LDAP search using DN '%s', filter '%s': %s", basedn,
+      filter, ldap_err2string(res));
+
+    if (res == LDAP_SERVER_DOWN) {
+      pr_ldap_unbind();
+    }
+
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 12,
+    "sent LDAP search (message ID %d) under base DN %s using filter %s",
+    msgid, basedn, filter);
+  return msgid;
+}
+
+/* Waits for the results of a search sent by pr_ldap_search_send(). */
+static LDAPMessage *pr_ldap_search_recv(int msgid, const char *basedn,
+    const char *filter) {
+  int err = LDAP_SUCCESS, res;
+  LDAPMessage *result = NULL;
+
+  res = ldap_result(ld, msgid, LDAP_MSG_ALL, &ldap_querytimeout_tv, &result);
+  if (res <= 0) {
+    if (res == 0) {
+      (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+        "LDAP search using DN '%s', filter '%s' timed out", basedn, filter);
+      (void) ldap_abandon_ext(ld, msgid, NULL, NULL);
+
+    } else {
+      (void) ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &err);
+      (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+        "error reading results of LDAP search using DN '%s', filter '%s': %s",
+        basedn, filter, ldap_err2string(err));
+
+      if (err == LDAP_SERVER_DOWN) {
+        pr_ldap_unbind();
+      }
+    }
+
+    if (result != NULL) {
+      ldap_msgfree(result);
+    }
+
+    return NULL;
+  }
+
+  res = ldap_parse_result(ld, result, &err, NULL, NULL, NULL, NULL, 0);
+  if (res != LDAP_SUCCESS ||
+      err != LDAP_SUCCESS) {
+    (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+      "LDAP search use DN '%s', filter '%s' failed: %s", basedn, filter,
+      ldap_err2string(res != LDAP_SUCCESS ? res : err));
+    ldap_msgfree(result);
+    return NULL;
+  }
+
+  (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+    "searched under base DN %s using filter %s", basedn, filter);
+  return result;
+}
+#endif /* LDAP_API_VERSION >= 2000 */
+
 static struct passwd *pr_ldap_user_lookup(pool *p, char *filter_template,
     const char *replace, const char *basedn, char *attrs[], char **user_dn) {
   const char *filter;
@@ -802,6 +913,7 @@ static struct passwd *pr_ldap_user_lookup(pool *p, char *filter_template,
     /* No LDAP entries for this user. */
     (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
       "no entries for filter %s under base DN %s", filter, basedn);
+    errno = ENOENT;
     return NULL;
   }
 
@@ -1074,6 +1186,7 @@ static struct group *pr_ldap_group_lookup(pool *p, char *filter_template,
     /* No LDAP entries found for this user. */
     (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
       "no group entries for filter %s", filter);
+    errno = ENOENT;
     return NULL;
   }
 
@@ -1113,12 +1226,14 @@ static struct group *pr_ldap_group_lookup(pool *p, char *filter_template,
 
     } else if (strcasecmp(attrs[i], ldap_attr_memberuid) == 0) {
       value_count = LDAP_COUNT_VALUES(values);
-      gr->gr_mem = (char **) palloc(session.pool, value_count * sizeof(char *));
+      gr->gr_mem = (char **) palloc(session.pool,
+        (value_count + 1) * sizeof(char *));
 
       for (value_offset = 0; value_offset < value_count; ++value_offset) {
         gr->gr_mem[value_offset] =
           pstrdup(session.pool, LDAP_VALUE(values, value_offset));
       }
+      gr->gr_mem[value_count] = NULL;
 
     } else {
       (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
@@ -1221,6 +1336,7 @@ static unsigned char pr_ldap_quota_lookup(pool *p, char *filter_template,
           "no entries for filter %s, and no default quota defined", filter);
       }
 
+      errno = ENOENT;
       return FALSE;
     }
 
@@ -1252,6 +1368,7 @@ static unsigned char pr_ldap_quota_lookup(pool *p, char *filter_template,
       (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
         "referenced DN %s does not have an ftpQuota attribute, and no "
         "default quota defined", basedn);
+      errno = ENOENT;
       return FALSE;
     }
 
@@ -1285,6 +1402,7 @@ static unsigned char pr_ldap_quota_lookup(pool *p, char *filter_template,
   /* No quota attributes for this user. */
   (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
     "no %s or %s attribute, and no default quota defined", attrs[0], attrs[1]);
+  errno = ENOENT;
   return FALSE;
 }
 
@@ -1329,11 +1447,14 @@ static unsigned char pr_ldap_ssh_pubkey_lookup(pool *p, char *filter_template,
       "LDAP search for SSH publickey using DN %s, filter %s returned "
       "no entries", basedn, filter);
     ldap_msgfree(result);
+    errno = ENOENT;
     return FALSE;
   }
 
   values = LDAP_GET_VALUES(ld, e, attrs[0]);
   if (values == NULL) {
+    ldap_msgfree(result);
+    errno = ENOENT;
     return FALSE;
   }
 
@@ -1349,12 +1470,264 @@ static unsigned char pr_ldap_ssh_pubkey_lookup(pool *p, char *filter_template,
   return TRUE;
 }
 
+/* LDAPCache support */
+
+static const char *ldap_cache_key(pool *p, const char *type, const char *name) {
+  return pstrcat(p, type, ":", name, NULL);
+}
+
+/* Returns the cache entry for the given key, or NULL (with errno set to
+ * ENOENT) if there is no such entry, or if it has expired.
+ */
+static struct ldap_cache_entry *ldap_cache_get(const char *key) {
+  struct ldap_cache_entry *entry;
+
+  if (ldap_cache_tab == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  entry = (struct ldap_cache_entry *) pr_table_get(ldap_cache_tab, key, NULL);
+  if (entry == NULL) {
+    pr_trace_msg(trace_channel, 17, "cache miss for '%s'", key);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  if (entry->expires <= time(NULL)) {
+    pr_trace_msg(trace_channel, 17, "cached entry for '%s' expired", key);
+    (void) pr_table_remove(ldap_cache_tab, key, NULL);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 17, "cache hit for '%s'%s", key,
+    entry->data == NULL ? " (not found)" : "");
+  return entry;
+}
+
+/* Returns the pool from which data to be cached is to be allocated.  Once
+ * enough entries have been stored, the cache is emptied first, so that the
+ * memory used by expired and replaced entries is reclaimed.
+ */
+static pool *ldap_cache_get_pool(void) {
+  if (ldap_cache_pool != NULL &&
+      ldap_cache_nstored >= PR_LDAP_CACHE_MAX_STORED) {
+    pr_trace_msg(trace_channel, 9, "emptying cache after %u stored entries",
+      ldap_cache_nstored);
+    destroy_pool(ldap_cache_pool);
+    ldap_cache_pool = NULL;
+    ldap_cache_tab = NULL;
+  }
+
+  if (ldap_cache_pool == NULL) {
+    ldap_cache_pool = make_sub_pool(ldap_pool);
+    pr_pool_tag(ldap_cache_pool, MOD_LDAP_VERSION ": Cache Pool");
+    ldap_cache_tab = pr_table_alloc(ldap_cache_pool, 0);
+    ldap_cache_nstored = 0;
+  }
+
+  return ldap_cache_pool;
+}
+
+/* Stores the given data, allocated from the pool most recently returned by
+ * ldap_cache_get_pool(), under the given key.  NULL data records that the
+ * lookup found no entry; such results are only cached if a negative TTL
+ * is configured.
+ */
+static void ldap_cache_set(const char *key, void *data) {
+  struct ldap_cache_entry *entry;
+  int ttl;
+
+  ttl = (data != NULL ? ldap_cache_ttl : ldap_cache_negative_ttl);
+  if (ttl <= 0) {
+    return;
+  }
+
+  if (ldap_cache_pool == NULL) {
+    (void) ldap_cache_get_pool();
+  }
+
+  entry = pcalloc(ldap_cache_pool, sizeof(struct ldap_cache_entry));
+  entry->expires = time(NULL) + ttl;
+  entry->data = data;
+
+  if (pr_table_set(ldap_cache_tab, key, entry, sizeof(void *)) < 0) {
+    if (pr_table_add(ldap_cache_tab, pstrdup(ldap_cache_pool, key), entry,
+        sizeof(void *)) < 0) {
+      pr_trace_msg(trace_channel, 3, "error caching '%s': %s", key,
+        strerror(errno));
+      return;
+    }
+  }
+
+  ldap_cache_nstored++;
+  pr_trace_msg(trace_channel, 17, "cached '%s'%s for %d secs", key,
+    data == NULL ? " (not found)" : "", ttl);
+}
+
+static struct passwd *ldap_cache_dup_passwd(pool *p, struct passwd *pw) {
+  struct passwd *dup;
+
+  dup = pcalloc(p, sizeof(struct passwd));
+  dup->pw_name = pw->pw_name ? pstrdup(p, pw->pw_name) : NULL;
+  dup->pw_passwd = pw->pw_passwd ? pstrdup(p, pw->pw_passwd) : NULL;
+  dup->pw_uid = pw->pw_uid;
+  dup->pw_gid = pw->pw_gid;
+  dup->pw_dir = pw->pw_dir ? pstrdup(p, pw->pw_dir) : NULL;
+  dup->pw_shell = pw->pw_shell ? pstrdup(p, pw->pw_shell) : NULL;
+
+  return dup;
+}
+
+static struct group *ldap_cache_dup_group(pool *p, struct group *gr) {
+  struct group *dup;
+
+  dup = pcalloc(p, sizeof(struct group));
+  dup->gr_name = gr->gr_name ? pstrdup(p, gr->gr_name) : NULL;
+  dup->gr_gid = gr->gr_gid;
+
+  if (gr->gr_mem != NULL) {
+    register unsigned int i;
+    unsigned int count = 0;
+
+    while (gr->gr_mem[count] != NULL) {
+      count++;
+    }
+
+    dup->gr_mem = pcalloc(p, (count + 1) * sizeof(char *));
+    for (i = 0; i < count; i++) {
+      dup->gr_mem[i] = pstrdup(p, gr->gr_mem[i]);
+    }
+  }
+
+  return dup;
+}
+
+static array_header *ldap_cache_dup_strings(pool *p, array_header *list) {
+  register unsigned int i;
+  array_header *dup;
+  char **elts;
+
+  dup = make_array(p, list->nelts, sizeof(char *));
+  elts = list->elts;
+  for (i = 0; i < list->nelts; i++) {
+    *((char **) push_array(dup)) = pstrdup(p, elts[i]);
+  }
+
+  return dup;
+}
+
+/* Looks up a user, using and populating the cache if enabled. */
+static struct passwd *ldap_cache_user_lookup(pool *p, const char *type,
+    const char *name, char *filter_template, const char *basedn,
+    char *attrs[], char **user_dn) {
+  const char *key = NULL;
+  struct passwd *pw;
+  int xerrno;
+
+  if (ldap_cache_engine == TRUE) {
+    struct ldap_cache_entry *entry;
+
+    key = ldap_cache_key(p, type, name);
+    entry = ldap_cache_get(key);
+    if (entry != NULL) {
+      if (entry->data == NULL) {
+        return NULL;
+      }
+
+      return ldap_cache_dup_passwd(p, entry->data);
+    }
+  }
+
+  errno = 0;
+  pw = pr_ldap_user_lookup(p, filter_template, name, basedn, attrs, user_dn);
+  xerrno = errno;
+
+  if (key != NULL) {
+    if (pw != NULL) {
+      pool *cache_pool;
+      struct passwd *cached;
+
+      cache_pool = ldap_cache_get_pool();
+      cached = ldap_cache_dup_passwd(cache_pool, pw);
+
+      /* Cache the user under the key used for this lookup, and under its
+       * name or UID for the other kind of lookup.
+       */
+      ldap_cache_set(key, cached);
+      if (strcmp(type, "u") == 0) {
+        ldap_cache_set(ldap_cache_key(p, "U", pr_uid2str(p, cached->pw_uid)),
+          cached);
+
+      } else if (cached->pw_name != NULL) {
+        ldap_cache_set(ldap_cache_key(p, "u", cached->pw_name), cached);
+      }
+
+    } else if (xerrno == ENOENT) {
+      ldap_cache_set(key, NULL);
+    }
+  }
+
+  return pw;
+}
+
+/* Looks up a group, using and populating the cache if enabled. */
+static struct group *ldap_cache_group_lookup(pool *p, const char *type,
+    const char *name, char *filter_template, char *attrs[]) {
+  const char *key = NULL;
+  struct group *gr;
+  int xerrno;
+
+  if (ldap_cache_engine == TRUE) {
+    struct ldap_cache_entry *entry;
+
+    key = ldap_cache_key(p, type, name);
+    entry = ldap_cache_get(key);
+    if (entry != NULL) {
+      if (entry->data == NULL) {
+        return NULL;
+      }
+
+      return ldap_cache_dup_group(p, entry->data);
+    }
+  }
+
+  errno = 0;
+  gr = pr_ldap_group_lookup(p, filter_template, name, attrs);
+  xerrno = errno;
+
+  if (key != NULL) {
+    if (gr != NULL) {
+      pool *cache_pool;
+      struct group *cached;
+
+      cache_pool = ldap_cache_get_pool();
+      cached = ldap_cache_dup_group(cache_pool, gr);
+
+      ldap_cache_set(key, cached);
+      if (strcmp(type, "g") == 0) {
+        ldap_cache_set(ldap_cache_key(p, "G", pr_gid2str(p, cached->gr_gid)),
+          cached);
+
+      } else if (cached->gr_name != NULL) {
+        ldap_cache_set(ldap_cache_key(p, "g", cached->gr_name), cached);
+      }
+
+    } else if (xerrno == ENOENT) {
+      ldap_cache_set(key, NULL);
+    }
+  }
+
+  return gr;
+}
+
 static struct group *pr_ldap_getgrnam(pool *p, const char *group_name) {
   char *group_attrs[] = {
     ldap_attr_cn, ldap_attr_gidnumber, ldap_attr_memberuid, NULL,
   };
 
-  return pr_ldap_group_lookup(p, ldap_group_name_filter, group_name,
+  return ldap_cache_group_lookup(p, "g", group_name, ldap_group_name_filter,
     group_attrs);
 }
 
@@ -1365,7 +1738,8 @@ static struct group *pr_ldap_getgrgid(pool *p, gid_t gid) {
   };
 
   gidstr = pr_gid2str(p, gid);
-  return pr_ldap_group_lookup(p, ldap_group_gid_filter, gidstr, group_attrs);
+  return ldap_cache_group_lookup(p, "G", gidstr, ldap_group_gid_filter,
+    group_attrs);
 }
 
 static struct passwd *pr_ldap_getpwnam(pool *p, const char *username) {
@@ -1401,8 +1775,8 @@ static struct passwd *pr_ldap_getpwnam(pool *p, const char *username) {
    * fetched userPassword, auth binds would never be done because
    * ldap_auth_check() would always get a crypted password.
    */
-  return pr_ldap_user_lookup(p, ldap_user_name_filter, username, filter,
-    ldap_authbinds ? name_attrs + 1 : name_attrs,
+  return ldap_cache_user_lookup(p, "u", username, ldap_user_name_filter,
+    filter, ldap_authbinds ? name_attrs + 1 : name_attrs,
     ldap_authbinds ? &ldap_authbind_dn : NULL);
 }
 
@@ -1414,12 +1788,12 @@ static struct passwd *pr_ldap_getpwuid(pool *p, uid_t uid) {
   };
 
   uidstr = pr_uid2str(p, uid);
-  return pr_ldap_user_lookup(p, ldap_user_uid_filter, uidstr,
+  return ldap_cache_user_lookup(p, "U", uidstr, ldap_user_uid_filter,
     ldap_user_basedn, uid_attrs, ldap_authbinds ? &ldap_authbind_dn : NULL);
 }
 
 MODRET handle_ldap_quota_lookup(cmd_rec *cmd) {
-  const char *basedn;
+  const char *basedn, *key = NULL;
 
   basedn = pr_ldap_interpolate_filter(cmd->tmp_pool,
     ldap_user_basedn, cmd->argv[0]);
@@ -1427,14 +1801,42 @@ MODRET handle_ldap_quota_lookup(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
+  if (ldap_cache_engine == TRUE) {
+    struct ldap_cache_entry *entry;
+
+    key = ldap_cache_key(cmd->tmp_pool, "q", cmd->argv[0]);
+    entry = ldap_cache_get(key);
+    if (entry != NULL) {
+      if (entry->data == NULL) {
+        return PR_DECLINED(cmd);
+      }
+
+      (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+        "returning cached quota for user %s", (char *) cmd->argv[0]);
+      return mod_create_data(cmd, ldap_cache_dup_strings(cmd->tmp_pool,
+        entry->data));
+    }
+  }
+
   if (cached_quota == NULL ||
       strcasecmp(((char **) cached_quota->elts)[0], cmd->argv[0]) != 0) {
 
+    errno = 0;
     if (pr_ldap_quota_lookup(cmd->tmp_pool, ldap_user_name_filter,
         cmd->argv[0], basedn) == FALSE) {
+      if (key != NULL &&
+          errno == ENOENT) {
+        ldap_cache_set(key, NULL);
+      }
+
       return PR_DECLINED(cmd);
     }
 
+    if (key != NULL) {
+      ldap_cache_set(key, ldap_cache_dup_strings(ldap_cache_get_pool(),
+        cached_quota));
+    }
+
   } else {
     (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
       "returning cached quota for user %s", (char *) cmd->argv[0]);
@@ -1444,6 +1846,7 @@ MODRET handle_ldap_quota_lookup(cmd_rec *cmd) {
 }
 
 MODRET handle_ldap_ssh_pubkey_lookup(cmd_rec *cmd) {
+  const char *key = NULL;
   char *user;
 
   if (ldap_do_users == FALSE) {
@@ -1452,20 +1855,39 @@ MODRET handle_ldap_ssh_pubkey_lookup(cmd_rec *cmd) {
 
   user = cmd->argv[0];
 
-  if (cached_ssh_pubkeys != NULL &&
-      cached_ssh_pubkeys->nelts > 0 &&
-      strcasecmp(((char **) cached_ssh_pubkeys->elts)[0], user) == 0) {
+  if (ldap_cache_engine == TRUE) {
+    struct ldap_cache_entry *entry;
 
-    (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
-      "returning cached SSH public keys for user %s", user);
-    return mod_create_data(cmd, cached_ssh_pubkeys);
+    key = ldap_cache_key(cmd->tmp_pool, "k", user);
+    entry = ldap_cache_get(key);
+    if (entry != NULL) {
+      if (entry->data == NULL) {
+        return PR_DECLINED(cmd);
+      }
+
+      (void) pr_log_writefile(ldap_logfd, MOD_LDAP_VERSION,
+        "returning cached SSH public keys for user %s", user);
+      return mod_create_data(cmd, ldap_cache_dup_strings(cmd->tmp_pool,
+        entry->data));
+    }
   }
 
+  errno = 0;
   if (pr_ldap_ssh_pubkey_lookup(cmd->tmp_pool, ldap_user_name_filter,
       user, ldap_user_basedn) == FALSE) {
+    if (key != NULL &&
+        errno == ENOENT) {
+      ldap_cache_set(key, NULL);
+    }
+
     return PR_DECLINED(cmd);
   }
 
+  if (key != NULL) {
+    ldap_cache_set(key, ldap_cache_dup_strings(ldap_cache_get_pool(),
+      cached_ssh_pubkeys));
+  }
+
   return mod_create_data(cmd, cached_ssh_pubkeys);
 }
 
@@ -1554,7 +1976,11 @@ MODRET ldap_auth_getgrgid(cmd_rec *cmd) {
 }
 
 MODRET ldap_auth_getgroups(cmd_rec *cmd) {
-  const char *filter;
+  const char *filter = NULL;
+#if LDAP_API_VERSION >= 2000
+  int msgid = -1;
+  unsigned int conn_generation = 0;
+#endif /* LDAP_API_VERSION >= 2000 */
   char *w[] = {
     ldap_attr_gidnumber, ldap_attr_cn, NULL,
   };
@@ -1574,6 +2000,22 @@ MODRET ldap_auth_getgroups(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
+  if (ldap_gid_basedn != NULL) {
+    filter = pr_ldap_interpolate_filter(cmd->tmp_pool,
+      ldap_group_member_filter, cmd->argv[0]);
+    if (filter == NULL) {
+      return NULL;
+    }
+
+#if LDAP_API_VERSION >= 2000
+    /* Send the secondary group search now, so that the server can process it
+     * while we look up the user's primary group.
+     */
+    msgid = pr_ldap_search_send(ldap_gid_basedn, filter, w, 0);
+    conn_generation = ldap_conn_generation;
+#endif /* LDAP_API_VERSION >= 2000 */
+  }
+
   pw = pr_ldap_getpwnam(cmd->tmp_pool, cmd->argv[0]);
   if (pw != NULL) {
     gr = pr_ldap_getgrgid(cmd->tmp_pool, pw->pw_gid);
@@ -1597,13 +2039,22 @@ MODRET ldap_auth_getgroups(cmd_rec *cmd) {
     goto return_groups;
   }
 
-  filter = pr_ldap_interpolate_filter(cmd->tmp_pool,
-    ldap_group_member_filter, cmd->argv[0]);
-  if (filter == NULL) {
-    return NULL;
-  }
+#if LDAP_API_VERSION >= 2000
+  if (msgid >= 0 &&
+      ld != NULL &&
+      conn_generation == ldap_conn_generation) {
+    result = pr_ldap_search_recv(msgid, ldap_gid_basedn, filter);
 
+  } else {
+    /* The search could not be sent, or the connection on which it was sent
+     * has since gone away; search again, the usual way.
+     */
+    result = pr_ldap_search(ldap_gid_basedn, filter, w, 0, TRUE);
+  }
+#else
   result = pr_ldap_search(ldap_gid_basedn, filter, w, 0, TRUE);
+#endif /* LDAP_API_VERSION >= 2000 */
+
   if (result == NULL) {
     return FALSE;
   }
@@ -2756,6 +3207,63 @@ MODRET set_ldapauthbinds(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: LDAPCache on|off [ttl secs] [negative-ttl secs] */
+MODRET set_ldapcache(cmd_rec *cmd) {
+  register unsigned int i;
+  int engine, ttl = PR_LDAP_CACHE_TTL_DEFAULT, negative_ttl = -1;
+  config_rec *c;
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc < 2 ||
+      (cmd->argc % 2) != 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  engine = get_boolean(cmd, 1);
+  if (engine == -1) {
+    CONF_ERROR(cmd, "expected Boolean parameter");
+  }
+
+  for (i = 2; i < cmd->argc; i += 2) {
+    int secs;
+
+    if (pr_str_get_duration(cmd->argv[i+1], &secs) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing ", cmd->argv[i],
+        " value '", cmd->argv[i+1], "': ", strerror(errno), NULL));
+    }
+
+    if (strcasecmp(cmd->argv[i], "ttl") == 0) {
+      if (secs <= 0) {
+        CONF_ERROR(cmd, "ttl must be greater than zero");
+      }
+
+      ttl = secs;
+
+    } else if (strcasecmp(cmd->argv[i], "negative-ttl") == 0) {
+      negative_ttl = secs;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown LDAPCache parameter: ",
+        cmd->argv[i], NULL));
+    }
+  }
+
+  if (negative_ttl < 0) {
+    negative_ttl = ttl;
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = engine;
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = ttl;
+  c->argv[2] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[2]) = negative_ttl;
+
+  return PR_HANDLED(cmd);
+}
+
 MODRET set_ldapdefaultauthscheme(cmd_rec *cmd) {
   CHECK_ARGS(cmd, 1);
   CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
@@ -3174,6 +3682,12 @@ static void ldap_sess_reinit_ev(const void *event_data, void *user_data) {
   ldap_genhdir = FALSE;
   ldap_genhdir_prefix = NULL;
   ldap_genhdir_prefix_nouname = FALSE;
+  ldap_cache_engine = FALSE;
+  ldap_cache_ttl = 0;
+  ldap_cache_negative_ttl = 0;
+  ldap_cache_pool = NULL;
+  ldap_cache_tab = NULL;
+  ldap_cache_nstored = 0;
 
   curr_server_info = NULL;
   curr_server_index = 0;
@@ -3370,6 +3884,13 @@ static int ldap_sess_init(void) {
     ldap_defaultauthscheme = (char *) ptr;
   }
 
+  c = find_config(main_server->conf, CONF_PARAM, "LDAPCache", FALSE);
+  if (c != NULL) {
+    ldap_cache_engine = *((int *) c->argv[0]);
+    ldap_cache_ttl = *((int *) c->argv[1]);
+    ldap_cache_negative_ttl = *((int *) c->argv[2]);
+  }
+
   /* Look up any attr redefinitions (LDAPAttr) before using those
    * variables, such as when generating the default search filters.
    */
@@ -3562,6 +4083,7 @@ static conftable ldap_conftab[] = {
   { "LDAPAttr",			set_ldapattr,			NULL },
   { "LDAPAuthBinds",		set_ldapauthbinds,		NULL },
   { "LDAPBindDN",		set_ldapbinddn,			NULL },
+  { "LDAPCache",		set_ldapcache,			NULL },
   { "LDAPDefaultAuthScheme",	set_ldapdefaultauthscheme,	NULL },
   { "LDAPDefaultGID",		set_ldapdefaultgid,		NULL },
   { "LDAPDefaultQuota",		set_ldapdefaultquota,		NULL },
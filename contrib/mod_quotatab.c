@@ -146,11 +146,7 @@ static unsigned char have_err_response = FALSE;
     sess_tally.files_xfer_used, sess_limit.files_xfer_avail, XFER)
 
 #define QUOTATAB_TALLY_READ \
-  if (!sess_limit.quota_per_session) { \
-    if (quotatab_read(&sess_tally) < 0) { \
-      quotatab_log("error: unable to read tally: %s", strerror(errno)); \
-    } \
-  }
+  quotatab_read_tally();
 
 #define QUOTATAB_TALLY_WRITE(bi, bo, bx, fi, fo, fx) \
   { \
@@ -162,6 +158,33 @@ static unsigned char have_err_response = FALSE;
 
 static unsigned long quotatab_opts = 0UL;
 #define QUOTA_OPT_SCAN_ON_LOGIN		0x0001
+#define QUOTA_OPT_STRICT_TALLY		0x0002
+
+/* For write-behind of tally updates (QuotaWriteBehind).  The session's
+ * tally updates are accumulated locally, and written out to the tally
+ * table, merged, on a timer, when a threshold is reached, when the session
+ * nears one of its limits, or when the session ends.
+ */
+static unsigned char quota_write_behind = FALSE;
+static int quota_write_behind_interval = 0;
+static off_t quota_write_behind_bytes = 0;
+static unsigned int quota_write_behind_files = 0;
+static int quota_write_behind_timerno = -1;
+
+/* Set by the write-behind timer; the flush itself happens at the next
+ * command dispatch, or when the session ends.
+ */
+static int quota_write_behind_due = FALSE;
+
+/* When the tally was last read from, or written to, the tally table. */
+static time_t quota_write_behind_synced = 0;
+
+static quota_deltas_t quotatab_pending_deltas;
+static unsigned char quotatab_have_pending_deltas = FALSE;
+
+#define QUOTA_WRITE_BEHIND_DEFAULT_INTERVAL	30
+#define QUOTA_WRITE_BEHIND_DEFAULT_BYTES	(10 * 1024 * 1024)
+#define QUOTA_WRITE_BEHIND_DEFAULT_FILES	100
 
 #define QUOTA_SCAN_FL_VERBOSE		0x0001
 
@@ -173,6 +196,7 @@ static int quotatab_sess_init(void);
 
 static int quotatab_rlock(quota_table_t *);
 static int quotatab_runlock(quota_table_t *);
+static void quotatab_read_tally(void);
 static int quotatab_wlock(quota_table_t *);
 static int quotatab_wunlock(quota_table_t *);
 
@@ -1283,27 +1307,12 @@ static int quotatab_wunlock(quota_table_t *tab) {
   return res;
 }
 
-int quotatab_write(quota_tally_t *tally,
-    double bytes_in_inc, double bytes_out_inc, double bytes_xfer_inc,
-    int files_in_inc, int files_out_inc, int files_xfer_inc) {
-
-  /* Make sure the tally table can support writes. */
-  if (!tally_tab || !tally_tab->tab_write) {
-    errno = EPERM;
-    return -1;
-  }
-
-  /* Obtain a writer lock for the entry in question */
-  if (quotatab_wlock(tally_tab) < 0) {
-    quotatab_log("error: unable to obtain write lock: %s", strerror(errno));
-    return -1;
-  }
-
-  /* Make sure the deltas are cleared. */
-  memset(&quotatab_deltas, '\0', sizeof(quotatab_deltas));
-
-  /* Read in the tally (to catch any possible updates by other processes). */
-  QUOTATAB_TALLY_READ
+/* Applies the given increments to the session's tally, and records them in
+ * quotatab_deltas, for those tallies whose limits are not "unlimited".
+ */
+static void quotatab_apply_incs(double bytes_in_inc, double bytes_out_inc,
+    double bytes_xfer_inc, int files_in_inc, int files_out_inc,
+    int files_xfer_inc) {
 
   /* Only update the tally if the value is not "unlimited". */
   if (sess_limit.bytes_in_avail > 0.0) {
@@ -1376,6 +1385,39 @@ int quotatab_write(quota_tally_t *tally,
 
     quotatab_deltas.files_xfer_delta = files_xfer_inc;
   }
+}
+
+static int quotatab_write_tally(quota_tally_t *tally,
+    double bytes_in_inc, double bytes_out_inc, double bytes_xfer_inc,
+    int files_in_inc, int files_out_inc, int files_xfer_inc) {
+
+  /* Make sure the tally table can support writes. */
+  if (!tally_tab || !tally_tab->tab_write) {
+    errno = EPERM;
+    return -1;
+  }
+
+  /* Obtain a writer lock for the entry in question */
+  if (quotatab_wlock(tally_tab) < 0) {
+    quotatab_log("error: unable to obtain write lock: %s", strerror(errno));
+    return -1;
+  }
+
+  /* Make sure the deltas are cleared. */
+  memset(&quotatab_deltas, '\0', sizeof(quotatab_deltas));
+
+  /* Read in the tally (to catch any possible updates by other processes). */
+  if (!sess_limit.quota_per_session) {
+    if (quotatab_read(&sess_tally) < 0) {
+      quotatab_log("error: unable to read tally: %s", strerror(errno));
+
+    } else {
+      quota_write_behind_synced = time(NULL);
+    }
+  }
+
+  quotatab_apply_incs(bytes_in_inc, bytes_out_inc, bytes_xfer_inc,
+    files_in_inc, files_out_inc, files_xfer_inc);
 
   /* No need to write out to the stream if per-session quotas are in effect. */
   if (sess_limit.quota_per_session) {
@@ -1402,6 +1444,188 @@ int quotatab_write(quota_tally_t *tally,
   return 0;
 }
 
+static int quotatab_write_behind_near_limit(void) {
+  double nbytes;
+  unsigned int nfiles;
+
+  /* Within this much of a limit, updates are written through, and the
+   * tally is re-read for each check, as when write-behind is not used.
+   */
+  nbytes = (double) quota_write_behind_bytes;
+  nfiles = quota_write_behind_files;
+
+  if ((sess_limit.bytes_in_avail > 0.0 &&
+       sess_tally.bytes_in_used + nbytes >= sess_limit.bytes_in_avail) ||
+      (sess_limit.bytes_out_avail > 0.0 &&
+       sess_tally.bytes_out_used + nbytes >= sess_limit.bytes_out_avail) ||
+      (sess_limit.bytes_xfer_avail > 0.0 &&
+       sess_tally.bytes_xfer_used + nbytes >= sess_limit.bytes_xfer_avail)) {
+    return TRUE;
+  }
+
+  if ((sess_limit.files_in_avail != 0 &&
+       sess_tally.files_in_used + nfiles >= sess_limit.files_in_avail) ||
+      (sess_limit.files_out_avail != 0 &&
+       sess_tally.files_out_used + nfiles >= sess_limit.files_out_avail) ||
+      (sess_limit.files_xfer_avail != 0 &&
+       sess_tally.files_xfer_used + nfiles >= sess_limit.files_xfer_avail)) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static int quotatab_use_write_behind(void) {
+  if (quota_write_behind == FALSE ||
+      (quotatab_opts & QUOTA_OPT_STRICT_TALLY) ||
+      sess_limit.quota_per_session) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int quotatab_flush_deltas(void) {
+  int res;
+  quota_deltas_t deltas;
+
+  if (quotatab_have_pending_deltas == FALSE) {
+    return 0;
+  }
+
+  memcpy(&deltas, &quotatab_pending_deltas, sizeof(deltas));
+  memset(&quotatab_pending_deltas, '\0', sizeof(quotatab_pending_deltas));
+  quotatab_have_pending_deltas = FALSE;
+
+  quotatab_log("writing pending tally updates: bytes in %.2f, out %.2f, "
+    "xfer %.2f; files in %d, out %d, xfer %d", deltas.bytes_in_delta,
+    deltas.bytes_out_delta, deltas.bytes_xfer_delta, deltas.files_in_delta,
+    deltas.files_out_delta, deltas.files_xfer_delta);
+
+  res = quotatab_write_tally(&sess_tally, deltas.bytes_in_delta,
+    deltas.bytes_out_delta, deltas.bytes_xfer_delta, deltas.files_in_delta,
+    deltas.files_out_delta, deltas.files_xfer_delta);
+  if (res < 0) {
+    int xerrno = errno;
+
+    /* Keep the deltas, so that they are retried on the next write. */
+    quotatab_pending_deltas.bytes_in_delta += deltas.bytes_in_delta;
+    quotatab_pending_deltas.bytes_out_delta += deltas.bytes_out_delta;
+    quotatab_pending_deltas.bytes_xfer_delta += deltas.bytes_xfer_delta;
+    quotatab_pending_deltas.files_in_delta += deltas.files_in_delta;
+    quotatab_pending_deltas.files_out_delta += deltas.files_out_delta;
+    quotatab_pending_deltas.files_xfer_delta += deltas.files_xfer_delta;
+    quotatab_have_pending_deltas = TRUE;
+
+    errno = xerrno;
+  }
+
+  return res;
+}
+
+int quotatab_write(quota_tally_t *tally,
+    double bytes_in_inc, double bytes_out_inc, double bytes_xfer_inc,
+    int files_in_inc, int files_out_inc, int files_xfer_inc) {
+  double pending_bytes;
+  int pending_files;
+
+  if (tally != &sess_tally ||
+      quotatab_use_write_behind() == FALSE) {
+    return quotatab_write_tally(tally, bytes_in_inc, bytes_out_inc,
+      bytes_xfer_inc, files_in_inc, files_out_inc, files_xfer_inc);
+  }
+
+  /* Make sure the tally table can support writes. */
+  if (!tally_tab || !tally_tab->tab_write) {
+    errno = EPERM;
+    return -1;
+  }
+
+  /* Update our cached tally, and accumulate the deltas to be written. */
+  memset(&quotatab_deltas, '\0', sizeof(quotatab_deltas));
+  quotatab_apply_incs(bytes_in_inc, bytes_out_inc, bytes_xfer_inc,
+    files_in_inc, files_out_inc, files_xfer_inc);
+
+  quotatab_pending_deltas.bytes_in_delta += quotatab_deltas.bytes_in_delta;
+  quotatab_pending_deltas.bytes_out_delta += quotatab_deltas.bytes_out_delta;
+  quotatab_pending_deltas.bytes_xfer_delta += quotatab_deltas.bytes_xfer_delta;
+  quotatab_pending_deltas.files_in_delta += quotatab_deltas.files_in_delta;
+  quotatab_pending_deltas.files_out_delta += quotatab_deltas.files_out_delta;
+  quotatab_pending_deltas.files_xfer_delta += quotatab_deltas.files_xfer_delta;
+  memset(&quotatab_deltas, '\0', sizeof(quotatab_deltas));
+  quotatab_have_pending_deltas = TRUE;
+
+  /* Write out the merged deltas now if they have reached the thresholds, or
+   * if the session is near its limits.
+   */
+  pending_bytes = quotatab_pending_deltas.bytes_xfer_delta;
+  if (pending_bytes < 0.0) {
+    pending_bytes = -pending_bytes;
+  }
+
+  if (quotatab_pending_deltas.bytes_in_delta > pending_bytes) {
+    pending_bytes = quotatab_pending_deltas.bytes_in_delta;
+  }
+
+  if (quotatab_pending_deltas.bytes_out_delta > pending_bytes) {
+    pending_bytes = quotatab_pending_deltas.bytes_out_delta;
+  }
+
+  pending_files = quotatab_pending_deltas.files_xfer_delta;
+  if (pending_files < 0) {
+    pending_files = -pending_files;
+  }
+
+  if (quotatab_pending_deltas.files_in_delta > pending_files) {
+    pending_files = quotatab_pending_deltas.files_in_delta;
+  }
+
+  if (quotatab_pending_deltas.files_out_delta > pending_files) {
+    pending_files = quotatab_pending_deltas.files_out_delta;
+  }
+
+  if (pending_bytes >= (double) quota_write_behind_bytes ||
+      (unsigned int) pending_files >= quota_write_behind_files ||
+      quotatab_write_behind_near_limit() == TRUE) {
+    return quotatab_flush_deltas();
+  }
+
+  return 0;
+}
+
+static void quotatab_read_tally(void) {
+  if (sess_limit.quota_per_session) {
+    return;
+  }
+
+  if (quotatab_use_write_behind() == TRUE) {
+    /* Use our cached tally, unless it is stale, or the session is near its
+     * limits.
+     */
+    if (quotatab_write_behind_near_limit() == FALSE &&
+        (time(NULL) - quota_write_behind_synced) <
+          quota_write_behind_interval) {
+      return;
+    }
+
+    /* Writing out any pending deltas also re-reads the tally. */
+    if (quotatab_have_pending_deltas == TRUE) {
+      if (quotatab_flush_deltas() < 0) {
+        quotatab_log("error: unable to write tally: %s", strerror(errno));
+      }
+
+      return;
+    }
+  }
+
+  if (quotatab_read(&sess_tally) < 0) {
+    quotatab_log("error: unable to read tally: %s", strerror(errno));
+
+  } else {
+    quota_write_behind_synced = time(NULL);
+  }
+}
+
 /* FSIO handlers
  */
 
@@ -1692,6 +1916,9 @@ MODRET set_quotaoptions(cmd_rec *cmd) {
     if (strcmp(cmd->argv[i], "ScanOnLogin") == 0) {
       opts |= QUOTA_OPT_SCAN_ON_LOGIN;
 
+    } else if (strcmp(cmd->argv[i], "StrictTally") == 0) {
+      opts |= QUOTA_OPT_STRICT_TALLY;
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown QuotaOption: '",
         cmd->argv[i], "'", NULL));
@@ -1704,6 +1931,73 @@ MODRET set_quotaoptions(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: QuotaWriteBehind on|off [interval secs] [bytes count]
+ *          [files count]
+ */
+MODRET set_quotawritebehind(cmd_rec *cmd) {
+  register unsigned int i;
+  int bool = -1, interval = QUOTA_WRITE_BEHIND_DEFAULT_INTERVAL;
+  off_t nbytes = QUOTA_WRITE_BEHIND_DEFAULT_BYTES;
+  unsigned int nfiles = QUOTA_WRITE_BEHIND_DEFAULT_FILES;
+  config_rec *c;
+
+  if (cmd->argc < 2 ||
+      (cmd->argc % 2) != 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  bool = get_boolean(cmd, 1);
+  if (bool == -1) {
+    CONF_ERROR(cmd, "expected boolean argument");
+  }
+
+  for (i = 2; i < cmd->argc; i += 2) {
+    if (strcasecmp(cmd->argv[i], "interval") == 0) {
+      interval = atoi(cmd->argv[i+1]);
+      if (interval <= 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid interval: ",
+          cmd->argv[i+1], NULL));
+      }
+
+    } else if (strcasecmp(cmd->argv[i], "bytes") == 0) {
+      if (pr_str_get_nbytes(cmd->argv[i+1], NULL, &nbytes) < 0 ||
+          nbytes == 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid bytes count: ",
+          cmd->argv[i+1], NULL));
+      }
+
+    } else if (strcasecmp(cmd->argv[i], "files") == 0) {
+      int n;
+
+      n = atoi(cmd->argv[i+1]);
+      if (n <= 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid files count: ",
+          cmd->argv[i+1], NULL));
+      }
+
+      nfiles = n;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown parameter: '",
+        cmd->argv[i], "'", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 4, NULL, NULL, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(unsigned char));
+  *((unsigned char *) c->argv[0]) = (unsigned char) bool;
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = interval;
+  c->argv[2] = pcalloc(c->pool, sizeof(off_t));
+  *((off_t *) c->argv[2]) = nbytes;
+  c->argv[3] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[3]) = nfiles;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: QuotaShowQuotas <on|off> */
 MODRET set_quotashowquotas(cmd_rec *cmd) {
   int bool = -1;
@@ -1860,6 +2154,35 @@ static const char *quota_get_files_str(void *data, size_t datasz) {
 /* Command handlers
  */
 
+MODRET quotatab_log_any(cmd_rec *cmd) {
+
+  /* Write out any deltas whose write-behind interval has elapsed.  This is
+   * done here, rather than in the timer callback, as timers fire from
+   * pr_signals_handle(), which may be called while e.g. a mod_sql query is
+   * in progress.
+   */
+  if (quota_write_behind_due == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  /* Avoid writing out the deltas while the tally table is in use. */
+  if (tally_tab != NULL &&
+      (tally_tab->rlock_count > 0 ||
+       tally_tab->wlock_count > 0)) {
+    return PR_DECLINED(cmd);
+  }
+
+  quota_write_behind_due = FALSE;
+
+  if (quotatab_have_pending_deltas == TRUE) {
+    if (quotatab_flush_deltas() < 0) {
+      quotatab_log("error: unable to write tally: %s", strerror(errno));
+    }
+  }
+
+  return PR_DECLINED(cmd);
+}
+
 MODRET quotatab_post_abor(cmd_rec *cmd) {
   have_aborted_transfer = TRUE;
   return PR_DECLINED(cmd);
@@ -4264,6 +4587,20 @@ MODRET quotatab_post_site_err(cmd_rec *cmd) {
   return PR_DECLINED(cmd);
 }
 
+/* Timer handlers
+ */
+
+static int quotatab_write_behind_cb(CALLBACK_FRAME) {
+
+  /* Only mark the flush as due; see quotatab_log_any(). */
+  if (quotatab_have_pending_deltas == TRUE) {
+    quota_write_behind_due = TRUE;
+  }
+
+  /* Always restart the timer. */
+  return 1;
+}
+
 /* Event handlers
  */
 
@@ -4292,6 +4629,11 @@ static void quotatab_exit_ev(const void *event_data, void *user_data) {
     }
   }
 
+  /* Write out any tally updates still pending. */
+  if (quotatab_flush_deltas() < 0) {
+    quotatab_log("error: unable to write tally: %s", strerror(errno));
+  }
+
   if (use_quotas &&
       have_quota_tally_table) {
     if (quotatab_close(TYPE_TALLY) < 0)
@@ -4342,6 +4684,15 @@ static void quotatab_sess_reinit_ev(const void *event_data, void *user_data) {
   pr_event_unregister(&quotatab_module, "core.session-reinit",
     quotatab_sess_reinit_ev);
 
+  if (quotatab_flush_deltas() < 0) {
+    quotatab_log("error: unable to write tally: %s", strerror(errno));
+  }
+
+  if (quota_write_behind_timerno > 0) {
+    (void) pr_timer_remove(quota_write_behind_timerno, &quotatab_module);
+    quota_write_behind_timerno = -1;
+  }
+
   /* Reset defaults. */
   use_quotas = FALSE;
   (void) close(quota_logfd);
@@ -4355,6 +4706,9 @@ static void quotatab_sess_reinit_ev(const void *event_data, void *user_data) {
   have_quota_limit_table = FALSE;
   have_quota_tally_table = FALSE;
   byte_units = BYTE;
+  quota_write_behind = FALSE;
+  quota_write_behind_due = FALSE;
+  quota_write_behind_synced = 0;
 
   (void) close(quota_lockfd);
   quota_lockfd = -1;
@@ -4503,6 +4857,25 @@ static int quotatab_sess_init(void) {
     c = find_config_next(c, c->next, CONF_PARAM, "QuotaOptions", FALSE);
   }
 
+  c = find_config(main_server->conf, CONF_PARAM, "QuotaWriteBehind", FALSE);
+  if (c != NULL &&
+      *((unsigned char *) c->argv[0]) == TRUE) {
+    quota_write_behind = TRUE;
+    quota_write_behind_interval = *((int *) c->argv[1]);
+    quota_write_behind_bytes = *((off_t *) c->argv[2]);
+    quota_write_behind_files = *((unsigned int *) c->argv[3]);
+
+    if (quotatab_opts & QUOTA_OPT_STRICT_TALLY) {
+      quotatab_log("StrictTally QuotaOption in effect, ignoring "
+        "QuotaWriteBehind");
+
+    } else {
+      quota_write_behind_timerno = pr_timer_add(quota_write_behind_interval,
+        -1, &quotatab_module, quotatab_write_behind_cb,
+        "QuotaWriteBehind flush");
+    }
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "QuotaLock", FALSE);
   if (c) {
     int fd, xerrno;
@@ -4548,10 +4921,13 @@ static conftable quotatab_conftab[] = {
   { "QuotaOptions",		set_quotaoptions,	NULL },
   { "QuotaShowQuotas",		set_quotashowquotas,	NULL },
   { "QuotaTallyTable",		set_quotatable,		NULL },
+  { "QuotaWriteBehind",		set_quotawritebehind,	NULL },
   { NULL }
 };
 
 static cmdtable quotatab_cmdtab[] = {
+  { LOG_CMD,		C_ANY,	G_NONE,	quotatab_log_any,	FALSE,	FALSE },
+  { LOG_CMD_ERR,	C_ANY,	G_NONE,	quotatab_log_any,	FALSE,	FALSE },
   { POST_CMD,		C_ABOR,	G_NONE,	quotatab_post_abor,	FALSE,	FALSE },
   { PRE_CMD,		C_APPE, G_NONE, quotatab_pre_appe,	FALSE,	FALSE },
   { POST_CMD,		C_APPE,	G_NONE,	quotatab_post_appe,	FALSE,	FALSE },
@@ -28,6 +28,10 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
 /* bloody lack of consistency... */
 #if defined(FREEBSD4)
 #  define QUOTATAB_IOV_BASE_TYPE        (char *)
@@ -432,10 +436,500 @@ static int filetab_wlock(quota_table_t *filetab) {
   return fcntl(filetab->tab_handle, F_SETLK, &filetab->tab_lock);
 }
 
+/* Indexed tally tables.
+ *
+ * An indexed tally table is a fixed-size hash table of tally records, keyed
+ * by name and quota type, which is mmap(2)'d by each session.  Lookups probe
+ * a few slots, rather than reading the entire table; each session locks
+ * only the byte range of the record it is updating, and the counters
+ * themselves are updated atomically.
+ *
+ * The table header is:
+ *
+ *  magic (4 bytes), version (4 bytes), slot count (4 bytes), unused (4 bytes)
+ *
+ * followed by the slots.  Use ftpquota(1) to create an indexed tally table,
+ * or to migrate an existing tally table to the indexed format.
+ */
+
+#define FILETAB_INDEXED_TALLY_MAGIC	0x07645
+#define FILETAB_INDEXED_VERSION		1
+
+#define FILETAB_SLOT_FL_EMPTY		0
+#define FILETAB_SLOT_FL_USED		1
+#define FILETAB_SLOT_FL_DELETED		2
+
+struct filetab_indexed_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nslots;
+  uint32_t unused;
+};
+
+/* Note that the on-disk slot length is 128 bytes; ftpquota(1) relies on
+ * this layout.  The counters are 8-byte aligned, for the atomic updates.
+ */
+struct filetab_indexed_slot {
+  volatile uint32_t flags;
+  int32_t quota_type;
+
+  volatile int64_t bytes_in_used;
+  volatile int64_t bytes_out_used;
+  volatile int64_t bytes_xfer_used;
+
+  volatile uint32_t files_in_used;
+  volatile uint32_t files_out_used;
+  volatile uint32_t files_xfer_used;
+
+  char name[81];
+  char pad[3];
+};
+
+struct filetab_indexed {
+  void *data;
+  size_t datasz;
+
+  struct filetab_indexed_header *hdr;
+  struct filetab_indexed_slot *slots;
+  uint32_t nslots;
+
+  /* The slot of the most recently looked-up record, or -1. */
+  int curr_slot;
+
+  /* The byte range currently locked. */
+  off_t lock_start;
+  off_t lock_len;
+};
+
+#if defined(__GNUC__)
+# define FILETAB_MEMORY_BARRIER()	__sync_synchronize()
+#else
+# define FILETAB_MEMORY_BARRIER()
+#endif /* __GNUC__ */
+
+/* FNV-1a, over the name (for all but ALL_QUOTA records) and quota type. */
+static uint32_t filetab_indexed_hash(const char *name,
+    quota_type_t quota_type) {
+  uint32_t h = 2166136261U;
+
+  if (quota_type != ALL_QUOTA &&
+      name != NULL) {
+    const unsigned char *ptr;
+
+    for (ptr = (const unsigned char *) name; *ptr; ptr++) {
+      h ^= *ptr;
+      h *= 16777619U;
+    }
+  }
+
+  h ^= (uint32_t) quota_type;
+  h *= 16777619U;
+
+  return h;
+}
+
+/* Returns the slot of the matching record, or -1 if not found.  If
+ * free_slot is not NULL, it is set to the first slot which could be used
+ * for the record, or -1 if the table is full.
+ */
+static int filetab_indexed_find(struct filetab_indexed *idx,
+    const char *name, quota_type_t quota_type, int *free_slot) {
+  register uint32_t i;
+  uint32_t start;
+
+  if (free_slot != NULL) {
+    *free_slot = -1;
+  }
+
+  start = filetab_indexed_hash(name, quota_type) % idx->nslots;
+
+  for (i = 0; i < idx->nslots; i++) {
+    struct filetab_indexed_slot *slot;
+    uint32_t flags, n;
+
+    n = (start + i) % idx->nslots;
+    slot = &(idx->slots[n]);
+
+    flags = slot->flags;
+    FILETAB_MEMORY_BARRIER();
+
+    if (flags == FILETAB_SLOT_FL_EMPTY) {
+      if (free_slot != NULL &&
+          *free_slot < 0) {
+        *free_slot = (int) n;
+      }
+
+      /* The end of this probe sequence. */
+      return -1;
+    }
+
+    if (flags == FILETAB_SLOT_FL_DELETED) {
+      if (free_slot != NULL &&
+          *free_slot < 0) {
+        *free_slot = (int) n;
+      }
+
+      continue;
+    }
+
+    if (slot->quota_type != (int32_t) quota_type) {
+      continue;
+    }
+
+    /* If the quota type is ALL_QUOTA, don't worry about the name. */
+    if (quota_type == ALL_QUOTA ||
+        (name != NULL &&
+         strncmp(name, slot->name, sizeof(slot->name)) == 0)) {
+      return (int) n;
+    }
+  }
+
+  return -1;
+}
+
+static void filetab_indexed_add64(volatile int64_t *counter, double delta) {
+  int64_t old_val, new_val;
+
+#if defined(__GNUC__)
+  do {
+    old_val = *counter;
+    new_val = old_val + (int64_t) delta;
+
+    /* Prevent underflows. */
+    if (new_val < 0) {
+      new_val = 0;
+    }
+
+  } while (!__sync_bool_compare_and_swap(counter, old_val, new_val));
+#else
+  /* Rely on the record lock. */
+  old_val = *counter;
+  new_val = old_val + (int64_t) delta;
+  if (new_val < 0) {
+    new_val = 0;
+  }
+
+  *counter = new_val;
+#endif /* __GNUC__ */
+}
+
+static void filetab_indexed_add32(volatile uint32_t *counter, int delta) {
+  uint32_t old_val, new_val;
+
+#if defined(__GNUC__)
+  do {
+    old_val = *counter;
+
+    /* Prevent underflows. */
+    if (delta < 0 &&
+        old_val < (uint32_t) -delta) {
+      new_val = 0;
+
+    } else {
+      new_val = old_val + delta;
+    }
+
+  } while (!__sync_bool_compare_and_swap(counter, old_val, new_val));
+#else
+  /* Rely on the record lock. */
+  old_val = *counter;
+  if (delta < 0 &&
+      old_val < (uint32_t) -delta) {
+    new_val = 0;
+
+  } else {
+    new_val = old_val + delta;
+  }
+
+  *counter = new_val;
+#endif /* __GNUC__ */
+}
+
+static void filetab_indexed_copy_tally(struct filetab_indexed_slot *slot,
+    quota_tally_t *tally) {
+  sstrncpy(tally->name, slot->name, sizeof(tally->name));
+  tally->quota_type = slot->quota_type;
+
+  tally->bytes_in_used = (double) slot->bytes_in_used;
+  tally->bytes_out_used = (double) slot->bytes_out_used;
+  tally->bytes_xfer_used = (double) slot->bytes_xfer_used;
+
+  tally->files_in_used = slot->files_in_used;
+  tally->files_out_used = slot->files_out_used;
+  tally->files_xfer_used = slot->files_xfer_used;
+}
+
+static int filetab_indexed_close(quota_table_t *filetab) {
+  struct filetab_indexed *idx;
+
+  idx = filetab->tab_data;
+  if (idx != NULL &&
+      idx->data != NULL) {
+    (void) munmap(idx->data, idx->datasz);
+    idx->data = NULL;
+  }
+
+  return filetab_close(filetab);
+}
+
+/* Note that the caller holds a write lock on the table header, via
+ * filetab_indexed_wlock(), since there is no current record.
+ */
+static int filetab_indexed_create(quota_table_t *filetab, void *ptr) {
+  struct filetab_indexed *idx;
+  struct filetab_indexed_slot *slot;
+  quota_tally_t *tally = ptr;
+  int free_slot = -1, n;
+
+  idx = filetab->tab_data;
+
+  /* Another session may have created this record since our lookup. */
+  n = filetab_indexed_find(idx, tally->name, tally->quota_type, &free_slot);
+  if (n >= 0) {
+    idx->curr_slot = n;
+    return sizeof(struct filetab_indexed_slot);
+  }
+
+  if (free_slot < 0) {
+    quotatab_log("error: indexed tally table is full (%lu slots), unable to "
+      "create tally entry; use ftpquota to migrate to a larger table",
+      (unsigned long) idx->nslots);
+    errno = ENOSPC;
+    return -1;
+  }
+
+  slot = &(idx->slots[free_slot]);
+
+  sstrncpy(slot->name, tally->name, sizeof(slot->name));
+  slot->quota_type = tally->quota_type;
+  slot->bytes_in_used = (int64_t) tally->bytes_in_used;
+  slot->bytes_out_used = (int64_t) tally->bytes_out_used;
+  slot->bytes_xfer_used = (int64_t) tally->bytes_xfer_used;
+  slot->files_in_used = tally->files_in_used;
+  slot->files_out_used = tally->files_out_used;
+  slot->files_xfer_used = tally->files_xfer_used;
+
+  /* Make sure the record is complete before it can be found. */
+  FILETAB_MEMORY_BARRIER();
+  slot->flags = FILETAB_SLOT_FL_USED;
+
+  idx->curr_slot = free_slot;
+  return sizeof(struct filetab_indexed_slot);
+}
+
+static unsigned char filetab_indexed_lookup(quota_table_t *filetab, void *ptr,
+    const char *name, quota_type_t quota_type) {
+  struct filetab_indexed *idx;
+  int n;
+
+  idx = filetab->tab_data;
+
+  n = filetab_indexed_find(idx, name, quota_type, NULL);
+  idx->curr_slot = n;
+
+  if (n < 0) {
+    return FALSE;
+  }
+
+  filetab_indexed_copy_tally(&(idx->slots[n]), ptr);
+  return TRUE;
+}
+
+static int filetab_indexed_read(quota_table_t *filetab, void *ptr) {
+  struct filetab_indexed *idx;
+
+  idx = filetab->tab_data;
+  if (idx->curr_slot < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  filetab_indexed_copy_tally(&(idx->slots[idx->curr_slot]), ptr);
+  return sizeof(struct filetab_indexed_slot);
+}
+
+static unsigned char filetab_indexed_verify(quota_table_t *filetab) {
+  struct filetab_indexed *idx;
+
+  idx = filetab->tab_data;
+  if (idx->hdr->magic == filetab->tab_magic &&
+      idx->hdr->version == FILETAB_INDEXED_VERSION) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Rather than writing out the entire tally, apply the deltas calculated
+ * by mod_quotatab to the record's counters atomically, then refresh the
+ * tally with the updated counters.  This way, concurrent updates by other
+ * sessions are never lost.
+ */
+static int filetab_indexed_write(quota_table_t *filetab, void *ptr) {
+  struct filetab_indexed *idx;
+  struct filetab_indexed_slot *slot;
+
+  idx = filetab->tab_data;
+  if (idx->curr_slot < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  slot = &(idx->slots[idx->curr_slot]);
+
+  if (quotatab_deltas.bytes_in_delta != 0.0) {
+    filetab_indexed_add64(&(slot->bytes_in_used),
+      quotatab_deltas.bytes_in_delta);
+  }
+
+  if (quotatab_deltas.bytes_out_delta != 0.0) {
+    filetab_indexed_add64(&(slot->bytes_out_used),
+      quotatab_deltas.bytes_out_delta);
+  }
+
+  if (quotatab_deltas.bytes_xfer_delta != 0.0) {
+    filetab_indexed_add64(&(slot->bytes_xfer_used),
+      quotatab_deltas.bytes_xfer_delta);
+  }
+
+  if (quotatab_deltas.files_in_delta != 0) {
+    filetab_indexed_add32(&(slot->files_in_used),
+      quotatab_deltas.files_in_delta);
+  }
+
+  if (quotatab_deltas.files_out_delta != 0) {
+    filetab_indexed_add32(&(slot->files_out_used),
+      quotatab_deltas.files_out_delta);
+  }
+
+  if (quotatab_deltas.files_xfer_delta != 0) {
+    filetab_indexed_add32(&(slot->files_xfer_used),
+      quotatab_deltas.files_xfer_delta);
+  }
+
+  filetab_indexed_copy_tally(slot, ptr);
+  return sizeof(struct filetab_indexed_slot);
+}
+
+/* Lock only the byte range of the current record or, if there is no
+ * current record (i.e. when creating a record), the table header.
+ */
+static int filetab_indexed_lock(quota_table_t *filetab, int lock_type) {
+  struct filetab_indexed *idx;
+
+  idx = filetab->tab_data;
+
+  if (lock_type != F_UNLCK) {
+    if (idx->curr_slot >= 0) {
+      idx->lock_start = sizeof(struct filetab_indexed_header) +
+        ((off_t) idx->curr_slot * sizeof(struct filetab_indexed_slot));
+      idx->lock_len = sizeof(struct filetab_indexed_slot);
+
+    } else {
+      idx->lock_start = 0;
+      idx->lock_len = sizeof(struct filetab_indexed_header);
+    }
+  }
+
+  filetab->tab_lock.l_type = lock_type;
+  filetab->tab_lock.l_whence = SEEK_SET;
+  filetab->tab_lock.l_start = idx->lock_start;
+  filetab->tab_lock.l_len = idx->lock_len;
+
+  return fcntl(filetab->tab_handle, F_SETLK, &filetab->tab_lock);
+}
+
+static int filetab_indexed_rlock(quota_table_t *filetab) {
+  return filetab_indexed_lock(filetab, F_RDLCK);
+}
+
+static int filetab_indexed_unlock(quota_table_t *filetab) {
+  return filetab_indexed_lock(filetab, F_UNLCK);
+}
+
+static int filetab_indexed_wlock(quota_table_t *filetab) {
+  return filetab_indexed_lock(filetab, F_WRLCK);
+}
+
+static int filetab_indexed_open(quota_table_t *tab) {
+  struct filetab_indexed *idx;
+  struct filetab_indexed_header hdr;
+  struct stat st;
+  size_t datasz;
+  void *data;
+  int xerrno;
+
+  if (pread(tab->tab_handle, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (hdr.version != FILETAB_INDEXED_VERSION ||
+      hdr.nslots == 0) {
+    quotatab_log("error: unsupported indexed tally table (version %lu, "
+      "%lu slots)", (unsigned long) hdr.version, (unsigned long) hdr.nslots);
+    errno = EINVAL;
+    return -1;
+  }
+
+  datasz = sizeof(struct filetab_indexed_header) +
+    ((size_t) hdr.nslots * sizeof(struct filetab_indexed_slot));
+
+  if (fstat(tab->tab_handle, &st) < 0) {
+    return -1;
+  }
+
+  if ((size_t) st.st_size < datasz) {
+    quotatab_log("error: indexed tally table size (%lu bytes) too small for "
+      "%lu slots", (unsigned long) st.st_size, (unsigned long) hdr.nslots);
+    errno = EINVAL;
+    return -1;
+  }
+
+  data = mmap(NULL, datasz, PROT_READ|PROT_WRITE, MAP_SHARED, tab->tab_handle,
+    0);
+  if (data == MAP_FAILED) {
+    xerrno = errno;
+
+    quotatab_log("error mapping indexed tally table: %s", strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  idx = pcalloc(tab->tab_pool, sizeof(struct filetab_indexed));
+  idx->data = data;
+  idx->datasz = datasz;
+  idx->hdr = data;
+  idx->slots = (struct filetab_indexed_slot *) (((char *) data) +
+    sizeof(struct filetab_indexed_header));
+  idx->nslots = hdr.nslots;
+  idx->curr_slot = -1;
+
+  tab->tab_data = idx;
+  tab->tab_magic = FILETAB_INDEXED_TALLY_MAGIC;
+  tab->tab_quotalen = sizeof(struct filetab_indexed_slot);
+
+  /* Set all the necessary function pointers. */
+  tab->tab_close = filetab_indexed_close;
+  tab->tab_create = filetab_indexed_create;
+  tab->tab_lookup = filetab_indexed_lookup;
+  tab->tab_read = filetab_indexed_read;
+  tab->tab_verify = filetab_indexed_verify;
+  tab->tab_write = filetab_indexed_write;
+
+  tab->tab_rlock = filetab_indexed_rlock;
+  tab->tab_unlock = filetab_indexed_unlock;
+  tab->tab_wlock = filetab_indexed_wlock;
+
+  return 0;
+}
+
 static quota_table_t *filetab_open(pool *parent_pool,
     quota_tabtype_t tab_type, const char *srcinfo) {
   quota_table_t *tab = NULL;
   pool *tab_pool = make_sub_pool(parent_pool);
+  unsigned int magic = 0;
 
   tab = (quota_table_t *) pcalloc(tab_pool, sizeof(quota_table_t));
   tab->tab_pool = tab_pool;
@@ -461,6 +955,22 @@ static quota_table_t *filetab_open(pool *parent_pool,
       return NULL;
     }
 
+    /* Check for an indexed tally table. */
+    if (pread(tab->tab_handle, &magic, sizeof(magic), 0) == sizeof(magic) &&
+        magic == FILETAB_INDEXED_TALLY_MAGIC) {
+      if (filetab_indexed_open(tab) < 0) {
+        int xerrno = errno;
+
+        (void) close(tab->tab_handle);
+        destroy_pool(tab->tab_pool);
+
+        errno = xerrno;
+        return NULL;
+      }
+
+      return tab;
+    }
+
   } else if (tab->tab_type == TYPE_LIMIT) {
 
     /* File-based limit table magic number */
@@ -90,6 +90,12 @@ static uint32_t chan_packet_size = SFTP_SSH2_CHANNEL_MAX_PACKET_SIZE;
 
 static array_header *accepted_envs = NULL;
 
+/* Session-wide channel window statistics, logged at session end. */
+static uint64_t chan_window_stall_ms = 0;
+static uint32_t chan_window_stall_count = 0;
+static uint32_t chan_window_adjust_count = 0;
+static uint32_t chan_window_max_tuned = 0;
+
 static const char *trace_channel = "ssh2";
 
 static int send_channel_done(pool *, uint32_t);
@@ -109,9 +115,16 @@ static struct ssh2_channel *alloc_channel(const char *type,
 
   chan->local_channel_id = channelno++;
 
-  chan->local_windowsz = chan_window_size;
+  chan->local_windowsz = chan->local_max_windowsz = chan_window_size;
   chan->local_max_packetsz = chan_packet_size;
 
+  if (sftp_opts & SFTP_OPT_AUTOTUNE_CHANNEL_WINDOW) {
+    /* Start with the configured window size, and let the window grow from
+     * there as needed; auto-tuning never advertises less than configured.
+     */
+    pr_gettimeofday_millis(&(chan->window_adjust_ms));
+  }
+
   chan->remote_channel_id = remote_channel_id;
   chan->remote_windowsz = remote_windowsz;
   chan->remote_max_packetsz = remote_max_packetsz;
@@ -126,6 +139,16 @@ static struct ssh2_channel *alloc_channel(const char *type,
   return chan;
 }
 
+static void collect_channel_stats(struct ssh2_channel *chan) {
+  chan_window_stall_count += chan->window_stall_count;
+  chan_window_stall_ms += chan->window_stall_ms;
+  chan_window_adjust_count += chan->window_adjust_count;
+
+  if (chan->local_max_windowsz > chan_window_max_tuned) {
+    chan_window_max_tuned = chan->local_max_windowsz;
+  }
+}
+
 static void destroy_channel(uint32_t channel_id) {
   register unsigned int i;
   struct ssh2_channel **chans;
@@ -150,6 +173,7 @@ static void destroy_channel(uint32_t channel_id) {
           (chans[i]->finish)(channel_id);
         }
 
+        collect_channel_stats(chans[i]);
         chans[i] = NULL;
         channel_count--;
         break;
@@ -472,6 +496,106 @@ static int handle_channel_close(struct ssh2_packet *pkt) {
   return 0;
 }
 
+/* Returns the smoothed RTT of the SSH connection, in millisecs, as measured
+ * by the kernel; returns zero if not available.
+ */
+static uint32_t get_conn_rtt_ms(void) {
+#if defined(TCP_INFO)
+  struct tcp_info info;
+  socklen_t infolen;
+
+  if (sftp_conn == NULL) {
+    return 0;
+  }
+
+  infolen = sizeof(info);
+  memset(&info, 0, infolen);
+  if (getsockopt(sftp_conn->rfd, IPPROTO_TCP, TCP_INFO, &info,
+      &infolen) < 0) {
+    pr_trace_msg(trace_channel, 19, "error obtaining TCP_INFO: %s",
+      strerror(errno));
+    return 0;
+  }
+
+  /* The kernel reports RTT in microsecs. */
+  return (uint32_t) (info.tcpi_rtt / 1000);
+#else
+  return 0;
+#endif /* TCP_INFO */
+}
+
+/* HPN-style auto-tuning of the local (receive) window.  We look at how many
+ * bytes the client sent since the last window refill, and how long that
+ * took, to estimate the throughput; multiplied by the RTT, that gives us the
+ * bandwidth-delay product.  If the client is using most of the window within
+ * an RTT, the window is what limits the transfer, and we grow it (at most
+ * doubling at a time), up to the max window size allowed by RFC 4254.  The
+ * window starts at the configured size, and never shrinks.
+ */
+static void tune_channel_window(struct ssh2_channel *chan) {
+  uint64_t now_ms, elapsed_ms, bdp, target_windowsz;
+  uint32_t consumed, rtt_ms;
+
+  pr_gettimeofday_millis(&now_ms);
+
+  consumed = chan->local_max_windowsz - chan->local_windowsz;
+  elapsed_ms = now_ms - chan->window_adjust_ms;
+  chan->window_adjust_ms = now_ms;
+
+  if (elapsed_ms == 0) {
+    elapsed_ms = 1;
+  }
+
+  rtt_ms = get_conn_rtt_ms();
+  if (rtt_ms == 0) {
+    /* Without a kernel-provided RTT, the time taken to consume this part of
+     * the window is the best approximation we have.
+     */
+    rtt_ms = (uint32_t) elapsed_ms;
+  }
+
+  bdp = (((uint64_t) consumed) * rtt_ms) / elapsed_ms;
+  target_windowsz = bdp * 2;
+
+  if (target_windowsz <= chan->local_max_windowsz) {
+    return;
+  }
+
+  if (target_windowsz > ((uint64_t) chan->local_max_windowsz) * 2) {
+    target_windowsz = ((uint64_t) chan->local_max_windowsz) * 2;
+  }
+
+  if (target_windowsz > SFTP_SSH2_CHANNEL_WINDOW_SIZE) {
+    target_windowsz = SFTP_SSH2_CHANNEL_WINDOW_SIZE;
+  }
+
+  if (target_windowsz == chan->local_max_windowsz) {
+    return;
+  }
+
+  pr_trace_msg(trace_channel, 12, "growing window for channel ID %lu from "
+    "%lu to %lu bytes (consumed %lu bytes in %lu ms, RTT %lu ms)",
+    (unsigned long) chan->local_channel_id,
+    (unsigned long) chan->local_max_windowsz, (unsigned long) target_windowsz,
+    (unsigned long) consumed, (unsigned long) elapsed_ms,
+    (unsigned long) rtt_ms);
+
+  chan->local_max_windowsz = (uint32_t) target_windowsz;
+}
+
+static int needs_window_adjust(struct ssh2_channel *chan) {
+  if (sftp_opts & SFTP_OPT_AUTOTUNE_CHANNEL_WINDOW) {
+    /* When auto-tuning, the window is sized to cover the bandwidth-delay
+     * product, so refill it once half has been used, lest the pipe drain
+     * while the adjustment is in flight.
+     */
+    return (chan->local_windowsz < (chan->local_max_windowsz / 2) ||
+            chan->local_windowsz < (chan->local_max_packetsz * 3));
+  }
+
+  return (chan->local_windowsz < (chan->local_max_packetsz * 3));
+}
+
 static int process_channel_data(struct ssh2_channel *chan,
     struct ssh2_packet *pkt, unsigned char *data, uint32_t datalen) {
   int res;
@@ -489,7 +613,7 @@ static int process_channel_data(struct ssh2_channel *chan,
 
   chan->local_windowsz -= datalen;
 
-  if (chan->local_windowsz < (chan->local_max_packetsz * 3)) {
+  if (needs_window_adjust(chan)) {
     unsigned char *buf, *ptr;
     uint32_t buflen, bufsz, window_adjlen;
     struct ssh2_packet *resp;
@@ -500,7 +624,11 @@ static int process_channel_data(struct ssh2_channel *chan,
     buflen = bufsz = 128;
     ptr = buf = palloc(pkt->pool, bufsz);
 
-    window_adjlen = chan_window_size - chan->local_windowsz;
+    if (sftp_opts & SFTP_OPT_AUTOTUNE_CHANNEL_WINDOW) {
+      tune_channel_window(chan);
+    }
+
+    window_adjlen = chan->local_max_windowsz - chan->local_windowsz;
 
     sftp_msg_write_byte(&buf, &buflen, SFTP_SSH2_MSG_CHANNEL_WINDOW_ADJUST);
     sftp_msg_write_int(&buf, &buflen, chan->remote_channel_id);
@@ -523,6 +651,7 @@ static int process_channel_data(struct ssh2_channel *chan,
 
     destroy_pool(resp->pool); 
     chan->local_windowsz += window_adjlen;
+    chan->window_adjust_count++;
   }
 
   return res;
@@ -1184,8 +1313,23 @@ static int handle_channel_window_adjust(struct ssh2_packet *pkt) {
 
   chan->remote_windowsz += adjust_len;
 
+  if (chan->window_stall_start_ms > 0) {
+    uint64_t now_ms;
+
+    pr_gettimeofday_millis(&now_ms);
+    chan->window_stall_ms += (now_ms - chan->window_stall_start_ms);
+    chan->window_stall_start_ms = 0;
+  }
+
   drain_pending_channel_data(channel_id);
 
+  if (chan->outgoing != NULL &&
+      chan->remote_windowsz == 0) {
+    /* Still stalled, waiting for more window. */
+    chan->window_stall_count++;
+    pr_gettimeofday_millis(&(chan->window_stall_start_ms));
+  }
+
   pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
   return 0;
 }
@@ -1383,12 +1527,30 @@ int sftp_channel_handle(struct ssh2_packet *pkt, char mesg_type) {
   return -1;
 }
 
+static void log_channel_stats(void) {
+  if (channelno == 0) {
+    return;
+  }
+
+  (void) pr_log_writefile(sftp_logfd, MOD_SFTP_VERSION,
+    "channel window stats: %lu %s opened, %lu window %s sent, "
+    "max window %lu bytes, %lu window %s (%lu ms total)",
+    (unsigned long) channelno, channelno != 1 ? "channels" : "channel",
+    (unsigned long) chan_window_adjust_count,
+    chan_window_adjust_count != 1 ? "adjustments" : "adjustment",
+    (unsigned long) chan_window_max_tuned,
+    (unsigned long) chan_window_stall_count,
+    chan_window_stall_count != 1 ? "stalls" : "stall",
+    (unsigned long) chan_window_stall_ms);
+}
+
 int sftp_channel_free(void) {
   register unsigned int i;
   struct ssh2_channel **chans;
 
   if (channel_count == 0 ||
       channel_list == NULL) {
+    log_channel_stats();
     return 0;
   }
 
@@ -1408,11 +1570,13 @@ int sftp_channel_free(void) {
         (chans[i]->finish)(chans[i]->local_channel_id);
       }
 
+      collect_channel_stats(chans[i]);
       chans[i] = NULL;
       channel_count--;
     }
   }
 
+  log_channel_stats();
   return 0;
 }
 
@@ -1652,6 +1816,13 @@ static int channel_write_data(pool *p, uint32_t channel_id,
     reason = "remote window size too small";
     if (sftp_sess_state & SFTP_SESS_STATE_REKEYING) {
       reason = "rekeying";
+
+    } else if (chan->window_stall_start_ms == 0) {
+      /* Track how often, and for how long, we are stalled waiting for the
+       * client to open its window.
+       */
+      chan->window_stall_count++;
+      pr_gettimeofday_millis(&(chan->window_stall_start_ms));
     }
 
     pr_trace_msg(trace_channel, 8, "buffering %lu remaining bytes of "
@@ -47,6 +47,7 @@ struct ssh2_channel {
 
   uint32_t local_channel_id;
   uint32_t local_windowsz;
+  uint32_t local_max_windowsz;
   uint32_t local_max_packetsz;
 
   uint32_t remote_channel_id;
@@ -55,6 +56,13 @@ struct ssh2_channel {
 
   struct ssh2_channel_databuf *outgoing;
 
+  /* For window auto-tuning, and window stall statistics. */
+  uint64_t window_adjust_ms;
+  uint64_t window_stall_start_ms;
+  uint64_t window_stall_ms;
+  uint32_t window_stall_count;
+  uint32_t window_adjust_count;
+
   int recvd_eof, sent_eof;
   int recvd_close, sent_close;
 
@@ -1512,6 +1512,9 @@ MODRET set_sftpoptions(cmd_rec *cmd) {
     } else if (strcmp(cmd->argv[i], "NoExtensionNegotiation") == 0) {
       opts |= SFTP_OPT_NO_EXT_INFO;
 
+    } else if (strcmp(cmd->argv[i], "AutoTuneChannelWindow") == 0) {
+      opts |= SFTP_OPT_AUTOTUNE_CHANNEL_WINDOW;
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown SFTPOption '",
         cmd->argv[i], "'", NULL));
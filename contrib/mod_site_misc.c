@@ -175,115 +175,28 @@ static int site_misc_create_path(pool *p, const char *path) {
   return 0;
 }
 
-static int site_misc_delete_dir(pool *p, const char *dir) {
-  void *dirh;
-  struct dirent *dent;
+/* Remove the given file, or (empty) directory, dispatching the fake DELE or
+ * RMD command for it, e.g. for mod_quotatab.  The walked entry, if any, is
+ * used for removing the path.
+ */
+static int site_misc_delete_ent(pool *p, const char *path, int is_dir,
+    pr_fs_walk_ent_t *ent) {
   int res, xerrno;
   cmd_rec *cmd;
   pool *sub_pool;
 
-  dirh = pr_fsio_opendir(dir);
-  xerrno = errno;
-
-  if (dirh == NULL) {
-    pr_log_debug(DEBUG2, MOD_SITE_MISC_VERSION
-      ": error reading directory '%s': %s", dir, strerror(xerrno));
-    errno = xerrno;
-    return -1;
-  }
-
-  while ((dent = pr_fsio_readdir(dirh)) != NULL) {
-    struct stat st;
-    char *file;
-
-    pr_signals_handle();
-
-    if (strcmp(dent->d_name, ".") == 0 ||
-        strcmp(dent->d_name, "..") == 0) {
-      continue;
-    }
-
-    file = pdircat(p, dir, dent->d_name, NULL);
-
-    if (pr_fsio_stat(file, &st) < 0) {
-      continue;
-    }
-
-    if (S_ISDIR(st.st_mode)) {
-      res = site_misc_delete_dir(p, file);
-      xerrno = errno;
-
-      if (res < 0) {
-        pr_fsio_closedir(dirh);
-
-        errno = xerrno;
-        return -1;
-      }
-
-    } else {
-      /* Dispatch fake C_DELE command, e.g. for mod_quotatab */
-      sub_pool = pr_pool_create_sz(p, 64);
-      cmd = pr_cmd_alloc(sub_pool, 2, pstrdup(sub_pool, C_DELE),
-        pstrdup(sub_pool, file));
-      cmd->arg = pstrdup(cmd->pool, file);
-      cmd->cmd_class = CL_WRITE;
-
-      pr_response_block(TRUE);
-      res = pr_cmd_dispatch_phase(cmd, PRE_CMD, 0);
-      xerrno = errno;
-
-      if (res < 0) {
-        pr_log_debug(DEBUG3, MOD_SITE_MISC_VERSION
-          ": deleting file '%s' blocked by DELE handler: %s", file,
-          strerror(xerrno));
-
-        pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
-        pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
-        pr_response_clear(&resp_err_list);
-        pr_response_block(FALSE);
-
-        destroy_pool(sub_pool);
-        pr_fsio_closedir(dirh);
-
-        errno = xerrno;
-        return -1;
-      }
-
-      res = pr_fsio_unlink(file);
-      xerrno = errno;
-
-      if (res < 0) {
-        pr_fsio_closedir(dirh);
-
-        pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
-        pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
-        pr_response_clear(&resp_err_list);
-        pr_response_block(FALSE);
-
-        destroy_pool(sub_pool);
-        pr_fsio_closedir(dirh);
-
-        errno = xerrno;
-        return -1;
-      }
+  sub_pool = pr_pool_create_sz(p, 64);
+  if (is_dir) {
+    cmd = pr_cmd_alloc(sub_pool, 2, pstrdup(sub_pool, C_RMD),
+      pstrdup(sub_pool, path));
+    cmd->cmd_class = CL_DIRS|CL_WRITE;
 
-      pr_response_add(R_250, _("%s command successful"), (char *) cmd->argv[0]);
-      pr_cmd_dispatch_phase(cmd, POST_CMD, 0);
-      pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
-      pr_response_clear(&resp_list);
-      destroy_pool(sub_pool);
-      pr_response_block(FALSE);
-    }
+  } else {
+    cmd = pr_cmd_alloc(sub_pool, 2, pstrdup(sub_pool, C_DELE),
+      pstrdup(sub_pool, path));
+    cmd->cmd_class = CL_WRITE;
   }
-
-  pr_fsio_closedir(dirh);
-
-  /* Dispatch fake C_RMD command, e.g. for mod_quotatab */
-  sub_pool = pr_pool_create_sz(p, 64);
-  cmd = pr_cmd_alloc(sub_pool, 2, pstrdup(sub_pool, C_RMD),
-    pstrdup(sub_pool, dir));
-  cmd->arg = pstrdup(cmd->pool, dir);
-  cmd->cmd_class = CL_DIRS|CL_WRITE;
+  cmd->arg = pstrdup(cmd->pool, path);
 
   pr_response_block(TRUE);
   res = pr_cmd_dispatch_phase(cmd, PRE_CMD, 0);
@@ -291,26 +204,37 @@ static int site_misc_delete_dir(pool *p, const char *dir) {
 
   if (res < 0) {
     pr_log_debug(DEBUG3, MOD_SITE_MISC_VERSION
-      ": removing directory '%s' blocked by RMD handler: %s", dir,
-      strerror(xerrno));
+      ": %s '%s' blocked by %s handler: %s",
+      is_dir ? "removing directory" : "deleting file", path,
+      (char *) cmd->argv[0], strerror(xerrno));
+
+    if (is_dir) {
+      pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
+    }
 
-    pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
     pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
     pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
     pr_response_clear(&resp_err_list);
     pr_response_block(FALSE);
 
     destroy_pool(sub_pool);
-
     errno = xerrno;
     return -1;
   }
 
-  res = pr_fsio_rmdir(dir);
+  if (ent != NULL) {
+    res = pr_fs_walk_remove(ent);
+
+  } else {
+    res = is_dir ? pr_fsio_rmdir(path) : pr_fsio_unlink(path);
+  }
   xerrno = errno;
 
   if (res < 0) {
-    pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
+    if (is_dir) {
+      pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
+    }
+
     pr_cmd_dispatch_phase(cmd, POST_CMD_ERR, 0);
     pr_cmd_dispatch_phase(cmd, LOG_CMD_ERR, 0);
     pr_response_clear(&resp_err_list);
@@ -321,17 +245,46 @@ static int site_misc_delete_dir(pool *p, const char *dir) {
     return -1;
   }
 
-  pr_response_add(R_257, _("\"%s\" - Directory successfully created"),
-    quote_dir(cmd->tmp_pool, (char *) dir));
+  pr_response_add(R_250, _("%s command successful"), (char *) cmd->argv[0]);
   pr_cmd_dispatch_phase(cmd, POST_CMD, 0);
   pr_cmd_dispatch_phase(cmd, LOG_CMD, 0);
   pr_response_clear(&resp_list);
   pr_response_block(FALSE);
   destroy_pool(sub_pool);
+  return 0;
+}
+
+static int site_misc_delete_walk_cb(pr_fs_walk_ent_t *ent, void *user_data) {
+  switch (ent->ent_type) {
+    case PR_FS_WALK_ENT_FILE:
+      return site_misc_delete_ent(ent->ent_pool, ent->ent_path, FALSE, ent);
+
+    case PR_FS_WALK_ENT_DIR_DONE:
+      return site_misc_delete_ent(ent->ent_pool, ent->ent_path, TRUE, ent);
+
+    default:
+      break;
+  }
 
   return 0;
 }
 
+static int site_misc_delete_dir(pool *p, const char *dir) {
+  int res, xerrno;
+
+  res = pr_fs_walk(p, dir, site_misc_delete_walk_cb, NULL);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_log_debug(DEBUG2, MOD_SITE_MISC_VERSION
+      ": error deleting directory '%s': %s", dir, strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  return site_misc_delete_ent(p, dir, TRUE, NULL);
+}
+
 static int site_misc_delete_path(pool *p, const char *path) {
   struct stat st;
 
@@ -39,6 +39,10 @@
 # include <openssl/evp.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
 /* Define if you have the LibreSSL library.  */
 #if defined(LIBRESSL_VERSION_NUMBER)
 # define HAVE_LIBRESSL  1
@@ -122,6 +126,12 @@ static const char *sql_keepalive_stmt = NULL;
  */
 #define SQL_MAX_STMT_LEN	4096
 
+/* SQLLogAsync defaults and limits. */
+#define SQL_ASYNC_DEFAULT_MAX_RECORDS	1000
+#define SQL_ASYNC_DEFAULT_INTERVAL	5
+#define SQL_ASYNC_MAX_BATCH_RECORDS	100
+#define SQL_ASYNC_MAX_RECORD_FAILURES	3
+
 static int sql_sess_init(void);
 
 static char *sql_prepare_where(int, cmd_rec *, int, ...);
@@ -147,11 +157,22 @@ static const char *trace_channel = "sql";
  * cache typedefs
  */
 
-#define CACHE_SIZE         13
+/* Initial number of buckets in each cache; a cache doubles its number of
+ * buckets whenever it holds more than CACHE_MAX_LOAD entries per bucket.
+ */
+#define CACHE_INITIAL_SIZE	64
+#define CACHE_MAX_LOAD		2
 
 typedef struct cache_entry {
-  struct cache_entry *list_next;
   struct cache_entry *bucket_next;
+  unsigned int hashval;
+
+  /* When this entry expires; zero means never. */
+  time_t expires;
+
+  /* Whether this entry records a failed (negative) lookup. */
+  int negative;
+
   void *data;
 } cache_entry_t;
 
@@ -204,14 +225,26 @@ static struct {
   uid_t defaultuid;             /* default UID if none in database */
   gid_t defaultgid;             /* default GID if none in database */
 
-  cache_entry_t *curr_group;    /* next group in group array for getgrent */
-  cache_entry_t *curr_passwd;   /* next passwd in passwd array for getpwent */
-  int group_cache_filled;
-  int passwd_cache_filled;
+  /* The userset/groupset result sets, walked one row at a time by
+   * getpwent/getgrent.
+   */
+  pool *passwd_set_pool;
+  sql_data_t *passwd_set;
+  unsigned long passwd_set_row;
+  struct passwd passwd_ent;
+
+  pool *group_set_pool;
+  sql_data_t *group_set;
+  unsigned long group_set_row;
+  pool *group_ent_pool;
 
   /* Cache negative, as well as positive, lookups */
   unsigned char negative_cache;
 
+  /* Lifetimes of cached positive/negative lookups; zero means forever. */
+  int cache_ttl;
+  int cache_negative_ttl;
+
   /* mod_ratio data -- someday this needs to be removed from mod_sql. */
   char *sql_fstor;              /* fstor int(11) NOT NULL DEFAULT '0', */
   char *sql_fretr;              /* fretr int(11) NOT NULL DEFAULT '0', */
@@ -350,15 +383,20 @@ typedef struct {
   /* memory pool for this object */
   pool *pool;
 
-  /* cache buckets */
-  cache_entry_t *buckets[ CACHE_SIZE ];
+  /* cache buckets; nbuckets is always a power of two */
+  cache_entry_t **buckets;
+  unsigned int nbuckets;
 
   /* cache functions */
   val_func hash_val;
   cmp_func cmp;
 
-  /* list pointers */
-  cache_entry_t *head;
+  /* entry lifetimes, in seconds; zero means forever */
+  int ttl;
+  int negative_ttl;
+
+  /* expired entries, for reuse */
+  cache_entry_t *free_entries;
 
   /* list size */
   unsigned int nelts;
@@ -383,53 +421,120 @@ static cache_t *make_cache(pool *p, val_func hash_val, cmp_func cmp) {
   res->hash_val = hash_val;
   res->cmp = cmp;
 
-  res->head = NULL;
+  res->nbuckets = CACHE_INITIAL_SIZE;
+  res->buckets = pcalloc(p, res->nbuckets * sizeof(cache_entry_t *));
 
   res->nelts = 0;
 
   return res;
 }
 
-static cache_entry_t *cache_addentry(cache_t *cache, void *data) {
+static void cache_resize(cache_t *cache, unsigned int nbuckets) {
+  register unsigned int i;
+  cache_entry_t **buckets;
+
+  buckets = pcalloc(cache->pool, nbuckets * sizeof(cache_entry_t *));
+
+  for (i = 0; i < cache->nbuckets; i++) {
+    cache_entry_t *entry;
+
+    entry = cache->buckets[i];
+    while (entry != NULL) {
+      cache_entry_t *next;
+      unsigned int idx;
+
+      next = entry->bucket_next;
+      idx = entry->hashval & (nbuckets - 1);
+      entry->bucket_next = buckets[idx];
+      buckets[idx] = entry;
+
+      entry = next;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 15, "resized cache %p from %u to %u buckets "
+    "(%u entries)", cache, cache->nbuckets, nbuckets, cache->nelts);
+
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+}
+
+static void cache_removeentry(cache_t *cache, cache_entry_t **prev) {
   cache_entry_t *entry;
-  int hashval;
+
+  entry = *prev;
+  *prev = entry->bucket_next;
+
+  entry->data = NULL;
+  entry->bucket_next = cache->free_entries;
+  cache->free_entries = entry;
+
+  cache->nelts--;
+}
+
+static cache_entry_t *cache_addentry(cache_t *cache, void *data,
+    int negative) {
+  cache_entry_t *entry, **prev;
+  unsigned int hashval, idx;
+  time_t now;
+  int ttl;
 
   if (cache == NULL ||
       data == NULL)
     return NULL;
 
-  /* create the entry */
-  entry = (cache_entry_t *) pcalloc(cache->pool, sizeof(cache_entry_t));
-  entry->data = data;
+  if (cache->nelts >= (cache->nbuckets * CACHE_MAX_LOAD)) {
+    cache_resize(cache, cache->nbuckets * 2);
+  }
+
+  hashval = cache->hash_val(data);
+  idx = hashval & (cache->nbuckets - 1);
+  time(&now);
 
-  /* deal with the list */
+  /* Drop any expired entries from this bucket, along with any stale entry
+   * for the same key, while we're here.
+   */
+  prev = &(cache->buckets[idx]);
+  while (*prev != NULL) {
+    entry = *prev;
 
-  if (cache->head == NULL) {
-    cache->head = entry;
+    if ((entry->expires > 0 && entry->expires <= now) ||
+        (entry->hashval == hashval && cache->cmp(data, entry->data))) {
+      cache_removeentry(cache, prev);
+      continue;
+    }
 
-  } else {
-    entry->list_next = cache->head;
-    cache->head = entry;
+    prev = &(entry->bucket_next);
   }
 
-  /* deal with the buckets */
-  hashval = cache->hash_val(data) % CACHE_SIZE;
-  if (cache->buckets[hashval] == NULL) {
-    cache->buckets[hashval] = entry;
+  /* create the entry */
+  if (cache->free_entries != NULL) {
+    entry = cache->free_entries;
+    cache->free_entries = entry->bucket_next;
 
   } else {
-    entry->bucket_next = cache->buckets[hashval];
-    cache->buckets[hashval] = entry;
+    entry = (cache_entry_t *) pcalloc(cache->pool, sizeof(cache_entry_t));
   }
+
+  entry->data = data;
+  entry->hashval = hashval;
+  entry->negative = negative;
+
+  ttl = negative ? cache->negative_ttl : cache->ttl;
+  entry->expires = ttl > 0 ? now + ttl : 0;
+
+  entry->bucket_next = cache->buckets[idx];
+  cache->buckets[idx] = entry;
   
   cache->nelts++;
 
   return entry;
 }
 
-static void *cache_findvalue(cache_t *cache, void *data) {
-  cache_entry_t *entry;
-  int hashval;
+static cache_entry_t *cache_findentry(cache_t *cache, void *data) {
+  cache_entry_t *entry, **prev;
+  unsigned int hashval;
+  time_t now = 0;
 
   if (cache == NULL ||
       data == NULL) {
@@ -437,22 +542,467 @@ static void *cache_findvalue(cache_t *cache, void *data) {
     return NULL;
   }
 
-  hashval = cache->hash_val(data) % CACHE_SIZE;
+  hashval = cache->hash_val(data);
 
-  entry = cache->buckets[hashval];
-  while (entry != NULL) {
-    pr_signals_handle();
+  prev = &(cache->buckets[hashval & (cache->nbuckets - 1)]);
+  while (*prev != NULL) {
+    entry = *prev;
 
-    if (cache->cmp(data, entry->data)) {
-      break;
+    if (entry->hashval == hashval &&
+        cache->cmp(data, entry->data)) {
+      if (entry->expires > 0) {
+        if (now == 0) {
+          time(&now);
+        }
+
+        if (entry->expires <= now) {
+          cache_removeentry(cache, prev);
+
+          errno = ENOENT;
+          return NULL;
+        }
+      }
+
+      return entry;
     }
 
-    entry = entry->bucket_next;
+    prev = &(entry->bucket_next);
   }
 
+  errno = ENOENT;
+  return NULL;
+}
+
+static void *cache_findvalue(cache_t *cache, void *data) {
+  cache_entry_t *entry;
+
+  entry = cache_findentry(cache, data);
   return (entry == NULL ? NULL : entry->data);
 }
 
+/* Shared auth cache.  When configured via SQLAuthCache, looked-up users and
+ * groups are also stored in a file, mapped into every session, so that one
+ * session's lookups can be used by others without asking the database.  The
+ * file holds an open-addressed table of fixed-size slots; each entry is kept
+ * under both its name and its ID, and the file is fcntl-locked while slots
+ * are read or written.  The file header records the database connection,
+ * and vhost, whose entries the file holds; sessions for any other ignore it.
+ */
+#define SQL_SHARED_CACHE_MAGIC			0x5351ca02
+#define SQL_SHARED_CACHE_DEFAULT_ENTRIES	4096
+#define SQL_SHARED_CACHE_DEFAULT_TTL		300
+#define SQL_SHARED_CACHE_MAX_PROBES		8
+#define SQL_SHARED_CACHE_DATA_SIZE		464
+#define SQL_SHARED_CACHE_IDENT_SIZE		256
+
+#define SQL_SHARED_KEY_USER_NAME	1
+#define SQL_SHARED_KEY_USER_ID		2
+#define SQL_SHARED_KEY_GROUP_NAME	3
+#define SQL_SHARED_KEY_GROUP_ID		4
+
+#define SQL_SHARED_FL_NEGATIVE		0x01
+#define SQL_SHARED_FL_NO_PASSWD		0x02
+#define SQL_SHARED_FL_NO_DIR		0x04
+#define SQL_SHARED_FL_NO_SHELL		0x08
+
+struct sql_shared_cache_hdr {
+  unsigned int magic;
+  unsigned int nslots;
+  unsigned int slotsz;
+
+  /* The (possibly truncated) identity, and the hash of the full identity. */
+  unsigned int identhash;
+  char ident[SQL_SHARED_CACHE_IDENT_SIZE];
+};
+
+struct sql_shared_cache_slot {
+  unsigned int hashval;
+  unsigned short key_type;
+  unsigned short flags;
+
+  /* UID or GID, and for users, the primary GID. */
+  unsigned int id;
+  unsigned int gid;
+
+  time_t expires;
+
+  /* NUL-separated strings: name, then password, home and shell for users,
+   * or the members for groups.
+   */
+  unsigned int datalen;
+  char data[SQL_SHARED_CACHE_DATA_SIZE];
+};
+
+static const char *sql_shared_cache_path = NULL;
+static int sql_shared_cache_fd = -1;
+static struct sql_shared_cache_hdr *sql_shared_cache_hdr = NULL;
+static struct sql_shared_cache_slot *sql_shared_cache_slots = NULL;
+static size_t sql_shared_cache_size = 0;
+static unsigned int sql_shared_cache_nslots = 0;
+static char sql_shared_cache_ident[SQL_SHARED_CACHE_IDENT_SIZE];
+static unsigned int sql_shared_cache_identhash = 0;
+
+static unsigned int sql_hash_name(const char *name) {
+  unsigned int hashval = 5381;
+
+  while (*name) {
+    hashval = ((hashval << 5) + hashval) + (unsigned char) *name++;
+  }
+
+  return hashval;
+}
+
+static unsigned int sql_hash_id(unsigned int id) {
+  return id * 2654435761U;
+}
+
+static int sql_shared_cache_lock(int lock_type) {
+  struct flock lock;
+
+  lock.l_type = lock_type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 0;
+
+  while (fcntl(sql_shared_cache_fd, F_SETLKW, &lock) < 0) {
+    int xerrno = errno;
+
+    if (xerrno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 3, "error %s shared SQLAuthCache '%s': %s",
+      lock_type == F_UNLCK ? "unlocking" : "locking", sql_shared_cache_path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void sql_shared_cache_close(void) {
+  if (sql_shared_cache_hdr != NULL) {
+    munmap((void *) sql_shared_cache_hdr, sql_shared_cache_size);
+    sql_shared_cache_hdr = NULL;
+    sql_shared_cache_slots = NULL;
+    sql_shared_cache_size = 0;
+    sql_shared_cache_nslots = 0;
+  }
+
+  if (sql_shared_cache_fd >= 0) {
+    (void) close(sql_shared_cache_fd);
+    sql_shared_cache_fd = -1;
+  }
+}
+
+/* Identifies the database connection, and vhost (whose SQLUserInfo et al
+ * may differ), for which the shared cache holds entries.
+ */
+static const char *sql_shared_cache_get_ident(pool *p) {
+  config_rec *c;
+  const char *backend, *info = "", *user = "";
+  char port[32];
+
+  backend = get_param_ptr(main_server->conf, "SQLBackend", FALSE);
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLConnectInfo", FALSE);
+  if (c != NULL) {
+    info = c->argv[0];
+    user = c->argv[1];
+  }
+
+  memset(port, '\0', sizeof(port));
+  pr_snprintf(port, sizeof(port)-1, "%u", main_server->ServerPort);
+
+  return pstrcat(p, backend ? backend : "", " ", user, "@", info, " ",
+    main_server->ServerName ? main_server->ServerName : "", "@",
+    main_server->ServerAddress, ":", port, NULL);
+}
+
+/* Returns TRUE if the shared cache holds entries for our identity.  Must be
+ * called with the file locked.
+ */
+static int sql_shared_cache_is_ours(void) {
+  return (sql_shared_cache_hdr->nslots == sql_shared_cache_nslots &&
+    sql_shared_cache_hdr->identhash == sql_shared_cache_identhash &&
+    strncmp(sql_shared_cache_hdr->ident, sql_shared_cache_ident,
+      SQL_SHARED_CACHE_IDENT_SIZE) == 0);
+}
+
+/* Opens and maps the shared cache file, (re)initializing it if it does not
+ * match the configured size, or holds entries for a different database
+ * connection or vhost.  Must be called with root privileges.
+ */
+static int sql_shared_cache_open(const char *path, unsigned int nslots,
+    const char *ident) {
+  int fd, flags, xerrno;
+  struct stat st;
+  void *data;
+  size_t size;
+
+  size = sizeof(struct sql_shared_cache_hdr) +
+    (nslots * sizeof(struct sql_shared_cache_slot));
+
+  memset(sql_shared_cache_ident, '\0', sizeof(sql_shared_cache_ident));
+  sstrncpy(sql_shared_cache_ident, ident, sizeof(sql_shared_cache_ident));
+  sql_shared_cache_identhash = sql_hash_name(ident);
+
+  flags = O_RDWR|O_CREAT;
+#if defined(O_NOFOLLOW)
+  flags |= O_NOFOLLOW;
+#endif /* O_NOFOLLOW */
+
+  fd = open(path, flags, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+
+  (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  sql_shared_cache_fd = fd;
+  sql_shared_cache_path = path;
+
+  if (sql_shared_cache_lock(F_WRLCK) < 0) {
+    xerrno = errno;
+
+    sql_shared_cache_close();
+    errno = xerrno;
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size != (off_t) size &&
+       ftruncate(fd, size) < 0)) {
+    xerrno = errno;
+
+    sql_shared_cache_lock(F_UNLCK);
+    sql_shared_cache_close();
+    errno = xerrno;
+    return -1;
+  }
+
+  data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    xerrno = errno;
+
+    sql_shared_cache_lock(F_UNLCK);
+    sql_shared_cache_close();
+    errno = xerrno;
+    return -1;
+  }
+
+  sql_shared_cache_size = size;
+  sql_shared_cache_nslots = nslots;
+  sql_shared_cache_hdr = data;
+  sql_shared_cache_slots = (struct sql_shared_cache_slot *)
+    (((char *) data) + sizeof(struct sql_shared_cache_hdr));
+
+  if (sql_shared_cache_hdr->magic != SQL_SHARED_CACHE_MAGIC ||
+      sql_shared_cache_hdr->nslots != nslots ||
+      sql_shared_cache_hdr->slotsz != sizeof(struct sql_shared_cache_slot) ||
+      sql_shared_cache_is_ours() == FALSE) {
+    if (sql_shared_cache_hdr->magic == SQL_SHARED_CACHE_MAGIC &&
+        sql_shared_cache_is_ours() == FALSE) {
+      sql_log(DEBUG_WARN, "shared SQLAuthCache '%s' was used for a different "
+        "database connection or vhost; use a separate file for each",
+        path);
+    }
+
+    pr_trace_msg(trace_channel, 5, "initializing shared SQLAuthCache '%s' "
+      "(%u entries)", path, nslots);
+
+    memset(data, '\0', size);
+    sql_shared_cache_hdr->magic = SQL_SHARED_CACHE_MAGIC;
+    sql_shared_cache_hdr->nslots = nslots;
+    sql_shared_cache_hdr->slotsz = sizeof(struct sql_shared_cache_slot);
+    sql_shared_cache_hdr->identhash = sql_shared_cache_identhash;
+    memcpy(sql_shared_cache_hdr->ident, sql_shared_cache_ident,
+      sizeof(sql_shared_cache_hdr->ident));
+  }
+
+  sql_shared_cache_lock(F_UNLCK);
+  return 0;
+}
+
+static int sql_shared_cache_slot_matches(struct sql_shared_cache_slot *slot,
+    unsigned short key_type, unsigned int hashval, const char *name,
+    unsigned int id) {
+
+  if (slot->key_type != key_type ||
+      slot->hashval != hashval) {
+    return FALSE;
+  }
+
+  if (name != NULL) {
+    size_t namelen;
+
+    namelen = strlen(name);
+    return (slot->datalen > namelen &&
+            memcmp(slot->data, name, namelen + 1) == 0);
+  }
+
+  return (slot->id == id);
+}
+
+/* Copies the matching, unexpired slot for the given key into the caller's
+ * buffer.  Name keys are looked up by name, ID keys by id.
+ */
+static int sql_shared_cache_get(unsigned short key_type, const char *name,
+    unsigned int id, struct sql_shared_cache_slot *res) {
+  register unsigned int i;
+  unsigned int hashval, nslots;
+  time_t now;
+  int found = FALSE;
+
+  if (sql_shared_cache_hdr == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  hashval = name != NULL ? sql_hash_name(name) : sql_hash_id(id);
+  nslots = sql_shared_cache_nslots;
+  time(&now);
+
+  if (sql_shared_cache_lock(F_RDLCK) < 0) {
+    return -1;
+  }
+
+  /* Another vhost may since have taken the file over. */
+  if (sql_shared_cache_is_ours() == FALSE) {
+    sql_shared_cache_lock(F_UNLCK);
+    errno = ENOENT;
+    return -1;
+  }
+
+  for (i = 0; i < SQL_SHARED_CACHE_MAX_PROBES && i < nslots; i++) {
+    struct sql_shared_cache_slot *slot;
+
+    slot = &(sql_shared_cache_slots[(hashval + key_type + i) % nslots]);
+    if (sql_shared_cache_slot_matches(slot, key_type, hashval, name, id)) {
+      /* Shared entries always expire; see set_sqlauthcache(). */
+      if (slot->expires > now) {
+        memcpy(res, slot, sizeof(struct sql_shared_cache_slot));
+        found = TRUE;
+      }
+
+      break;
+    }
+  }
+
+  sql_shared_cache_lock(F_UNLCK);
+
+  if (found == FALSE) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Stores the given slot contents under its key, replacing any existing entry
+ * for that key, else an empty or expired slot, else the slot closest to
+ * expiring within the probe window.
+ */
+static int sql_shared_cache_put(struct sql_shared_cache_slot *src,
+    const char *name) {
+  register unsigned int i;
+  struct sql_shared_cache_slot *victim = NULL;
+  unsigned int nslots;
+  time_t now;
+
+  if (sql_shared_cache_hdr == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  nslots = sql_shared_cache_nslots;
+  time(&now);
+
+  if (sql_shared_cache_lock(F_WRLCK) < 0) {
+    return -1;
+  }
+
+  if (sql_shared_cache_is_ours() == FALSE) {
+    sql_shared_cache_lock(F_UNLCK);
+    return 0;
+  }
+
+  for (i = 0; i < SQL_SHARED_CACHE_MAX_PROBES && i < nslots; i++) {
+    struct sql_shared_cache_slot *slot;
+
+    slot = &(sql_shared_cache_slots[(src->hashval + src->key_type + i) %
+      nslots]);
+
+    if (sql_shared_cache_slot_matches(slot, src->key_type, src->hashval, name,
+        src->id)) {
+      victim = slot;
+      break;
+    }
+
+    if (slot->key_type == 0 ||
+        (slot->expires > 0 && slot->expires <= now)) {
+      if (victim == NULL ||
+          victim->key_type != 0) {
+        victim = slot;
+      }
+
+      continue;
+    }
+
+    if (victim == NULL ||
+        (victim->key_type != 0 &&
+         victim->expires > 0 &&
+         (slot->expires > 0 && slot->expires < victim->expires))) {
+      victim = slot;
+    }
+  }
+
+  if (victim != NULL) {
+    memcpy(victim, src, sizeof(struct sql_shared_cache_slot));
+  }
+
+  sql_shared_cache_lock(F_UNLCK);
+  return 0;
+}
+
+static int sql_shared_cache_append(struct sql_shared_cache_slot *slot,
+    const char *str) {
+  size_t len;
+
+  len = strlen(str) + 1;
+  if (slot->datalen + len > sizeof(slot->data)) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  memcpy(slot->data + slot->datalen, str, len);
+  slot->datalen += len;
+  return 0;
+}
+
+/* Returns the next NUL-terminated string in the slot data, or NULL. */
+static const char *sql_shared_cache_next(struct sql_shared_cache_slot *slot,
+    unsigned int *offset) {
+  const char *str, *end;
+
+  if (*offset >= slot->datalen ||
+      slot->datalen > sizeof(slot->data)) {
+    return NULL;
+  }
+
+  str = slot->data + *offset;
+  end = memchr(str, '\0', slot->datalen - *offset);
+  if (end == NULL) {
+    return NULL;
+  }
+
+  *offset += (end - str) + 1;
+  return str;
+}
+
 cmd_rec *sql_make_cmd(pool *p, int argc, ...) {
   register int i = 0;
   pool *newpool = NULL;
@@ -536,6 +1086,25 @@ static modret_t *sql_dispatch(cmd_rec *cmd, char *cmdname) {
   return PR_ERROR(cmd);
 }
 
+/* Returns TRUE if the current backend implements the given command, FALSE
+ * otherwise.  Used for optional backend commands, such as "sql_execute".
+ */
+static int sql_backend_has_cmd(const char *cmdname) {
+  register unsigned int i = 0;
+
+  if (sql_cmdtable == NULL) {
+    return FALSE;
+  }
+
+  for (i = 0; sql_cmdtable[i].command; i++) {
+    if (strcmp(cmdname, sql_cmdtable[i].command) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 static struct sql_backend *sql_get_backend(const char *backend) {
   struct sql_backend *sb;
 
@@ -735,16 +1304,54 @@ struct sql_resolved {
   /* Used for escaping the resolved values per the database rules. */
   const char *conn_name;
   int conn_flags;
+
+  /* When preparing statements, the resolved text is collected here as
+   * segments, rather than written into the buffer, so that variable values
+   * can later be bound as parameters.
+   */
+  array_header *segments;
 };
 
+struct sql_segment {
+  const char *text;
+  size_t text_len;
+  int is_value;
+};
+
+static void sql_resolved_add_segment(pool *p, struct sql_resolved *resolved,
+    const char *text, size_t text_len, int is_value) {
+  struct sql_segment *seg;
+
+  seg = push_array(resolved->segments);
+  seg->text = pstrndup(p, text, text_len);
+  seg->text_len = text_len;
+  seg->is_value = is_value;
+}
+
+static void sql_resolved_append_raw(struct sql_resolved *resolved,
+    const char *text, size_t text_len) {
+  if (text_len > resolved->buflen) {
+    text_len = resolved->buflen;
+  }
+
+  memcpy(resolved->buf, text, text_len);
+  resolved->buf += text_len;
+  resolved->buflen -= text_len;
+}
+
 static int is_escaped_text(const char *text, size_t text_len) {
   register unsigned int i;
 
-  if (text[0] != '\'') {
+  /* A lone quote is not a quoted string. */
+  if (text_len < 2) {
     return FALSE;
   }
 
-  if (text[text_len-1] != '\'') {
+  if (text[0] != '\'') {
+    return FALSE;
+  }
+
+  if (text[text_len-1] != '\'') {
     return FALSE;
   }
 
@@ -764,6 +1371,15 @@ static int sql_resolved_append_text(pool *p, struct sql_resolved *resolved,
 
   if (text == NULL ||
       text_len == 0) {
+    if (resolved->segments != NULL) {
+      sql_resolved_add_segment(p, resolved, "", 0, TRUE);
+    }
+
+    return 0;
+  }
+
+  if (resolved->segments != NULL) {
+    sql_resolved_add_segment(p, resolved, text, text_len, TRUE);
     return 0;
   }
 
@@ -1083,6 +1699,12 @@ static int sql_resolve_on_other(pool *p, pr_jot_ctx_t *jot_ctx,
   struct sql_resolved *resolved;
 
   resolved = jot_ctx->log;
+  if (resolved->segments != NULL) {
+    sql_resolved_add_segment(p, resolved, (const char *) text, text_len,
+      FALSE);
+    return 0;
+  }
+
   if (resolved->buflen > 0) {
     pr_trace_msg(trace_channel, 19, "appending text '%.*s' (%lu) to buffer",
       (int) text_len, text, (unsigned long) text_len);
@@ -1094,6 +1716,256 @@ static int sql_resolve_on_other(pool *p, pr_jot_ctx_t *jot_ctx,
   return 0;
 }
 
+static int is_identifier_char(char c) {
+  return (PR_ISALNUM(c) || c == '_' || c == '.' || c == '$' || c == '"');
+}
+
+static int is_numeric_text(const char *text, size_t text_len) {
+  register unsigned int i;
+  int have_digit = FALSE, have_point = FALSE;
+
+  for (i = 0; i < text_len; i++) {
+    if (PR_ISDIGIT(text[i])) {
+      have_digit = TRUE;
+      continue;
+    }
+
+    if (i == 0 &&
+        text[i] == '-') {
+      continue;
+    }
+
+    if (text[i] == '.' &&
+        have_point == FALSE) {
+      have_point = TRUE;
+      continue;
+    }
+
+    return FALSE;
+  }
+
+  return have_digit;
+}
+
+/* Assemble the statement text from the collected segments.  Where a value
+ * can safely be bound as a parameter -- the entire contents of a quoted
+ * literal, or a standalone number or already-quoted string -- a '?'
+ * placeholder is written instead, and the value is added to the params list.
+ *
+ * If any value cannot be bound (or params is NULL), the whole statement is
+ * written inline, with escaped values, as for non-prepared statements.  Such
+ * text differs from call to call, and so is not worth preparing.
+ *
+ * Returns 1 if placeholders were used, 0 if the statement was written
+ * entirely inline, and -1 on error.
+ */
+static int sql_resolved_build_stmt(pool *p, struct sql_resolved *resolved,
+    array_header *params) {
+  register unsigned int i;
+  struct sql_segment *segs;
+  array_header *segments;
+  int in_quote = FALSE, skip_quote = FALSE, use_params, inlined = FALSE;
+  char *quote_start = NULL;
+
+  segments = resolved->segments;
+  segs = segments->elts;
+  use_params = (params != NULL);
+
+  /* If the static text already contains placeholders, we cannot tell them
+   * apart from ours.  Our quote tracking only knows about plain '...'
+   * literals, so the same goes for backslash escapes, and for prefixed
+   * literals such as E'...'.
+   */
+  for (i = 0; use_params && i < segments->nelts; i++) {
+    register unsigned int j;
+
+    if (segs[i].is_value) {
+      continue;
+    }
+
+    for (j = 0; j < segs[i].text_len; j++) {
+      char c;
+
+      c = segs[i].text[j];
+
+      if (c == '\\') {
+        use_params = FALSE;
+        break;
+      }
+
+      if (c == '\'') {
+        if (in_quote == FALSE &&
+            ((j > 0 && is_identifier_char(segs[i].text[j-1]) == TRUE) ||
+             (j == 0 && i > 0))) {
+          use_params = FALSE;
+          break;
+        }
+
+        in_quote = !in_quote;
+
+      } else if (c == '?' &&
+                 in_quote == FALSE) {
+        use_params = FALSE;
+        break;
+      }
+    }
+  }
+
+  in_quote = FALSE;
+
+  for (i = 0; i < segments->nelts; i++) {
+    struct sql_segment *seg;
+    int res;
+
+    seg = &(segs[i]);
+
+    if (seg->is_value == FALSE) {
+      register unsigned int j;
+      const char *text;
+      size_t text_len;
+      char *base;
+
+      text = seg->text;
+      text_len = seg->text_len;
+
+      if (skip_quote) {
+        /* Drop the closing quote of a literal replaced by a placeholder. */
+        text++;
+        text_len--;
+        skip_quote = FALSE;
+        in_quote = FALSE;
+      }
+
+      base = resolved->buf;
+      for (j = 0; j < text_len; j++) {
+        if (text[j] == '\'') {
+          in_quote = !in_quote;
+          if (in_quote) {
+            quote_start = base + j;
+          }
+        }
+      }
+
+      sql_resolved_append_raw(resolved, text, text_len);
+      continue;
+    }
+
+    if (use_params) {
+      struct sql_segment *next_seg = NULL;
+      char prev_char = '\0', next_char = '\0';
+      int standalone;
+
+      if (i+1 < segments->nelts &&
+          segs[i+1].is_value == FALSE) {
+        next_seg = &(segs[i+1]);
+        next_char = next_seg->text[0];
+      }
+
+      if (resolved->buf > resolved->ptr) {
+        prev_char = *(resolved->buf - 1);
+      }
+
+      if (in_quote == TRUE &&
+          quote_start == resolved->buf - 1 &&
+          next_char == '\'') {
+        /* The value is the entire quoted literal; replace the literal,
+         * quotes and all, with a placeholder.
+         */
+        resolved->buf--;
+        resolved->buflen++;
+        sql_resolved_append_raw(resolved, "?", 1);
+        *((char **) push_array(params)) = (char *) seg->text;
+        skip_quote = TRUE;
+        continue;
+      }
+
+      /* A value directly next to another value, or to an identifier, is
+       * part of some larger token, and cannot be a parameter.
+       */
+      if ((i > 0 && segs[i-1].is_value == TRUE) ||
+          (i+1 < segments->nelts && segs[i+1].is_value == TRUE)) {
+        standalone = FALSE;
+
+      } else {
+        standalone = (is_identifier_char(prev_char) == FALSE &&
+          is_identifier_char(next_char) == FALSE);
+      }
+
+      if (in_quote == FALSE &&
+          standalone == TRUE &&
+          seg->text_len > 0) {
+        if (is_escaped_text(seg->text, seg->text_len) == TRUE) {
+          sql_resolved_append_raw(resolved, "?", 1);
+          *((char **) push_array(params)) = pstrndup(p, seg->text + 1,
+            seg->text_len - 2);
+          continue;
+        }
+
+        if (is_numeric_text(seg->text, seg->text_len) == TRUE) {
+          sql_resolved_append_raw(resolved, "?", 1);
+          *((char **) push_array(params)) = (char *) seg->text;
+          continue;
+        }
+      }
+    }
+
+    if (use_params) {
+      inlined = TRUE;
+      break;
+    }
+
+    /* Otherwise, escape the value and write it inline. */
+    resolved->segments = NULL;
+    res = sql_resolved_append_text(p, resolved, seg->text, seg->text_len);
+    resolved->segments = segments;
+
+    if (res < 0) {
+      return -1;
+    }
+  }
+
+  if (inlined) {
+    pr_trace_msg(trace_channel, 17, "%s",
+      "statement has values which cannot be bound, writing inline");
+
+    resolved->buf = resolved->ptr;
+    resolved->buflen = resolved->bufsz;
+    params->nelts = 0;
+
+    return sql_resolved_build_stmt(p, resolved, NULL);
+  }
+
+  return use_params ? 1 : 0;
+}
+
+static modret_t *sql_execute_stmt(cmd_rec *cmd, const char *conn_name,
+    const char *name, const char *text, array_header *params) {
+  register unsigned int i;
+  cmd_rec *exec_cmd;
+  char **elts;
+  modret_t *mr;
+
+  exec_cmd = sql_make_cmd(cmd->tmp_pool, 3, conn_name, name, text);
+  exec_cmd->argc = 3 + params->nelts;
+  exec_cmd->argv = pcalloc(exec_cmd->pool,
+    sizeof(void *) * (exec_cmd->argc + 1));
+  exec_cmd->argv[0] = (void *) conn_name;
+  exec_cmd->argv[1] = (void *) name;
+  exec_cmd->argv[2] = (void *) text;
+
+  elts = params->elts;
+  for (i = 0; i < params->nelts; i++) {
+    exec_cmd->argv[3+i] = elts[i];
+  }
+
+  pr_trace_msg(trace_channel, 17,
+    "executing prepared statement '%s' (%u %s): %s", name, params->nelts,
+    params->nelts != 1 ? "parameters" : "parameter", text);
+
+  mr = sql_dispatch(exec_cmd, "sql_execute");
+  return mr;
+}
+
 /* Default SQL password handlers (a.k.a. "AuthTypes") provided by mod_sql. */
 
 static modret_t *sql_auth_crypt(cmd_rec *cmd, const char *plaintext,
@@ -1486,14 +2358,11 @@ static unsigned int _group_gid(const void *val) {
     return 0;
   }
 
-  return ((struct group *) val)->gr_gid;
+  return sql_hash_id(((struct group *) val)->gr_gid);
 } 
 
 static unsigned int _group_name(const void *val) {
-  register unsigned int i;
-  size_t namelen;
   char *name;
-  unsigned int nameval = 0;
 
   if (val == NULL) {
     return 0;
@@ -1504,31 +2373,24 @@ static unsigned int _group_name(const void *val) {
     return 0;
   }
 
-  namelen = strlen(name);
-  for (i = 0; i < namelen; i++) {
-    nameval += name[i];
-  }
-
-  return nameval;
+  return sql_hash_name(name);
 }
 
-static int _groupcmp(const void *val1, const void *val2) {
+static int _group_gidcmp(const void *val1, const void *val2) {
   if ((val1 == NULL) || (val2 == NULL)) {
     return 0;
   }
 
-  /* either the groupnames match or the GIDs match */
-  
-  if (_sql_strcmp(((struct group *) val1)->gr_name,
-      ((struct group *) val2)->gr_name) == 0) {
-    return 1;
-  }
+  return (((struct group *) val1)->gr_gid == ((struct group *) val2)->gr_gid);
+}
 
-  if (((struct group *) val1)->gr_gid == ((struct group *) val2)->gr_gid) {
-    return 1;
+static int _group_namecmp(const void *val1, const void *val2) {
+  if ((val1 == NULL) || (val2 == NULL)) {
+    return 0;
   }
 
-  return 0;
+  return (_sql_strcmp(((struct group *) val1)->gr_name,
+    ((struct group *) val2)->gr_name) == 0);
 }
 
 static unsigned int _passwd_uid(const void *val) {
@@ -1536,14 +2398,11 @@ static unsigned int _passwd_uid(const void *val) {
     return 0;
   }
 
-  return ((struct passwd *) val)->pw_uid;
+  return sql_hash_id(((struct passwd *) val)->pw_uid);
 } 
 
 static unsigned int _passwd_name(const void *val) {
-  register unsigned int i;
   char *name;
-  size_t namelen;
-  unsigned int nameval = 0;
 
   if (val == NULL) {
     return 0;
@@ -1554,30 +2413,25 @@ static unsigned int _passwd_name(const void *val) {
     return 0;
   }
 
-  namelen = strlen(name);
-  for (i = 0; i < namelen; i++) {
-    nameval += name[i];
-  }
-
-  return nameval;
+  return sql_hash_name(name);
 }
 
-static int _passwdcmp(const void *val1, const void *val2) {
+static int _passwd_uidcmp(const void *val1, const void *val2) {
   if ((val1 == NULL) || (val2 == NULL)) {
      return 0;
   }
 
-  /* either the usernames match or the UIDs match */
-  if (_sql_strcmp(((struct passwd *) val1)->pw_name,
-      ((struct passwd *) val2)->pw_name) == 0) {
-    return 1;
-  }
+  return (((struct passwd *) val1)->pw_uid ==
+    ((struct passwd *) val2)->pw_uid);
+}
 
-  if (((struct passwd *) val1)->pw_uid == ((struct passwd *) val2)->pw_uid) {
-    return 1;
+static int _passwd_namecmp(const void *val1, const void *val2) {
+  if ((val1 == NULL) || (val2 == NULL)) {
+     return 0;
   }
 
-  return 0;
+  return (_sql_strcmp(((struct passwd *) val1)->pw_name,
+    ((struct passwd *) val2)->pw_name) == 0);
 }
 
 static void show_group(pool *p, struct group *g) {
@@ -1636,6 +2490,10 @@ static struct passwd *_sql_addpasswd(cmd_rec *cmd, char *username,
     char *password, uid_t uid, gid_t gid, char *shell, char *dir) {
   struct passwd *cached = NULL;
   struct passwd *pwd = NULL;
+  int negative;
+
+  /* Negative entries have no password, home, or shell. */
+  negative = (password == NULL && shell == NULL && dir == NULL);
 
   pwd = pcalloc(cmd->tmp_pool, sizeof(struct passwd));
   pwd->pw_uid = uid;
@@ -1685,8 +2543,15 @@ static struct passwd *_sql_addpasswd(cmd_rec *cmd, char *username,
       }
     }
     
-    cache_addentry(passwd_name_cache, pwd);
-    cache_addentry(passwd_uid_cache, pwd);
+    /* Negative entries are only cached under the key that was looked up. */
+    if (pwd->pw_name != NULL) {
+      cache_addentry(passwd_name_cache, pwd, negative);
+    }
+
+    if (!negative ||
+        pwd->pw_name == NULL) {
+      cache_addentry(passwd_uid_cache, pwd, negative);
+    }
 
     sql_log(DEBUG_INFO, "cache miss for user '%s'", pwd->pw_name);
     sql_log(DEBUG_INFO, "user '%s' cached", pwd->pw_name);
@@ -1696,6 +2561,115 @@ static struct passwd *_sql_addpasswd(cmd_rec *cmd, char *username,
   return pwd;
 }
 
+/* Publishes a looked-up (or negative) passwd entry to the shared cache. */
+static void sql_shared_cache_add_passwd(struct passwd *pwd) {
+  struct sql_shared_cache_slot slot;
+  int negative, ttl;
+
+  if (sql_shared_cache_hdr == NULL ||
+      pwd == NULL) {
+    return;
+  }
+
+  negative = (pwd->pw_passwd == NULL && pwd->pw_shell == NULL &&
+    pwd->pw_dir == NULL);
+
+  memset(&slot, 0, sizeof(slot));
+  slot.id = (unsigned int) pwd->pw_uid;
+  slot.gid = (unsigned int) pwd->pw_gid;
+
+  if (negative) {
+    slot.flags |= SQL_SHARED_FL_NEGATIVE;
+  }
+
+  if (pwd->pw_passwd == NULL) {
+    slot.flags |= SQL_SHARED_FL_NO_PASSWD;
+  }
+
+  if (pwd->pw_dir == NULL) {
+    slot.flags |= SQL_SHARED_FL_NO_DIR;
+  }
+
+  if (pwd->pw_shell == NULL) {
+    slot.flags |= SQL_SHARED_FL_NO_SHELL;
+  }
+
+  ttl = negative ? cmap.cache_negative_ttl : cmap.cache_ttl;
+  slot.expires = ttl > 0 ? time(NULL) + ttl : 0;
+
+  if (sql_shared_cache_append(&slot, pwd->pw_name ? pwd->pw_name : "") < 0 ||
+      sql_shared_cache_append(&slot, pwd->pw_passwd ? pwd->pw_passwd : "") < 0 ||
+      sql_shared_cache_append(&slot, pwd->pw_dir ? pwd->pw_dir : "") < 0 ||
+      sql_shared_cache_append(&slot, pwd->pw_shell ? pwd->pw_shell : "") < 0) {
+    pr_trace_msg(trace_channel, 8, "user '%s' too large for shared "
+      "SQLAuthCache, not sharing", pwd->pw_name ? pwd->pw_name : "(null)");
+    return;
+  }
+
+  if (pwd->pw_name != NULL) {
+    slot.key_type = SQL_SHARED_KEY_USER_NAME;
+    slot.hashval = sql_hash_name(pwd->pw_name);
+    (void) sql_shared_cache_put(&slot, pwd->pw_name);
+  }
+
+  if (!negative ||
+      pwd->pw_name == NULL) {
+    slot.key_type = SQL_SHARED_KEY_USER_ID;
+    slot.hashval = sql_hash_id(slot.id);
+    (void) sql_shared_cache_put(&slot, NULL);
+  }
+}
+
+/* Looks up the given passwd in the shared cache, adding any entry found to
+ * the session's caches.
+ */
+static struct passwd *sql_shared_cache_get_passwd(cmd_rec *cmd,
+    struct passwd *p) {
+  struct sql_shared_cache_slot slot;
+  const char *name, *passwd, *dir, *shell;
+  unsigned int offset = 0;
+  int res;
+
+  if (sql_shared_cache_hdr == NULL) {
+    return NULL;
+  }
+
+  if (p->pw_name != NULL) {
+    res = sql_shared_cache_get(SQL_SHARED_KEY_USER_NAME, p->pw_name, 0, &slot);
+
+  } else {
+    res = sql_shared_cache_get(SQL_SHARED_KEY_USER_ID, NULL,
+      (unsigned int) p->pw_uid, &slot);
+  }
+
+  if (res < 0) {
+    return NULL;
+  }
+
+  name = sql_shared_cache_next(&slot, &offset);
+  passwd = sql_shared_cache_next(&slot, &offset);
+  dir = sql_shared_cache_next(&slot, &offset);
+  shell = sql_shared_cache_next(&slot, &offset);
+
+  if (name == NULL ||
+      passwd == NULL ||
+      dir == NULL ||
+      shell == NULL) {
+    return NULL;
+  }
+
+  if (slot.flags & SQL_SHARED_FL_NEGATIVE) {
+    return _sql_addpasswd(cmd, p->pw_name, NULL, p->pw_uid, p->pw_gid, NULL,
+      NULL);
+  }
+
+  return _sql_addpasswd(cmd, (char *) name,
+    (slot.flags & SQL_SHARED_FL_NO_PASSWD) ? NULL : (char *) passwd,
+    (uid_t) slot.id, (gid_t) slot.gid,
+    (slot.flags & SQL_SHARED_FL_NO_SHELL) ? NULL : (char *) shell,
+    (slot.flags & SQL_SHARED_FL_NO_DIR) ? NULL : (char *) dir);
+}
+
 static int sql_getuserprimarykey(cmd_rec *cmd, const char *username) {
   sql_data_t *sd = NULL;
   modret_t *mr = NULL;
@@ -1889,6 +2863,7 @@ static int sql_getgroupprimarykey(cmd_rec *cmd, const char *groupname) {
 static struct passwd *sql_getpasswd(cmd_rec *cmd, struct passwd *p) {
   sql_data_t *sd = NULL;
   modret_t *mr = NULL;
+  cache_entry_t *entry = NULL;
   struct passwd *pwd = NULL;
   char *usrwhere, *where;
   char *realname = NULL;
@@ -1911,15 +2886,28 @@ static struct passwd *sql_getpasswd(cmd_rec *cmd, struct passwd *p) {
    * Give preference to name-based lookups, as opposed to UID-based lookups.
    */
   if (p->pw_name != NULL) {
-    pwd = (struct passwd *) cache_findvalue(passwd_name_cache, p);
+    entry = cache_findentry(passwd_name_cache, p);
 
   } else {
-    pwd = (struct passwd *) cache_findvalue(passwd_uid_cache, p);
+    entry = cache_findentry(passwd_uid_cache, p);
   }
 
-  if (pwd != NULL) {
+  if (entry != NULL) {
+    pwd = entry->data;
     sql_log(DEBUG_AUTH, "cache hit for user '%s'", pwd->pw_name);
 
+    if (entry->negative) {
+      sql_log(DEBUG_AUTH, "negative cache entry for user '%s'", pwd->pw_name);
+      return NULL;
+    }
+
+    return pwd;
+  }
+
+  pwd = sql_shared_cache_get_passwd(cmd, p);
+  if (pwd != NULL) {
+    sql_log(DEBUG_AUTH, "shared cache hit for user '%s'", pwd->pw_name);
+
     /* Check for negatively cached passwds, which will have NULL
      * passwd/home/shell.
      */
@@ -2070,8 +3058,10 @@ static struct passwd *sql_getpasswd(cmd_rec *cmd, struct passwd *p) {
       /* If doing caching of negative lookups, cache this failed lookup.
        * Use the default UID and GID.
        */
-      return _sql_addpasswd(cmd, username, NULL, p->pw_uid, p->pw_gid,
+      pwd = _sql_addpasswd(cmd, username, NULL, p->pw_uid, p->pw_gid,
         NULL, NULL);
+      sql_shared_cache_add_passwd(pwd);
+      return pwd;
     }
   }
 
@@ -2151,7 +3141,9 @@ static struct passwd *sql_getpasswd(cmd_rec *cmd, struct passwd *p) {
     gid = cmap.defaultgid;
   }
 
-  return _sql_addpasswd(cmd, username, password, uid, gid, shell, dir);
+  pwd = _sql_addpasswd(cmd, username, password, uid, gid, shell, dir);
+  sql_shared_cache_add_passwd(pwd);
+  return pwd;
 }
 
 /* _sql_addgroup: creates a group and adds it to the group struct
@@ -2165,6 +3157,10 @@ static struct group *_sql_addgroup(cmd_rec *cmd, char *groupname, gid_t gid,
     array_header *ah) {
   struct group *cached = NULL;
   struct group *grp = NULL;
+  int negative;
+
+  /* Negative entries have no member list. */
+  negative = (ah == NULL);
 
   grp = pcalloc(cmd->tmp_pool, sizeof(struct group));
   grp->gr_gid = gid;
@@ -2207,8 +3203,15 @@ static struct group *_sql_addgroup(cmd_rec *cmd, char *groupname, gid_t gid,
       grp->gr_mem[i] = NULL;
     }
 
-    cache_addentry(group_name_cache, grp);
-    cache_addentry(group_gid_cache, grp);
+    /* Negative entries are only cached under the key that was looked up. */
+    if (grp->gr_name != NULL) {
+      cache_addentry(group_name_cache, grp, negative);
+    }
+
+    if (!negative ||
+        grp->gr_name == NULL) {
+      cache_addentry(group_gid_cache, grp, negative);
+    }
 
     sql_log(DEBUG_INFO, "cache miss for group '%s'", grp->gr_name);
     sql_log(DEBUG_INFO, "group '%s' cached", grp->gr_name);
@@ -2218,7 +3221,107 @@ static struct group *_sql_addgroup(cmd_rec *cmd, char *groupname, gid_t gid,
   return grp;
 }
 
+/* Publishes a looked-up (or negative) group entry to the shared cache. */
+static void sql_shared_cache_add_group(struct group *grp) {
+  struct sql_shared_cache_slot slot;
+  int negative, ttl;
+
+  if (sql_shared_cache_hdr == NULL ||
+      grp == NULL) {
+    return;
+  }
+
+  negative = (grp->gr_mem == NULL);
+
+  memset(&slot, 0, sizeof(slot));
+  slot.id = (unsigned int) grp->gr_gid;
+
+  if (negative) {
+    slot.flags |= SQL_SHARED_FL_NEGATIVE;
+  }
+
+  ttl = negative ? cmap.cache_negative_ttl : cmap.cache_ttl;
+  slot.expires = ttl > 0 ? time(NULL) + ttl : 0;
+
+  if (sql_shared_cache_append(&slot, grp->gr_name ? grp->gr_name : "") < 0) {
+    return;
+  }
+
+  if (grp->gr_mem != NULL) {
+    register unsigned int i;
+
+    for (i = 0; grp->gr_mem[i] != NULL; i++) {
+      if (sql_shared_cache_append(&slot, grp->gr_mem[i]) < 0) {
+        pr_trace_msg(trace_channel, 8, "group '%s' too large for shared "
+          "SQLAuthCache, not sharing", grp->gr_name ? grp->gr_name : "(null)");
+        return;
+      }
+    }
+  }
+
+  if (grp->gr_name != NULL) {
+    slot.key_type = SQL_SHARED_KEY_GROUP_NAME;
+    slot.hashval = sql_hash_name(grp->gr_name);
+    (void) sql_shared_cache_put(&slot, grp->gr_name);
+  }
+
+  if (!negative ||
+      grp->gr_name == NULL) {
+    slot.key_type = SQL_SHARED_KEY_GROUP_ID;
+    slot.hashval = sql_hash_id(slot.id);
+    (void) sql_shared_cache_put(&slot, NULL);
+  }
+}
+
+/* Looks up the given group in the shared cache, adding any entry found to
+ * the session's caches.
+ */
+static struct group *sql_shared_cache_get_group(cmd_rec *cmd,
+    struct group *g) {
+  struct sql_shared_cache_slot slot;
+  const char *name, *member;
+  unsigned int offset = 0;
+  array_header *ah;
+  int res;
+
+  if (sql_shared_cache_hdr == NULL) {
+    return NULL;
+  }
+
+  if (g->gr_name != NULL) {
+    res = sql_shared_cache_get(SQL_SHARED_KEY_GROUP_NAME, g->gr_name, 0,
+      &slot);
+
+  } else {
+    res = sql_shared_cache_get(SQL_SHARED_KEY_GROUP_ID, NULL,
+      (unsigned int) g->gr_gid, &slot);
+  }
+
+  if (res < 0) {
+    return NULL;
+  }
+
+  name = sql_shared_cache_next(&slot, &offset);
+  if (name == NULL) {
+    return NULL;
+  }
+
+  if (slot.flags & SQL_SHARED_FL_NEGATIVE) {
+    return _sql_addgroup(cmd, g->gr_name, g->gr_gid, NULL);
+  }
+
+  ah = make_array(cmd->tmp_pool, 10, sizeof(char *));
+  for (member = sql_shared_cache_next(&slot, &offset); member != NULL;
+      member = sql_shared_cache_next(&slot, &offset)) {
+    *((char **) push_array(ah)) = pstrdup(cmd->tmp_pool, member);
+  }
+
+  return _sql_addgroup(cmd, pstrdup(cmd->tmp_pool, name), (gid_t) slot.id,
+    ah);
+}
+
 static struct group *sql_getgroup(cmd_rec *cmd, struct group *g) {
+  cache_entry_t *entry = NULL;
   struct group *grp = NULL;
   modret_t *mr = NULL;
   int cnt = 0;
@@ -2242,12 +3345,31 @@ static struct group *sql_getgroup(cmd_rec *cmd, struct group *g) {
   }
 
   /* check to see if the group already exists in one of the group caches */
-  if (((grp = (struct group *) cache_findvalue(group_name_cache, g)) != NULL) ||
-      ((grp = (struct group *) cache_findvalue(group_gid_cache, g)) != NULL)) {
-    sql_log(DEBUG_AUTH, "cache hit for group '%s'", grp->gr_name);
+  if (g->gr_name != NULL) {
+    entry = cache_findentry(group_name_cache, g);
 
-    /* Check for negatively cached groups, which will have NULL gr_mem. */
-    if (!grp->gr_mem) {
+  } else {
+    entry = cache_findentry(group_gid_cache, g);
+  }
+
+  if (entry != NULL) {
+    grp = entry->data;
+    sql_log(DEBUG_AUTH, "cache hit for group '%s'", grp->gr_name);
+
+    if (entry->negative) {
+      sql_log(DEBUG_AUTH, "negative cache entry for group '%s'", grp->gr_name);
+      return NULL;
+    }
+
+    return grp;
+  }
+
+  grp = sql_shared_cache_get_group(cmd, g);
+  if (grp != NULL) {
+    sql_log(DEBUG_AUTH, "shared cache hit for group '%s'", grp->gr_name);
+
+    /* Check for negatively cached groups, which will have NULL gr_mem. */
+    if (!grp->gr_mem) {
       sql_log(DEBUG_AUTH, "negative cache entry for group '%s'", grp->gr_name);
       return NULL;
     }
@@ -2369,7 +3491,9 @@ static struct group *sql_getgroup(cmd_rec *cmd, struct group *g) {
     } else {
 
       /* If doing caching of negative lookups, cache this failed lookup. */
-      return _sql_addgroup(cmd, groupname, g->gr_gid, NULL);
+      grp = _sql_addgroup(cmd, groupname, g->gr_gid, NULL);
+      sql_shared_cache_add_group(grp);
+      return grp;
     }
   }
  
@@ -2408,7 +3532,9 @@ static struct group *sql_getgroup(cmd_rec *cmd, struct group *g) {
     }      
   }
   
-  return _sql_addgroup(cmd, groupname, gid, ah);
+  grp = _sql_addgroup(cmd, groupname, gid, ah);
+  sql_shared_cache_add_group(grp);
+  return grp;
 }
 
 static void _setstats(cmd_rec *cmd, int fstor, int fretr, int bstor,
@@ -2734,153 +3860,976 @@ MODRET sql_post_retr(cmd_rec *cmd) {
   if (cmap.sql_fretr)
     _setstats(cmd, 0, 1, 0, session.xfer.total_bytes);
 
-  sql_log(DEBUG_FUNC, "%s", "<<< sql_post_retr");
-  return PR_DECLINED(cmd);
-}
+  sql_log(DEBUG_FUNC, "%s", "<<< sql_post_retr");
+  return PR_DECLINED(cmd);
+}
+
+static int resolve_numeric_val(cmd_rec *cmd, const char *val) {
+  int idx = -1;
+  char *ptr = NULL;
+
+  idx = strtol(val, &ptr, 10);
+  if (*ptr != '\0') {
+    return -1;
+  }
+
+  if (idx < 0) {
+    return -1;
+  }
+
+  if ((cmd->argc - 3) < (unsigned int) idx) {
+    return -1;
+  }
+
+  return idx;
+}
+
+static char *named_query_type(cmd_rec *cmd, char *name) {
+  config_rec *c = NULL;
+  char *query = NULL;
+
+  query = pstrcat(cmd->tmp_pool, "SQLNamedQuery_", name, NULL);
+  c = find_config(main_server->conf, CONF_PARAM, query, FALSE);
+  if (c != NULL) {
+    return c->argv[0];
+  }
+
+  sql_log(DEBUG_FUNC, "no '%s' SQLNamedQuery found", name);
+  errno = ENOENT;
+  return NULL;
+}
+
+static modret_t *process_named_query(cmd_rec *cmd, char *name, int flags) {
+  config_rec *c;
+  char *conn_name, *query = NULL;
+  char stmt[SQL_MAX_STMT_LEN+1];
+  size_t stmt_len;
+  modret_t *mr = NULL;
+  int res;
+  pool *tmp_pool;
+  pr_jot_ctx_t *jot_ctx;
+  struct sql_resolved *resolved;
+  array_header *params = NULL;
+
+  sql_log(DEBUG_FUNC, ">>> process_named_query '%s'", name);
+
+  /* Check for a query by that name. */
+  query = pstrcat(cmd->tmp_pool, "SQLNamedQuery_", name, NULL);
+
+  c = find_config(main_server->conf, CONF_PARAM, query, FALSE);
+  if (c == NULL) {
+    mr = PR_ERROR(cmd);
+    sql_log(DEBUG_FUNC, "<<< process_named_query '%s'", name);
+    return mr;
+  }
+
+  conn_name = get_query_named_conn(c);
+  set_named_conn_backend(conn_name);
+
+  tmp_pool = make_sub_pool(cmd->tmp_pool);
+  jot_ctx = pcalloc(tmp_pool, sizeof(pr_jot_ctx_t));
+  resolved = pcalloc(tmp_pool, sizeof(struct sql_resolved));
+  resolved->bufsz = resolved->buflen = sizeof(stmt)-1;
+  resolved->ptr = resolved->buf = stmt;
+  resolved->conn_name = conn_name;
+  resolved->conn_flags = flags;
+
+  if ((pr_sql_opts & SQL_OPT_USE_PREPARED_STATEMENTS) &&
+      sql_backend_has_cmd("sql_execute") == TRUE) {
+    resolved->segments = make_array(tmp_pool, 8, sizeof(struct sql_segment));
+  }
+
+  jot_ctx->log = resolved;
+  jot_ctx->user_data = cmd;
+
+  res = pr_jot_resolve_logfmt(tmp_pool, cmd, NULL, c->argv[1], jot_ctx,
+    sql_resolve_on_meta, sql_resolve_on_default, sql_resolve_on_other);
+  if (res == 0 &&
+      resolved->segments != NULL) {
+    params = make_array(tmp_pool, 4, sizeof(char *));
+
+    res = sql_resolved_build_stmt(tmp_pool, resolved, params);
+    if (res == 0) {
+      sql_log(DEBUG_INFO, "SQLNamedQuery '%s' cannot be fully "
+        "parameterized, not using a prepared statement", name);
+      params = NULL;
+
+    } else if (res > 0) {
+      res = 0;
+    }
+  }
+
+  if (res < 0) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    set_named_conn_backend(NULL);
+
+    if (xerrno == EIO) {
+      return PR_ERROR_MSG(cmd, MOD_SQL_VERSION, "database error");
+    }
+
+    return PR_ERROR_MSG(cmd, MOD_SQL_VERSION,
+      "malformed reference %{?} in query");
+  }
+
+  stmt_len = resolved->bufsz - resolved->buflen;
+  stmt[stmt_len] = '\0';
+
+  /* Construct our return data based on the type of query */
+  if (strcasecmp(c->argv[0], SQL_UPDATE_C) == 0) {
+    query = pstrcat(cmd->tmp_pool, c->argv[2], " SET ", stmt, NULL);
+    if (params != NULL) {
+      mr = sql_execute_stmt(cmd, conn_name, name,
+        pstrcat(cmd->tmp_pool, "UPDATE ", query, NULL), params);
+
+    } else {
+      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, query),
+        "sql_update");
+    }
+
+  } else if (strcasecmp(c->argv[0], SQL_INSERT_C) == 0) {
+    query = pstrcat(cmd->tmp_pool, "INTO ", c->argv[2], " VALUES (",
+      stmt, ")", NULL);
+    if (params != NULL) {
+      mr = sql_execute_stmt(cmd, conn_name, name,
+        pstrcat(cmd->tmp_pool, "INSERT ", query, NULL), params);
+
+    } else {
+      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, query),
+        "sql_insert");
+    }
+
+  } else if (strcasecmp(c->argv[0], SQL_FREEFORM_C) == 0) {
+    if (params != NULL) {
+      mr = sql_execute_stmt(cmd, conn_name, name,
+        pstrdup(cmd->tmp_pool, stmt), params);
+
+    } else {
+      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, stmt),
+        "sql_query");
+    }
+
+  } else if (strcasecmp(c->argv[0], SQL_SELECT_C) == 0) {
+    if (params != NULL) {
+      mr = sql_execute_stmt(cmd, conn_name, name,
+        pstrcat(cmd->tmp_pool, "SELECT ", stmt, NULL), params);
+
+    } else {
+      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, stmt),
+        "sql_select");
+    }
+
+    if (MODRET_ISHANDLED(mr) &&
+        MODRET_HASDATA(mr) &&
+        pr_trace_get_level(trace_channel) >= 9) {
+      register unsigned long i, idx;
+      sql_data_t *sd;
+
+      sd = mr->data;
+
+      pr_trace_msg(trace_channel, 9, "SQLNamedQuery %s results:", name);
+      pr_trace_msg(trace_channel, 9, "  row count: %lu", sd->rnum);
+      pr_trace_msg(trace_channel, 9, "  col count: %lu", sd->fnum);
+
+      for (i = 0, idx = 0; i < sd->rnum; i++) {
+        register unsigned long j;
+
+        pr_trace_msg(trace_channel, 9, "    row #%lu:", i+1);
+        for (j = 0; j < sd->fnum; j++) {
+          pr_trace_msg(trace_channel, 9, "      col #%lu: '%s'", j+1,
+            sd->data[idx++]);
+        }
+      }
+    }
+
+  } else {
+    mr = PR_ERROR_MSG(cmd, MOD_SQL_VERSION, "unknown NamedQuery type");
+  }
+
+  set_named_conn_backend(NULL);
+  destroy_pool(tmp_pool);
+
+  sql_log(DEBUG_FUNC, "<<< process_named_query '%s'", name);
+  return mr;
+}
+
+/* SQLLogAsync: rather than executing SQLLog queries as each command is
+ * logged, the resolved query values are queued, and written to the database
+ * in batches, when the timer interval has elapsed, when the queue fills up,
+ * and when the session ends.  Queued INSERTs of the same SQLNamedQuery are
+ * combined into multi-row INSERT statements.  If the database cannot be
+ * reached, the queued records are kept, or written to the
+ * SQLLogAsyncSpoolFile, to be replayed by the next successful flush.
+ */
+
+struct sql_async_rec {
+  /* The vhost whose SQLNamedQuery, and connection, the record is for. */
+  const char *server_ident;
+  const char *query_name;
+
+  /* The number of times the database has rejected this record. */
+  unsigned int nfailed;
+
+  array_header *segments;
+};
+
+static pool *sql_async_pool = NULL;
+static array_header *sql_async_queue = NULL;
+static int sql_async_engine = FALSE;
+static int sql_async_flushing = FALSE;
+static int sql_async_flush_due = FALSE;
+static int sql_async_timer_id = -1;
+static const char *sql_async_server_ident = NULL;
+static unsigned int sql_async_max_records = SQL_ASYNC_DEFAULT_MAX_RECORDS;
+static int sql_async_interval = SQL_ASYNC_DEFAULT_INTERVAL;
+static const char *sql_async_spool_path = NULL;
+static int sql_async_spool_fd = -1;
+
+static struct {
+  unsigned long nqueued;
+  unsigned long nwritten;
+  unsigned long nbatches;
+  unsigned long nspooled;
+  unsigned long nreplayed;
+  unsigned long ndropped;
+  unsigned long nerrors;
+} sql_async_stats;
+
+static int sql_async_resolve(pool *p, cmd_rec *cmd, config_rec *c,
+    const char *conn_name, array_header *segments) {
+  pr_jot_ctx_t *jot_ctx;
+  struct sql_resolved *resolved;
+
+  jot_ctx = pcalloc(p, sizeof(pr_jot_ctx_t));
+  resolved = pcalloc(p, sizeof(struct sql_resolved));
+
+  /* In segment mode, nothing is written to the buffer. */
+  resolved->bufsz = resolved->buflen = SQL_MAX_STMT_LEN;
+  resolved->conn_name = conn_name;
+  resolved->segments = segments;
+
+  jot_ctx->log = resolved;
+  jot_ctx->user_data = cmd;
+
+  return pr_jot_resolve_logfmt(p, cmd, NULL, c->argv[1], jot_ctx,
+    sql_resolve_on_meta, sql_resolve_on_default, sql_resolve_on_other);
+}
+
+static const char *sql_async_get_server_ident(pool *p, server_rec *s) {
+  char buf[1024];
+
+  memset(buf, '\0', sizeof(buf));
+  pr_snprintf(buf, sizeof(buf)-1, "%s@%s:%u",
+    s->ServerName ? s->ServerName : "", s->ServerAddress, s->ServerPort);
+
+  return pstrdup(p, buf);
+}
+
+static struct sql_async_rec *sql_async_copy_rec(pool *p, array_header *queue,
+    const struct sql_async_rec *src) {
+  register unsigned int i;
+  struct sql_async_rec *rec;
+  struct sql_segment *segs;
+
+  rec = push_array(queue);
+  rec->server_ident = pstrdup(p, src->server_ident);
+  rec->query_name = pstrdup(p, src->query_name);
+  rec->nfailed = src->nfailed;
+  rec->segments = make_array(p, src->segments->nelts,
+    sizeof(struct sql_segment));
+
+  segs = src->segments->elts;
+  for (i = 0; i < src->segments->nelts; i++) {
+    struct sql_segment *seg;
+
+    seg = push_array(rec->segments);
+    seg->text = pstrndup(p, segs[i].text, segs[i].text_len);
+    seg->text_len = segs[i].text_len;
+    seg->is_value = segs[i].is_value;
+  }
+
+  return rec;
+}
+
+/* Spool file records are one per line: the vhost identity, the number of
+ * failed attempts, the query name, then each segment prefixed by 'S' (static
+ * text) or 'V' (value), separated by tabs, with backslash, tab, and newline
+ * characters escaped.
+ */
+static char *sql_async_spool_escape(pool *p, const char *text,
+    size_t text_len) {
+  register unsigned int i;
+  char *buf, *ptr;
+
+  buf = ptr = pcalloc(p, (text_len * 2) + 1);
+  for (i = 0; i < text_len; i++) {
+    switch (text[i]) {
+      case '\\':
+        *ptr++ = '\\';
+        *ptr++ = '\\';
+        break;
+
+      case '\t':
+        *ptr++ = '\\';
+        *ptr++ = 't';
+        break;
+
+      case '\n':
+        *ptr++ = '\\';
+        *ptr++ = 'n';
+        break;
+
+      default:
+        *ptr++ = text[i];
+    }
+  }
+
+  return buf;
+}
+
+static size_t sql_async_spool_unescape(char *text) {
+  char *src, *dst;
+
+  for (src = dst = text; *src; src++) {
+    if (*src == '\\' &&
+        *(src + 1) != '\0') {
+      src++;
+
+      switch (*src) {
+        case 't':
+          *dst++ = '\t';
+          break;
+
+        case 'n':
+          *dst++ = '\n';
+          break;
+
+        default:
+          *dst++ = *src;
+      }
+
+      continue;
+    }
+
+    *dst++ = *src;
+  }
+
+  *dst = '\0';
+  return dst - text;
+}
+
+static int sql_async_spool_lock(int lock_type) {
+  struct flock lock;
+
+  lock.l_type = lock_type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 0;
+
+  while (fcntl(sql_async_spool_fd, F_SETLKW, &lock) < 0) {
+    if (errno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Writes the given records to the spool file.  Returns the number of
+ * records spooled, or -1 if they could not be spooled.
+ */
+static int sql_async_spool(struct sql_async_rec *recs, unsigned int nrecs) {
+  register unsigned int i;
+  pool *tmp_pool;
+  char *buf = "";
+  size_t buflen;
+  int res, xerrno;
+
+  if (sql_async_spool_fd < 0 ||
+      nrecs == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(sql_async_pool);
+
+  for (i = 0; i < nrecs; i++) {
+    register unsigned int j;
+    struct sql_segment *segs;
+    char nfailed[32];
+
+    memset(nfailed, '\0', sizeof(nfailed));
+    pr_snprintf(nfailed, sizeof(nfailed)-1, "%u", recs[i].nfailed);
+
+    buf = pstrcat(tmp_pool, buf,
+      sql_async_spool_escape(tmp_pool, recs[i].server_ident,
+        strlen(recs[i].server_ident)), "\t", nfailed, "\t",
+      recs[i].query_name, NULL);
+
+    segs = recs[i].segments->elts;
+    for (j = 0; j < recs[i].segments->nelts; j++) {
+      buf = pstrcat(tmp_pool, buf, "\t", segs[j].is_value ? "V" : "S",
+        sql_async_spool_escape(tmp_pool, segs[j].text, segs[j].text_len),
+        NULL);
+    }
+
+    buf = pstrcat(tmp_pool, buf, "\n", NULL);
+  }
+
+  buflen = strlen(buf);
+
+  if (sql_async_spool_lock(F_WRLCK) < 0) {
+    xerrno = errno;
+    sql_log(DEBUG_WARN, "error locking SQLLogAsyncSpoolFile '%s': %s",
+      sql_async_spool_path, strerror(xerrno));
+    destroy_pool(tmp_pool);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  res = write(sql_async_spool_fd, buf, buflen);
+  xerrno = errno;
+
+  (void) sql_async_spool_lock(F_UNLCK);
+  destroy_pool(tmp_pool);
+
+  if (res < 0 ||
+      (size_t) res != buflen) {
+    sql_log(DEBUG_WARN, "error writing to SQLLogAsyncSpoolFile '%s': %s",
+      sql_async_spool_path, res < 0 ? strerror(xerrno) : "short write");
+    errno = xerrno;
+    return -1;
+  }
+
+  sql_async_stats.nspooled += nrecs;
+  pr_trace_msg(trace_channel, 12, "spooled %u SQLLog %s to '%s'", nrecs,
+    nrecs != 1 ? "records" : "record", sql_async_spool_path);
+  return (int) nrecs;
+}
+
+/* Reads, and removes, all of this vhost's records from the spool file,
+ * adding them to the given queue.  Records for other vhosts are left in the
+ * spool file, as their SQLNamedQuery definitions may differ from ours.
+ */
+static int sql_async_spool_load(pool *p, array_header *queue) {
+  register unsigned int i;
+  struct stat st;
+  pool *tmp_pool;
+  char *buf, *line, *next, *ident, *others;
+  array_header *lines;
+  ssize_t nread;
+  size_t buflen = 0, ident_len, others_len = 0;
+  unsigned int nrecs = 0;
+
+  if (sql_async_spool_fd < 0) {
+    return 0;
+  }
+
+  if (sql_async_spool_lock(F_WRLCK) < 0) {
+    sql_log(DEBUG_WARN, "error locking SQLLogAsyncSpoolFile '%s': %s",
+      sql_async_spool_path, strerror(errno));
+    return -1;
+  }
+
+  if (fstat(sql_async_spool_fd, &st) < 0 ||
+      st.st_size == 0) {
+    (void) sql_async_spool_lock(F_UNLCK);
+    return 0;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  buf = palloc(tmp_pool, st.st_size + 1);
+
+  if (lseek(sql_async_spool_fd, 0, SEEK_SET) < 0) {
+    (void) sql_async_spool_lock(F_UNLCK);
+    destroy_pool(tmp_pool);
+    return -1;
+  }
+
+  while (buflen < (size_t) st.st_size) {
+    nread = read(sql_async_spool_fd, buf + buflen, st.st_size - buflen);
+    if (nread < 0) {
+      if (errno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      sql_log(DEBUG_WARN, "error reading SQLLogAsyncSpoolFile '%s': %s",
+        sql_async_spool_path, strerror(errno));
+      (void) sql_async_spool_lock(F_UNLCK);
+      destroy_pool(tmp_pool);
+      return -1;
+    }
+
+    if (nread == 0) {
+      break;
+    }
+
+    buflen += nread;
+  }
+
+  buf[buflen] = '\0';
+
+  ident = sql_async_spool_escape(tmp_pool, sql_async_server_ident,
+    strlen(sql_async_server_ident));
+  ident_len = strlen(ident);
+
+  lines = make_array(tmp_pool, 8, sizeof(char *));
+  others = palloc(tmp_pool, buflen + 1);
+
+  for (line = buf; line != NULL && *line; line = next) {
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    if (strncmp(line, ident, ident_len) == 0 &&
+        line[ident_len] == '\t') {
+      *((char **) push_array(lines)) = line + ident_len + 1;
+
+    } else {
+      size_t line_len;
+
+      line_len = strlen(line);
+      memcpy(others + others_len, line, line_len);
+      others[others_len + line_len] = '\n';
+      others_len += line_len + 1;
+    }
+  }
+
+  /* Our records are ours now; any which we fail to write will be spooled
+   * again.
+   */
+  if (ftruncate(sql_async_spool_fd, 0) < 0) {
+    sql_log(DEBUG_WARN, "error truncating SQLLogAsyncSpoolFile '%s': %s",
+      sql_async_spool_path, strerror(errno));
+    (void) sql_async_spool_lock(F_UNLCK);
+    destroy_pool(tmp_pool);
+    return -1;
+  }
+
+  if (others_len > 0) {
+    nread = write(sql_async_spool_fd, others, others_len);
+    if (nread < 0 ||
+        (size_t) nread != others_len) {
+      sql_log(DEBUG_WARN, "error writing to SQLLogAsyncSpoolFile '%s': %s",
+        sql_async_spool_path, nread < 0 ? strerror(errno) : "short write");
+    }
+  }
+
+  (void) sql_async_spool_lock(F_UNLCK);
+
+  for (i = 0; i < lines->nelts; i++) {
+    char *field, *nfailed;
+    array_header *segments;
+    struct sql_async_rec rec;
+
+    line = ((char **) lines->elts)[i];
+
+    nfailed = pr_str_get_token(&line, "\t");
+    rec.query_name = pr_str_get_token(&line, "\t");
+    if (nfailed == NULL ||
+        rec.query_name == NULL ||
+        *rec.query_name == '\0') {
+      continue;
+    }
+
+    rec.server_ident = sql_async_server_ident;
+    rec.nfailed = (unsigned int) strtoul(nfailed, NULL, 10);
+
+    segments = make_array(tmp_pool, 8, sizeof(struct sql_segment));
+    while ((field = pr_str_get_token(&line, "\t")) != NULL) {
+      struct sql_segment *seg;
+
+      pr_signals_handle();
+
+      if (*field != 'S' &&
+          *field != 'V') {
+        continue;
+      }
+
+      seg = push_array(segments);
+      seg->is_value = (*field == 'V');
+      seg->text = field + 1;
+      seg->text_len = sql_async_spool_unescape(field + 1);
+    }
+
+    rec.segments = segments;
+    sql_async_copy_rec(p, queue, &rec);
+    nrecs++;
+  }
+
+  destroy_pool(tmp_pool);
+
+  if (nrecs > 0) {
+    sql_async_stats.nreplayed += nrecs;
+    pr_trace_msg(trace_channel, 12, "loaded %u SQLLog %s from '%s'", nrecs,
+      nrecs != 1 ? "records" : "record", sql_async_spool_path);
+  }
+
+  return (int) nrecs;
+}
+
+/* Builds the text of the record's query, escaping values as needed. */
+static char *sql_async_build_text(pool *p, struct sql_async_rec *rec,
+    const char *conn_name) {
+  char *stmt;
+  struct sql_resolved *resolved;
+
+  stmt = pcalloc(p, SQL_MAX_STMT_LEN+1);
+  resolved = pcalloc(p, sizeof(struct sql_resolved));
+  resolved->bufsz = resolved->buflen = SQL_MAX_STMT_LEN;
+  resolved->ptr = resolved->buf = stmt;
+  resolved->conn_name = conn_name;
+  resolved->conn_flags = SQL_LOG_FL_IGNORE_ERRORS;
+  resolved->segments = rec->segments;
+
+  if (sql_resolved_build_stmt(p, resolved, NULL) < 0) {
+    return NULL;
+  }
+
+  stmt[resolved->bufsz - resolved->buflen] = '\0';
+  return stmt;
+}
+
+/* Executes the given records, all for the same SQLNamedQuery, combining
+ * them into one INSERT if possible.  Returns 0 on success, -1 on failure.
+ */
+static int sql_async_exec(pool *p, config_rec *c, struct sql_async_rec *recs,
+    unsigned int nrecs) {
+  register unsigned int i;
+  char *conn_name, *query = NULL;
+  char *backend_cmd = NULL;
+  modret_t *mr;
+
+  conn_name = get_query_named_conn(c);
+
+  for (i = 0; i < nrecs; i++) {
+    char *text;
+
+    text = sql_async_build_text(p, &(recs[i]), conn_name);
+    if (text == NULL) {
+      return -1;
+    }
+
+    if (strcasecmp(c->argv[0], SQL_INSERT_C) == 0) {
+      if (query == NULL) {
+        query = pstrcat(p, "INTO ", c->argv[2], " VALUES (", text, ")", NULL);
+
+      } else {
+        query = pstrcat(p, query, ", (", text, ")", NULL);
+      }
+
+      backend_cmd = "sql_insert";
+
+    } else if (strcasecmp(c->argv[0], SQL_UPDATE_C) == 0) {
+      query = pstrcat(p, c->argv[2], " SET ", text, NULL);
+      backend_cmd = "sql_update";
+
+    } else {
+      query = text;
+      backend_cmd = "sql_query";
+    }
+  }
+
+  mr = sql_dispatch(sql_make_cmd(p, 2, conn_name, query), backend_cmd);
+  if (mr == NULL ||
+      MODRET_ISERROR(mr)) {
+    sql_log(DEBUG_WARN, "error writing %u queued '%s' SQLLog %s: %s", nrecs,
+      recs[0].query_name, nrecs != 1 ? "records" : "record",
+      mr != NULL && mr->mr_message ? mr->mr_message : "unknown error");
+    return -1;
+  }
+
+  sql_async_stats.nwritten += nrecs;
+  sql_async_stats.nbatches++;
+  return 0;
+}
+
+/* Checks that the connection can be opened (reconnecting, if necessary), to
+ * tell an unavailable database apart from one which rejected a record.
+ */
+static int sql_async_conn_ok(pool *p, char *conn_name) {
+  modret_t *mr;
+
+  mr = sql_dispatch(sql_make_cmd(p, 1, conn_name), "sql_open");
+  if (mr == NULL ||
+      MODRET_ISERROR(mr)) {
+    return FALSE;
+  }
+
+  (void) sql_dispatch(sql_make_cmd(p, 1, conn_name), "sql_close");
+  return TRUE;
+}
+
+static int sql_async_conn_unavailable(array_header *conns,
+    const char *conn_name) {
+  register unsigned int i;
+  char **names;
+
+  names = conns->elts;
+  for (i = 0; i < conns->nelts; i++) {
+    if (strcmp(names[i], conn_name) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Writes all queued (and spooled) records to the database.  Records which
+ * cannot be written, because the database is unavailable, are spooled, or
+ * kept in the queue; records which the database rejects are retried, up to
+ * SQL_ASYNC_MAX_RECORD_FAILURES times, then dropped.
+ */
+static int sql_async_flush(void) {
+  register unsigned int i;
+  pool *flush_pool, *tmp_pool;
+  array_header *queue, *pending, *unavailable_conns;
+  struct sql_async_rec *recs;
+  const char *server_ident;
+  unsigned int nkept = 0;
+
+  if (sql_async_engine == FALSE ||
+      sql_async_flushing == TRUE) {
+    return 0;
+  }
+
+  sql_async_flushing = TRUE;
+  sql_async_flush_due = FALSE;
+
+  /* Spooled records are older than those we have queued, so they go
+   * first.
+   */
+  flush_pool = make_sub_pool(session.pool);
+  pr_pool_tag(flush_pool, "SQLLogAsync flush pool");
+  queue = make_array(flush_pool, sql_async_queue->nelts + 1,
+    sizeof(struct sql_async_rec));
+  (void) sql_async_spool_load(flush_pool, queue);
+
+  recs = sql_async_queue->elts;
+  for (i = 0; i < sql_async_queue->nelts; i++) {
+    sql_async_copy_rec(flush_pool, queue, &(recs[i]));
+  }
+
+  /* Start a new queue, for any records which we fail to write. */
+  destroy_pool(sql_async_pool);
+  sql_async_pool = make_sub_pool(session.pool);
+  pr_pool_tag(sql_async_pool, "SQLLogAsync pool");
+  sql_async_queue = make_array(sql_async_pool, 32,
+    sizeof(struct sql_async_rec));
+
+  if (queue->nelts == 0) {
+    destroy_pool(flush_pool);
+    sql_async_flushing = FALSE;
+    return 0;
+  }
+
+  pr_trace_msg(trace_channel, 12, "flushing %u queued SQLLog %s",
+    queue->nelts, queue->nelts != 1 ? "records" : "record");
+
+  pending = make_array(flush_pool, 8, sizeof(struct sql_async_rec));
+  unavailable_conns = make_array(flush_pool, 1, sizeof(char *));
+  recs = queue->elts;
+
+  /* Only records for the current vhost can be written using its
+   * SQLNamedQuery definitions (a HOST command may have changed it).
+   */
+  server_ident = sql_async_get_server_ident(flush_pool, main_server);
+
+  i = 0;
+  while (i < queue->nelts) {
+    register unsigned int j;
+    config_rec *c;
+    char *conn_name;
+    unsigned int nrecs = 1;
+    int res;
+
+    pr_signals_handle();
+
+    if (strcmp(recs[i].server_ident, server_ident) != 0) {
+      *((struct sql_async_rec *) push_array(pending)) = recs[i];
+      i++;
+      continue;
+    }
+
+    c = find_config(main_server->conf, CONF_PARAM,
+      pstrcat(flush_pool, "SQLNamedQuery_", recs[i].query_name, NULL), FALSE);
+    if (c == NULL) {
+      sql_log(DEBUG_WARN, "dropping queued SQLLog record: no '%s' "
+        "SQLNamedQuery found", recs[i].query_name);
+      sql_async_stats.ndropped++;
+      i++;
+      continue;
+    }
+
+    /* Other connections may still be available, so only records for this
+     * one are held back.
+     */
+    conn_name = get_query_named_conn(c);
+    if (sql_async_conn_unavailable(unavailable_conns, conn_name) == TRUE) {
+      *((struct sql_async_rec *) push_array(pending)) = recs[i];
+      i++;
+      continue;
+    }
+
+    /* Batch together consecutive INSERTs for the same query. */
+    if (strcasecmp(c->argv[0], SQL_INSERT_C) == 0) {
+      while (i + nrecs < queue->nelts &&
+             nrecs < SQL_ASYNC_MAX_BATCH_RECORDS &&
+             strcmp(recs[i].query_name, recs[i + nrecs].query_name) == 0 &&
+             strcmp(recs[i + nrecs].server_ident, server_ident) == 0) {
+        nrecs++;
+      }
+    }
+
+    tmp_pool = make_sub_pool(flush_pool);
+    set_named_conn_backend(conn_name);
+
+    res = sql_async_exec(tmp_pool, c, &(recs[i]), nrecs);
+    if (res < 0) {
+      /* Try batched records individually, so that one bad record does not
+       * prevent the writing of the others.
+       */
+      for (j = 0; j < nrecs; j++) {
+        struct sql_async_rec *rec;
+
+        rec = &(recs[i + j]);
+
+        if (sql_async_conn_unavailable(unavailable_conns, conn_name) == TRUE) {
+          *((struct sql_async_rec *) push_array(pending)) = *rec;
+          continue;
+        }
+
+        if (nrecs > 1 &&
+            sql_async_exec(tmp_pool, c, rec, 1) == 0) {
+          continue;
+        }
+
+        /* Find out whether the database is unavailable (even if earlier
+         * records were written, it may since have gone away), or whether it
+         * rejected this record.
+         */
+        if (sql_async_conn_ok(tmp_pool, conn_name) == FALSE) {
+          *((char **) push_array(unavailable_conns)) = conn_name;
+          *((struct sql_async_rec *) push_array(pending)) = *rec;
+          continue;
+        }
+
+        rec->nfailed++;
+        if (rec->nfailed < SQL_ASYNC_MAX_RECORD_FAILURES) {
+          *((struct sql_async_rec *) push_array(pending)) = *rec;
+          continue;
+        }
 
-static int resolve_numeric_val(cmd_rec *cmd, const char *val) {
-  int idx = -1;
-  char *ptr = NULL;
+        sql_log(DEBUG_WARN, "dropping '%s' SQLLog record rejected by the "
+          "database %u times", rec->query_name, rec->nfailed);
+        sql_async_stats.nerrors++;
+      }
+    }
 
-  idx = strtol(val, &ptr, 10);
-  if (*ptr != '\0') {
-    return -1;
+    set_named_conn_backend(NULL);
+    destroy_pool(tmp_pool);
+    i += nrecs;
   }
 
-  if (idx < 0) {
-    return -1;
-  }
+  if (pending->nelts > 0) {
+    if (sql_async_spool(pending->elts, pending->nelts) < 0) {
+      /* Keep as many as we can in the queue, dropping the oldest. */
+      recs = pending->elts;
+      for (i = 0; i < pending->nelts; i++) {
+        if (pending->nelts - i > sql_async_max_records) {
+          sql_async_stats.ndropped++;
+          continue;
+        }
 
-  if ((cmd->argc - 3) < (unsigned int) idx) {
-    return -1;
+        sql_async_copy_rec(sql_async_pool, sql_async_queue, &(recs[i]));
+        nkept++;
+      }
+    }
   }
 
-  return idx;
-}
-
-static char *named_query_type(cmd_rec *cmd, char *name) {
-  config_rec *c = NULL;
-  char *query = NULL;
+  pr_trace_msg(trace_channel, 12, "flushed SQLLog queue: %lu written, "
+    "%lu batches, %lu spooled, %lu replayed, %lu dropped, %lu errors, "
+    "%u backlog", sql_async_stats.nwritten, sql_async_stats.nbatches,
+    sql_async_stats.nspooled, sql_async_stats.nreplayed,
+    sql_async_stats.ndropped, sql_async_stats.nerrors, nkept);
 
-  query = pstrcat(cmd->tmp_pool, "SQLNamedQuery_", name, NULL);
-  c = find_config(main_server->conf, CONF_PARAM, query, FALSE);
-  if (c != NULL) {
-    return c->argv[0];
-  }
+  destroy_pool(flush_pool);
+  sql_async_flushing = FALSE;
+  return 0;
+}
 
-  sql_log(DEBUG_FUNC, "no '%s' SQLNamedQuery found", name);
-  errno = ENOENT;
-  return NULL;
+/* Timers fire from pr_signals_handle(), which the backends may call while a
+ * query is in progress; the flush itself is left to the next logged command,
+ * or the end of the session.
+ */
+static int sql_async_timer_cb(CALLBACK_FRAME) {
+  sql_async_flush_due = TRUE;
+  return 1;
 }
 
-static modret_t *process_named_query(cmd_rec *cmd, char *name, int flags) {
+static int sql_async_enqueue(cmd_rec *cmd, const char *query_name) {
   config_rec *c;
-  char *conn_name, *query = NULL;
-  char stmt[SQL_MAX_STMT_LEN+1];
-  size_t stmt_len;
-  modret_t *mr = NULL;
-  int res;
   pool *tmp_pool;
-  pr_jot_ctx_t *jot_ctx;
-  struct sql_resolved *resolved;
-
-  sql_log(DEBUG_FUNC, ">>> process_named_query '%s'", name);
-
-  /* Check for a query by that name. */
-  query = pstrcat(cmd->tmp_pool, "SQLNamedQuery_", name, NULL);
+  array_header *segments;
+  struct sql_async_rec rec;
+  int res;
 
-  c = find_config(main_server->conf, CONF_PARAM, query, FALSE);
+  c = find_config(main_server->conf, CONF_PARAM,
+    pstrcat(cmd->tmp_pool, "SQLNamedQuery_", query_name, NULL), FALSE);
   if (c == NULL) {
-    mr = PR_ERROR(cmd);
-    sql_log(DEBUG_FUNC, "<<< process_named_query '%s'", name);
-    return mr;
+    errno = ENOENT;
+    return -1;
   }
 
-  conn_name = get_query_named_conn(c);
-  set_named_conn_backend(conn_name);
-
   tmp_pool = make_sub_pool(cmd->tmp_pool);
-  jot_ctx = pcalloc(tmp_pool, sizeof(pr_jot_ctx_t));
-  resolved = pcalloc(tmp_pool, sizeof(struct sql_resolved));
-  resolved->bufsz = resolved->buflen = sizeof(stmt)-1;
-  resolved->ptr = resolved->buf = stmt;
-  resolved->conn_name = conn_name;
-  resolved->conn_flags = flags;
-
-  jot_ctx->log = resolved;
-  jot_ctx->user_data = cmd;
+  segments = make_array(tmp_pool, 8, sizeof(struct sql_segment));
 
-  res = pr_jot_resolve_logfmt(tmp_pool, cmd, NULL, c->argv[1], jot_ctx,
-    sql_resolve_on_meta, sql_resolve_on_default, sql_resolve_on_other);
+  res = sql_async_resolve(tmp_pool, cmd, c, get_query_named_conn(c),
+    segments);
   if (res < 0) {
     int xerrno = errno;
 
     destroy_pool(tmp_pool);
-    set_named_conn_backend(NULL);
-
-    if (xerrno == EIO) {
-      return PR_ERROR_MSG(cmd, MOD_SQL_VERSION, "database error");
-    }
-
-    return PR_ERROR_MSG(cmd, MOD_SQL_VERSION,
-      "malformed reference %{?} in query");
+    errno = xerrno;
+    return -1;
   }
 
-  stmt_len = resolved->bufsz - resolved->buflen;
-  stmt[stmt_len] = '\0';
-
-  /* Construct our return data based on the type of query */
-  if (strcasecmp(c->argv[0], SQL_UPDATE_C) == 0) {
-    query = pstrcat(cmd->tmp_pool, c->argv[2], " SET ", stmt, NULL);
-    mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, query),
-      "sql_update");
-
-  } else if (strcasecmp(c->argv[0], SQL_INSERT_C) == 0) {
-    query = pstrcat(cmd->tmp_pool, "INTO ", c->argv[2], " VALUES (",
-      stmt, ")", NULL);
-    mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, query),
-      "sql_insert");
-
-  } else if (strcasecmp(c->argv[0], SQL_FREEFORM_C) == 0) {
-    mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, stmt),
-      "sql_query");
-
-  } else if (strcasecmp(c->argv[0], SQL_SELECT_C) == 0) {
-    mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 2, conn_name, stmt),
-      "sql_select");
-
-    if (MODRET_ISHANDLED(mr) &&
-        MODRET_HASDATA(mr) &&
-        pr_trace_get_level(trace_channel) >= 9) {
-      register unsigned long i, idx;
-      sql_data_t *sd;
-
-      sd = mr->data;
+  rec.server_ident = sql_async_server_ident;
+  rec.query_name = query_name;
+  rec.nfailed = 0;
+  rec.segments = segments;
 
-      pr_trace_msg(trace_channel, 9, "SQLNamedQuery %s results:", name);
-      pr_trace_msg(trace_channel, 9, "  row count: %lu", sd->rnum);
-      pr_trace_msg(trace_channel, 9, "  col count: %lu", sd->fnum);
+  if (sql_async_queue->nelts >= sql_async_max_records) {
+    (void) sql_async_flush();
+  }
 
-      for (i = 0, idx = 0; i < sd->rnum; i++) {
-        register unsigned long j;
+  if (sql_async_queue->nelts >= sql_async_max_records) {
+    /* Still no room; spool this record, or drop it. */
 
-        pr_trace_msg(trace_channel, 9, "    row #%lu:", i+1);
-        for (j = 0; j < sd->fnum; j++) {
-          pr_trace_msg(trace_channel, 9, "      col #%lu: '%s'", j+1,
-            sd->data[idx++]);
-        }
-      }
+    if (sql_async_spool(&rec, 1) < 0) {
+      sql_log(DEBUG_WARN, "SQLLog queue full (%u records), dropping '%s' "
+        "record", sql_async_max_records, query_name);
+      sql_async_stats.ndropped++;
     }
 
-  } else {
-    mr = PR_ERROR_MSG(cmd, MOD_SQL_VERSION, "unknown NamedQuery type");
+    destroy_pool(tmp_pool);
+    return 0;
   }
 
-  set_named_conn_backend(NULL);
+  sql_async_copy_rec(sql_async_pool, sql_async_queue, &rec);
+  sql_async_stats.nqueued++;
   destroy_pool(tmp_pool);
 
-  sql_log(DEBUG_FUNC, "<<< process_named_query '%s'", name);
-  return mr;
+  pr_trace_msg(trace_channel, 17, "queued '%s' SQLLog record (%u queued)",
+    query_name, sql_async_queue->nelts);
+  return 0;
 }
 
 MODRET process_sqllog(cmd_rec *cmd, config_rec *c, const char *label,
@@ -2897,6 +4846,21 @@ MODRET process_sqllog(cmd_rec *cmd, config_rec *c, const char *label,
     if (strcasecmp(query_type, SQL_UPDATE_C) == 0 ||
         strcasecmp(query_type, SQL_FREEFORM_C) == 0 ||
         strcasecmp(query_type, SQL_INSERT_C) == 0) {
+      /* Only queries whose failure would not end the session anyway can be
+       * queued; the others still run now, so that their errors can.
+       */
+      if (sql_async_engine == TRUE &&
+          ((flags & SQL_LOG_FL_IGNORE_ERRORS) ||
+           (pr_sql_opts & SQL_OPT_NO_DISCONNECT_ON_ERROR))) {
+        if (sql_async_enqueue(cmd, query_name) < 0) {
+          sql_log(DEBUG_WARN, "error queueing named query '%s': %s",
+            query_name, strerror(errno));
+        }
+
+        sql_log(DEBUG_FUNC, "<<< %s (%s)", label, c->name);
+        return NULL;
+      }
+
       mr = process_named_query(cmd, query_name, flags);
       if (check_response(mr, flags) < 0) {
         return mr;
@@ -2970,6 +4934,10 @@ MODRET log_master(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
+  if (sql_async_flush_due == TRUE) {
+    (void) sql_async_flush();
+  }
+
   /* Ignore EXIT commands (as from mod_log) here; we handle them differently
    * in the 'core.exit' event lister.
    */
@@ -3053,6 +5021,10 @@ MODRET err_master(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
+  if (sql_async_flush_due == TRUE) {
+    (void) sql_async_flush();
+  }
+
   /* handle explicit errors */
   name = pstrcat(cmd->tmp_pool, "SQLLog_ERR_", cmd->argv[0], NULL);
   
@@ -3643,35 +5615,23 @@ static int sql_keepalive_cb(CALLBACK_FRAME) {
 /* Auth Handlers.
  */
 
-MODRET sql_auth_setpwent(cmd_rec *cmd) {
+/* Loads the userset result set, which getpwent walks one row at a time.
+ * Returns NULL on success, else the error response.
+ */
+static modret_t *sql_load_passwd_set(cmd_rec *cmd) {
   sql_data_t *sd = NULL;
   modret_t *mr = NULL;
   char *where = NULL;
-  int i = 0;
-  unsigned long cnt = 0;
-
-  char *username = NULL;
-  char *password = NULL;
-  char *shell = NULL;
-  char *dir = NULL;
-  uid_t uid = 0;
-  gid_t gid = 0;
-  
-  struct passwd lpw;
 
-  if (!SQL_USERSET ||
-      !(cmap.engine & SQL_ENGINE_FL_AUTH)) {
-    return PR_DECLINED(cmd);
+  if (cmap.passwd_set_pool != NULL) {
+    destroy_pool(cmap.passwd_set_pool);
   }
 
-  sql_log(DEBUG_FUNC, "%s", ">>> cmd_setpwent");
-
-  /* if we've already filled the passwd cache, just reset the curr_passwd */
-  if (cmap.passwd_cache_filled) {
-    cmap.curr_passwd = passwd_name_cache->head;
-    sql_log(DEBUG_FUNC, "%s", "<<< cmd_setpwent");
-    return PR_DECLINED(cmd);
-  }
+  /* The result set outlives this command, so it gets its own pool. */
+  cmap.passwd_set_pool = make_sub_pool(sql_pool);
+  pr_pool_tag(cmap.passwd_set_pool, "SQL userset pool");
+  cmap.passwd_set = NULL;
+  cmap.passwd_set_row = 0;
 
   /* single select or not? */
   if (SQL_FASTUSERS) {
@@ -3680,8 +5640,9 @@ MODRET sql_auth_setpwent(cmd_rec *cmd) {
     if (!cmap.usercustomusersetfast) {
       where = sql_prepare_where(0, cmd, 1, cmap.userwhere, NULL);
 
-      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 4, MOD_SQL_DEF_CONN_NAME,
-        cmap.usrtable, cmap.usrfields, where), "sql_select");
+      mr = sql_dispatch(sql_make_cmd(cmap.passwd_set_pool, 4,
+        MOD_SQL_DEF_CONN_NAME, cmap.usrtable, cmap.usrfields, where),
+        "sql_select");
       if (check_response(mr, 0) < 0) {
         return mr;
       }
@@ -3689,100 +5650,23 @@ MODRET sql_auth_setpwent(cmd_rec *cmd) {
       sd = (sql_data_t *) mr->data;
 
     } else {
-      mr = sql_lookup(sql_make_cmd(cmd->tmp_pool, 2, MOD_SQL_DEF_CONN_NAME,
-        cmap.usercustomusersetfast));
+      mr = sql_lookup(sql_make_cmd(cmap.passwd_set_pool, 2,
+        MOD_SQL_DEF_CONN_NAME, cmap.usercustomusersetfast));
       if (check_response(mr, 0) < 0) {
         return mr;
       }
 
+      sd = pcalloc(cmap.passwd_set_pool, sizeof(sql_data_t));
+
       if (MODRET_HASDATA(mr)) {
         array_header *ah = (array_header *) mr->data;
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
 
         /* Assume the query returned 6 columns per row. */
         sd->fnum = 6;
         sd->rnum = ah->nelts / 6;
         sd->data = (char **) ah->elts;
-
-      } else {
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
-        sd->rnum = 0;
       }
     }
- 
-    /* Walk through the array, adding users to the cache */
-    if (sd != NULL) {
-      for (i = 0, cnt = 0; cnt < sd->rnum; cnt++) {
-        username = sd->data[i++];
-
-        /* if the username is NULL, skip it */
-        if (username == NULL)
-          continue;
-
-        password = sd->data[i++];
-
-        uid = cmap.defaultuid;
-        if (cmap.uidfield) {
-          if (sd->data[i]) {
-            if (pr_str2uid(sd->data[i++], &uid) < 0) {
-              uid = cmap.defaultuid;
-            }
-
-          } else {
-            i++;
-          }
-        }
-
-        gid = cmap.defaultgid;
-        if (cmap.gidfield) {
-          if (sd->data[i]) {
-            if (pr_str2gid(sd->data[i++], &gid) < 0) {
-              gid = cmap.defaultgid;
-            }
-
-          } else {
-            i++;
-          }
-        }
-
-        dir = cmap.defaulthomedir;
-        if (sd->data[i]) {
-          if (strncmp(sd->data[i], "", 2) == 0 ||
-              strncmp(sd->data[i], "NULL", 5) == 0) {
-            /* Leave dir pointing to the SQLDefaultHomedir, if any. */
-            i++;
-
-          } else {
-            dir = sd->data[i++];
-          }
-        }
-
-        if (cmap.shellfield) {
-          shell = sd->data[i++];
-
-        } else {
-          shell =  "";
-        }
-
-        if (uid < cmap.minuseruid) {
-          sql_log(DEBUG_INFO, "user UID %s below SQLMinUserUID %s, using "
-            "SQLDefaultUID %s", pr_uid2str(cmd->tmp_pool, uid),
-            pr_uid2str(cmd->tmp_pool, cmap.minuseruid),
-            pr_uid2str(cmd->tmp_pool, cmap.defaultuid));
-          uid = cmap.defaultuid;
-        }
-      
-        if (gid < cmap.minusergid) {
-          sql_log(DEBUG_INFO, "user GID %s below SQLMinUserGID %s, using "
-            "SQLDefaultGID %s", pr_gid2str(cmd->tmp_pool, gid),
-            pr_gid2str(cmd->tmp_pool, cmap.minusergid),
-            pr_gid2str(cmd->tmp_pool, cmap.defaultgid));
-          gid = cmap.defaultgid;
-        }
-
-        _sql_addpasswd(cmd, username, password, uid, gid, shell, dir);
-      } 
-    }
 
   } else {
     /* Retrieve our list of users */
@@ -3790,8 +5674,9 @@ MODRET sql_auth_setpwent(cmd_rec *cmd) {
     if (!cmap.usercustomuserset) {
       where = sql_prepare_where(0, cmd, 1, cmap.userwhere, NULL);
 
-      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 4, MOD_SQL_DEF_CONN_NAME,
-        cmap.usrtable, cmap.usrfield, where), "sql_select");
+      mr = sql_dispatch(sql_make_cmd(cmap.passwd_set_pool, 4,
+        MOD_SQL_DEF_CONN_NAME, cmap.usrtable, cmap.usrfield, where),
+        "sql_select");
       if (check_response(mr, 0) < 0) {
         return mr;
       }
@@ -3799,49 +5684,142 @@ MODRET sql_auth_setpwent(cmd_rec *cmd) {
       sd = (sql_data_t *) mr->data;
 
     } else {
-      mr = sql_lookup(sql_make_cmd(cmd->tmp_pool, 2, MOD_SQL_DEF_CONN_NAME,
-        cmap.usercustomuserset));
+      mr = sql_lookup(sql_make_cmd(cmap.passwd_set_pool, 2,
+        MOD_SQL_DEF_CONN_NAME, cmap.usercustomuserset));
       if (check_response(mr, 0) < 0) {
         return mr;
       }
 
-      if (MODRET_HASDATA(mr)) {
-        array_header *ah = (array_header *) mr->data;
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
+      sd = pcalloc(cmap.passwd_set_pool, sizeof(sql_data_t));
+
+      if (MODRET_HASDATA(mr)) {
+        array_header *ah = (array_header *) mr->data;
+
+        /* Assume the query only returned 1 column per row. */
+        sd->fnum = 1;
+        sd->rnum = ah->nelts;
+        sd->data = (char **) ah->elts;
+      }
+    }
+  }
+
+  if (sd == NULL) {
+    sd = pcalloc(cmap.passwd_set_pool, sizeof(sql_data_t));
+  }
+
+  sql_log(DEBUG_INFO, "loaded %lu %s for getpwent", sd->rnum,
+    sd->rnum != 1 ? "users" : "user");
+  cmap.passwd_set = sd;
+  return NULL;
+}
+
+/* Fills in the session's getpwent passwd from a usersetfast row; the
+ * strings point into the result set.
+ */
+static struct passwd *sql_passwd_from_row(cmd_rec *cmd, char **row,
+    unsigned long ncols) {
+  struct passwd *pwd;
+  unsigned long i = 0;
+  uid_t uid;
+  gid_t gid;
+
+  pwd = &(cmap.passwd_ent);
+  memset(pwd, 0, sizeof(struct passwd));
+
+  pwd->pw_name = row[i++];
+  pwd->pw_passwd = i < ncols ? row[i++] : NULL;
+
+  uid = cmap.defaultuid;
+  if (cmap.uidfield &&
+      i < ncols) {
+    if (row[i] == NULL ||
+        pr_str2uid(row[i], &uid) < 0) {
+      uid = cmap.defaultuid;
+    }
+
+    i++;
+  }
+
+  gid = cmap.defaultgid;
+  if (cmap.gidfield &&
+      i < ncols) {
+    if (row[i] == NULL ||
+        pr_str2gid(row[i], &gid) < 0) {
+      gid = cmap.defaultgid;
+    }
+
+    i++;
+  }
+
+  pwd->pw_dir = cmap.defaulthomedir;
+  if (i < ncols) {
+    if (row[i] != NULL &&
+        strcmp(row[i], "") != 0 &&
+        strcmp(row[i], "NULL") != 0) {
+      pwd->pw_dir = row[i];
+    }
+
+    i++;
+  }
+
+  pwd->pw_shell = "";
+  if (cmap.shellfield &&
+      i < ncols &&
+      row[i] != NULL) {
+    pwd->pw_shell = row[i];
+  }
+
+  if (uid < cmap.minuseruid) {
+    sql_log(DEBUG_INFO, "user UID %s below SQLMinUserUID %s, using "
+      "SQLDefaultUID %s", pr_uid2str(cmd->tmp_pool, uid),
+      pr_uid2str(cmd->tmp_pool, cmap.minuseruid),
+      pr_uid2str(cmd->tmp_pool, cmap.defaultuid));
+    uid = cmap.defaultuid;
+  }
+
+  if (gid < cmap.minusergid) {
+    sql_log(DEBUG_INFO, "user GID %s below SQLMinUserGID %s, using "
+      "SQLDefaultGID %s", pr_gid2str(cmd->tmp_pool, gid),
+      pr_gid2str(cmd->tmp_pool, cmap.minusergid),
+      pr_gid2str(cmd->tmp_pool, cmap.defaultgid));
+    gid = cmap.defaultgid;
+  }
+
+  pwd->pw_uid = uid;
+  pwd->pw_gid = gid;
+
+  return pwd;
+}
+
+MODRET sql_auth_setpwent(cmd_rec *cmd) {
+  modret_t *mr = NULL;
+
+  if (!SQL_USERSET ||
+      !(cmap.engine & SQL_ENGINE_FL_AUTH)) {
+    return PR_DECLINED(cmd);
+  }
+
+  sql_log(DEBUG_FUNC, "%s", ">>> cmd_setpwent");
 
-        /* Assume the query only returned 1 column per row. */
-        sd->fnum = 1;
-        sd->rnum = ah->nelts;
-        sd->data = (char **) ah->elts;
-      }
-    }
+  /* If we've already loaded the userset, just start over at its first row;
+   * otherwise, load it now.
+   */
+  if (cmap.passwd_set != NULL) {
+    cmap.passwd_set_row = 0;
 
-    if (sd != NULL) {
-      for (cnt = 0; cnt < sd->rnum; cnt++) {
-        username = sd->data[cnt];
-      
-        /* if the username is NULL for whatever reason, skip it */
-        if (username == NULL)
-          continue;
-      
-        /* otherwise, add it to the cache */
-        lpw.pw_uid = -1;
-        lpw.pw_name = username;
-        sql_getpasswd(cmd, &lpw);
-      }
+  } else {
+    mr = sql_load_passwd_set(cmd);
+    if (mr != NULL) {
+      return mr;
     }
   }
-  
-  cmap.passwd_cache_filled = 1;
-  cmap.curr_passwd = passwd_name_cache->head;
 
   sql_log(DEBUG_FUNC, "%s", "<<< cmd_setpwent");
   return PR_DECLINED(cmd);
 }
 
 MODRET sql_auth_getpwent(cmd_rec *cmd) {
-  struct passwd *pw;
-  modret_t *mr;
+  struct passwd *pw = NULL;
 
   if (!SQL_USERSET ||
       !(cmap.engine & SQL_ENGINE_FL_AUTH)) {
@@ -3850,29 +5828,59 @@ MODRET sql_auth_getpwent(cmd_rec *cmd) {
 
   sql_log(DEBUG_FUNC, "%s", ">>> cmd_getpwent");
 
-  /* make sure our passwd cache is complete  */
-  if (!cmap.passwd_cache_filled) {
-    mr = sql_auth_setpwent(cmd);
-    if (mr->data == NULL) {
-      /* something didn't work in the setpwent call */
+  /* make sure our userset is loaded */
+  if (cmap.passwd_set == NULL) {
+    if (sql_load_passwd_set(cmd) != NULL) {
+      /* something didn't work in loading the userset */
       sql_log(DEBUG_FUNC, "%s", "<<< cmd_getpwent");
       return PR_DECLINED(cmd);
     }
   }
 
-  if (cmap.curr_passwd != NULL) {
-    pw = (struct passwd *) cmap.curr_passwd->data;
-    cmap.curr_passwd = cmap.curr_passwd->list_next;
+  /* Rather than caching every user in the set, build each passwd as it is
+   * requested.
+   */
+  while (pw == NULL &&
+         cmap.passwd_set_row < cmap.passwd_set->rnum) {
+    sql_data_t *sd;
+    char **row;
 
-  } else {
-    pw = NULL;
+    pr_signals_handle();
+
+    sd = cmap.passwd_set;
+    row = &(sd->data[cmap.passwd_set_row * sd->fnum]);
+    cmap.passwd_set_row++;
+
+    /* if the username is NULL for whatever reason, skip it */
+    if (row[0] == NULL) {
+      continue;
+    }
+
+    if (SQL_FASTUSERS) {
+      pw = sql_passwd_from_row(cmd, row, sd->fnum);
+
+    } else {
+      struct passwd lpw;
+
+      lpw.pw_uid = -1;
+      lpw.pw_name = row[0];
+      pw = sql_getpasswd(cmd, &lpw);
+
+      /* Skip negatively cached users. */
+      if (pw != NULL &&
+          pw->pw_passwd == NULL &&
+          pw->pw_shell == NULL &&
+          pw->pw_dir == NULL) {
+        pw = NULL;
+      }
+    }
   }
 
   sql_log(DEBUG_FUNC, "%s", "<<< cmd_getpwent");
 
-  if (pw == NULL ||
-      pw->pw_uid == (uid_t) -1)
+  if (pw == NULL) {
     return PR_DECLINED(cmd);
+  }
 
   return mod_create_data(cmd, (void *) pw);
 }
@@ -3885,38 +5893,36 @@ MODRET sql_auth_endpwent(cmd_rec *cmd) {
 
   sql_log(DEBUG_FUNC, "%s", ">>> cmd_endpwent");
 
-  cmap.curr_passwd = NULL;
+  if (cmap.passwd_set_pool != NULL) {
+    destroy_pool(cmap.passwd_set_pool);
+    cmap.passwd_set_pool = NULL;
+  }
+
+  cmap.passwd_set = NULL;
+  cmap.passwd_set_row = 0;
 
   sql_log(DEBUG_FUNC, "%s", "<<< cmd_endpwent");
   return PR_DECLINED(cmd);
 }
 
-MODRET sql_auth_setgrent(cmd_rec *cmd) {
+/* Loads the groupset result set, which getgrent walks one row at a time.
+ * Returns NULL on success, else the error response.
+ */
+static modret_t *sql_load_group_set(cmd_rec *cmd) {
   modret_t *mr = NULL;
   sql_data_t *sd = NULL;
-  unsigned long cnt = 0;
-  struct group lgr;
-  gid_t gid;
-  char *groupname = NULL;
-  char *grp_mem = NULL;
+  array_header *ah = NULL;
   char *where = NULL;
-  array_header *ah =NULL;
-  char *iterator = NULL;
-  char *member = NULL;
 
-  if (!SQL_GROUPSET ||
-      !(cmap.engine & SQL_ENGINE_FL_AUTH)) {
-    return PR_DECLINED(cmd);
+  if (cmap.group_set_pool != NULL) {
+    destroy_pool(cmap.group_set_pool);
   }
 
-  sql_log(DEBUG_FUNC, "%s", ">>> cmd_setgrent");
-
-  /* if we've already filled the passwd group, just reset curr_group */
-  if (cmap.group_cache_filled) {
-    cmap.curr_group = group_name_cache->head;
-    sql_log(DEBUG_FUNC, "%s", "<<< cmd_setgrent");
-    return PR_DECLINED(cmd);
-  }
+  /* The result set outlives this command, so it gets its own pool. */
+  cmap.group_set_pool = make_sub_pool(sql_pool);
+  pr_pool_tag(cmap.group_set_pool, "SQL groupset pool");
+  cmap.group_set = NULL;
+  cmap.group_set_row = 0;
 
   if (SQL_FASTGROUPS) {
     /* retrieve our list of groups */
@@ -3924,8 +5930,9 @@ MODRET sql_auth_setgrent(cmd_rec *cmd) {
     if (!cmap.groupcustomgroupsetfast) {
       where = sql_prepare_where(0, cmd, 1, cmap.groupwhere, NULL);
 
-      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 5, MOD_SQL_DEF_CONN_NAME,
-        cmap.grptable, cmap.grpfields, where, "1"), "sql_select");
+      mr = sql_dispatch(sql_make_cmd(cmap.group_set_pool, 5,
+        MOD_SQL_DEF_CONN_NAME, cmap.grptable, cmap.grpfields, where, "1"),
+        "sql_select");
       if (check_response(mr, 0) < 0) {
         return mr;
       }
@@ -3933,51 +5940,22 @@ MODRET sql_auth_setgrent(cmd_rec *cmd) {
       sd = (sql_data_t *) mr->data;
    
     } else {
-      mr = sql_lookup(sql_make_cmd(cmd->tmp_pool, 2, MOD_SQL_DEF_CONN_NAME,
-        cmap.groupcustomgroupsetfast));
+      mr = sql_lookup(sql_make_cmd(cmap.group_set_pool, 2,
+        MOD_SQL_DEF_CONN_NAME, cmap.groupcustomgroupsetfast));
       if (check_response(mr, 0) < 0) {
         return mr;
       }
 
+      sd = pcalloc(cmap.group_set_pool, sizeof(sql_data_t));
+
       if (MODRET_HASDATA(mr)) {
         ah = mr->data;
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
 
         /* Assume the query returned 3 columns per row. */
         sd->fnum = 3;
         sd->rnum = ah->nelts / 3;
         sd->data = (char **) ah->elts;
-
-      } else {
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
-        sd->rnum = 0;
-      }
-    }
- 
-    /* for each group, fill our array header and call _sql_addgroup */
-
-    for (cnt = 0; cnt < sd->rnum; cnt ++) {
-      /* if the groupname is NULL for whatever reason, skip the row */
-      groupname = sd->data[cnt * 3];
-      if (groupname == NULL) {
-        continue;
-      }
-
-      gid = (gid_t) atol(sd->data[(cnt * 3) + 1]);
-      grp_mem = sd->data[(cnt * 3) + 2];
-      
-      ah = make_array(cmd->tmp_pool, 10, sizeof(char *));
-      iterator = grp_mem;
-
-      for (member = strsep(&iterator, " ,"); member; member = strsep(&iterator, " ,")) {
-	if (*member == '\0') {
-          continue;
-        }
-
-	*((char **) push_array(ah)) = member;
       }
-
-      _sql_addgroup(cmd, groupname, gid, ah);
     }
 
   } else {
@@ -3986,8 +5964,9 @@ MODRET sql_auth_setgrent(cmd_rec *cmd) {
     if (!cmap.groupcustomgroupset) {
       where = sql_prepare_where(0, cmd, 1, cmap.groupwhere, NULL);
  
-      mr = sql_dispatch(sql_make_cmd(cmd->tmp_pool, 6, MOD_SQL_DEF_CONN_NAME,
-        cmap.grptable, cmap.grpfield, where, NULL, "DISTINCT"), "sql_select");
+      mr = sql_dispatch(sql_make_cmd(cmap.group_set_pool, 6,
+        MOD_SQL_DEF_CONN_NAME, cmap.grptable, cmap.grpfield, where, NULL,
+        "DISTINCT"), "sql_select");
       if (check_response(mr, 0) < 0) {
         return mr;
       }
@@ -3995,52 +5974,64 @@ MODRET sql_auth_setgrent(cmd_rec *cmd) {
       sd = (sql_data_t *) mr->data;
 
     } else {
-      mr = sql_lookup(sql_make_cmd(cmd->tmp_pool, 2, MOD_SQL_DEF_CONN_NAME,
-        cmap.groupcustomgroupset));
+      mr = sql_lookup(sql_make_cmd(cmap.group_set_pool, 2,
+        MOD_SQL_DEF_CONN_NAME, cmap.groupcustomgroupset));
       if (check_response(mr, 0) < 0) {
         return mr;
       }
 
+      sd = pcalloc(cmap.group_set_pool, sizeof(sql_data_t));
+
       if (MODRET_HASDATA(mr)) {
         ah = mr->data;
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
 
         /* Assume the query only returned 1 column per row. */
         sd->fnum = 1;
         sd->rnum = ah->nelts;
         sd->data = (char **) ah->elts;
-
-      } else {
-        sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
-        sd->rnum = 0;
       }
     }
- 
-    for (cnt = 0; cnt < sd->rnum; cnt++) {
-      groupname = sd->data[cnt];
-      
-      /* if the groupname is NULL for whatever reason, skip it */
-      if (groupname == NULL)
-        continue;
-      
-      /* otherwise, add it to the cache */
-      lgr.gr_gid = -1;
-      lgr.gr_name = groupname;
-      
-      sql_getgroup(cmd, &lgr);
+  }
+
+  if (sd == NULL) {
+    sd = pcalloc(cmap.group_set_pool, sizeof(sql_data_t));
+  }
+
+  sql_log(DEBUG_INFO, "loaded %lu %s for getgrent", sd->rnum,
+    sd->rnum != 1 ? "groups" : "group");
+  cmap.group_set = sd;
+  return NULL;
+}
+
+MODRET sql_auth_setgrent(cmd_rec *cmd) {
+  modret_t *mr = NULL;
+
+  if (!SQL_GROUPSET ||
+      !(cmap.engine & SQL_ENGINE_FL_AUTH)) {
+    return PR_DECLINED(cmd);
+  }
+
+  sql_log(DEBUG_FUNC, "%s", ">>> cmd_setgrent");
+
+  /* If we've already loaded the groupset, just start over at its first row;
+   * otherwise, load it now.
+   */
+  if (cmap.group_set != NULL) {
+    cmap.group_set_row = 0;
+
+  } else {
+    mr = sql_load_group_set(cmd);
+    if (mr != NULL) {
+      return mr;
     }
   }
-  
-  cmap.group_cache_filled = 1;
-  cmap.curr_group = group_name_cache->head;
 
   sql_log(DEBUG_FUNC, "%s", "<<< cmd_setgrent");
   return PR_DECLINED(cmd);
 }
 
 MODRET sql_auth_getgrent(cmd_rec *cmd) {
-  struct group *gr;
-  modret_t *mr;
+  struct group *gr = NULL;
 
   if (!SQL_GROUPSET ||
       !(cmap.engine & SQL_ENGINE_FL_AUTH)) {
@@ -4049,28 +6040,83 @@ MODRET sql_auth_getgrent(cmd_rec *cmd) {
 
   sql_log(DEBUG_FUNC, "%s", ">>> cmd_getgrent");
 
-  /* make sure our group cache is complete  */
-  if (!cmap.group_cache_filled) {
-    mr = sql_auth_setgrent(cmd);
-    if (mr->data == NULL) {
-      /* something didn't work in the setgrent call */
+  /* make sure our groupset is loaded */
+  if (cmap.group_set == NULL) {
+    if (sql_load_group_set(cmd) != NULL) {
+      /* something didn't work in loading the groupset */
       sql_log(DEBUG_FUNC, "%s", "<<< cmd_getgrent");
       return PR_DECLINED(cmd);
     }
   }
 
-  if (cmap.curr_group != NULL) {
-    gr = (struct group *) cmap.curr_group->data;
-    cmap.curr_group = cmap.curr_group->list_next;
+  /* Rather than caching every group in the set, build each group as it is
+   * requested; the previous group's memory is reused.
+   */
+  if (cmap.group_ent_pool != NULL) {
+    destroy_pool(cmap.group_ent_pool);
+  }
 
-  } else {
-    gr = NULL;
+  cmap.group_ent_pool = make_sub_pool(sql_pool);
+  pr_pool_tag(cmap.group_ent_pool, "SQL getgrent pool");
+
+  while (gr == NULL &&
+         cmap.group_set_row < cmap.group_set->rnum) {
+    sql_data_t *sd;
+    char **row;
+
+    pr_signals_handle();
+
+    sd = cmap.group_set;
+    row = &(sd->data[cmap.group_set_row * sd->fnum]);
+    cmap.group_set_row++;
+
+    /* if the groupname is NULL for whatever reason, skip the row */
+    if (row[0] == NULL) {
+      continue;
+    }
+
+    if (SQL_FASTGROUPS) {
+      array_header *ah;
+      char *iterator, *member;
+
+      gr = pcalloc(cmap.group_ent_pool, sizeof(struct group));
+      gr->gr_name = row[0];
+      gr->gr_gid = row[1] ? (gid_t) atol(row[1]) : cmap.defaultgid;
+
+      /* Split a copy of the members, so that the row can be walked again. */
+      ah = make_array(cmap.group_ent_pool, 10, sizeof(char *));
+      iterator = row[2] ? pstrdup(cmap.group_ent_pool, row[2]) : NULL;
+
+      for (member = strsep(&iterator, " ,"); member;
+          member = strsep(&iterator, " ,")) {
+        if (*member == '\0') {
+          continue;
+        }
+
+        *((char **) push_array(ah)) = member;
+      }
+
+      *((char **) push_array(ah)) = NULL;
+      gr->gr_mem = (char **) ah->elts;
+
+    } else {
+      struct group lgr;
+
+      lgr.gr_gid = -1;
+      lgr.gr_name = row[0];
+      gr = sql_getgroup(cmd, &lgr);
+
+      /* Skip negatively cached groups. */
+      if (gr != NULL &&
+          gr->gr_mem == NULL) {
+        gr = NULL;
+      }
+    }
   }
 
   sql_log(DEBUG_FUNC, "%s", "<<< cmd_getgrent");
 
-  if (gr == NULL ||
-      gr->gr_gid == (gid_t) -1) {
+  if (gr == NULL) {
     return PR_DECLINED(cmd);
   }
 
@@ -4085,7 +6131,18 @@ MODRET sql_auth_endgrent(cmd_rec *cmd) {
 
   sql_log(DEBUG_FUNC, "%s", ">>> cmd_endgrent");
 
-  cmap.curr_group = NULL;
+  if (cmap.group_set_pool != NULL) {
+    destroy_pool(cmap.group_set_pool);
+    cmap.group_set_pool = NULL;
+  }
+
+  if (cmap.group_ent_pool != NULL) {
+    destroy_pool(cmap.group_ent_pool);
+    cmap.group_ent_pool = NULL;
+  }
+
+  cmap.group_set = NULL;
+  cmap.group_set_row = 0;
 
   sql_log(DEBUG_FUNC, "%s", "<<< cmd_endgrent");
   return PR_DECLINED(cmd);
@@ -4593,6 +6650,101 @@ MODRET set_sqlratiostats(cmd_rec * cmd)
   return PR_HANDLED(cmd);
 }
 
+/* usage: SQLAuthCache [ttl secs] [negative-ttl secs] [shared path]
+ *   [entries count]
+ */
+MODRET set_sqlauthcache(cmd_rec *cmd) {
+  register unsigned int i;
+  config_rec *c;
+  int ttl = -1, negative_ttl = -1;
+  const char *path = NULL;
+  unsigned int nentries = SQL_SHARED_CACHE_DEFAULT_ENTRIES;
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc < 3 ||
+      (cmd->argc - 1) % 2 != 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  for (i = 1; i < cmd->argc; i += 2) {
+    if (strcasecmp(cmd->argv[i], "ttl") == 0) {
+      ttl = atoi(cmd->argv[i+1]);
+      if (ttl < 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "ttl '",
+          (char *) cmd->argv[i+1], "' must be equal to or greater than zero",
+          NULL));
+      }
+
+    } else if (strcasecmp(cmd->argv[i], "negative-ttl") == 0) {
+      negative_ttl = atoi(cmd->argv[i+1]);
+      if (negative_ttl < 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "negative-ttl '",
+          (char *) cmd->argv[i+1], "' must be equal to or greater than zero",
+          NULL));
+      }
+
+    } else if (strcasecmp(cmd->argv[i], "shared") == 0) {
+      path = cmd->argv[i+1];
+      if (pr_fs_valid_path(path) < 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "'", path,
+          "' is not a valid path", NULL));
+      }
+
+    } else if (strcasecmp(cmd->argv[i], "entries") == 0) {
+      int count;
+
+      count = atoi(cmd->argv[i+1]);
+      if (count <= 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "entries count '",
+          (char *) cmd->argv[i+1], "' must be greater than zero", NULL));
+      }
+
+      nentries = count;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown SQLAuthCache parameter '",
+        (char *) cmd->argv[i], "'", NULL));
+    }
+  }
+
+  if (path != NULL) {
+    /* Shared entries outlive the sessions, and the daemon, which cached
+     * them; they must expire, so that changes to the database (e.g. changed
+     * passwords, deleted or added users) are seen.
+     */
+    if (ttl == 0 ||
+        negative_ttl == 0) {
+      CONF_ERROR(cmd, "shared cache requires a ttl greater than zero");
+    }
+
+    if (ttl < 0) {
+      ttl = SQL_SHARED_CACHE_DEFAULT_TTL;
+    }
+
+  } else if (ttl < 0) {
+    ttl = 0;
+  }
+
+  /* Unless configured otherwise, negative lookups are cached as long as
+   * positive ones.
+   */
+  if (negative_ttl < 0) {
+    negative_ttl = ttl;
+  }
+
+  c = add_config_param(cmd->argv[0], 4, NULL, NULL, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = ttl;
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = negative_ttl;
+  c->argv[2] = path ? pstrdup(c->pool, path) : NULL;
+  c->argv[3] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[3]) = nentries;
+
+  return PR_HANDLED(cmd);
+}
+
 MODRET set_sqlnegativecache(cmd_rec *cmd) {
   int bool = -1;
   config_rec *c = NULL;
@@ -4637,6 +6789,9 @@ MODRET set_sqloptions(cmd_rec *cmd) {
     } else if (strcasecmp(cmd->argv[i], "IgnoreConfigFile") == 0) {
       opts |= SQL_OPT_IGNORE_CONFIG_FILE;
 
+    } else if (strcasecmp(cmd->argv[i], "UsePreparedStatements") == 0) {
+      opts |= SQL_OPT_USE_PREPARED_STATEMENTS;
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown SQLOption '",
         cmd->argv[i], "'", NULL));
@@ -4899,6 +7054,76 @@ MODRET set_sqlkeepalive(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: SQLLogAsync on|off [records count] [interval secs] */
+MODRET set_sqllogasync(cmd_rec *cmd) {
+  register unsigned int i;
+  config_rec *c;
+  int engine, interval = SQL_ASYNC_DEFAULT_INTERVAL;
+  unsigned int max_records = SQL_ASYNC_DEFAULT_MAX_RECORDS;
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_GLOBAL|CONF_VIRTUAL);
+
+  if (cmd->argc < 2 ||
+      cmd->argc % 2 != 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  engine = get_boolean(cmd, 1);
+  if (engine == -1) {
+    CONF_ERROR(cmd, "expected Boolean parameter");
+  }
+
+  for (i = 2; i < cmd->argc; i += 2) {
+    if (strcasecmp(cmd->argv[i], "records") == 0) {
+      int count;
+
+      count = atoi(cmd->argv[i+1]);
+      if (count <= 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "records count '",
+          (char *) cmd->argv[i+1], "' must be greater than zero", NULL));
+      }
+
+      max_records = count;
+
+    } else if (strcasecmp(cmd->argv[i], "interval") == 0) {
+      interval = atoi(cmd->argv[i+1]);
+      if (interval < 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "interval '",
+          (char *) cmd->argv[i+1], "' must be equal to or greater than zero",
+          NULL));
+      }
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown SQLLogAsync parameter '",
+        (char *) cmd->argv[i], "'", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = engine;
+  c->argv[1] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = max_records;
+  c->argv[2] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[2]) = interval;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLLogAsyncSpoolFile path */
+MODRET set_sqllogasyncspoolfile(cmd_rec *cmd) {
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_GLOBAL|CONF_VIRTUAL);
+
+  if (pr_fs_valid_path(cmd->argv[1]) < 0) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "'", (char *) cmd->argv[1],
+      "' is not a valid path", NULL));
+  }
+
+  add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
+  return PR_HANDLED(cmd);
+}
+
 /* usage: SQLLog cmdlist query-name ["IGNORE_ERRORS"] */
 MODRET set_sqllog(cmd_rec *cmd) {
   config_rec *c;
@@ -5897,6 +8122,25 @@ static void sql_exit_ev(const void *event_data, void *user_data) {
     c = find_config_next(c, c->next, CONF_PARAM, "SQLLog_EXIT", FALSE);
   }
 
+  if (sql_async_engine == TRUE) {
+    (void) sql_async_flush();
+
+    if (sql_async_queue->nelts > 0) {
+      sql_log(DEBUG_WARN, "unable to write %u queued SQLLog %s at exit",
+        sql_async_queue->nelts,
+        sql_async_queue->nelts != 1 ? "records" : "record");
+      sql_async_stats.ndropped += sql_async_queue->nelts;
+    }
+
+    sql_log(DEBUG_INFO, "SQLLogAsync: %lu queued, %lu written in %lu %s, "
+      "%lu spooled, %lu replayed, %lu dropped, %lu errors",
+      sql_async_stats.nqueued, sql_async_stats.nwritten,
+      sql_async_stats.nbatches,
+      sql_async_stats.nbatches != 1 ? "batches" : "batch",
+      sql_async_stats.nspooled, sql_async_stats.nreplayed,
+      sql_async_stats.ndropped, sql_async_stats.nerrors);
+  }
+
   cmd = sql_make_cmd(session.pool, 0);
   mr = sql_dispatch(cmd, "sql_exit");
   (void) check_response(mr, SQL_LOG_FL_IGNORE_ERRORS);
@@ -5968,9 +8212,45 @@ static void sql_sess_reinit_ev(const void *event_data, void *user_data) {
   pr_event_unregister(&sql_module, "core.exit", sql_exit_ev);
   pr_event_unregister(&sql_module, "core.session-reinit", sql_sess_reinit_ev);
 
+  /* Write out anything queued using the old configuration. */
+  (void) sql_async_flush();
+
   pr_timer_remove(-1, &sql_module);
   sql_keepalive_timer_id = -1;
   sql_keepalive_stmt = NULL;
+  sql_async_timer_id = -1;
+
+  if (sql_async_pool != NULL) {
+    destroy_pool(sql_async_pool);
+    sql_async_pool = NULL;
+    sql_async_queue = NULL;
+  }
+
+  sql_async_engine = FALSE;
+  sql_async_flush_due = FALSE;
+  sql_async_server_ident = NULL;
+  sql_async_max_records = SQL_ASYNC_DEFAULT_MAX_RECORDS;
+  sql_async_interval = SQL_ASYNC_DEFAULT_INTERVAL;
+
+  if (sql_async_spool_fd >= 0) {
+    (void) close(sql_async_spool_fd);
+    sql_async_spool_fd = -1;
+    sql_async_spool_path = NULL;
+  }
+
+  sql_shared_cache_close();
+
+  if (cmap.passwd_set_pool != NULL) {
+    destroy_pool(cmap.passwd_set_pool);
+  }
+
+  if (cmap.group_set_pool != NULL) {
+    destroy_pool(cmap.group_set_pool);
+  }
+
+  if (cmap.group_ent_pool != NULL) {
+    destroy_pool(cmap.group_ent_pool);
+  }
 
   c = find_config(session.prev_server->conf, CONF_PARAM, "SQLLogOnEvent",
     FALSE);
@@ -6120,16 +8400,16 @@ static int sql_sess_init(void) {
     pr_pool_tag(sql_pool, MOD_SQL_VERSION);
   }
 
-  group_name_cache = make_cache(sql_pool, _group_name, _groupcmp);
-  passwd_name_cache = make_cache(sql_pool, _passwd_name, _passwdcmp);
-  group_gid_cache = make_cache(sql_pool, _group_gid, _groupcmp);
-  passwd_uid_cache = make_cache(sql_pool, _passwd_uid, _passwdcmp);
-
-  cmap.group_cache_filled = 0;
-  cmap.passwd_cache_filled = 0;
+  group_name_cache = make_cache(sql_pool, _group_name, _group_namecmp);
+  passwd_name_cache = make_cache(sql_pool, _passwd_name, _passwd_namecmp);
+  group_gid_cache = make_cache(sql_pool, _group_gid, _group_gidcmp);
+  passwd_uid_cache = make_cache(sql_pool, _passwd_uid, _passwd_uidcmp);
 
-  cmap.curr_group = NULL;
-  cmap.curr_passwd = NULL;
+  cmap.passwd_set_pool = NULL;
+  cmap.passwd_set = NULL;
+  cmap.group_set_pool = NULL;
+  cmap.group_set = NULL;
+  cmap.group_ent_pool = NULL;
 
   ptr = get_param_ptr(main_server->conf, "SQLAuthenticate", FALSE);
   if (ptr != NULL) {
@@ -6144,6 +8424,49 @@ static int sql_sess_init(void) {
     FALSE);
   cmap.negative_cache = negative_cache ? *negative_cache : FALSE;
 
+  c = find_config(main_server->conf, CONF_PARAM, "SQLAuthCache", FALSE);
+  if (c != NULL) {
+    cmap.cache_ttl = *((int *) c->argv[0]);
+    cmap.cache_negative_ttl = *((int *) c->argv[1]);
+
+    group_name_cache->ttl = group_gid_cache->ttl = cmap.cache_ttl;
+    passwd_name_cache->ttl = passwd_uid_cache->ttl = cmap.cache_ttl;
+    group_name_cache->negative_ttl = cmap.cache_negative_ttl;
+    group_gid_cache->negative_ttl = cmap.cache_negative_ttl;
+    passwd_name_cache->negative_ttl = cmap.cache_negative_ttl;
+    passwd_uid_cache->negative_ttl = cmap.cache_negative_ttl;
+
+    if (c->argv[2] != NULL) {
+      const char *path;
+      unsigned int nentries;
+      int xerrno;
+
+      path = c->argv[2];
+      nentries = *((unsigned int *) c->argv[3]);
+
+      /* Opened and mapped now, before any chroot or dropping of privileges,
+       * and kept for the session.
+       */
+      PRIVS_ROOT
+      res = sql_shared_cache_open(path, nentries,
+        sql_shared_cache_get_ident(tmp_pool));
+      xerrno = errno;
+      PRIVS_RELINQUISH
+
+      if (res < 0) {
+        sql_log(DEBUG_WARN, "unable to open shared SQLAuthCache '%s': %s",
+          path, strerror(xerrno));
+
+      } else {
+        sql_log(DEBUG_INFO, "using shared SQLAuthCache '%s' (%u entries)",
+          path, nentries);
+      }
+    }
+
+  } else {
+    cmap.cache_ttl = cmap.cache_negative_ttl = 0;
+  }
+
   cmap.defaulthomedir = get_param_ptr(main_server->conf, "SQLDefaultHomedir",
     FALSE);
 
@@ -6689,6 +9012,57 @@ static int sql_sess_init(void) {
       sql_keepalive_stmt, interval, interval != 1 ? "secs" : "sec");
   }
 
+  c = find_config(main_server->conf, CONF_PARAM, "SQLLogAsync", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) == TRUE &&
+      (cmap.engine & SQL_ENGINE_FL_LOG)) {
+    sql_async_engine = TRUE;
+    sql_async_max_records = *((unsigned int *) c->argv[1]);
+    sql_async_interval = *((int *) c->argv[2]);
+
+    sql_async_pool = make_sub_pool(session.pool);
+    pr_pool_tag(sql_async_pool, "SQLLogAsync pool");
+    sql_async_queue = make_array(sql_async_pool, 32,
+      sizeof(struct sql_async_rec));
+    sql_async_server_ident = sql_async_get_server_ident(session.pool,
+      main_server);
+    memset(&sql_async_stats, 0, sizeof(sql_async_stats));
+
+    sql_async_spool_path = get_param_ptr(main_server->conf,
+      "SQLLogAsyncSpoolFile", FALSE);
+    if (sql_async_spool_path != NULL) {
+      int flags = O_RDWR|O_CREAT|O_APPEND, xerrno;
+
+#if defined(O_NOFOLLOW)
+      flags |= O_NOFOLLOW;
+#endif /* O_NOFOLLOW */
+
+      /* Opened now, before any chroot, and kept open for the session. */
+      PRIVS_ROOT
+      sql_async_spool_fd = open(sql_async_spool_path, flags, 0600);
+      xerrno = errno;
+      PRIVS_RELINQUISH
+
+      if (sql_async_spool_fd < 0) {
+        sql_log(DEBUG_WARN, "unable to open SQLLogAsyncSpoolFile '%s': %s",
+          sql_async_spool_path, strerror(xerrno));
+        sql_async_spool_path = NULL;
+
+      } else {
+        (void) fcntl(sql_async_spool_fd, F_SETFD, FD_CLOEXEC);
+      }
+    }
+
+    if (sql_async_interval > 0) {
+      sql_async_timer_id = pr_timer_add(sql_async_interval, -1, &sql_module,
+        sql_async_timer_cb, "SQLLogAsync flush");
+    }
+
+    sql_log(DEBUG_INFO, "queueing SQLLog records (max %u), writing every "
+      "%d %s", sql_async_max_records, sql_async_interval,
+      sql_async_interval != 1 ? "secs" : "sec");
+  }
+
   return 0;
 }
 
@@ -6699,6 +9073,7 @@ static int sql_sess_init(void) {
  *****************************************************************/
 
 static conftable sql_conftab[] = {
+  { "SQLAuthCache",		set_sqlauthcache,		NULL },
   { "SQLAuthenticate",		set_sqlauthenticate,		NULL },
   { "SQLAuthTypes",		set_sqlauthtypes,		NULL },
   { "SQLBackend",		set_sqlbackend,			NULL },
@@ -6712,6 +9087,8 @@ static conftable sql_conftab[] = {
   { "SQLGroupWhereClause",	set_sqlgroupwhereclause,	NULL },
   { "SQLKeepAlive",		set_sqlkeepalive,		NULL },
   { "SQLLog",			set_sqllog,			NULL },
+  { "SQLLogAsync",		set_sqllogasync,		NULL },
+  { "SQLLogAsyncSpoolFile",	set_sqllogasyncspoolfile,	NULL },
   { "SQLLogFile",		set_sqllogfile,			NULL },
   { "SQLLogOnEvent",		set_sqllogonevent,		NULL },
   { "SQLMinID",			set_sqlminid,			NULL },
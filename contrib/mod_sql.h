@@ -83,6 +83,19 @@ typedef struct sql_data_struct sql_data_t;
  */
 #define MOD_SQL_API_V2 "mod_sql_api_v2"
 
+/* Prepared statements: a backend MAY implement a "sql_execute" command, used
+ *  when the UsePreparedStatements SQLOption is set.  Its inputs are:
+ *
+ *  cmd->argv[0]: connection name
+ *  cmd->argv[1]: statement name (the SQLNamedQuery name)
+ *  cmd->argv[2]: complete statement text, with '?' parameter placeholders
+ *  cmd->argv[3..]: parameter values, one per placeholder, as text
+ *
+ *  The backend should prepare the statement once per connection, cache it by
+ *  name (preparing it again if the text for that name changes), and return
+ *  the resulting rows, if any, as sql_data_t.
+ */
+
 /* SQLOption values */
 extern unsigned long pr_sql_opts;
 
@@ -90,6 +103,7 @@ extern unsigned long pr_sql_opts;
 #define SQL_OPT_USE_NORMALIZED_GROUP_SCHEMA     0x0002
 #define SQL_OPT_NO_RECONNECT                    0x0004
 #define SQL_OPT_IGNORE_CONFIG_FILE		0x0008
+#define SQL_OPT_USE_PREPARED_STATEMENTS		0x0010
 
 /* SQL connection policy */
 extern unsigned int pr_sql_conn_policy;
@@ -124,7 +124,7 @@
 /* Internal define used for debug and logging.  All backends are encouraged
  * to use the same format.
  */
-#define MOD_SQL_MYSQL_VERSION		"mod_sql_mysql/4.0.9"
+#define MOD_SQL_MYSQL_VERSION		"mod_sql_mysql/4.0.10"
 
 #define _MYSQL_PORT "3306"
 
@@ -176,10 +176,33 @@ struct db_conn_struct {
   const char *ssl_ciphers;
 
   MYSQL *mysql;
+
+  /* Prepared statements, cached by name for the life of the connection.
+   * A reconnect (which changes the thread ID) invalidates them.
+   */
+  pool *stmt_pool;
+  array_header *stmts;
+  unsigned long stmt_thread_id;
 };
 
 typedef struct db_conn_struct db_conn_t;
 
+#if MYSQL_VERSION_ID >= 80000
+typedef bool mysql_bool_t;
+#else
+typedef my_bool mysql_bool_t;
+#endif
+
+struct prepared_stmt {
+  const char *name;
+  const char *text;
+  MYSQL_STMT *stmt;
+
+  /* Execution statistics, for tracing. */
+  unsigned long nexecs;
+  uint64_t total_ms;
+};
+
 /*
  * This struct is a wrapper for whatever backend data is needed to access 
  * the database, and supports named connections, connection counting, and 
@@ -395,6 +418,330 @@ static modret_t *build_data(cmd_rec *cmd, db_conn_t *conn) {
   return mod_create_data(cmd, (void *) sd);
 }
 
+static void clear_prepared_stmts(db_conn_t *conn) {
+  register unsigned int i;
+
+  if (conn->stmts == NULL) {
+    return;
+  }
+
+  for (i = 0; i < conn->stmts->nelts; i++) {
+    struct prepared_stmt *ps;
+
+    ps = &(((struct prepared_stmt *) conn->stmts->elts)[i]);
+    if (ps->stmt != NULL) {
+      pr_trace_msg(trace_channel, 15,
+        "closing prepared statement '%s' (%lu %s)", ps->name, ps->nexecs,
+        ps->nexecs != 1 ? "executions" : "execution");
+      mysql_stmt_close(ps->stmt);
+      ps->stmt = NULL;
+    }
+  }
+
+  destroy_pool(conn->stmt_pool);
+  conn->stmt_pool = NULL;
+  conn->stmts = NULL;
+}
+
+static struct prepared_stmt *get_prepared_stmt(cmd_rec *cmd, db_conn_t *conn,
+    const char *name, const char *text, char **errstr) {
+  register unsigned int i;
+  struct prepared_stmt *ps = NULL;
+  unsigned long thread_id;
+
+  /* If the client library reconnected behind our backs, the server has
+   * discarded our statements.
+   */
+  thread_id = mysql_thread_id(conn->mysql);
+  if (conn->stmts != NULL &&
+      conn->stmt_thread_id != thread_id) {
+    pr_trace_msg(trace_channel, 15, "%s",
+      "connection thread ID changed, discarding prepared statements");
+    clear_prepared_stmts(conn);
+  }
+
+  if (conn->stmts == NULL) {
+    conn->stmt_pool = make_sub_pool(conn_pool);
+    pr_pool_tag(conn->stmt_pool, "MySQL prepared statements pool");
+
+    conn->stmts = make_array(conn->stmt_pool, 4,
+      sizeof(struct prepared_stmt));
+    conn->stmt_thread_id = thread_id;
+  }
+
+  for (i = 0; i < conn->stmts->nelts; i++) {
+    struct prepared_stmt *elt;
+
+    elt = &(((struct prepared_stmt *) conn->stmts->elts)[i]);
+    if (strcmp(elt->name, name) == 0) {
+      ps = elt;
+      break;
+    }
+  }
+
+  if (ps != NULL) {
+    if (ps->stmt != NULL &&
+        strcmp(ps->text, text) == 0) {
+      return ps;
+    }
+
+    /* The text for this name has changed (which should not happen, as only
+     * fully parameterized statements are prepared), or a previous attempt
+     * failed; prepare it again.
+     */
+    pr_trace_msg(trace_channel, 15, "preparing statement '%s' again", name);
+    if (ps->stmt != NULL) {
+      mysql_stmt_close(ps->stmt);
+      ps->stmt = NULL;
+    }
+
+  } else {
+    ps = push_array(conn->stmts);
+    ps->name = pstrdup(conn->stmt_pool, name);
+  }
+
+  ps->text = pstrdup(conn->stmt_pool, text);
+  ps->nexecs = 0;
+  ps->total_ms = 0;
+
+  ps->stmt = mysql_stmt_init(conn->mysql);
+  if (ps->stmt == NULL) {
+    *errstr = pstrdup(cmd->pool, mysql_error(conn->mysql));
+    sql_log(DEBUG_FUNC, "error allocating statement for '%s': %s", text,
+      *errstr);
+    return NULL;
+  }
+
+  if (mysql_stmt_prepare(ps->stmt, text, strlen(text)) != 0) {
+    *errstr = pstrdup(cmd->pool, mysql_stmt_error(ps->stmt));
+    sql_log(DEBUG_FUNC, "error preparing '%s': %s", text, *errstr);
+    mysql_stmt_close(ps->stmt);
+    ps->stmt = NULL;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 15, "prepared statement '%s': %s", name, text);
+  return ps;
+}
+
+/* Returns TRUE, with its value, if the text is an integer which fits in a
+ * long long.
+ */
+static int get_integer_param(const char *text, long long *val) {
+  const char *ptr = text;
+
+  if (*ptr == '-') {
+    ptr++;
+  }
+
+  if (*ptr == '\0') {
+    return FALSE;
+  }
+
+  for (; *ptr; ptr++) {
+    if (!PR_ISDIGIT(*ptr)) {
+      return FALSE;
+    }
+  }
+
+  errno = 0;
+  *val = strtoll(text, NULL, 10);
+  if (errno == ERANGE) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Executes the prepared statement, returning its result rows, if any, in
+ * the same form as build_data().
+ */
+static modret_t *exec_prepared_stmt(cmd_rec *cmd, db_conn_t *conn,
+    struct prepared_stmt *ps) {
+  register int i;
+  int nparams, res;
+  unsigned long nfields;
+  MYSQL_BIND *params = NULL, *results = NULL;
+  MYSQL_RES *metadata;
+  unsigned long *lengths;
+  long long *ints;
+  mysql_bool_t *nulls, update_max_len = 1;
+  sql_data_t *sd;
+  char **data;
+  unsigned long idx = 0;
+  uint64_t start_ms = 0, end_ms = 0;
+
+  nparams = cmd->argc - 3;
+  if ((unsigned long) nparams != mysql_stmt_param_count(ps->stmt)) {
+    return PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+      "wrong number of parameters for prepared statement");
+  }
+
+  if (nparams > 0) {
+    params = pcalloc(cmd->tmp_pool, sizeof(MYSQL_BIND) * nparams);
+    lengths = pcalloc(cmd->tmp_pool, sizeof(unsigned long) * nparams);
+    ints = pcalloc(cmd->tmp_pool, sizeof(long long) * nparams);
+
+    for (i = 0; i < nparams; i++) {
+      char *val;
+
+      val = cmd->argv[i+3];
+
+      /* Integers are bound as such, so that they can be used where only
+       * integers are allowed, e.g. LIMIT.
+       */
+      if (get_integer_param(val, &(ints[i])) == TRUE) {
+        params[i].buffer_type = MYSQL_TYPE_LONGLONG;
+        params[i].buffer = &(ints[i]);
+
+      } else {
+        lengths[i] = strlen(val);
+        params[i].buffer_type = MYSQL_TYPE_STRING;
+        params[i].buffer = val;
+        params[i].buffer_length = lengths[i];
+        params[i].length = &(lengths[i]);
+      }
+    }
+
+    if (mysql_stmt_bind_param(ps->stmt, params) != 0) {
+      return PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+        pstrdup(cmd->pool, mysql_stmt_error(ps->stmt)));
+    }
+  }
+
+  pr_gettimeofday_millis(&start_ms);
+
+  if (mysql_stmt_execute(ps->stmt) != 0) {
+    modret_t *mr;
+
+    mr = PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+      pstrdup(cmd->pool, mysql_stmt_error(ps->stmt)));
+
+    /* Prepare this statement again next time. */
+    mysql_stmt_close(ps->stmt);
+    ps->stmt = NULL;
+    return mr;
+  }
+
+  pr_gettimeofday_millis(&end_ms);
+  ps->nexecs++;
+  ps->total_ms += (end_ms - start_ms);
+
+  pr_trace_msg(trace_channel, 11,
+    "prepared statement '%s': execution #%lu took %lu ms (avg %0.3f ms)",
+    ps->name, ps->nexecs, (unsigned long) (end_ms - start_ms),
+    (double) ps->total_ms / ps->nexecs);
+
+  metadata = mysql_stmt_result_metadata(ps->stmt);
+  if (metadata == NULL) {
+    /* No result set, e.g. for INSERT/UPDATE. */
+    return PR_HANDLED(cmd);
+  }
+
+  /* Have the client library compute the longest value of each column, so
+   * that we can size our buffers.
+   */
+  mysql_stmt_attr_set(ps->stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_len);
+
+  if (mysql_stmt_store_result(ps->stmt) != 0) {
+    modret_t *mr;
+
+    mr = PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+      pstrdup(cmd->pool, mysql_stmt_error(ps->stmt)));
+    mysql_free_result(metadata);
+    mysql_stmt_free_result(ps->stmt);
+    return mr;
+  }
+
+  nfields = mysql_num_fields(metadata);
+  results = pcalloc(cmd->tmp_pool, sizeof(MYSQL_BIND) * nfields);
+  lengths = pcalloc(cmd->tmp_pool, sizeof(unsigned long) * nfields);
+  nulls = pcalloc(cmd->tmp_pool, sizeof(mysql_bool_t) * nfields);
+
+  for (i = 0; i < (int) nfields; i++) {
+    MYSQL_FIELD *field;
+
+    field = mysql_fetch_field_direct(metadata, i);
+
+    results[i].buffer_type = MYSQL_TYPE_STRING;
+    results[i].buffer_length = field->max_length + 1;
+    results[i].buffer = pcalloc(cmd->tmp_pool, results[i].buffer_length);
+    results[i].length = &(lengths[i]);
+    results[i].is_null = &(nulls[i]);
+  }
+
+  mysql_free_result(metadata);
+
+  if (mysql_stmt_bind_result(ps->stmt, results) != 0) {
+    modret_t *mr;
+
+    mr = PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+      pstrdup(cmd->pool, mysql_stmt_error(ps->stmt)));
+    mysql_stmt_free_result(ps->stmt);
+    return mr;
+  }
+
+  sd = pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
+  sd->rnum = (unsigned long) mysql_stmt_num_rows(ps->stmt);
+  sd->fnum = nfields;
+
+  data = pcalloc(cmd->tmp_pool, sizeof(char *) * ((sd->rnum * nfields) + 1));
+
+  while ((res = mysql_stmt_fetch(ps->stmt)) == 0 ||
+         res == MYSQL_DATA_TRUNCATED) {
+    if (idx + nfields > sd->rnum * nfields) {
+      break;
+    }
+
+    for (i = 0; i < (int) nfields; i++) {
+      if (nulls[i]) {
+        data[idx++] = NULL;
+        continue;
+      }
+
+      if (lengths[i] >= results[i].buffer_length) {
+        MYSQL_BIND col;
+
+        /* Longer than the client library predicted; fetch it whole. */
+        memset(&col, 0, sizeof(col));
+        col.buffer_type = MYSQL_TYPE_STRING;
+        col.buffer_length = lengths[i] + 1;
+        col.buffer = pcalloc(cmd->tmp_pool, col.buffer_length);
+
+        if (mysql_stmt_fetch_column(ps->stmt, &col, i, 0) != 0) {
+          modret_t *mr;
+
+          mr = PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+            pstrdup(cmd->pool, mysql_stmt_error(ps->stmt)));
+          mysql_stmt_free_result(ps->stmt);
+          return mr;
+        }
+
+        data[idx++] = pstrndup(cmd->tmp_pool, col.buffer, lengths[i]);
+        continue;
+      }
+
+      data[idx++] = pstrndup(cmd->tmp_pool, results[i].buffer, lengths[i]);
+    }
+  }
+
+  if (res == 1) {
+    modret_t *mr;
+
+    mr = PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+      pstrdup(cmd->pool, mysql_stmt_error(ps->stmt)));
+    mysql_stmt_free_result(ps->stmt);
+    return mr;
+  }
+
+  mysql_stmt_free_result(ps->stmt);
+
+  data[idx] = NULL;
+  sd->data = data;
+
+  return mod_create_data(cmd, (void *) sd);
+}
+
 /*
  * cmd_open: attempts to open a named connection to the database.
  *
@@ -765,6 +1112,7 @@ MODRET cmd_close(cmd_rec *cmd) {
    */
   if (((--entry->connections) == 0) || ((cmd->argc == 2) && (cmd->argv[1]))) {
     if (conn->mysql != NULL) {
+      clear_prepared_stmts(conn);
       mysql_close(conn->mysql);
       conn->mysql = NULL;
     }
@@ -1526,6 +1874,85 @@ MODRET cmd_query(cmd_rec *cmd) {
   return dmr;
 }
 
+/*
+ * cmd_execute: executes a named statement, preparing it first if this
+ *  connection has not already done so.
+ *
+ * Inputs:
+ *  cmd->argv[0]: connection name
+ *  cmd->argv[1]: statement name
+ *  cmd->argv[2]: statement text, using '?' for parameters
+ *  cmd->argv[3..]: parameter values
+ *
+ * Returns:
+ *  either a properly filled error modret_t if the statement failed in
+ *  some way, or a modret_t with the result data, as for cmd_query.
+ *
+ * Notes:
+ *  prepared statements live as long as the server connection; they are
+ *  discarded when the connection is closed or reconnected.
+ */
+MODRET cmd_execute(cmd_rec *cmd) {
+  conn_entry_t *entry = NULL;
+  db_conn_t *conn = NULL;
+  modret_t *cmr = NULL;
+  modret_t *dmr = NULL;
+  struct prepared_stmt *ps;
+  char *errstr = NULL;
+  cmd_rec *close_cmd;
+
+  sql_log(DEBUG_FUNC, "%s", "entering \tmysql cmd_execute");
+
+  sql_check_cmd(cmd, "cmd_execute");
+
+  if (cmd->argc < 3) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tmysql cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION, "badly formed request");
+  }
+
+  entry = sql_get_connection(cmd->argv[0]);
+  if (entry == NULL) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tmysql cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION,
+      pstrcat(cmd->tmp_pool, "unknown named connection: ", cmd->argv[0], NULL));
+  }
+
+  conn = (db_conn_t *) entry->data;
+
+  cmr = cmd_open(cmd);
+  if (MODRET_ERROR(cmr)) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tmysql cmd_execute");
+    return cmr;
+  }
+
+  /* Log the query string */
+  sql_log(DEBUG_INFO, "query \"%s\" (prepared statement '%s', %d %s)",
+    (char *) cmd->argv[2], (char *) cmd->argv[1], cmd->argc - 3,
+    cmd->argc - 3 != 1 ? "parameters" : "parameter");
+
+  ps = get_prepared_stmt(cmd, conn, cmd->argv[1], cmd->argv[2], &errstr);
+  if (ps == NULL) {
+    dmr = PR_ERROR_MSG(cmd, MOD_SQL_MYSQL_VERSION, errstr);
+
+    close_cmd = sql_make_cmd(cmd->tmp_pool, 1, entry->name);
+    cmd_close(close_cmd);
+    SQL_FREE_CMD(close_cmd);
+
+    sql_log(DEBUG_FUNC, "%s", "exiting \tmysql cmd_execute");
+    return dmr;
+  }
+
+  dmr = exec_prepared_stmt(cmd, conn, ps);
+
+  /* close the connection, return the data. */
+  close_cmd = sql_make_cmd(cmd->tmp_pool, 1, entry->name);
+  cmd_close(close_cmd);
+  SQL_FREE_CMD(close_cmd);
+
+  sql_log(DEBUG_FUNC, "%s", "exiting \tmysql cmd_execute");
+  return dmr;
+}
+
 /*
  * cmd_escapestring: certain strings sent to a database should be properly
  *  escaped -- for instance, quotes need to be escaped to insure that 
@@ -1916,6 +2343,7 @@ static cmdtable sql_mysql_cmdtable[] = {
   { CMD, "sql_cleanup",          G_NONE, cmd_cleanup,          FALSE, FALSE },
   { CMD, "sql_defineconnection", G_NONE, cmd_defineconnection, FALSE, FALSE },
   { CMD, "sql_escapestring",     G_NONE, cmd_escapestring,     FALSE, FALSE },
+  { CMD, "sql_execute",          G_NONE, cmd_execute,          FALSE, FALSE },
   { CMD, "sql_exit",             G_NONE, cmd_exit,             FALSE, FALSE },
   { CMD, "sql_identify",         G_NONE, cmd_identify,         FALSE, FALSE },
   { CMD, "sql_insert",           G_NONE, cmd_insert,           FALSE, FALSE },
@@ -29,7 +29,7 @@
 /* Internal define used for debug and logging.  All backends are encouraged
  * to use the same format.
  */
-#define MOD_SQL_POSTGRES_VERSION	"mod_sql_postgres/4.0.4"
+#define MOD_SQL_POSTGRES_VERSION	"mod_sql_postgres/4.0.5"
 
 #define _POSTGRES_PORT "5432"
 
@@ -97,10 +97,28 @@ struct db_conn_struct {
 
   PGconn *postgres;
   PGresult *result;
+
+  /* Prepared statements, cached by name for the life of the connection. */
+  pool *stmt_pool;
+  array_header *stmts;
+  unsigned int stmt_count;
 };
 
 typedef struct db_conn_struct db_conn_t;
 
+struct prepared_stmt {
+  const char *name;
+  const char *text;
+
+  /* The server-side name of the statement. */
+  const char *server_name;
+  int nparams;
+
+  /* Execution statistics, for tracing. */
+  unsigned long nexecs;
+  uint64_t total_ms;
+};
+
 /* This struct is a wrapper for whatever backend data is needed to access
  * the database, and supports named connections, connection counting, and 
  * timer handling.  
@@ -274,6 +292,160 @@ static modret_t *build_data(cmd_rec *cmd, db_conn_t *conn) {
   return mod_create_data(cmd, (void *) sd);
 }
 
+/* Prepared statements are scoped to the server session, so once the session
+ * is gone (closed or reset), so are our statements.
+ */
+static void clear_prepared_stmts(db_conn_t *conn) {
+  if (conn->stmts == NULL) {
+    return;
+  }
+
+  if (pr_trace_get_level(trace_channel) >= 15) {
+    register unsigned int i;
+
+    for (i = 0; i < conn->stmts->nelts; i++) {
+      struct prepared_stmt *ps;
+
+      ps = &(((struct prepared_stmt *) conn->stmts->elts)[i]);
+      pr_trace_msg(trace_channel, 15,
+        "discarding prepared statement '%s' (%lu %s)", ps->name, ps->nexecs,
+        ps->nexecs != 1 ? "executions" : "execution");
+    }
+  }
+
+  destroy_pool(conn->stmt_pool);
+  conn->stmt_pool = NULL;
+  conn->stmts = NULL;
+}
+
+/* Postgres uses $1, $2, etc for its parameters, rather than '?'. */
+static char *get_postgres_stmt_text(pool *p, const char *text, int *nparams) {
+  const char *ptr;
+  char *buf, *bufp;
+  int count = 0, in_quote = FALSE, in_escape_quote = FALSE;
+
+  /* Each '?' becomes at most "$" plus 10 digits. */
+  buf = bufp = pcalloc(p, (strlen(text) * 11) + 1);
+
+  for (ptr = text; *ptr; ptr++) {
+    if (in_quote == TRUE &&
+        in_escape_quote == TRUE &&
+        *ptr == '\\' &&
+        *(ptr+1) != '\0') {
+      /* Backslash escapes (e.g. \') in E'...' strings. */
+      *bufp++ = *ptr++;
+
+    } else if (*ptr == '\'') {
+      /* A doubled quote continues the same literal. */
+      if (in_quote == FALSE &&
+          (ptr == text || *(ptr-1) != '\'')) {
+        in_escape_quote = (ptr > text &&
+          (*(ptr-1) == 'E' || *(ptr-1) == 'e') &&
+          (ptr-1 == text ||
+           !(PR_ISALNUM(*(ptr-2)) || *(ptr-2) == '_')));
+      }
+
+      in_quote = !in_quote;
+
+    } else if (*ptr == '?' &&
+               in_quote == FALSE) {
+      bufp += sprintf(bufp, "$%d", ++count);
+      continue;
+    }
+
+    *bufp++ = *ptr;
+  }
+
+  *nparams = count;
+  return buf;
+}
+
+static struct prepared_stmt *get_prepared_stmt(cmd_rec *cmd, db_conn_t *conn,
+    const char *name, const char *text) {
+  register unsigned int i;
+  struct prepared_stmt *ps = NULL;
+  PGresult *res;
+  char server_name[64], *pg_text;
+  int nparams = 0;
+
+  if (conn->stmts == NULL) {
+    conn->stmt_pool = make_sub_pool(conn_pool);
+    pr_pool_tag(conn->stmt_pool, "Postgres prepared statements pool");
+
+    conn->stmts = make_array(conn->stmt_pool, 4,
+      sizeof(struct prepared_stmt));
+  }
+
+  for (i = 0; i < conn->stmts->nelts; i++) {
+    struct prepared_stmt *elt;
+
+    elt = &(((struct prepared_stmt *) conn->stmts->elts)[i]);
+    if (strcmp(elt->name, name) == 0) {
+      ps = elt;
+      break;
+    }
+  }
+
+  if (ps != NULL) {
+    if (strcmp(ps->text, text) == 0) {
+      return ps;
+    }
+
+    /* Only fully parameterized statements are prepared, so the text for a
+     * name should not change; should it do so anyway, prepare it again,
+     * under a new server-side name.
+     */
+    pr_trace_msg(trace_channel, 15,
+      "text for prepared statement '%s' changed, preparing again", name);
+
+    if (ps->server_name != NULL) {
+      res = PQexec(conn->postgres, pstrcat(cmd->tmp_pool, "DEALLOCATE ",
+        ps->server_name, NULL));
+      if (res != NULL) {
+        PQclear(res);
+      }
+    }
+
+  } else {
+    ps = push_array(conn->stmts);
+    ps->name = pstrdup(conn->stmt_pool, name);
+  }
+
+  ps->text = "";
+  ps->server_name = NULL;
+  ps->nexecs = 0;
+  ps->total_ms = 0;
+
+  pr_snprintf(server_name, sizeof(server_name)-1, "proftpd_stmt_%u",
+    ++conn->stmt_count);
+  server_name[sizeof(server_name)-1] = '\0';
+
+  pg_text = get_postgres_stmt_text(cmd->tmp_pool, text, &nparams);
+
+  res = PQprepare(conn->postgres, server_name, pg_text, 0, NULL);
+  if (res == NULL ||
+      PQresultStatus(res) != PGRES_COMMAND_OK) {
+    sql_log(DEBUG_FUNC, "error preparing '%s': %s", pg_text,
+      PQerrorMessage(conn->postgres));
+
+    if (res != NULL) {
+      PQclear(res);
+    }
+
+    return NULL;
+  }
+
+  PQclear(res);
+
+  ps->text = pstrdup(conn->stmt_pool, text);
+  ps->server_name = pstrdup(conn->stmt_pool, server_name);
+  ps->nparams = nparams;
+
+  pr_trace_msg(trace_channel, 15, "prepared statement '%s' as '%s': %s", name,
+    server_name, pg_text);
+  return ps;
+}
+
 #ifdef PR_USE_NLS
 static const char *get_postgres_encoding(const char *encoding) {
 
@@ -419,6 +591,7 @@ MODRET cmd_open(cmd_rec *cmd) {
        */
       if (!(pr_sql_opts & SQL_OPT_NO_RECONNECT)) {
         PQreset(conn->postgres);
+        clear_prepared_stmts(conn);
 
         if (PQstatus(conn->postgres) == CONNECTION_OK) {
           entry->connections++;
@@ -632,6 +805,7 @@ MODRET cmd_close(cmd_rec *cmd) {
       PQfinish(conn->postgres);
       conn->postgres = NULL;
     }
+    clear_prepared_stmts(conn);
     entry->connections = 0;
 
     if (entry->timer) {
@@ -1406,6 +1580,144 @@ MODRET cmd_query(cmd_rec *cmd) {
   return dmr;
 }
 
+/*
+ * cmd_execute: executes a named statement, preparing it first if this
+ *  connection has not already done so.
+ *
+ * Inputs:
+ *  cmd->argv[0]: connection name
+ *  cmd->argv[1]: statement name
+ *  cmd->argv[2]: statement text, using '?' for parameters
+ *  cmd->argv[3..]: parameter values
+ *
+ * Returns:
+ *  either a properly filled error modret_t if the statement failed in
+ *  some way, or a modret_t with the result data, as for cmd_query.
+ *
+ * Notes:
+ *  prepared statements live as long as the server session; they are
+ *  discarded when the connection is closed or reset.
+ */
+MODRET cmd_execute(cmd_rec *cmd) {
+  conn_entry_t *entry = NULL;
+  db_conn_t *conn = NULL;
+  modret_t *cmr = NULL;
+  modret_t *dmr = NULL;
+  struct prepared_stmt *ps;
+  const char **params = NULL;
+  int nparams;
+  uint64_t start_ms = 0, end_ms = 0;
+  cmd_rec *close_cmd;
+
+  sql_log(DEBUG_FUNC, "%s", "entering \tpostgres cmd_execute");
+
+  sql_check_cmd(cmd, "cmd_execute");
+
+  if (cmd->argc < 3) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_POSTGRES_VERSION, "badly formed request");
+  }
+
+  entry = sql_get_connection(cmd->argv[0]);
+  if (entry == NULL) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_POSTGRES_VERSION,
+      pstrcat(cmd->tmp_pool, "unknown named connection: ", cmd->argv[0], NULL));
+  }
+
+  conn = (db_conn_t *) entry->data;
+
+  cmr = cmd_open(cmd);
+  if (MODRET_ERROR(cmr)) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+    return cmr;
+  }
+
+  sql_log(DEBUG_INFO, "query \"%s\" (prepared statement '%s', %d %s)",
+    (char *) cmd->argv[2], (char *) cmd->argv[1], cmd->argc - 3,
+    cmd->argc - 3 != 1 ? "parameters" : "parameter");
+
+  ps = get_prepared_stmt(cmd, conn, cmd->argv[1], cmd->argv[2]);
+  if (ps == NULL) {
+    dmr = build_error(cmd, conn);
+
+    close_cmd = sql_make_cmd(cmd->tmp_pool, 1, entry->name);
+    cmd_close(close_cmd);
+    SQL_FREE_CMD(close_cmd);
+
+    sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+    return dmr;
+  }
+
+  nparams = cmd->argc - 3;
+  if (nparams != ps->nparams) {
+    close_cmd = sql_make_cmd(cmd->tmp_pool, 1, entry->name);
+    cmd_close(close_cmd);
+    SQL_FREE_CMD(close_cmd);
+
+    sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_POSTGRES_VERSION,
+      "wrong number of parameters for prepared statement");
+  }
+
+  if (nparams > 0) {
+    register int i;
+
+    params = pcalloc(cmd->tmp_pool, sizeof(char *) * nparams);
+    for (i = 0; i < nparams; i++) {
+      params[i] = cmd->argv[i+3];
+    }
+  }
+
+  pr_gettimeofday_millis(&start_ms);
+
+  /* perform the query.  if it doesn't work, log the error, close the
+   * connection then return the error from the query processing.
+   */
+  if (!(conn->result = PQexecPrepared(conn->postgres, ps->server_name,
+        nparams, params, NULL, NULL, 0)) ||
+      ((PQresultStatus(conn->result) != PGRES_TUPLES_OK) &&
+       (PQresultStatus(conn->result) != PGRES_COMMAND_OK))) {
+    dmr = build_error(cmd, conn);
+
+    if (conn->result != NULL) {
+      PQclear(conn->result);
+    }
+
+    close_cmd = sql_make_cmd(cmd->tmp_pool, 1, entry->name);
+    cmd_close(close_cmd);
+    SQL_FREE_CMD(close_cmd);
+
+    sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+    return dmr;
+  }
+
+  pr_gettimeofday_millis(&end_ms);
+  ps->nexecs++;
+  ps->total_ms += (end_ms - start_ms);
+
+  pr_trace_msg(trace_channel, 11,
+    "prepared statement '%s': execution #%lu took %lu ms (avg %0.3f ms)",
+    ps->name, ps->nexecs, (unsigned long) (end_ms - start_ms),
+    (double) ps->total_ms / ps->nexecs);
+
+  if (PQresultStatus(conn->result) == PGRES_TUPLES_OK) {
+    dmr = build_data(cmd, conn);
+
+  } else {
+    dmr = PR_HANDLED(cmd);
+  }
+
+  PQclear(conn->result);
+
+  close_cmd = sql_make_cmd(cmd->tmp_pool, 1, entry->name);
+  cmd_close(close_cmd);
+  SQL_FREE_CMD(close_cmd);
+
+  sql_log(DEBUG_FUNC, "%s", "exiting \tpostgres cmd_execute");
+  return dmr;
+}
+
 /*
  * cmd_escapestring: certain strings sent to a database should be properly
  *  escaped -- for instance, quotes need to be escaped to insure that 
@@ -1562,6 +1874,7 @@ static cmdtable sql_postgres_cmdtable[] = {
   { CMD, "sql_close",            G_NONE, cmd_close,            FALSE, FALSE },
   { CMD, "sql_defineconnection", G_NONE, cmd_defineconnection, FALSE, FALSE },
   { CMD, "sql_escapestring",     G_NONE, cmd_escapestring,     FALSE, FALSE },
+  { CMD, "sql_execute",          G_NONE, cmd_execute,          FALSE, FALSE },
   { CMD, "sql_exit",             G_NONE, cmd_exit,             FALSE, FALSE },
   { CMD, "sql_identify",         G_NONE, cmd_identify,         FALSE, FALSE },
   { CMD, "sql_insert",           G_NONE, cmd_insert,           FALSE, FALSE },
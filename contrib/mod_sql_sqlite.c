@@ -23,7 +23,7 @@
  * $Libraries: -lsqlite3$
  */
 
-#define MOD_SQL_SQLITE_VERSION		"mod_sql_sqlite/0.4"
+#define MOD_SQL_SQLITE_VERSION		"mod_sql_sqlite/0.5"
 
 #include "conf.h"
 #include "privs.h"
@@ -48,8 +48,22 @@ typedef struct db_conn_struct {
 
   sqlite3 *dbh;
 
+  /* Prepared statements, cached by name for the life of the connection. */
+  pool *stmt_pool;
+  array_header *stmts;
+
 } db_conn_t;
 
+struct prepared_stmt {
+  const char *name;
+  const char *text;
+  sqlite3_stmt *stmt;
+
+  /* Execution statistics, for tracing. */
+  unsigned long nexecs;
+  uint64_t total_ms;
+};
+
 typedef struct conn_entry_struct {
   char *name;
   void *data;
@@ -224,6 +238,184 @@ static int exec_stmt(cmd_rec *cmd, db_conn_t *conn, char *stmt, char **errstr) {
   return 0;
 }
 
+static struct prepared_stmt *get_prepared_stmt(db_conn_t *conn,
+    const char *name, const char *text, char **errstr) {
+  register unsigned int i;
+  struct prepared_stmt *ps = NULL;
+  int res;
+
+  if (conn->stmts == NULL) {
+    conn->stmt_pool = make_sub_pool(conn_pool);
+    pr_pool_tag(conn->stmt_pool, "SQLite prepared statements pool");
+
+    conn->stmts = make_array(conn->stmt_pool, 4,
+      sizeof(struct prepared_stmt));
+  }
+
+  for (i = 0; i < conn->stmts->nelts; i++) {
+    struct prepared_stmt *elt;
+
+    elt = &(((struct prepared_stmt *) conn->stmts->elts)[i]);
+    if (strcmp(elt->name, name) == 0) {
+      ps = elt;
+      break;
+    }
+  }
+
+  if (ps != NULL) {
+    if (strcmp(ps->text, text) == 0) {
+      return ps;
+    }
+
+    /* Only fully parameterized statements are prepared, so the text for a
+     * name should not change; should it do so anyway, prepare it again.
+     */
+    pr_trace_msg(trace_channel, 15,
+      "text for prepared statement '%s' changed, preparing again", name);
+    sqlite3_finalize(ps->stmt);
+    ps->stmt = NULL;
+
+  } else {
+    ps = push_array(conn->stmts);
+    ps->name = pstrdup(conn->stmt_pool, name);
+  }
+
+  ps->text = pstrdup(conn->stmt_pool, text);
+  ps->nexecs = 0;
+  ps->total_ms = 0;
+
+  res = sqlite3_prepare_v2(conn->dbh, text, -1, &(ps->stmt), NULL);
+  if (res != SQLITE_OK) {
+    *errstr = pstrdup(conn->stmt_pool, sqlite3_errmsg(conn->dbh));
+    sql_log(DEBUG_FUNC, "error preparing '%s': (%d) %s", text, res, *errstr);
+
+    /* Leave the entry in place, but with empty text, so that the next
+     * attempt prepares it again.
+     */
+    ps->text = "";
+    ps->stmt = NULL;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 15, "prepared statement '%s': %s", name, text);
+  return ps;
+}
+
+static void clear_prepared_stmts(db_conn_t *conn) {
+  register unsigned int i;
+
+  if (conn->stmts == NULL) {
+    return;
+  }
+
+  for (i = 0; i < conn->stmts->nelts; i++) {
+    struct prepared_stmt *ps;
+
+    ps = &(((struct prepared_stmt *) conn->stmts->elts)[i]);
+    if (ps->stmt != NULL) {
+      pr_trace_msg(trace_channel, 15,
+        "finalizing prepared statement '%s' (%lu %s)", ps->name, ps->nexecs,
+        ps->nexecs != 1 ? "executions" : "execution");
+      sqlite3_finalize(ps->stmt);
+      ps->stmt = NULL;
+    }
+  }
+
+  destroy_pool(conn->stmt_pool);
+  conn->stmt_pool = NULL;
+  conn->stmts = NULL;
+}
+
+static int exec_prepared_stmt(cmd_rec *cmd, db_conn_t *conn,
+    struct prepared_stmt *ps, char **errstr) {
+  register int i;
+  int ncols, res;
+  unsigned int nretries = 0;
+  uint64_t start_ms = 0, end_ms = 0;
+
+  for (i = 3; i < cmd->argc; i++) {
+    res = sqlite3_bind_text(ps->stmt, i - 2, cmd->argv[i], -1,
+      SQLITE_TRANSIENT);
+    if (res != SQLITE_OK) {
+      *errstr = pstrdup(cmd->pool, sqlite3_errmsg(conn->dbh));
+      sql_log(DEBUG_FUNC, "error binding parameter #%d for '%s': %s", i - 2,
+        ps->name, *errstr);
+      sqlite3_clear_bindings(ps->stmt);
+      return -1;
+    }
+  }
+
+  ncols = sqlite3_column_count(ps->stmt);
+  pr_gettimeofday_millis(&start_ms);
+
+  while (TRUE) {
+    PRIVS_ROOT
+    res = sqlite3_step(ps->stmt);
+    PRIVS_RELINQUISH
+
+    if (res == SQLITE_ROW) {
+      char **cols;
+
+      cols = pcalloc(cmd->tmp_pool, sizeof(char *) * (ncols + 1));
+      for (i = 0; i < ncols; i++) {
+        cols[i] = (char *) sqlite3_column_text(ps->stmt, i);
+      }
+
+      exec_cb(cmd, ncols, cols, NULL);
+      continue;
+    }
+
+    if (res == SQLITE_BUSY) {
+      struct timeval tv;
+
+      nretries++;
+      sql_log(DEBUG_FUNC, "attempt #%u, database busy, trying '%s' again",
+        nretries, ps->text);
+
+      /* Discard any partial results, and start over. */
+      sqlite3_reset(ps->stmt);
+      result_ncols = 0;
+      result_list = NULL;
+
+      /* Sleep for short bit, then try again. */
+      tv.tv_sec = 0;
+      tv.tv_usec = 500000L;
+
+      if (select(0, NULL, NULL, NULL, &tv) < 0) {
+        if (errno == EINTR) {
+          pr_signals_handle();
+        }
+      }
+
+      continue;
+    }
+
+    break;
+  }
+
+  if (res != SQLITE_DONE) {
+    *errstr = pstrdup(cmd->pool, sqlite3_errmsg(conn->dbh));
+    sql_log(DEBUG_FUNC, "error executing '%s': (%d) %s", ps->text, res,
+      *errstr);
+    sqlite3_reset(ps->stmt);
+    sqlite3_clear_bindings(ps->stmt);
+    return -1;
+  }
+
+  sqlite3_reset(ps->stmt);
+  sqlite3_clear_bindings(ps->stmt);
+
+  pr_gettimeofday_millis(&end_ms);
+  ps->nexecs++;
+  ps->total_ms += (end_ms - start_ms);
+
+  pr_trace_msg(trace_channel, 11,
+    "prepared statement '%s': execution #%lu took %lu ms (avg %0.3f ms)",
+    ps->name, ps->nexecs, (unsigned long) (end_ms - start_ms),
+    (double) ps->total_ms / ps->nexecs);
+  return 0;
+}
+
 static int query_start(cmd_rec *cmd, db_conn_t *conn, int flags,
     char **errstr) {
   char *start_txn = NULL;
@@ -247,7 +439,20 @@ static int query_start(cmd_rec *cmd, db_conn_t *conn, int flags,
 
 static int query_run(cmd_rec *cmd, db_conn_t *conn, char *query,
     char **errstr) {
-  return exec_stmt(cmd, conn, query, errstr);
+  int res;
+
+  res = exec_stmt(cmd, conn, query, errstr);
+  if (res < 0) {
+    char *rollback_errstr = NULL;
+
+    /* Do not leave the transaction open; every later statement on this
+     * connection would fail.
+     */
+    (void) exec_stmt(cmd, conn, pstrdup(cmd->tmp_pool, "ROLLBACK"),
+      &rollback_errstr);
+  }
+
+  return res;
 }
 
 static int query_finish(cmd_rec *cmd, db_conn_t *conn, char **errstr) {
@@ -468,6 +673,8 @@ MODRET sql_sqlite_close(cmd_rec *cmd) {
       (cmd->argc == 2 && cmd->argv[1])) {
 
     if (conn->dbh) {
+      clear_prepared_stmts(conn);
+
       if (sqlite3_close(conn->dbh) != SQLITE_OK) {
         sql_log(DEBUG_FUNC, "error closing SQLite database: %s",
           sqlite3_errmsg(conn->dbh));
@@ -994,6 +1201,74 @@ MODRET sql_sqlite_query(cmd_rec *cmd) {
   return mr;
 }
 
+MODRET sql_sqlite_execute(cmd_rec *cmd) {
+  conn_entry_t *entry = NULL;
+  db_conn_t *conn = NULL;
+  modret_t *mr = NULL;
+  char *errstr = NULL;
+  struct prepared_stmt *ps;
+  cmd_rec *close_cmd;
+
+  sql_log(DEBUG_FUNC, "%s", "entering \tsqlite cmd_execute");
+
+  if (cmd->argc < 3) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tsqlite cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_SQLITE_VERSION, "badly formed request");
+  }
+
+  /* Get the named connection. */
+  entry = sql_sqlite_get_conn(cmd->argv[0]);
+  if (entry == NULL) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tsqlite cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_SQLITE_VERSION,
+      pstrcat(cmd->tmp_pool, "unknown named connection: ", cmd->argv[0], NULL));
+  }
+
+  conn = (db_conn_t *) entry->data;
+
+  mr = sql_sqlite_open(cmd);
+  if (MODRET_ERROR(mr)) {
+    sql_log(DEBUG_FUNC, "%s", "exiting \tsqlite cmd_execute");
+    return mr;
+  }
+
+  /* Log the query string */
+  sql_log(DEBUG_INFO, "query \"%s\" (prepared statement '%s', %d %s)",
+    (char *) cmd->argv[2], (char *) cmd->argv[1], cmd->argc - 3,
+    cmd->argc - 3 != 1 ? "parameters" : "parameter");
+
+  ps = get_prepared_stmt(conn, cmd->argv[1], cmd->argv[2], &errstr);
+  if (ps == NULL) {
+    close_cmd = pr_cmd_alloc(cmd->tmp_pool, 1, entry->name);
+    sql_sqlite_close(close_cmd);
+    destroy_pool(close_cmd->pool);
+
+    sql_log(DEBUG_FUNC, "%s", "exiting \tsqlite cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_SQLITE_VERSION, errstr);
+  }
+
+  if (query_start(cmd, conn, 0, &errstr) < 0 ||
+      exec_prepared_stmt(cmd, conn, ps, &errstr) < 0 ||
+      query_finish(cmd, conn, &errstr) < 0) {
+    close_cmd = pr_cmd_alloc(cmd->tmp_pool, 1, entry->name);
+    sql_sqlite_close(close_cmd);
+    destroy_pool(close_cmd->pool);
+
+    sql_log(DEBUG_FUNC, "%s", "exiting \tsqlite cmd_execute");
+    return PR_ERROR_MSG(cmd, MOD_SQL_SQLITE_VERSION, errstr);
+  }
+
+  mr = sql_sqlite_get_data(cmd);
+
+  /* Close the connection, return the data. */
+  close_cmd = pr_cmd_alloc(cmd->tmp_pool, 1, entry->name);
+  sql_sqlite_close(close_cmd);
+  destroy_pool(close_cmd->pool);
+
+  sql_log(DEBUG_FUNC, "%s", "exiting \tsqlite cmd_execute");
+  return mr;
+}
+
 MODRET sql_sqlite_quote(cmd_rec *cmd) {
   conn_entry_t *entry = NULL;
   modret_t *mr = NULL;
@@ -1056,6 +1331,7 @@ static cmdtable sql_sqlite_cmdtable[] = {
   { CMD, "sql_cleanup",		G_NONE, sql_sqlite_cleanup,	FALSE, FALSE },
   { CMD, "sql_defineconnection",G_NONE, sql_sqlite_def_conn,	FALSE, FALSE },
   { CMD, "sql_escapestring",	G_NONE, sql_sqlite_quote,	FALSE, FALSE },
+  { CMD, "sql_execute",		G_NONE, sql_sqlite_execute,	FALSE, FALSE },
   { CMD, "sql_exit",		G_NONE,	sql_sqlite_exit,	FALSE, FALSE },
   { CMD, "sql_identify",	G_NONE, sql_sqlite_identify,	FALSE, FALSE },
   { CMD, "sql_insert",		G_NONE, sql_sqlite_insert,	FALSE, FALSE },
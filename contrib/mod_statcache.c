@@ -71,6 +71,20 @@
 /* Max number of lock attempts */
 #define STATCACHE_MAX_LOCK_ATTEMPTS	10
 
+/* How many times to try reading a row without locking it. */
+#define STATCACHE_SEQLOCK_MAX_ATTEMPTS	100
+
+/* How many stats updates a session accumulates before adding them to the
+ * table header.
+ */
+#define STATCACHE_STATS_FLUSH_INTERVAL	64
+
+#if defined(__GNUC__)
+# define STATCACHE_MEMORY_BARRIER()	__sync_synchronize()
+#else
+# define STATCACHE_MEMORY_BARRIER()
+#endif /* __GNUC__ */
+
 /* Subpool size */
 #define STATCACHE_POOL_SIZE		256
 
@@ -107,10 +121,19 @@ struct statcache_entry {
  *      uint32_t expires
  *      uint32_t rejects
  *
+ *    Header (row sequence numbers):
+ *      uint32_t seqno[nrows]
+ *
  *  Data (entries):
  *    nrows = capacity / STATCACHE_COLS_PER_ROW
  *    row_len = sizeof(struct statcache_entry) * STATCACHE_COLS_PER_ROW
  *    row_start = ((hash % nrows) * row_len) + data_start
+ *
+ *  Lookups read a row without locking it.  Writers, which hold the fcntl(2)
+ *  write lock on that row, make the row's sequence number odd while they
+ *  change the row, and even again when done; a reader which sees an odd
+ *  number, or a number which changed while it was reading, reads the row
+ *  again.
  */
 
 static int statcache_engine = FALSE;
@@ -125,9 +148,21 @@ static pr_fh_t *statcache_tabfh = NULL;
 
 static void *statcache_table = NULL;
 static size_t statcache_tablesz = 0;
+static size_t statcache_hdrlen = 0;
 static void *statcache_table_stats = NULL;
+static volatile uint32_t *statcache_table_seqnos = NULL;
 static struct statcache_entry *statcache_table_data = NULL;
 
+/* Stats updates made by this process, not yet added to the table header. */
+static struct {
+  int32_t count;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t expires;
+  uint32_t rejects;
+  unsigned int nupdates;
+} statcache_pending_stats;
+
 static const char *trace_channel = "statcache";
 
 static int statcache_wlock_row(int fd, uint32_t hash);
@@ -289,7 +324,7 @@ static int lock_table(int fd, int lock_type, off_t lock_len) {
   lock.l_type = lock_type;
   lock.l_whence = 0;
   lock.l_start = 0;
-  lock.l_len = (6 * sizeof(uint32_t));
+  lock.l_len = lock_len;
 
   pr_trace_msg(trace_channel, 15,
     "attempt #%u to acquire %s lock on StatCacheTable fd %d (off %lu, len %lu)",
@@ -363,7 +398,7 @@ static int statcache_rlock_table(int fd) {
 }
 
 static int statcache_unlock_table(int fd) {
-  return lock_table(fd, F_RDLCK, 0);
+  return lock_table(fd, F_UNLCK, 0);
 }
 #endif /* PR_USE_CTRLS */
 
@@ -430,129 +465,68 @@ static uint32_t statcache_stats_get_rejects(void) {
 }
 #endif /* PR_USE_CTRLS */
 
-static int statcache_stats_incr_count(int32_t incr) {
-  uint32_t *count = NULL, *highest = NULL;
+/* Add this process' pending stats updates to the table header.  Unless
+ * forced, this only happens once enough updates have accumulated, so that
+ * lookups do not need to lock the header each time.
+ */
+static int statcache_stats_flush(int fd, int force) {
+  uint32_t *stats;
 
-  if (incr == 0) {
+  if (statcache_pending_stats.nupdates == 0) {
     return 0;
   }
 
-  /* count = statcache_table_stats + (0 * sizeof(uint32_t)) */
-  count = ((uint32_t *) statcache_table_stats);
-
-  /* highest = statcache_table_stats + (1 * sizeof(uint32_t)) */
-  highest = ((uint32_t *) ((char *) statcache_table_stats) +
-    (1 * sizeof(uint32_t)));
-
-  if (incr < 0) {
-    /* Prevent underflow. */
-    if (*count <= incr) {
-      *count = 0;
-
-    } else {
-      *count += incr;
-    }
-
-  } else {
-    *count += incr;
-
-    if (*count > *highest) {
-      *highest = *count;
-    }
-  }
-
-  return 0;
-}
-
-static int statcache_stats_incr_hits(int32_t incr) {
-  uint32_t *hits = NULL;
-
-  if (incr == 0) {
+  if (force == FALSE &&
+      statcache_pending_stats.nupdates < STATCACHE_STATS_FLUSH_INTERVAL) {
     return 0;
   }
 
-  /* hits = statcache_table_stats + (2 * sizeof(uint32_t)) */
-  hits = ((uint32_t *) ((char *) statcache_table_stats) +
-    (2 * sizeof(uint32_t)));
-
-  /* Prevent underflow. */
-  if (incr < 0 &&
-      *hits <= incr) {
-    *hits = 0;
-
-  } else {
-    *hits += incr;
+  if (statcache_table_stats == NULL) {
+    errno = EPERM;
+    return -1;
   }
 
-  return 0;
-} 
-
-static int statcache_stats_incr_misses(int32_t incr) {
-  uint32_t *misses = NULL;
- 
-  if (incr == 0) {
-    return 0;
+  if (statcache_wlock_stats(fd) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error write-locking shared memory: %s", strerror(errno));
   }
- 
-  /* misses = statcache_table_stats + (3 * sizeof(uint32_t)) */
-  misses = ((uint32_t *) ((char *) statcache_table_stats) +
-    (3 * sizeof(uint32_t)));
-
-  /* Prevent underflow. */
-  if (incr < 0 &&
-      *misses <= incr) {
-    *misses = 0;
 
-  } else {
-    *misses += incr;
-  }
+  /* count = stats[0], highest = stats[1], hits = stats[2], misses = stats[3],
+   * expires = stats[4], rejects = stats[5]
+   */
+  stats = statcache_table_stats;
 
-  return 0;
-} 
+  if (statcache_pending_stats.count < 0) {
+    uint32_t decr;
 
-static int statcache_stats_incr_expires(int32_t incr) {
-  uint32_t *expires = NULL;
- 
-  if (incr == 0) {
-    return 0;
-  }
- 
-  /* expires = statcache_table_stats + (4 * sizeof(uint32_t)) */
-  expires = ((uint32_t *) ((char *) statcache_table_stats) +
-    (4 * sizeof(uint32_t)));
+    /* Prevent underflow. */
+    decr = (uint32_t) -statcache_pending_stats.count;
+    if (stats[0] <= decr) {
+      stats[0] = 0;
 
-  /* Prevent underflow. */
-  if (incr < 0 &&
-      *expires <= incr) {
-    *expires = 0;
+    } else {
+      stats[0] -= decr;
+    }
 
   } else {
-    *expires += incr;
-  }
+    stats[0] += statcache_pending_stats.count;
 
-  return 0;
-} 
-
-static int statcache_stats_incr_rejects(int32_t incr) {
-  uint32_t *rejects = NULL;
-
-  if (incr == 0) {
-    return 0;
+    if (stats[0] > stats[1]) {
+      stats[1] = stats[0];
+    }
   }
 
-  /* rejects = statcache_table_stats + (5 * sizeof(uint32_t)) */
-  rejects = ((uint32_t *) ((char *) statcache_table_stats) +
-    (5 * sizeof(uint32_t)));
-
-  /* Prevent underflow. */
-  if (incr < 0 &&
-      *rejects <= incr) {
-    *rejects = 0;
+  stats[2] += statcache_pending_stats.hits;
+  stats[3] += statcache_pending_stats.misses;
+  stats[4] += statcache_pending_stats.expires;
+  stats[5] += statcache_pending_stats.rejects;
 
-  } else {
-    *rejects += incr;
+  if (statcache_unlock_stats(fd) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error un-locking shared memory: %s", strerror(errno));
   }
 
+  memset(&statcache_pending_stats, 0, sizeof(statcache_pending_stats));
   return 0;
 }
 
@@ -562,7 +536,9 @@ static int get_row_range(uint32_t hash, off_t *row_start, off_t *row_len) {
   uint32_t row_idx;
 
   row_idx = hash % statcache_nrows;
-  *row_start = (row_idx * statcache_rowlen);
+
+  /* Skip past the header, so that row locks do not block the stats lock. */
+  *row_start = statcache_hdrlen + (row_idx * statcache_rowlen);
   *row_len = statcache_rowlen;
 
   return 0;
@@ -703,6 +679,12 @@ static int statcache_table_add(int fd, const char *path, size_t pathlen,
      */
     if (sce->sce_errno == 0) {
       if (now > (sce->sce_ts + statcache_max_positive_age)) {
+        pr_trace_msg(trace_channel, 17,
+          "clearing expired cache entry for path '%s' (hash %lu) "
+          "at row %lu, col %u: aged %lu secs",
+          sce->sce_path, (unsigned long) sce->sce_hash,
+          (unsigned long) row_idx + 1, i + 1,
+          (unsigned long) (now - sce->sce_ts));
         found_slot = TRUE;
         expired_entries++;
         break;
@@ -710,6 +692,12 @@ static int statcache_table_add(int fd, const char *path, size_t pathlen,
 
     } else {
       if (now > (sce->sce_ts + statcache_max_negative_age)) {
+        pr_trace_msg(trace_channel, 17,
+          "clearing expired negative cache entry for path '%s' "
+          "(hash %lu) at row %lu, col %u: aged %lu secs",
+          sce->sce_path, (unsigned long) sce->sce_hash,
+          (unsigned long) row_idx + 1, i + 1,
+          (unsigned long) (now - sce->sce_ts));
         found_slot = TRUE;
         expired_entries++;
         break;
@@ -718,17 +706,9 @@ static int statcache_table_add(int fd, const char *path, size_t pathlen,
   }
 
   if (found_slot == FALSE) {
-    if (statcache_wlock_stats(fd) < 0) {
-      pr_trace_msg(trace_channel, 3,
-        "error write-locking shared memory: %s", strerror(errno));
-    }
-
-    statcache_stats_incr_rejects(1);
-
-    if (statcache_unlock_stats(fd) < 0) {
-      pr_trace_msg(trace_channel, 3,
-        "error un-locking shared memory: %s", strerror(errno));
-    }
+    statcache_pending_stats.rejects++;
+    statcache_pending_stats.nupdates++;
+    (void) statcache_stats_flush(fd, FALSE);
 
     errno = ENOSPC;
     return -1;
@@ -751,6 +731,9 @@ static int statcache_table_add(int fd, const char *path, size_t pathlen,
       op == FSIO_FILE_LSTAT ? "LSTAT" : "STAT", xerrno);
   }
 
+  statcache_table_seqnos[row_idx]++;
+  STATCACHE_MEMORY_BARRIER();
+
   sce->sce_hash = hash;
   sce->sce_pathlen = pathlen;
 
@@ -763,30 +746,93 @@ static int statcache_table_add(int fd, const char *path, size_t pathlen,
   sce->sce_ts = now;
   sce->sce_op = op;
 
-  if (statcache_wlock_stats(fd) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error write-locking shared memory: %s", strerror(errno));
-  }
+  STATCACHE_MEMORY_BARRIER();
+  statcache_table_seqnos[row_idx]++;
 
-  statcache_stats_incr_count(1);
-  if (expired_entries > 0) {
-    statcache_stats_incr_count(-expired_entries);
-    statcache_stats_incr_expires(expired_entries);
-  }
+  statcache_pending_stats.count += (1 - expired_entries);
+  statcache_pending_stats.expires += expired_entries;
+  statcache_pending_stats.nupdates++;
+  (void) statcache_stats_flush(fd, FALSE);
 
-  if (statcache_unlock_stats(fd) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error un-locking shared memory: %s", strerror(errno));
+  return 0;
+}
+
+/* Look for a usable entry for this path in the given row, copying it out
+ * if found.  The caller is responsible for making sure that the row did not
+ * change while we were reading it.
+ */
+static int statcache_row_get(uint32_t row_idx, const char *path,
+    size_t pathlen, struct stat *st, int *xerrno, uint32_t hash,
+    unsigned char op, time_t now, unsigned int *col) {
+  register unsigned int i;
+  uint32_t row_start;
+
+  row_start = (row_idx * statcache_rowlen);
+
+  for (i = 0; i < STATCACHE_COLS_PER_ROW; i++) {
+    uint32_t col_start;
+    struct statcache_entry *sce;
+    time_t ts;
+
+    col_start = (row_start + (i * sizeof(struct statcache_entry)));
+    sce = (struct statcache_entry *) (((char *) statcache_table_data) +
+      col_start);
+
+    ts = sce->sce_ts;
+    if (ts == 0 ||
+        sce->sce_hash != hash ||
+        sce->sce_pathlen != pathlen) {
+      continue;
+    }
+
+    /* Possible collision; check paths, including the trailing NUL in the
+     * comparison...
+     */
+    if (strncmp(sce->sce_path, path, pathlen + 1) != 0) {
+      continue;
+    }
+
+    /* Skip aged-out entries; statcache_table_add() will reuse their
+     * slots.  Note that there are different expiry rules for negative
+     * cache entries (i.e. errors) than for positive cache entries.
+     */
+    if (sce->sce_errno == 0) {
+      if (now > (ts + statcache_max_positive_age)) {
+        continue;
+      }
+
+    } else {
+      if (now > (ts + statcache_max_negative_age)) {
+        continue;
+      }
+    }
+
+    /* If the ops match, OR if the entry is from a LSTAT AND the entry
+     * is NOT a symlink, we can use it.
+     */
+    if (sce->sce_op == op ||
+        (sce->sce_op == FSIO_FILE_LSTAT &&
+         S_ISLNK(sce->sce_stat.st_mode) == FALSE)) {
+      *xerrno = sce->sce_errno;
+      if (sce->sce_errno == 0) {
+        memcpy(st, &(sce->sce_stat), sizeof(struct stat));
+      }
+
+      *col = i;
+      return 0;
+    }
   }
 
-  return 0;
+  return -1;
 }
 
 static int statcache_table_get(int fd, const char *path, size_t pathlen,
     struct stat *st, int *xerrno, uint32_t hash, unsigned char op) {
-  register unsigned int i;
-  int expired_entries = 0, res = -1;
-  uint32_t row_idx, row_start;
+  register unsigned int attempt;
+  int res = -1;
+  uint32_t row_idx;
+  unsigned int col = 0;
+  time_t now;
 
   if (statcache_table == NULL) {
     errno = EPERM;
@@ -794,102 +840,71 @@ static int statcache_table_get(int fd, const char *path, size_t pathlen,
   }
 
   row_idx = hash % statcache_nrows;
-  row_start = (row_idx * statcache_rowlen);
+  now = time(NULL);
 
-  /* Find the matching entry for this path. */
-  for (i = 0; i < STATCACHE_COLS_PER_ROW; i++) {
-    uint32_t col_start;
-    struct statcache_entry *sce;
+  for (attempt = 0; attempt < STATCACHE_SEQLOCK_MAX_ATTEMPTS; attempt++) {
+    uint32_t seqno;
 
-    pr_signals_handle();
+    seqno = statcache_table_seqnos[row_idx];
+    if (seqno % 2 != 0) {
+      /* Row is being written; try again. */
+      continue;
+    }
 
-    col_start = (row_start + (i * sizeof(struct statcache_entry)));
-    sce = (((char *) statcache_table_data) + col_start);
-    if (sce->sce_ts > 0) {
-      if (sce->sce_hash == hash) {
-        /* Possible collision; check paths. */
-        if (sce->sce_pathlen == pathlen) {
+    STATCACHE_MEMORY_BARRIER();
+    res = statcache_row_get(row_idx, path, pathlen, st, xerrno, hash, op, now,
+      &col);
+    STATCACHE_MEMORY_BARRIER();
 
-          /* Include the trailing NUL in the comparison... */
-          if (strncmp(sce->sce_path, path, pathlen + 1) == 0) {
-            time_t now;
-
-            now = time(NULL);
-
-            /* Check the age.  If it's aged out, clear it now, for later use. */
-            if (sce->sce_errno == 0) {
-              if (now > (sce->sce_ts + statcache_max_positive_age)) {
-                pr_trace_msg(trace_channel, 17,
-                  "clearing expired cache entry for path '%s' (hash %lu) "
-                  "at row %lu, col %u: aged %lu secs",
-                  sce->sce_path, (unsigned long) hash,
-                  (unsigned long) row_idx + 1, i + 1,
-                  (unsigned long) (now - sce->sce_ts));
-                sce->sce_ts = 0;
-                expired_entries++;
-                continue;
-              }
-
-            } else {
-              if (now > (sce->sce_ts + statcache_max_negative_age)) {
-                pr_trace_msg(trace_channel, 17,
-                  "clearing expired negative cache entry for path '%s' "
-                  "(hash %lu) at row %lu, col %u: aged %lu secs",
-                  sce->sce_path, (unsigned long) hash,
-                  (unsigned long) row_idx + 1, i + 1,
-                  (unsigned long) (now - sce->sce_ts));
-                sce->sce_ts = 0;
-                expired_entries++;
-                continue;
-              }
-            }
-
-            /* If the ops match, OR if the entry is from a LSTAT AND the entry
-             * is NOT a symlink, we can use it.
-             */
-            if (sce->sce_op == op ||
-                (sce->sce_op == FSIO_FILE_LSTAT &&
-                 S_ISLNK(sce->sce_stat.st_mode) == FALSE)) {
-              /* Found matching entry. */
-              pr_trace_msg(trace_channel, 9,
-                "found entry for path '%s' (hash %lu) at row %lu, col %u",
-                path, (unsigned long) hash, (unsigned long) row_idx + 1, i + 1);
-
-              *xerrno = sce->sce_errno;
-              if (sce->sce_errno == 0) {
-                memcpy(st, &(sce->sce_stat), sizeof(struct stat));
-              }
-
-              res = 0;
-              break;
-            }
-          }
-        }
-      }
+    if (statcache_table_seqnos[row_idx] == seqno) {
+      break;
     }
   }
 
-  if (statcache_wlock_stats(fd) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error write-locking shared memory: %s", strerror(errno));
+  if (attempt == STATCACHE_SEQLOCK_MAX_ATTEMPTS) {
+    /* The row kept changing underneath us; wait for its writers by taking
+     * the row lock ourselves.
+     */
+    pr_trace_msg(trace_channel, 15,
+      "unable to read row %lu after %u attempts, locking row",
+      (unsigned long) row_idx + 1, attempt);
+
+    if (statcache_wlock_row(fd, hash) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error write-locking shared memory: %s", strerror(errno));
+      res = -1;
+
+    } else {
+      /* A writer which died while changing this row leaves its sequence
+       * number odd.  Since we hold the row lock, no writer is active now,
+       * so we can make it even again.
+       */
+      if (statcache_table_seqnos[row_idx] % 2 != 0) {
+        statcache_table_seqnos[row_idx]++;
+      }
+
+      res = statcache_row_get(row_idx, path, pathlen, st, xerrno, hash, op,
+        now, &col);
+
+      if (statcache_unlock_row(fd, hash) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error unlocking shared memory: %s", strerror(errno));
+      }
+    }
   }
 
   if (res == 0) {
-    statcache_stats_incr_hits(1);
+    pr_trace_msg(trace_channel, 9,
+      "found entry for path '%s' (hash %lu) at row %lu, col %u",
+      path, (unsigned long) hash, (unsigned long) row_idx + 1, col + 1);
+    statcache_pending_stats.hits++;
 
   } else {
-    statcache_stats_incr_misses(1);
-  }
-
-  if (expired_entries > 0) {
-    statcache_stats_incr_count(-expired_entries);
-    statcache_stats_incr_expires(expired_entries);
+    statcache_pending_stats.misses++;
   }
 
-  if (statcache_unlock_stats(fd) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error un-locking shared memory: %s", strerror(errno));
-  }
+  statcache_pending_stats.nupdates++;
+  (void) statcache_stats_flush(fd, FALSE);
 
   if (res < 0) {
     errno = ENOENT;
@@ -912,6 +927,9 @@ static int statcache_table_remove(int fd, const char *path, size_t pathlen,
   row_idx = hash % statcache_nrows;
   row_start = (row_idx * statcache_rowlen);
 
+  statcache_table_seqnos[row_idx]++;
+  STATCACHE_MEMORY_BARRIER();
+
   /* Find the matching entry for this path. */
   for (i = 0; i < STATCACHE_COLS_PER_ROW; i++) {
     uint32_t col_start;
@@ -948,20 +966,13 @@ static int statcache_table_remove(int fd, const char *path, size_t pathlen,
     }
   }
 
-  if (res == 0) {
-    if (statcache_wlock_stats(fd) < 0) {
-      pr_trace_msg(trace_channel, 3,
-        "error write-locking shared memory: %s", strerror(errno));
-    }
-
-    if (removed_entries > 0) {
-      statcache_stats_incr_count(-removed_entries);
-    }
+  STATCACHE_MEMORY_BARRIER();
+  statcache_table_seqnos[row_idx]++;
 
-    if (statcache_unlock_stats(fd) < 0) {
-      pr_trace_msg(trace_channel, 3,
-        "error un-locking shared memory: %s", strerror(errno));
-    }
+  if (res == 0) {
+    statcache_pending_stats.count -= removed_entries;
+    statcache_pending_stats.nupdates++;
+    (void) statcache_stats_flush(fd, FALSE);
 
   } else {
     errno = ENOENT;
@@ -1021,19 +1032,9 @@ static int statcache_fsio_stat(pr_fs_t *fs, const char *path,
   hash = statcache_hash(canon_path, canon_pathlen);
   tab_fd = statcache_tabfh->fh_fd;
 
-  if (statcache_wlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error write-locking shared memory: %s", strerror(errno));
-  }
-
   res = statcache_table_get(tab_fd, canon_path, canon_pathlen, st, &xerrno,
     hash, FSIO_FILE_STAT);
 
-  if (statcache_unlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error unlocking shared memory: %s", strerror(errno));
-  }
-
   if (res == 0) {
     if (xerrno != 0) {
       res = -1;
@@ -1056,11 +1057,6 @@ static int statcache_fsio_stat(pr_fs_t *fs, const char *path,
       "error write-locking shared memory: %s", strerror(errno));
   }
 
-  if (statcache_wlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error write-locking shared memory: %s", strerror(errno));
-  }
-
   if (res < 0) {
     if (statcache_max_negative_age > 0) {
       /* Negatively cache the failed stat(2). */
@@ -1105,19 +1101,9 @@ static int statcache_fsio_fstat(pr_fh_t *fh, int fd, struct stat *st) {
   hash = statcache_hash(fh->fh_path, pathlen);
   tab_fd = statcache_tabfh->fh_fd;
 
-  if (statcache_wlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error write-locking shared memory: %s", strerror(errno));
-  }
-
   res = statcache_table_get(tab_fd, fh->fh_path, pathlen, st, &xerrno, hash,
     FSIO_FILE_STAT);
 
-  if (statcache_unlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error unlocking shared memory: %s", strerror(errno));
-  }
-
   if (res == 0) {
     if (xerrno != 0) {
       res = -1;
@@ -1188,19 +1174,9 @@ static int statcache_fsio_lstat(pr_fs_t *fs, const char *path,
   hash = statcache_hash(canon_path, canon_pathlen);
   tab_fd = statcache_tabfh->fh_fd;
 
-  if (statcache_wlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error write-locking shared memory: %s", strerror(errno));
-  }
-
   res = statcache_table_get(tab_fd, canon_path, canon_pathlen, st, &xerrno,
     hash, FSIO_FILE_LSTAT);
 
-  if (statcache_unlock_row(tab_fd, hash) < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error unlocking shared memory: %s", strerror(errno));
-  }
-
   if (res == 0) {
     if (xerrno != 0) {
       res = -1;
@@ -2230,6 +2206,12 @@ static void statcache_fs_statcache_clear_ev(const void *event_data,
   destroy_pool(p);
 }
 
+static void statcache_exit_ev(const void *event_data, void *user_data) {
+  if (statcache_tabfh != NULL) {
+    (void) statcache_stats_flush(statcache_tabfh->fh_fd, TRUE);
+  }
+}
+
 static void statcache_sess_reinit_ev(const void *event_data, void *user_data) {
   int res;
 
@@ -2379,17 +2361,21 @@ static void statcache_postparse_ev(const void *event_data, void *user_data) {
     }
   } 
 
+  statcache_nrows = (statcache_capacity / STATCACHE_COLS_PER_ROW);
+  statcache_rowlen = (STATCACHE_COLS_PER_ROW * sizeof(struct statcache_entry));
+
   /* The size of the table, in bytes, is:
    *
    *  sizeof(header) + sizeof(data)
    *
    * thus:
    *
-   *  header = 6 * sizeof(uint32_t)
+   *  header = (6 + nrows) * sizeof(uint32_t)
    *  data = capacity * sizeof(struct statcache_entry)
    */
 
-  tablesz = (6 * sizeof(uint32_t)) +
+  statcache_hdrlen = (6 + statcache_nrows) * sizeof(uint32_t);
+  tablesz = statcache_hdrlen +
     (statcache_capacity * sizeof(struct statcache_entry));
 
   /* Get the shm for storing all of our stat info. */
@@ -2409,10 +2395,10 @@ static void statcache_postparse_ev(const void *event_data, void *user_data) {
   statcache_table = table;
   statcache_tablesz = tablesz;
   statcache_table_stats = statcache_table;
-  statcache_table_data = (struct statcache_entry *) (statcache_table + (6 * sizeof(uint32_t)));
-
-  statcache_nrows = (statcache_capacity / STATCACHE_COLS_PER_ROW);
-  statcache_rowlen = (STATCACHE_COLS_PER_ROW * sizeof(struct statcache_entry));
+  statcache_table_seqnos = (volatile uint32_t *) ((char *) statcache_table +
+    (6 * sizeof(uint32_t)));
+  statcache_table_data = (struct statcache_entry *) ((char *) statcache_table +
+    statcache_hdrlen);
 
   return;
 }
@@ -2497,6 +2483,7 @@ static int statcache_init(void) {
 static int statcache_sess_init(void) {
   config_rec *c;
 
+  pr_event_register(&statcache_module, "core.exit", statcache_exit_ev, NULL);
   pr_event_register(&statcache_module, "core.session-reinit",
     statcache_sess_reinit_ev, NULL);
 
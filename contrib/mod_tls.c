@@ -564,6 +564,24 @@ static unsigned int tls_npkeys = 0;
 static uint64_t tls_data_adaptive_bytes_written_ms = 0L;
 static off_t tls_data_adaptive_bytes_written_count = 0;
 
+/* Current max TLS record (send fragment) size for the data connection. */
+static size_t tls_data_adaptive_record_size = 0;
+
+/* Buffer for coalescing small writes on the data connection into full
+ * TLS records.
+ */
+static char *tls_data_wbuf = NULL;
+static size_t tls_data_wbuflen = 0;
+
+/* Data connection write statistics, logged at the end of a transfer. */
+static struct {
+  uint64_t bytes;
+  uint64_t est_records;
+  uint64_t syscalls;
+  uint64_t writes;
+  uint64_t netio_writes;
+} tls_data_wstats;
+
 /* Module variables */
 #if OPENSSL_VERSION_NUMBER > 0x000907000L
 static const char *tls_crypto_device = NULL;
@@ -661,6 +679,7 @@ static unsigned char *tls_authenticated = NULL;
 #define TLS_OPT_ALLOW_WEAK_DH				0x2000
 #define TLS_OPT_IGNORE_SNI				0x4000
 #define TLS_OPT_ALLOW_WEAK_SECURITY			0x8000
+#define TLS_OPT_ENABLE_KTLS				0x10000
 
 /* mod_tls SSCN modes */
 #define TLS_SSCN_MODE_SERVER				0
@@ -734,6 +753,16 @@ static unsigned char tls_renegotiate_required = TRUE;
 
 #define TLS_NETIO_NOTE		"mod_tls.SSL"
 
+/* Set on the data write stream when kernel TLS offload is in effect for
+ * sending, i.e. when plaintext written directly to the socket (such as via
+ * sendfile(2)) is encrypted by the kernel.
+ */
+#define TLS_KTLS_SEND_NOTE	"mod_tls.ktls-send"
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+# define TLS_USE_KTLS
+#endif /* SSL_OP_ENABLE_KTLS and !OPENSSL_NO_KTLS */
+
 static pr_netio_t *tls_ctrl_netio = NULL;
 static pr_netio_stream_t *tls_ctrl_rd_nstrm = NULL;
 static pr_netio_stream_t *tls_ctrl_wr_nstrm = NULL;
@@ -767,6 +796,9 @@ static int tls_sess_init(void);
 
 /* SSL/TLS support functions */
 static void tls_closelog(void);
+static void tls_data_flush_pending(SSL *);
+static void tls_data_log_stats(void);
+static void tls_data_write_init(SSL *);
 static void tls_end_sess(SSL *, conn_t *, int);
 #define TLS_SHUTDOWN_FL_BIDIRECTIONAL		0x0001
 
@@ -865,6 +897,39 @@ struct tls_ticket_key {
  * encrypted with older keys will be renewed using the newest key.
  */
 static xaset_t *tls_ticket_keys = NULL;
+
+/* Session ticket keys are generated by the daemon process, on a timer.  So
+ * that session processes can use keys generated after they were forked
+ * (e.g. to resume sessions whose tickets were issued by a newer session
+ * process), the daemon also publishes its keys into an anonymous shared
+ * memory segment, inherited by all session processes.  The daemon is the
+ * only writer; readers use the sequence number to detect, and retry, reads
+ * which raced with an update.
+ */
+#define TLS_TICKET_KEY_SHM_MAX_COUNT		64
+
+struct tls_ticket_key_shared {
+  time_t created;
+  unsigned char key_name[16];
+  unsigned char cipher_key[32];
+  unsigned char hmac_key[32];
+};
+
+struct tls_ticket_key_shm {
+  volatile unsigned int seqno;
+  unsigned int nkeys;
+
+  /* Newest key first. */
+  struct tls_ticket_key_shared keys[TLS_TICKET_KEY_SHM_MAX_COUNT];
+};
+
+static struct tls_ticket_key_shm *tls_ticket_key_shm = NULL;
+
+# if defined(__GNUC__)
+#  define TLS_MEMORY_BARRIER()		__sync_synchronize()
+# else
+#  define TLS_MEMORY_BARRIER()
+# endif /* __GNUC__ */
 #endif
 
 #ifdef PR_USE_CTRLS
@@ -6661,6 +6726,194 @@ static int add_ticket_key(struct tls_ticket_key *k) {
   return res;
 }
 
+/* Daemon PID */
+extern pid_t mpid;
+
+static int create_ticket_key_shm(void) {
+  void *data;
+  size_t datasz;
+  int mmap_flags, fd = -1;
+
+  if (tls_ticket_key_shm != NULL) {
+    return 0;
+  }
+
+  datasz = sizeof(struct tls_ticket_key_shm);
+  mmap_flags = MAP_SHARED;
+
+# if defined(MAP_ANONYMOUS)
+  /* Linux */
+  mmap_flags |= MAP_ANONYMOUS;
+
+# elif defined(MAP_ANON)
+  /* FreeBSD, MacOSX, Solaris, others? */
+  mmap_flags |= MAP_ANON;
+
+# else
+  pr_log_debug(DEBUG8, MOD_TLS_VERSION
+    ": mmap(2) MAP_ANONYMOUS and MAP_ANON flags not defined, unable to "
+    "share session ticket keys");
+  errno = ENOSYS;
+  return -1;
+# endif
+
+  data = mmap(NULL, datasz, PROT_READ|PROT_WRITE, mmap_flags, fd, 0);
+  if (data == MAP_FAILED) {
+    int xerrno = errno;
+
+    pr_log_debug(DEBUG0, MOD_TLS_VERSION
+      ": error mapping %lu bytes for shared session ticket keys: %s",
+      (unsigned long) datasz, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(data, 0, datasz);
+
+# ifdef HAVE_MLOCK
+  {
+    int res, xerrno = 0;
+
+    PRIVS_ROOT
+    res = mlock(data, datasz);
+    xerrno = errno;
+    PRIVS_RELINQUISH
+
+    if (res < 0) {
+      pr_log_debug(DEBUG1, MOD_TLS_VERSION
+        ": error locking shared session ticket keys into memory: %s",
+        strerror(xerrno));
+    }
+  }
+# endif /* HAVE_MLOCK */
+
+  tls_ticket_key_shm = data;
+  return 0;
+}
+
+static void destroy_ticket_key_shm(void) {
+  if (tls_ticket_key_shm == NULL) {
+    return;
+  }
+
+  /* Only the daemon owns (and can write) the shared keys. */
+  if (getpid() == mpid) {
+    pr_memscrub(tls_ticket_key_shm, sizeof(struct tls_ticket_key_shm));
+  }
+
+  (void) munmap((void *) tls_ticket_key_shm, sizeof(struct tls_ticket_key_shm));
+  tls_ticket_key_shm = NULL;
+}
+
+/* Copies the daemon's current list of ticket keys into shared memory. */
+static void publish_ticket_keys(void) {
+  struct tls_ticket_key *k;
+  unsigned int nkeys = 0;
+
+  if (tls_ticket_key_shm == NULL ||
+      tls_ticket_keys == NULL ||
+      getpid() != mpid) {
+    return;
+  }
+
+  /* An odd sequence number tells readers that an update is in progress. */
+  tls_ticket_key_shm->seqno++;
+  TLS_MEMORY_BARRIER();
+
+  for (k = (struct tls_ticket_key *) tls_ticket_keys->xas_list;
+       k != NULL && nkeys < TLS_TICKET_KEY_SHM_MAX_COUNT;
+       k = k->next) {
+    struct tls_ticket_key_shared *sk;
+
+    sk = &(tls_ticket_key_shm->keys[nkeys++]);
+    sk->created = k->created;
+    memcpy(sk->key_name, k->key_name, sizeof(sk->key_name));
+    memcpy(sk->cipher_key, k->cipher_key, sizeof(sk->cipher_key));
+    memcpy(sk->hmac_key, k->hmac_key, sizeof(sk->hmac_key));
+  }
+
+  if (nkeys < tls_ticket_key_shm->nkeys) {
+    pr_memscrub(&(tls_ticket_key_shm->keys[nkeys]),
+      (tls_ticket_key_shm->nkeys - nkeys) *
+        sizeof(struct tls_ticket_key_shared));
+  }
+
+  tls_ticket_key_shm->nkeys = nkeys;
+
+  TLS_MEMORY_BARRIER();
+  tls_ticket_key_shm->seqno++;
+
+  pr_trace_msg(trace_channel, 17, "published %u session ticket %s to shared "
+    "memory", nkeys, nkeys != 1 ? "keys" : "key");
+}
+
+/* Looks up the shared ticket key with the given name, or the newest key if
+ * the given name is NULL, copying it into the given key.  Returns 0 if
+ * found, -1 otherwise.  If found, the newest_created pointer is set to the
+ * creation time of the newest shared key.
+ */
+static int get_shared_ticket_key(const unsigned char *key_name,
+    struct tls_ticket_key *key, time_t *newest_created) {
+  register unsigned int attempt;
+
+  if (tls_ticket_key_shm == NULL) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  for (attempt = 0; attempt < 100; attempt++) {
+    register unsigned int i;
+    unsigned int seqno, nkeys;
+    int found = FALSE;
+
+    seqno = tls_ticket_key_shm->seqno;
+    if (seqno % 2 != 0) {
+      /* Update in progress. */
+      continue;
+    }
+
+    TLS_MEMORY_BARRIER();
+
+    nkeys = tls_ticket_key_shm->nkeys;
+    if (nkeys > TLS_TICKET_KEY_SHM_MAX_COUNT) {
+      nkeys = TLS_TICKET_KEY_SHM_MAX_COUNT;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+      struct tls_ticket_key_shared *sk;
+
+      sk = &(tls_ticket_key_shm->keys[i]);
+      if (key_name == NULL ||
+          memcmp(key_name, sk->key_name, sizeof(sk->key_name)) == 0) {
+        key->created = sk->created;
+        memcpy(key->key_name, sk->key_name, sizeof(key->key_name));
+        memcpy(key->cipher_key, sk->cipher_key, sizeof(key->cipher_key));
+        memcpy(key->hmac_key, sk->hmac_key, sizeof(key->hmac_key));
+        *newest_created = tls_ticket_key_shm->keys[0].created;
+        found = TRUE;
+        break;
+      }
+    }
+
+    TLS_MEMORY_BARRIER();
+    if (tls_ticket_key_shm->seqno != seqno) {
+      /* Raced with an update; try again. */
+      continue;
+    }
+
+    if (found == FALSE) {
+      errno = ENOENT;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
 /* Note: This lookup routine is where we might look in external storage,
  * e.g. Redis/memcache, for clustered/shared pool of ticket keys generated by
  * other servers.
@@ -6687,6 +6940,12 @@ static struct tls_ticket_key *get_ticket_key(unsigned char *key_name,
 static int new_ticket_key_timer_cb(CALLBACK_FRAME) {
   struct tls_ticket_key *k;
 
+  if (tls_ticket_key_shm != NULL &&
+      getpid() != mpid) {
+    /* Session processes use the keys published by the daemon. */
+    return 1;
+  }
+
   pr_log_debug(DEBUG9, MOD_TLS_VERSION
     ": generating new TLS session ticket key");
 
@@ -6697,12 +6956,36 @@ static int new_ticket_key_timer_cb(CALLBACK_FRAME) {
 
   } else {
     add_ticket_key(k);
+    publish_ticket_keys();
   }
 
   /* Always restart this timer. */
   return 1;
 }
 
+/* The daemon is the only writer of the shared ticket keys; session
+ * processes get a read-only view, so that a compromised session process
+ * cannot replace the keys used by all of the others.
+ */
+static void protect_ticket_key_shm(void) {
+  if (tls_ticket_key_shm == NULL ||
+      getpid() == mpid) {
+    return;
+  }
+
+  if (mprotect((void *) tls_ticket_key_shm, sizeof(struct tls_ticket_key_shm),
+      PROT_READ) < 0) {
+    int xerrno = errno;
+
+    /* Without a read-only view, do not use the shared keys at all. */
+    pr_log_debug(DEBUG1, MOD_TLS_VERSION
+      ": error protecting shared session ticket keys: %s", strerror(xerrno));
+    (void) munmap((void *) tls_ticket_key_shm,
+      sizeof(struct tls_ticket_key_shm));
+    tls_ticket_key_shm = NULL;
+  }
+}
+
 /* Remember that mlock(2) locks are not inherited across forks, thus
  * we want to renew those locks for session processes.
  */
@@ -6710,6 +6993,21 @@ static void lock_ticket_keys(void) {
 # ifdef HAVE_MLOCK
   struct tls_ticket_key *k;
 
+  if (tls_ticket_key_shm != NULL) {
+    int res, xerrno = 0;
+
+    PRIVS_ROOT
+    res = mlock((void *) tls_ticket_key_shm, sizeof(struct tls_ticket_key_shm));
+    xerrno = errno;
+    PRIVS_RELINQUISH
+
+    if (res < 0) {
+      pr_log_debug(DEBUG1, MOD_TLS_VERSION
+        ": error locking shared session ticket keys into memory: %s",
+        strerror(xerrno));
+    }
+  }
+
   if (tls_ticket_keys == NULL) {
     return;
   }
@@ -6751,6 +7049,7 @@ static void scrub_ticket_keys(void) {
   }
 
   tls_ticket_keys = NULL;
+  destroy_ticket_key_shm();
 }
 
 /* TLS session ticket _key_ callback; not to be confused with the TLSv1.3
@@ -6759,7 +7058,8 @@ static void scrub_ticket_keys(void) {
 static int tls_ticket_key_cb(SSL *ssl, unsigned char *key_name,
     unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx,
     int mode) {
-  struct tls_ticket_key *k;
+  struct tls_ticket_key *k, shared_key;
+  time_t newest_created = 0;
   char *key_name_str;
 
   /* Note: should we have a list of ciphers from which we randomly choose,
@@ -6780,12 +7080,20 @@ static int tls_ticket_key_cb(SSL *ssl, unsigned char *key_name,
   if (mode == 1) {
     int ticket_key_len, sess_key_len;
 
-    if (tls_ticket_keys == NULL) {
-      return -1;
-    }
+    /* Creating a new session ticket.  Always use the newest key, preferring
+     * the keys shared by the daemon, so that the ticket can be decrypted by
+     * any session process.
+     */
+    if (get_shared_ticket_key(NULL, &shared_key, &newest_created) == 0) {
+      k = &shared_key;
 
-    /* Creating a new session ticket.  Always use the first key in the set. */
-    k = (struct tls_ticket_key *) tls_ticket_keys->xas_list;
+    } else {
+      if (tls_ticket_keys == NULL) {
+        return -1;
+      }
+
+      k = (struct tls_ticket_key *) tls_ticket_keys->xas_list;
+    }
 
     key_name_str = pr_str_bin2hex(session.pool, k->key_name, 16,
       PR_STR_FL_HEX_USE_LC);
@@ -6834,13 +7142,22 @@ static int tls_ticket_key_cb(SSL *ssl, unsigned char *key_name,
   }
 
   if (mode == 0) {
-    struct tls_ticket_key *newest_key;
     time_t key_age, now;
 
     key_name_str = pr_str_bin2hex(session.pool, key_name, 16,
       PR_STR_FL_HEX_USE_LC);
 
-    k = get_ticket_key(key_name, 16);
+    if (get_shared_ticket_key(key_name, &shared_key, &newest_created) == 0) {
+      k = &shared_key;
+
+    } else {
+      k = get_ticket_key(key_name, 16);
+      if (k != NULL) {
+        newest_created = ((struct tls_ticket_key *)
+          tls_ticket_keys->xas_list)->created;
+      }
+    }
+
     if (k == NULL) {
       /* No matching key found. */
       pr_trace_msg(trace_channel, 3,
@@ -6876,11 +7193,10 @@ static int tls_ticket_key_cb(SSL *ssl, unsigned char *key_name,
     time(&now);
     key_age = now - k->created;
 
-    newest_key = (struct tls_ticket_key *) tls_ticket_keys->xas_list;
-    if (k != newest_key) {
+    if (k->created < newest_created) {
       time_t newest_age;
 
-      newest_age = now - newest_key->created;
+      newest_age = now - newest_created;
 
       pr_trace_msg(trace_channel, 3,
         "key '%s' age (%lu %s) older than newest key (%lu %s), requesting "
@@ -7349,6 +7665,11 @@ static SSL_CTX *tls_init_ctx(server_rec *s) {
     } else {
       tls_ticket_keys = xaset_create(permanent_pool, tls_ticket_key_cmp);
       add_ticket_key(k);
+
+      /* Share the keys, as they are rotated, with all session processes. */
+      if (create_ticket_key_shm() == 0) {
+        publish_ticket_keys();
+      }
     }
 
     /* Also register a timer, to generate new keys every hour (or just under
@@ -7383,6 +7704,7 @@ static SSL_CTX *tls_init_ctx(server_rec *s) {
 
     } else {
       add_ticket_key(k);
+      publish_ticket_keys();
     }
   }
 #endif /* TLS_USE_SESSION_TICKETS */
@@ -7558,6 +7880,39 @@ static int tls_compare_session_ids(SSL_SESSION *ctrl_sess,
   return res;
 }
 
+/* Determine whether OpenSSL was able to enable kernel TLS offload for the
+ * given data connection.  If so for sending, we advertise that via a note
+ * on the data write stream, so that modules such as mod_xfer know that they
+ * can use sendfile(2) for this connection.
+ */
+static void tls_data_ktls_check(SSL *ssl) {
+#if defined(TLS_USE_KTLS)
+  int ktls_send, ktls_recv;
+
+  if (!(tls_opts & TLS_OPT_ENABLE_KTLS)) {
+    return;
+  }
+
+  ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+  ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+
+  pr_trace_msg(trace_channel, 9,
+    "kernel TLS offload for data connection (cipher %s): send %s, recv %s",
+    SSL_get_cipher_name(ssl), ktls_send ? "enabled" : "disabled",
+    ktls_recv ? "enabled" : "disabled");
+
+  if (ktls_send) {
+    if (pr_table_add_dup(tls_data_wr_nstrm->notes, TLS_KTLS_SEND_NOTE,
+        "true", 0) < 0) {
+      if (errno != EEXIST) {
+        tls_log("error stashing '%s' note on data write stream: %s",
+          TLS_KTLS_SEND_NOTE, strerror(errno));
+      }
+    }
+  }
+#endif /* TLS_USE_KTLS */
+}
+
 static int tls_accept(conn_t *conn, unsigned char on_data) {
   static unsigned char logged_data = FALSE;
   int blocking, res = 0, xerrno = 0;
@@ -7614,6 +7969,15 @@ static int tls_accept(conn_t *conn, unsigned char on_data) {
   }
 
   if (on_data) {
+#if defined(TLS_USE_KTLS)
+    if (tls_opts & TLS_OPT_ENABLE_KTLS) {
+      /* Ask OpenSSL to hand the record layer off to the kernel, if the
+       * negotiated cipher allows.
+       */
+      SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif /* TLS_USE_KTLS */
+
     /* Make sure that TCP_NODELAY is enabled for the handshake. */
     if (pr_inet_set_proto_nodelay(conn->pool, conn, 1) < 0) {
       pr_trace_msg(trace_channel, 9,
@@ -7926,11 +8290,6 @@ static int tls_accept(conn_t *conn, unsigned char on_data) {
       /* Restore the previous session cache mode. */
       SSL_CTX_set_session_cache_mode(ssl_ctx, cache_mode);
     }
-
-    (void) BIO_set_write_buf_size(wbio,
-      TLS_DATA_ADAPTIVE_WRITE_MIN_BUFFER_SIZE);
-    tls_data_adaptive_bytes_written_ms = 0L;
-    tls_data_adaptive_bytes_written_count = 0;
   }
 
   /* Disable the handshake timer. */
@@ -8030,6 +8389,20 @@ static int tls_accept(conn_t *conn, unsigned char on_data) {
       strm_buf->remaining = strm_buf->buflen;
     }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+    /* The control connection only carries short, latency-sensitive
+     * responses, never bulk data; keep its records at the small size used
+     * at the start of data transfers, so that the client can decrypt each
+     * record as soon as it arrives.
+     */
+    if (SSL_set_max_send_fragment(ssl,
+        (long) TLS_DATA_ADAPTIVE_WRITE_MIN_BUFFER_SIZE) != 1) {
+      pr_trace_msg(trace_channel, 9,
+        "error setting max TLS record size for control connection: %s",
+        tls_get_errors());
+    }
+#endif /* OpenSSL-1.0.0 and later */
+
   } else if (conn == session.d) {
     pr_buffer_t *strm_buf;
 
@@ -8059,6 +8432,9 @@ static int tls_accept(conn_t *conn, unsigned char on_data) {
       strm_buf->current = NULL;
       strm_buf->remaining = strm_buf->buflen;
     }
+
+    tls_data_ktls_check(ssl);
+    tls_data_write_init(ssl);
   }
 
 #if OPENSSL_VERSION_NUMBER == 0x009080cfL
@@ -8352,6 +8728,12 @@ static int tls_connect(conn_t *conn) {
    */
   SSL_set_verify(ssl, SSL_VERIFY_NONE, NULL);
 
+#if defined(TLS_USE_KTLS)
+  if (tls_opts & TLS_OPT_ENABLE_KTLS) {
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+  }
+#endif /* TLS_USE_KTLS */
+
   /* This works with either rfd or wfd (I hope). */
   rbio = BIO_new_socket(conn->rfd, FALSE);
   wbio = BIO_new_socket(conn->rfd, FALSE);
@@ -8509,6 +8891,9 @@ static int tls_connect(conn_t *conn) {
       strm_buf->current = NULL;
       strm_buf->remaining = strm_buf->buflen;
     }
+
+    tls_data_ktls_check(ssl);
+    tls_data_write_init(ssl);
   }
 
 #if OPENSSL_VERSION_NUMBER == 0x009080cfL
@@ -10916,6 +11301,78 @@ static int tls_verify_ocsp(int ok, X509_STORE_CTX *ctx) {
 #endif
 }
 
+/* Dynamic record sizing for data connections: we start with smaller TLS
+ * records, which fit within the initial TCP congestion window and can be
+ * decrypted by the client as soon as they arrive, then switch to full-sized
+ * records for bulk transfer.  Note that the records are sized using the
+ * max send fragment; the write buffer size of our socket BIOs has no
+ * effect.
+ */
+static void tls_data_set_record_size(SSL *ssl, size_t record_size) {
+  if (tls_data_adaptive_record_size == record_size) {
+    return;
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+  if (SSL_set_max_send_fragment(ssl, (long) record_size) != 1) {
+    pr_trace_msg(trace_channel, 9,
+      "error setting max TLS record size to %lu bytes: %s",
+      (unsigned long) record_size, tls_get_errors());
+    return;
+  }
+#endif /* OpenSSL-1.0.0 and later */
+
+  pr_trace_msg(trace_channel, 19,
+    "set max TLS record size for data connection to %lu bytes",
+    (unsigned long) record_size);
+  tls_data_adaptive_record_size = record_size;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/* Counts the write(2) calls made on the data connection socket. */
+static long tls_data_bio_cb(BIO *bio, int oper, const char *argp, size_t len,
+    int argi, long argl, int ret, size_t *processed) {
+  if (oper == (BIO_CB_WRITE|BIO_CB_RETURN)) {
+    tls_data_wstats.syscalls++;
+  }
+
+  return ret;
+}
+#endif /* OpenSSL-1.1.1 and later */
+
+/* Prepare a newly established data connection for writing: reset the
+ * adaptive record sizing and statistics, and allocate the buffer used to
+ * coalesce small writes into full records.
+ */
+static void tls_data_write_init(SSL *ssl) {
+  memset(&tls_data_wstats, 0, sizeof(tls_data_wstats));
+  tls_data_adaptive_bytes_written_ms = 0L;
+  tls_data_adaptive_bytes_written_count = 0;
+  tls_data_adaptive_record_size = 0;
+  tls_data_set_record_size(ssl, TLS_DATA_ADAPTIVE_WRITE_MIN_BUFFER_SIZE);
+
+  tls_data_wbuf = NULL;
+  tls_data_wbuflen = 0;
+
+  if (tls_data_wr_nstrm == NULL ||
+      tls_data_adaptive_record_size == 0) {
+    return;
+  }
+
+  /* With kernel TLS, the kernel builds the records; there is no benefit to
+   * coalescing writes here.
+   */
+  if (pr_table_get(tls_data_wr_nstrm->notes, TLS_KTLS_SEND_NOTE,
+      NULL) == NULL) {
+    tls_data_wbuf = palloc(tls_data_wr_nstrm->strm_pool,
+      TLS_DATA_ADAPTIVE_WRITE_MAX_BUFFER_SIZE);
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  BIO_set_callback_ex(SSL_get_wbio(ssl), tls_data_bio_cb);
+#endif /* OpenSSL-1.1.1 and later */
+}
+
 static ssize_t tls_write(SSL *ssl, const void *buf, size_t len) {
   ssize_t count;
   int lineno, xerrno = 0;
@@ -10948,30 +11405,41 @@ static ssize_t tls_write(SSL *ssl, const void *buf, size_t len) {
     }
   }
 
-  if (ssl != ctrl_ssl) {
-    BIO *wbio;
+  if (ssl != ctrl_ssl &&
+      count > 0) {
     uint64_t now;
 
+    tls_data_wstats.writes++;
+    tls_data_wstats.bytes += count;
+
+    /* OpenSSL does not report the records it sends; estimate them from the
+     * max record size in effect.
+     */
+    if (tls_data_adaptive_record_size > 0) {
+      tls_data_wstats.est_records += ((count +
+        tls_data_adaptive_record_size - 1) / tls_data_adaptive_record_size);
+
+    } else {
+      tls_data_wstats.est_records++;
+    }
+
     (void) pr_gettimeofday_millis(&now);
     tls_data_adaptive_bytes_written_count += count;
-    wbio = SSL_get_wbio(ssl);
 
     if (tls_data_adaptive_bytes_written_count >= TLS_DATA_ADAPTIVE_WRITE_BOOST_THRESHOLD) {
-      /* Boost the buffer size if we've written more than the "boost"
+      /* Boost the record size if we've written more than the "boost"
        * threshold.
        */
-      (void) BIO_set_write_buf_size(wbio,
-        TLS_DATA_ADAPTIVE_WRITE_MAX_BUFFER_SIZE);
+      tls_data_set_record_size(ssl, TLS_DATA_ADAPTIVE_WRITE_MAX_BUFFER_SIZE);
     }
 
     if (now > (tls_data_adaptive_bytes_written_ms + TLS_DATA_ADAPTIVE_WRITE_BOOST_INTERVAL_MS)) {
       /* If it's been longer than the boost interval since our last write,
-       * then reset the buffer size to the smaller version, assuming
+       * then reset the record size to the smaller version, assuming
        * congestion (and thus closing of the TCP congestion window).
        */
       tls_data_adaptive_bytes_written_count = 0;
-      (void) BIO_set_write_buf_size(wbio,
-        TLS_DATA_ADAPTIVE_WRITE_MIN_BUFFER_SIZE);
+      tls_data_set_record_size(ssl, TLS_DATA_ADAPTIVE_WRITE_MIN_BUFFER_SIZE);
     }
 
     tls_data_adaptive_bytes_written_ms = now;
@@ -11739,6 +12207,37 @@ static int tls_sess_cache_add_sess_cb(SSL *ssl, SSL_SESSION *sess) {
     return 1;
   }
 
+#if defined(TLS_USE_SESSION_TICKETS)
+  /* When session tickets are used, sessions established on data connections,
+   * and TLSv1.3 sessions, are resumed statelessly, using tickets encrypted
+   * with the shared ticket keys; there is no need to add them to the
+   * external cache.  This keeps the cache traffic (and locking) for busy
+   * FTPS servers down to the control connection handshakes which need it.
+   */
+  if (tls_use_session_tickets == TRUE) {
+    int skip_cache = FALSE;
+
+    if (ctrl_ssl != NULL &&
+        ssl != ctrl_ssl) {
+      pr_trace_msg(trace_channel, 17, "%s",
+        "not adding data connection SSL session to cache, using session "
+        "tickets");
+      skip_cache = TRUE;
+
+# if defined(TLS1_3_VERSION)
+    } else if (SSL_SESSION_get_protocol_version(sess) == TLS1_3_VERSION) {
+      pr_trace_msg(trace_channel, 17, "%s",
+        "not adding TLSv1.3 SSL session to cache, using session tickets");
+      skip_cache = TRUE;
+# endif /* TLS1_3_VERSION */
+    }
+
+    if (skip_cache == TRUE) {
+      return 0;
+    }
+  }
+#endif /* TLS_USE_SESSION_TICKETS */
+
   pr_trace_msg(trace_channel, 9, "adding new SSL session to '%s' cache",
     tls_sess_cache->cache_name);
 
@@ -11982,6 +12481,11 @@ static int tls_netio_close_cb(pr_netio_stream_t *nstrm) {
       } else if (nstrm->strm_mode == PR_NETIO_IO_WR) {
         tls_data_wr_nstrm = NULL;
 
+        tls_data_flush_pending(ssl);
+        tls_data_log_stats();
+        tls_data_wbuf = NULL;
+        tls_data_wbuflen = 0;
+
         tls_end_sess(ssl, session.d, 0);
         tls_data_netio = NULL;
         tls_flags &= ~TLS_SESS_ON_DATA;
@@ -12191,6 +12695,16 @@ static void tls_data_renegotiate(SSL *ssl) {
     return;
   }
 
+#if defined(TLS_USE_KTLS)
+  /* Renegotiations, and key updates, are not supported once the record
+   * layer has been handed off to the kernel.
+   */
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+      BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+    return;
+  }
+#endif /* TLS_USE_KTLS */
+
   tls_data_renegotiate_current = session.xfer.total_bytes;
 
   if (tls_data_renegotiate_limit > 0 &&
@@ -12337,6 +12851,10 @@ static int tls_netio_shutdown_cb(pr_netio_stream_t *nstrm, int how) {
         wbio_rbytes = BIO_number_read(wbio);
         wbio_wbytes = BIO_number_written(wbio);
 
+        if (nstrm->strm_type == PR_NETIO_STRM_DATA) {
+          tls_data_flush_pending(ssl);
+        }
+
         if (!(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN)) {
 
           /* Disable any socket buffering (Nagle, TCP_CORK), so that the alert
@@ -12387,6 +12905,125 @@ static int tls_netio_shutdown_cb(pr_netio_stream_t *nstrm, int how) {
   return shutdown(nstrm->strm_fd, how);
 }
 
+/* Writes all of the given data to the data connection. */
+static int tls_data_write_all(SSL *ssl, const char *buf, size_t buflen) {
+  size_t offset = 0;
+
+  while (offset < buflen) {
+    ssize_t res;
+
+    pr_signals_handle();
+
+    res = tls_write(ssl, buf + offset, buflen - offset);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    offset += res;
+  }
+
+  return 0;
+}
+
+/* Writes out any coalesced data for the data connection. */
+static int tls_data_flush(SSL *ssl) {
+  int res;
+
+  res = tls_data_write_all(ssl, tls_data_wbuf, tls_data_wbuflen);
+  tls_data_wbuflen = 0;
+
+  return res;
+}
+
+/* Flushes any coalesced data for the data connection, from outside of the
+ * write callback, accounting for the raw bytes written.
+ */
+static void tls_data_flush_pending(SSL *ssl) {
+  BIO *wbio;
+  unsigned long wbio_wbytes;
+
+  if (tls_data_wbuf == NULL ||
+      tls_data_wbuflen == 0) {
+    return;
+  }
+
+  wbio = SSL_get_wbio(ssl);
+  wbio_wbytes = BIO_number_written(wbio);
+
+  if (tls_data_flush(ssl) < 0) {
+    tls_log("error flushing pending data connection data: %s",
+      strerror(errno));
+  }
+
+  session.total_raw_out += (BIO_number_written(wbio) - wbio_wbytes);
+}
+
+/* Copies the given data into the coalescing buffer, sending a full TLS
+ * record each time that buffer reaches the current record size.  Full
+ * records are written directly, without copying, when nothing is already
+ * buffered.
+ */
+static ssize_t tls_data_write(SSL *ssl, const char *buf, size_t buflen) {
+  size_t remaining;
+
+  tls_data_wstats.netio_writes++;
+  remaining = buflen;
+
+  while (remaining > 0) {
+    size_t len;
+
+    if (tls_data_wbuflen == 0 &&
+        remaining >= tls_data_adaptive_record_size) {
+      len = remaining - (remaining % tls_data_adaptive_record_size);
+
+      if (tls_data_write_all(ssl, buf, len) < 0) {
+        return -1;
+      }
+
+      buf += len;
+      remaining -= len;
+      continue;
+    }
+
+    len = tls_data_adaptive_record_size - tls_data_wbuflen;
+    if (len > remaining) {
+      len = remaining;
+    }
+
+    memcpy(tls_data_wbuf + tls_data_wbuflen, buf, len);
+    tls_data_wbuflen += len;
+    buf += len;
+    remaining -= len;
+
+    if (tls_data_wbuflen >= tls_data_adaptive_record_size) {
+      if (tls_data_flush(ssl) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return (ssize_t) buflen;
+}
+
+static void tls_data_log_stats(void) {
+  if (tls_data_wstats.writes == 0) {
+    return;
+  }
+
+  pr_trace_msg(trace_channel, 9, "data connection TLS write stats: "
+    "%" PR_LU " bytes, %" PR_LU " netio writes, %" PR_LU " SSL writes, "
+    "~%" PR_LU " records (estimated), %" PR_LU " socket writes, "
+    "max record size %lu bytes",
+    (pr_off_t) tls_data_wstats.bytes, (pr_off_t) tls_data_wstats.netio_writes,
+    (pr_off_t) tls_data_wstats.writes, (pr_off_t) tls_data_wstats.est_records,
+    (pr_off_t) tls_data_wstats.syscalls,
+    (unsigned long) tls_data_adaptive_record_size);
+}
+
 static int tls_netio_write_cb(pr_netio_stream_t *nstrm, char *buf,
     size_t buflen) {
   SSL *ssl;
@@ -12410,7 +13047,13 @@ static int tls_netio_write_cb(pr_netio_stream_t *nstrm, char *buf,
       tls_data_renegotiate(ssl);
     }
 
-    res = tls_write(ssl, buf, buflen);
+    if (nstrm->strm_type == PR_NETIO_STRM_DATA &&
+        tls_data_wbuf != NULL) {
+      res = tls_data_write(ssl, buf, buflen);
+
+    } else {
+      res = tls_write(ssl, buf, buflen);
+    }
     xerrno = errno;
 
     bread = (BIO_number_read(rbio) - rbio_rbytes) +
@@ -14226,6 +14869,16 @@ MODRET set_tlsoptions(cmd_rec *cmd) {
     } else if (strcmp(cmd->argv[i], "ExportCertData") == 0) {
       opts |= TLS_OPT_EXPORT_CERT_DATA;
 
+    } else if (strcmp(cmd->argv[i], "EnableKTLS") == 0) {
+#if defined(TLS_USE_KTLS)
+      opts |= TLS_OPT_ENABLE_KTLS;
+#else
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "The ", cmd->argv[i],
+        " option cannot be used on this system, as your OpenSSL version "
+        "does not support kernel TLS; requires OpenSSL-3.0.0 or later, "
+        "built with KTLS support", NULL));
+#endif /* TLS_USE_KTLS */
+
     } else if (strcmp(cmd->argv[i], "IgnoreSNI") == 0) {
       opts |= TLS_OPT_IGNORE_SNI;
 
@@ -18583,6 +19236,7 @@ static int tls_sess_init(void) {
   config_rec *c = NULL;
 
 #if defined(TLS_USE_SESSION_TICKETS)
+  protect_ticket_key_shm();
   lock_ticket_keys();
 #endif /* TLS_USE_SESSION_TICKETS */
 
@@ -25,6 +25,8 @@
  *
  * This is mod_tls_shmcache, contrib software for proftpd 1.3.x and above.
  * For more information contact TJ Saunders <tj@castaglia.org>.
+ *
+ * $Libraries: -lpthread$
  */
 
 #include "conf.h"
@@ -38,12 +40,23 @@
 # include <sys/mman.h>
 #endif
 
+/* Use robust, process-shared mutexes for locking the session cache shards,
+ * where supported; otherwise, use fcntl(2) locks on a byte per shard.
+ */
+#if defined(_POSIX_THREAD_PROCESS_SHARED) && \
+    _POSIX_THREAD_PROCESS_SHARED > 0 && \
+    defined(_POSIX_THREAD_ROBUST_PRIO_INHERIT) && \
+    _POSIX_THREAD_ROBUST_PRIO_INHERIT > 0
+# include <pthread.h>
+# define TLS_SHMCACHE_USE_ROBUST_MUTEX	1
+#endif
+
 /* Define if you have the LibreSSL library.  */
 #if defined(LIBRESSL_VERSION_NUMBER)
 # define HAVE_LIBRESSL	1
 #endif
 
-#define MOD_TLS_SHMCACHE_VERSION		"mod_tls_shmcache/0.2"
+#define MOD_TLS_SHMCACHE_VERSION		"mod_tls_shmcache/0.3"
 
 /* Make sure the version of proftpd is as necessary. */
 #if PROFTPD_VERSION_NUMBER < 0x0001030602
@@ -96,12 +109,27 @@ struct sesscache_large_entry {
   const unsigned char *sess_data;
 };
 
-/* The number of entries in the list is determined at run-time, based on
- * the maximum desired size of the shared memory segment.
+/* The session cache is divided into shards, selected by the hash of the
+ * session ID.  Each shard has its own lock, stats, and range of entries, so
+ * that processes handling sessions in different shards do not contend with
+ * each other.
  */
-struct sesscache_data {
+#define TLS_SHMCACHE_SESS_MAX_NSHARDS		16
 
-  /* Cache metadata. */
+/* The maximum number of a shard's entries checked for expired sessions,
+ * each time a session is added to that shard.
+ */
+#define TLS_SHMCACHE_SESS_EXPIRE_BATCHSZ	8
+
+/* Marks a session cache shm segment as initialized with this layout. */
+#define TLS_SHMCACHE_SESS_MAGIC			0x53484d32
+
+struct sesscache_shard {
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+  pthread_mutex_t sh_mutex;
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+
+  /* Shard metadata. */
   unsigned int nhits;
   unsigned int nmisses;
 
@@ -116,23 +144,47 @@ struct sesscache_data {
   unsigned int nexceeded;
   unsigned int exceeded_maxsz;
 
-  /* Track the timestamp of the next session to expire in the cache; used
-   * as an optimization when flushing the cache of expired sessions.
+  /* These track the number of times a process had to wait for the shard
+   * lock, and the number of times the lock was recovered from a process
+   * which died while holding it.
+   */
+  unsigned int ncontended;
+  unsigned int nrecovered;
+
+  /* Track the timestamp of the next session to expire in the shard; used
+   * as an optimization when expiring sessions.  Note that this may be
+   * earlier than the actual next expiration, but is never later.
    */
   time_t next_expiring;
 
-  /* These listlen/listsz track the number of entries in the cache and total
+  /* The index of the entry where the next expiry scan starts. */
+  unsigned int sh_expire_idx;
+
+  /* These listlen/listsz track the number of entries in the shard and total
    * entries possible, and thus can be used for determining the fullness of
-   * the cache.
+   * the shard.
    */
-  unsigned int sd_listlen, sd_listsz;
+  unsigned int sh_listlen, sh_listsz;
+};
 
-  /* It is important that this field be the last in the struct! */
-  struct sesscache_entry *sd_entries;
+/* The number of entries in the list is determined at run-time, based on
+ * the maximum desired size of the shared memory segment.  The entries
+ * follow this header in the segment, with each shard using sh_listsz
+ * consecutive entries.
+ */
+struct sesscache_data {
+  unsigned int sd_magic;
+  unsigned int sd_nshards;
+
+  /* The total number of entries, across all shards. */
+  unsigned int sd_listsz;
+
+  struct sesscache_shard sd_shards[TLS_SHMCACHE_SESS_MAX_NSHARDS];
 };
 
 static tls_sess_cache_t sess_cache;
 static struct sesscache_data *sesscache_data = NULL;
+static struct sesscache_entry *sesscache_entries = NULL;
 static size_t sesscache_datasz = 0;
 static int sesscache_shmid = -1;
 static pr_fh_t *sesscache_fh = NULL;
@@ -364,8 +416,9 @@ static unsigned int shmcache_hash(const unsigned char *id, unsigned int len) {
   unsigned int i = 0;
   size_t sz = len;
 
+  const unsigned char *k = id;
+
   while (sz--) {
-    const unsigned char *k = id;
     unsigned int c = *k;
     k++;
 
@@ -529,12 +582,96 @@ static void *shmcache_get_shm(pr_fh_t *fh, size_t *shm_size, int project_id,
   return data;
 }
 
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+static int sess_cache_init_shard_lock(struct sesscache_shard *shard) {
+  pthread_mutexattr_t attr;
+  int res;
+
+  res = pthread_mutexattr_init(&attr);
+  if (res != 0) {
+    errno = res;
+    return -1;
+  }
+
+  res = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  if (res == 0) {
+    /* A robust mutex lets us recover the lock if a session process dies
+     * while holding it.
+     */
+    res = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  }
+
+  if (res == 0) {
+    res = pthread_mutex_init(&(shard->sh_mutex), &attr);
+  }
+
+  (void) pthread_mutexattr_destroy(&attr);
+
+  if (res != 0) {
+    errno = res;
+    return -1;
+  }
+
+  return 0;
+}
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+
+/* Initialize the shards of a new session cache segment, or of an existing
+ * segment which uses a different layout.  This is done by the daemon
+ * process, before any session processes use the segment.
+ */
+static int sess_cache_init_shm(pr_fh_t *fh, struct sesscache_data *data,
+    size_t shm_size, unsigned int nshards, unsigned int shard_sess_max) {
+  register unsigned int i;
+  int res = 0, xerrno = 0;
+
+  if (shmcache_lock_shm(fh, F_WRLCK) < 0) {
+    pr_trace_msg(trace_channel, 1, "error write-locking shm: %s",
+      strerror(errno));
+  }
+
+  memset(data, 0, shm_size);
+
+  for (i = 0; i < nshards; i++) {
+    struct sesscache_shard *shard;
+
+    shard = &(data->sd_shards[i]);
+    shard->sh_listsz = shard_sess_max;
+
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+    if (sess_cache_init_shard_lock(shard) < 0) {
+      xerrno = errno;
+
+      pr_trace_msg(trace_channel, 1,
+        "error initializing lock for session cache shard %u: %s", i,
+        strerror(xerrno));
+      res = -1;
+      break;
+    }
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+  }
+
+  if (res == 0) {
+    data->sd_nshards = nshards;
+    data->sd_listsz = nshards * shard_sess_max;
+    data->sd_magic = TLS_SHMCACHE_SESS_MAGIC;
+  }
+
+  if (shmcache_lock_shm(fh, F_UNLCK) < 0) {
+    pr_trace_msg(trace_channel, 1, "error unlocking shm: %s",
+      strerror(errno));
+  }
+
+  errno = xerrno;
+  return res;
+}
+
 static struct sesscache_data *sess_cache_get_shm(pr_fh_t *fh,
     size_t requested_size) {
   int shmid, xerrno = 0;
   struct sesscache_data *data = NULL;
   size_t shm_size;
-  unsigned int shm_sess_max = 0;
+  unsigned int nshards, shard_sess_max, shm_sess_max = 0;
 
   /* Calculate the size to allocate.  First, calculate the maximum number
    * of sessions we can cache, given the configured size.  Then
@@ -546,6 +683,21 @@ static struct sesscache_data *sess_cache_get_shm(pr_fh_t *fh,
   shm_size = sizeof(struct sesscache_data) +
     (shm_sess_max * sizeof(struct sesscache_entry));
 
+  /* Divide the sessions evenly among the shards; any remainder goes
+   * unused.
+   */
+  nshards = TLS_SHMCACHE_SESS_MAX_NSHARDS;
+  if (shm_sess_max < nshards) {
+    nshards = shm_sess_max;
+  }
+
+  if (nshards == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  shard_sess_max = shm_sess_max / nshards;
+
   data = shmcache_get_shm(fh, &shm_size, TLS_SHMCACHE_SESS_PROJECT_ID, &shmid);
   if (data == NULL) {
     xerrno = errno;
@@ -558,14 +710,32 @@ static struct sesscache_data *sess_cache_get_shm(pr_fh_t *fh,
     return NULL;
   }
 
+  if (data->sd_magic != TLS_SHMCACHE_SESS_MAGIC ||
+      data->sd_nshards != nshards ||
+      data->sd_listsz != (nshards * shard_sess_max)) {
+    pr_trace_msg(trace_channel, 9,
+      "initializing %u shards of %u sessions for sesscache path '%s'",
+      nshards, shard_sess_max, fh->fh_path);
+
+    if (sess_cache_init_shm(fh, data, shm_size, nshards, shard_sess_max) < 0) {
+      xerrno = errno;
+
+      pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
+        ": error initializing session shm: %s", strerror(xerrno));
+
+      errno = xerrno;
+      return NULL;
+    }
+  }
+
   sesscache_datasz = shm_size;
   sesscache_shmid = shmid;
   pr_trace_msg(trace_channel, 9,
-    "using shm ID %d for sesscache path '%s' (%u sessions)", sesscache_shmid,
-    fh->fh_path, shm_sess_max);
+    "using shm ID %d for sesscache path '%s' (%u sessions, %u shards)",
+    sesscache_shmid, fh->fh_path, data->sd_listsz, data->sd_nshards);
 
-  data->sd_entries = (struct sesscache_entry *) (data + sizeof(struct sesscache_data));
-  data->sd_listsz = shm_sess_max;
+  sesscache_entries = (struct sesscache_entry *) (((char *) data) +
+    sizeof(struct sesscache_data));
 
   return data;
 }
@@ -616,83 +786,235 @@ static struct ocspcache_data *ocsp_cache_get_shm(pr_fh_t *fh,
 /* SSL session cache implementation callbacks.
  */
 
-/* Scan the entire list, clearing out expired sessions.  Logs the number
- * of sessions that expired and updates the header stat.
+static struct sesscache_entry *sess_cache_get_entry(unsigned int shard_idx,
+    unsigned int idx) {
+  struct sesscache_shard *shard;
+
+  shard = &(sesscache_data->sd_shards[shard_idx]);
+  return &(sesscache_entries[(shard_idx * shard->sh_listsz) +
+    (idx % shard->sh_listsz)]);
+}
+
+/* Determine the shard, and the initial slot within that shard, for the
+ * given session ID.
+ */
+static void sess_cache_get_slot(const unsigned char *sess_id,
+    unsigned int sess_id_len, unsigned int *shard_idx, unsigned int *idx) {
+  unsigned int h, nshards;
+
+  h = shmcache_hash(sess_id, sess_id_len);
+  nshards = sesscache_data->sd_nshards;
+
+  *shard_idx = h % nshards;
+  *idx = (h / nshards) % sesscache_data->sd_shards[*shard_idx].sh_listsz;
+}
+
+/* Clears all of the entries in a shard.
  *
- * NOTE: Callers are assumed to handle the locking of the shm before/after
- * calling this function!
+ * NOTE: Callers are assumed to hold the shard lock!
  */
-static unsigned int sess_cache_flush(void) {
+static unsigned int sess_cache_clear_shard(unsigned int shard_idx) {
   register unsigned int i;
-  unsigned int flushed = 0;
-  time_t now, next_expiring = 0;
+  struct sesscache_shard *shard;
+  unsigned int cleared;
 
-  now = time(NULL);
+  shard = &(sesscache_data->sd_shards[shard_idx]);
 
-  /* We always scan the in-memory large session entry list. */
-  if (sesscache_sess_list != NULL) {
-    struct sesscache_large_entry *entries;
+  for (i = 0; i < shard->sh_listsz; i++) {
+    struct sesscache_entry *entry;
 
-    entries = sesscache_sess_list->elts;
-    for (i = 0; i < sesscache_sess_list->nelts; i++) {
-      struct sesscache_large_entry *entry;
+    entry = sess_cache_get_entry(shard_idx, i);
+    entry->expires = 0;
+    pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
+  }
 
-      entry = &(entries[i]);
+  cleared = shard->sh_listlen;
+  shard->sh_listlen = 0;
+  shard->next_expiring = 0;
 
-      if (entry->expires > now) {
-        /* This entry has expired; clear its slot. */
-        entry->expires = 0;
-        pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
-      }
+  return cleared;
+}
+
+static int sess_cache_lock_shard(unsigned int shard_idx) {
+  struct sesscache_shard *shard;
+  int contended = FALSE;
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+  int res;
+#else
+  int fd;
+  struct flock lock;
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+
+  shard = &(sesscache_data->sd_shards[shard_idx]);
+
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+  res = pthread_mutex_trylock(&(shard->sh_mutex));
+  if (res == EBUSY) {
+    contended = TRUE;
+    res = pthread_mutex_lock(&(shard->sh_mutex));
+  }
+
+  if (res == EOWNERDEAD) {
+    /* The previous owner died while holding this lock, possibly while
+     * updating an entry.  Rather than trust the shard's entries, clear them.
+     */
+    tls_log("shmcache: recovering lock for session cache shard %u from "
+      "dead process, clearing shard", shard_idx);
+
+    (void) sess_cache_clear_shard(shard_idx);
+    (void) pthread_mutex_consistent(&(shard->sh_mutex));
+    shard->nrecovered++;
+    res = 0;
+  }
+
+  if (res != 0) {
+    errno = res;
+    return -1;
+  }
+
+#else
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = shard_idx;
+  lock.l_len = 1;
+
+  fd = PR_FH_FD(sesscache_fh);
+
+  while (fcntl(fd, contended ? F_SETLKW : F_SETLK, &lock) < 0) {
+    int xerrno = errno;
+
+    if (xerrno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    if ((xerrno == EACCES || xerrno == EAGAIN) &&
+        contended == FALSE) {
+      /* Another process holds this shard; wait for it. */
+      contended = TRUE;
+      continue;
     }
+
+    errno = xerrno;
+    return -1;
   }
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+
+  if (contended == TRUE) {
+    shard->ncontended++;
+    pr_trace_msg(trace_channel, 19,
+      "waited for lock on session cache shard %u", shard_idx);
+  }
+
+  return 0;
+}
+
+static int sess_cache_unlock_shard(unsigned int shard_idx) {
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+  int res;
+
+  res = pthread_mutex_unlock(&(sesscache_data->sd_shards[shard_idx].sh_mutex));
+  if (res != 0) {
+    errno = res;
+    return -1;
+  }
+
+#else
+  struct flock lock;
+
+  lock.l_type = F_UNLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = shard_idx;
+  lock.l_len = 1;
+
+  while (fcntl(PR_FH_FD(sesscache_fh), F_SETLK, &lock) < 0) {
+    if (errno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    return -1;
+  }
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+
+  return 0;
+}
 
-  /* If now is earlier than the earliest expiring session in the cache,
+/* Scan up to max_scan entries of the shard, starting where the previous scan
+ * stopped, clearing out expired sessions.  Scanning every entry also
+ * updates the shard's next expiring timestamp.  Expiring sessions a few at
+ * a time, as sessions are added, keeps any one lock holder from having to
+ * scan the entire cache.
+ *
+ * NOTE: Callers are assumed to hold the shard lock!
+ */
+static unsigned int sess_cache_expire_shard(unsigned int shard_idx,
+    unsigned int max_scan, time_t now) {
+  register unsigned int i;
+  struct sesscache_shard *shard;
+  unsigned int expired = 0, idx;
+  time_t next_expiring = 0;
+
+  shard = &(sesscache_data->sd_shards[shard_idx]);
+
+  /* If now is earlier than the earliest expiring session in the shard,
    * then a scan will be pointless.
    */
-  if (now < sesscache_data->next_expiring) {
-    unsigned int secs;
-
-    secs = sesscache_data->next_expiring - now;
-    tls_log("shmcache: no expired sessions to flush; %u secs to next "
-      "expiration", secs);
+  if (shard->sh_listlen == 0 ||
+      now < shard->next_expiring) {
     return 0;
   }
 
-  tls_log("shmcache: flushing session cache of expired sessions");
+  if (max_scan > shard->sh_listsz) {
+    max_scan = shard->sh_listsz;
+  }
+
+  idx = shard->sh_expire_idx % shard->sh_listsz;
 
-  for (i = 0; i < sesscache_data->sd_listsz; i++) {
+  for (i = 0; i < max_scan; i++) {
     struct sesscache_entry *entry;
 
-    entry = &(sesscache_data->sd_entries[i]);
-    if (entry->expires > 0) {
-      if (entry->expires > now) {
-        if (entry->expires < next_expiring) {
-          next_expiring = entry->expires;
-        }
+    entry = sess_cache_get_entry(shard_idx, idx + i);
+    if (entry->expires == 0) {
+      continue;
+    }
 
-      } else {
-        /* This entry has expired; clear its slot. */
-        entry->expires = 0;
-        pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
+    if (entry->expires > now) {
+      if (next_expiring == 0 ||
+          entry->expires < next_expiring) {
+        next_expiring = entry->expires;
+      }
 
-        /* Don't forget to update the stats. */
-        sesscache_data->nexpired++;
+      continue;
+    }
 
-        if (sesscache_data->sd_listlen > 0) {
-          sesscache_data->sd_listlen--;
-        }
+    /* This entry has expired; clear its slot. */
+    entry->expires = 0;
+    pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
 
-        flushed++;
-      }
+    /* Don't forget to update the stats. */
+    shard->nexpired++;
+
+    if (shard->sh_listlen > 0) {
+      shard->sh_listlen--;
     }
 
-    sesscache_data->next_expiring = next_expiring;
+    expired++;
   }
 
-  tls_log("shmcache: flushed %u expired %s from session cache", flushed,
-    flushed != 1 ? "sessions" : "session");
-  return flushed;
+  shard->sh_expire_idx = (idx + max_scan) % shard->sh_listsz;
+
+  if (max_scan == shard->sh_listsz) {
+    shard->next_expiring = next_expiring;
+  }
+
+  if (expired > 0) {
+    pr_trace_msg(trace_channel, 9,
+      "expired %u %s from session cache shard %u", expired,
+      expired != 1 ? "sessions" : "session", shard_idx);
+  }
+
+  return expired;
 }
 
 static int sess_cache_open(tls_sess_cache_t *cache, char *info, long timeout) {
@@ -940,6 +1262,7 @@ static int sess_cache_close(tls_sess_cache_t *cache) {
     }
 
     sesscache_data = NULL;
+    sesscache_entries = NULL;
   }
 
   pr_fsio_close(sesscache_fh);
@@ -953,23 +1276,32 @@ static int sess_cache_add_large_sess(tls_sess_cache_t *cache,
   struct sesscache_large_entry *entry = NULL;
 
   if (sess_len > TLS_MAX_SSL_SESSION_SIZE) {
+    unsigned int shard_idx, idx;
+
     /* We may get sessions to add to the list which do not exceed the max
      * size, but instead are here because we couldn't get the lock on the
-     * shmcache.  Don't track these in the 'exceeded' stats'.
+     * shmcache, or the shard was full.  Don't track these in the 'exceeded'
+     * stats'.
      */
 
-    if (shmcache_lock_shm(sesscache_fh, F_WRLCK) == 0) {
-      sesscache_data->nexceeded++;
-      if ((size_t) sess_len > sesscache_data->exceeded_maxsz) {
-        sesscache_data->exceeded_maxsz = sess_len;
+    sess_cache_get_slot(sess_id, sess_id_len, &shard_idx, &idx);
+    if (sess_cache_lock_shard(shard_idx) == 0) {
+      struct sesscache_shard *shard;
+
+      shard = &(sesscache_data->sd_shards[shard_idx]);
+      shard->nexceeded++;
+      if ((size_t) sess_len > shard->exceeded_maxsz) {
+        shard->exceeded_maxsz = sess_len;
       }
 
-      if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-        tls_log("shmcache: error unlocking shmcache: %s", strerror(errno));
+      if (sess_cache_unlock_shard(shard_idx) < 0) {
+        tls_log("shmcache: error unlocking session cache shard %u: %s",
+          shard_idx, strerror(errno));
       }
 
     } else {
-      tls_log("shmcache: error write-locking shmcache: %s", strerror(errno));
+      tls_log("shmcache: error locking session cache shard %u: %s",
+        shard_idx, strerror(errno));
     }
   }
 
@@ -982,17 +1314,22 @@ static int sess_cache_add_large_sess(tls_sess_cache_t *cache,
     entries = sesscache_sess_list->elts;
     now = time(NULL);
     for (i = 0; i < sesscache_sess_list->nelts; i++) {
-      entry = &(entries[i]);
-
-      if (entry->expires > now) {
+      if (entries[i].expires <= now) {
         /* This entry has expired; clear and reuse its slot. */
-        entry->expires = 0;
-        pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
+        entry = &(entries[i]);
+        if (entry->expires > 0) {
+          entry->expires = 0;
+          pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
+        }
 
         break;
       }
     }
 
+    if (entry == NULL) {
+      entry = push_array(sesscache_sess_list);
+    }
+
   } else {
     sesscache_sess_list = make_array(cache->cache_pool, 1,
       sizeof(struct sesscache_large_entry));
@@ -1019,8 +1356,10 @@ static int sess_cache_add_large_sess(tls_sess_cache_t *cache,
 static int sess_cache_add(tls_sess_cache_t *cache, const unsigned char *sess_id,
     unsigned int sess_id_len, time_t expires, SSL_SESSION *sess) {
   register unsigned int i;
-  unsigned int h, idx, last;
-  int found_slot = FALSE, need_lock = TRUE, res = 0, sess_len;
+  unsigned int shard_idx, idx, max_scan;
+  int found_slot = FALSE, res = 0, sess_len;
+  struct sesscache_shard *shard;
+  time_t now;
 
   pr_trace_msg(trace_channel, 9, "adding session to shmcache session cache %p",
     cache);
@@ -1048,120 +1387,86 @@ static int sess_cache_add(tls_sess_cache_t *cache, const unsigned char *sess_id,
       sess, sess_len);
   }
 
-  if (sesscache_data->sd_listlen == sesscache_data->sd_listsz) {
-    /* It appears that the cache is full.  Try flushing any expired
-     * sessions.
-     */
-
-    if (shmcache_lock_shm(sesscache_fh, F_WRLCK) == 0) {
-      if (sess_cache_flush() > 0) {
-        /* If we made room, then do NOT release the lock; we keep the lock
-         * so that we can add the session.
-         */
-        need_lock = FALSE;
-
-      } else {
-        /* Release the lock, and use the "large session" list fallback. */
-        if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-          tls_log("shmcache: error unlocking shmcache: %s", strerror(errno));
-        }
-
-        return sess_cache_add_large_sess(cache, sess_id, sess_id_len, expires,
-          sess, sess_len);
-      }
+  /* Hash the key to find its shard, and where to start looking for an open
+   * slot in that shard.
+   */
+  sess_cache_get_slot(sess_id, sess_id_len, &shard_idx, &idx);
+  shard = &(sesscache_data->sd_shards[shard_idx]);
 
-    } else {
-      tls_log("shmcache: unable to flush shm cache: error write-locking "
-        "shmcache: %s", strerror(errno));
+  if (sess_cache_lock_shard(shard_idx) < 0) {
+    tls_log("shmcache: unable to add session to shm cache: error "
+      "locking session cache shard %u: %s", shard_idx, strerror(errno));
 
-      /* Add this session to the "large session" list instead as a fallback. */
-      return sess_cache_add_large_sess(cache, sess_id, sess_id_len, expires,
-        sess, sess_len);
-    }
+    /* Add this session to the "large session" list instead as a fallback. */
+    return sess_cache_add_large_sess(cache, sess_id, sess_id_len, expires,
+      sess, sess_len);
   }
 
-  /* Hash the key, start looking for an open slot. */
-  h = shmcache_hash(sess_id, sess_id_len);
-  idx = h % sesscache_data->sd_listsz;
-
-  if (need_lock) {
-    if (shmcache_lock_shm(sesscache_fh, F_WRLCK) < 0) {
-      tls_log("shmcache: unable to add session to shm cache: error "
-        "write-locking shmcache: %s", strerror(errno));
-
-      /* Add this session to the "large session" list instead as a fallback. */
-      return sess_cache_add_large_sess(cache, sess_id, sess_id_len, expires,
-        sess, sess_len);
-    }
+  /* Expire a few of the shard's sessions with each add.  If the shard
+   * appears to be full, check all of its sessions.
+   */
+  now = time(NULL);
+  max_scan = TLS_SHMCACHE_SESS_EXPIRE_BATCHSZ;
+  if (shard->sh_listlen == shard->sh_listsz) {
+    max_scan = shard->sh_listsz;
   }
 
-  i = idx;
-  last = idx > 0 ? (idx - 1) : 0;
+  (void) sess_cache_expire_shard(shard_idx, max_scan, now);
 
-  do {
-    struct sesscache_entry *entry;
+  if (shard->sh_listlen < shard->sh_listsz) {
+    for (i = 0; i < shard->sh_listsz; i++) {
+      struct sesscache_entry *entry;
 
-    pr_signals_handle();
+      pr_signals_handle();
 
-    /* Look for the first open slot (i.e. expires == 0). */
-    entry = &(sesscache_data->sd_entries[i]);
-    if (entry->expires == 0) {
-      unsigned char *ptr;
+      /* Look for the first open slot (i.e. expires == 0). */
+      entry = sess_cache_get_entry(shard_idx, idx + i);
+      if (entry->expires == 0) {
+        unsigned char *ptr;
 
-      entry->expires = expires;
-      entry->sess_id_len = sess_id_len;
-      memcpy(entry->sess_id, sess_id, sess_id_len);
-      entry->sess_datalen = sess_len;
+        entry->expires = expires;
+        entry->sess_id_len = sess_id_len;
+        memcpy(entry->sess_id, sess_id, sess_id_len);
+        entry->sess_datalen = sess_len;
 
-      ptr = entry->sess_data;
-      i2d_SSL_SESSION(sess, &ptr);
+        ptr = entry->sess_data;
+        i2d_SSL_SESSION(sess, &ptr);
+
+        shard->sh_listlen++;
+        shard->nstored++;
 
-      sesscache_data->sd_listlen++;
-      sesscache_data->nstored++;
+        if (shard->next_expiring > 0) {
+          if (expires < shard->next_expiring) {
+            shard->next_expiring = expires;
+          }
 
-      if (sesscache_data->next_expiring > 0) {
-        if (expires < sesscache_data->next_expiring) {
-          sesscache_data->next_expiring = expires;
+        } else {
+          shard->next_expiring = expires;
         }
 
-      } else {
-        sesscache_data->next_expiring = expires;
+        found_slot = TRUE;
+        break;
       }
-
-      found_slot = TRUE;
-      break;
-    }
-
-    if (i < sesscache_data->sd_listsz) {
-      i++;
-
-    } else {
-      i = 0;
     }
+  }
 
-  } while (i != last);
+  if (sess_cache_unlock_shard(shard_idx) < 0) {
+    tls_log("shmcache: error unlocking session cache shard %u: %s",
+      shard_idx, strerror(errno));
+  }
 
-  /* There is a race condition possible between the open slots check
-   * above and the scan through the slots.  So if we didn't actually find
-   * an open slot at this point, add it to the "large session" list.
-   */
+  /* If the shard is full, add it to the "large session" list. */
   if (!found_slot) {
     res = sess_cache_add_large_sess(cache, sess_id, sess_id_len, expires, sess,
       sess_len);
   }
 
-  if (need_lock) {
-    if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-      tls_log("shmcache: error unlocking shmcache: %s", strerror(errno));
-    }
-  }
-
   return res;
 }
 
 static SSL_SESSION *sess_cache_get(tls_sess_cache_t *cache,
     const unsigned char *sess_id, unsigned int sess_id_len) {
-  unsigned int h, idx;
+  unsigned int shard_idx, idx;
   SSL_SESSION *sess = NULL;
 
   pr_trace_msg(trace_channel, 9,
@@ -1183,7 +1488,7 @@ static SSL_SESSION *sess_cache_get(tls_sess_cache_t *cache,
         time_t now;
 
         now = time(NULL);
-        if (entry->expires <= now) {
+        if (entry->expires > now) {
           TLS_D2I_SSL_SESSION_CONST unsigned char *ptr;
 
           ptr = entry->sess_data;
@@ -1204,22 +1509,20 @@ static SSL_SESSION *sess_cache_get(tls_sess_cache_t *cache,
     return sess;
   }
 
-  h = shmcache_hash(sess_id, sess_id_len);
-  idx = h % sesscache_data->sd_listsz;
+  sess_cache_get_slot(sess_id, sess_id_len, &shard_idx, &idx);
 
-  if (shmcache_lock_shm(sesscache_fh, F_WRLCK) == 0) {
+  if (sess_cache_lock_shard(shard_idx) == 0) {
     register unsigned int i;
-    unsigned int last;
+    struct sesscache_shard *shard;
 
-    i = idx;
-    last = idx > 0 ? (idx -1) : 0;
+    shard = &(sesscache_data->sd_shards[shard_idx]);
 
-    do {
+    for (i = 0; i < shard->sh_listsz; i++) {
       struct sesscache_entry *entry;
 
       pr_signals_handle();
 
-      entry = &(sesscache_data->sd_entries[i]);
+      entry = sess_cache_get_entry(shard_idx, idx + i);
       if (entry->expires > 0 &&
           entry->sess_id_len == sess_id_len &&
           memcmp(entry->sess_id, sess_id, entry->sess_id_len) == 0) {
@@ -1234,39 +1537,42 @@ static SSL_SESSION *sess_cache_get(tls_sess_cache_t *cache,
           ptr = entry->sess_data;
           sess = d2i_SSL_SESSION(NULL, &ptr, entry->sess_datalen);
           if (sess != NULL) {
-            sesscache_data->nhits++;
+            shard->nhits++;
 
           } else {
             tls_log("shmcache: error retrieving session from session cache: %s",
               shmcache_get_errors());
-            sesscache_data->nerrors++;
+            shard->nerrors++;
           }
-        }
 
-        break;
-      }
+        } else {
+          /* This entry has expired; clear its slot now. */
+          entry->expires = 0;
+          pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
+          shard->nexpired++;
 
-      if (i < sesscache_data->sd_listsz) {
-        i++;
+          if (shard->sh_listlen > 0) {
+            shard->sh_listlen--;
+          }
+        }
 
-      } else {
-        i = 0;
+        break;
       }
-
-    } while (i != last);
+    }
 
     if (sess == NULL) {
-      sesscache_data->nmisses++;
+      shard->nmisses++;
       errno = ENOENT;
     }
 
-    if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-      tls_log("shmcache: error unlocking shmcache: %s", strerror(errno));
+    if (sess_cache_unlock_shard(shard_idx) < 0) {
+      tls_log("shmcache: error unlocking session cache shard %u: %s",
+        shard_idx, strerror(errno));
     }
 
   } else {
     tls_log("shmcache: unable to retrieve session from session cache: error "
-      "write-locking shmcache: %s", strerror(errno));
+      "locking session cache shard %u: %s", shard_idx, strerror(errno));
 
     errno = EPERM;
   }
@@ -1276,7 +1582,7 @@ static SSL_SESSION *sess_cache_get(tls_sess_cache_t *cache,
 
 static int sess_cache_delete(tls_sess_cache_t *cache,
     const unsigned char *sess_id, unsigned int sess_id_len) {
-  unsigned int h, idx;
+  unsigned int shard_idx, idx;
   int res;
 
   pr_trace_msg(trace_channel, 9,
@@ -1302,63 +1608,55 @@ static int sess_cache_delete(tls_sess_cache_t *cache,
     }
   }
 
-  h = shmcache_hash(sess_id, sess_id_len);
-  idx = h % sesscache_data->sd_listsz;
+  sess_cache_get_slot(sess_id, sess_id_len, &shard_idx, &idx);
 
-  if (shmcache_lock_shm(sesscache_fh, F_WRLCK) == 0) {
+  if (sess_cache_lock_shard(shard_idx) == 0) {
     register unsigned int i;
-    unsigned int last;
+    struct sesscache_shard *shard;
 
-    i = idx;
-    last = idx > 0 ? (idx - 1) : 0;
+    shard = &(sesscache_data->sd_shards[shard_idx]);
 
-    do {
+    for (i = 0; i < shard->sh_listsz; i++) {
       struct sesscache_entry *entry;
 
       pr_signals_handle();
 
-      entry = &(sesscache_data->sd_entries[i]);
-      if (entry->sess_id_len == sess_id_len &&
+      entry = sess_cache_get_entry(shard_idx, idx + i);
+      if (entry->expires > 0 &&
+          entry->sess_id_len == sess_id_len &&
           memcmp(entry->sess_id, sess_id, entry->sess_id_len) == 0) {
         time_t now;
 
         pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
 
-        if (sesscache_data->sd_listlen > 0) {
-          sesscache_data->sd_listlen--;
+        if (shard->sh_listlen > 0) {
+          shard->sh_listlen--;
         }
 
         /* Don't forget to update the stats. */
         now = time(NULL);
         if (entry->expires > now) {
-          sesscache_data->ndeleted++;
+          shard->ndeleted++;
 
         } else {
-          sesscache_data->nexpired++;
+          shard->nexpired++;
         }
 
         entry->expires = 0;
         break;
       }
+    }
 
-      if (i < sesscache_data->sd_listsz) {
-        i++;
-
-      } else {
-        i = 0;
-      }
-
-    } while (i != last);
-
-    if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-      tls_log("shmcache: error unlocking shmcache: %s", strerror(errno));
+    if (sess_cache_unlock_shard(shard_idx) < 0) {
+      tls_log("shmcache: error unlocking session cache shard %u: %s",
+        shard_idx, strerror(errno));
     }
 
     res = 0;
 
   } else {
     tls_log("shmcache: unable to delete session from session cache: error "
-      "write-locking shmcache: %s", strerror(errno));
+      "locking session cache shard %u: %s", shard_idx, strerror(errno));
 
     errno = EPERM;
     res = -1;
@@ -1369,7 +1667,7 @@ static int sess_cache_delete(tls_sess_cache_t *cache,
 
 static int sess_cache_clear(tls_sess_cache_t *cache) {
   register unsigned int i;
-  int res;
+  int res = 0;
 
   pr_trace_msg(trace_channel, 9, "clearing shmcache session cache %p", cache);
 
@@ -1391,26 +1689,19 @@ static int sess_cache_clear(tls_sess_cache_t *cache) {
     }
   }
 
-  if (shmcache_lock_shm(sesscache_fh, F_WRLCK) < 0) {
-    tls_log("shmcache: unable to clear cache: error write-locking shmcache: %s",
-      strerror(errno));
-    return -1;
-  }
-
-  for (i = 0; i < sesscache_data->sd_listsz; i++) {
-    struct sesscache_entry *entry;
-
-    entry = &(sesscache_data->sd_entries[i]);
-
-    entry->expires = 0;
-    pr_memscrub((void *) entry->sess_data, entry->sess_datalen);
-  }
+  for (i = 0; i < sesscache_data->sd_nshards; i++) {
+    if (sess_cache_lock_shard(i) < 0) {
+      tls_log("shmcache: unable to clear cache: error locking session cache "
+        "shard %u: %s", i, strerror(errno));
+      return -1;
+    }
 
-  res = sesscache_data->sd_listlen; 
-  sesscache_data->sd_listlen = 0;
+    res += sess_cache_clear_shard(i);
 
-  if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-    tls_log("shmcache: error unlocking shmcache: %s", strerror(errno));
+    if (sess_cache_unlock_shard(i) < 0) {
+      tls_log("shmcache: error unlocking session cache shard %u: %s", i,
+        strerror(errno));
+    }
   }
 
   return res;
@@ -1462,22 +1753,149 @@ static int sess_cache_remove(tls_sess_cache_t *cache) {
   return res;
 }
 
+static void sess_cache_status_sess(pool *tmp_pool,
+    struct sesscache_entry *entry, void (*statusf)(void *, const char *, ...),
+    void *arg) {
+  SSL_SESSION *sess;
+  TLS_D2I_SSL_SESSION_CONST unsigned char *ptr;
+  time_t ts;
+  int ssl_version;
+
+  ptr = entry->sess_data;
+  sess = d2i_SSL_SESSION(NULL, &ptr, entry->sess_datalen); 
+  if (sess == NULL) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_TLS_SHMCACHE_VERSION
+      ": error retrieving session from session cache: %s",
+      shmcache_get_errors());
+    return;
+  }
+
+  statusf(arg, "%s", "  -----BEGIN SSL SESSION PARAMETERS-----");
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  /* XXX Directly accessing these fields cannot be a Good Thing. */
+  if (sess->session_id_length > 0) {
+    char *sess_id_str;
+
+    sess_id_str = pr_str_bin2hex(tmp_pool, sess->session_id,
+      sess->session_id_length, PR_STR_FL_HEX_USE_UC);
+
+    statusf(arg, "    Session ID: %s", sess_id_str);
+  }
+
+  if (sess->sid_ctx_length > 0) {
+    char *sid_ctx_str;
+
+    sid_ctx_str = pr_str_bin2hex(tmp_pool, sess->sid_ctx,
+      sess->sid_ctx_length, PR_STR_FL_HEX_USE_UC);
+
+    statusf(arg, "    Session ID Context: %s", sid_ctx_str);
+  }
+
+  ssl_version = sess->ssl_version;
+#else
+# if OPENSSL_VERSION_NUMBER >= 0x10100006L && \
+     !defined(HAVE_LIBRESSL)
+  ssl_version = SSL_SESSION_get_protocol_version(sess);
+# else
+  ssl_version = 0;
+# endif /* prior to OpenSSL-1.1.0-pre5 */
+#endif /* prior to OpenSSL-1.1.x */
+
+  switch (ssl_version) {
+    case SSL3_VERSION:
+      statusf(arg, "    Protocol: %s", "SSLv3");
+      break;
+
+    case TLS1_VERSION:
+      statusf(arg, "    Protocol: %s", "TLSv1");
+      break;
+
+#if defined(TLS1_1_VERSION)
+    case TLS1_1_VERSION:
+      statusf(arg, "    Protocol: %s", "TLSv1.1");
+      break;
+#endif /* TLS1_1_VERSION */
+
+#if defined(TLS1_2_VERSION)
+    case TLS1_2_VERSION:
+      statusf(arg, "    Protocol: %s", "TLSv1.2");
+      break;
+#endif /* TLS1_2_VERSION */
+
+#ifdef TLS1_3_VERSION
+    case TLS1_3_VERSION:
+      statusf(arg, "    Protocol: %s", "TLSv1.3");
+      break;
+#endif /* TLS1_3_VERSION */
+
+    default:
+      statusf(arg, "    Protocol: %s", "unknown");
+  }
+
+  ts = SSL_SESSION_get_time(sess);
+  statusf(arg, "    Started: %s", pr_strtime3(tmp_pool, ts, FALSE));
+  ts = entry->expires;
+  statusf(arg, "    Expires: %s (%u secs)",
+    pr_strtime3(tmp_pool, ts, FALSE), SSL_SESSION_get_timeout(sess));
+
+  SSL_SESSION_free(sess);
+  statusf(arg, "%s", "  -----END SSL SESSION PARAMETERS-----");
+  statusf(arg, "%s", "");
+}
+
 static int sess_cache_status(tls_sess_cache_t *cache,
     void (*statusf)(void *, const char *, ...), void *arg, int flags) {
+  register unsigned int i;
   int res, xerrno = 0;
   struct shmid_ds ds;
+  struct sesscache_shard *shards, totals;
+  unsigned int nshards, listlen = 0;
   pool *tmp_pool;
 
   pr_trace_msg(trace_channel, 9, "checking shmcache session cache %p", cache);
 
-  if (shmcache_lock_shm(sesscache_fh, F_RDLCK) < 0) {
-    pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
-      ": error read-locking shmcache: %s", strerror(errno));
-    return -1;
-  }
-
   tmp_pool = make_sub_pool(permanent_pool);
 
+  /* Take a snapshot of each shard's stats, locking each shard in turn. */
+  nshards = sesscache_data->sd_nshards;
+  shards = pcalloc(tmp_pool, nshards * sizeof(struct sesscache_shard));
+  memset(&totals, 0, sizeof(totals));
+
+  for (i = 0; i < nshards; i++) {
+    struct sesscache_shard *shard;
+
+    if (sess_cache_lock_shard(i) < 0) {
+      pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
+        ": error locking session cache shard %u: %s", i, strerror(errno));
+      destroy_pool(tmp_pool);
+      return -1;
+    }
+
+    memcpy(&(shards[i]), &(sesscache_data->sd_shards[i]),
+      sizeof(struct sesscache_shard));
+
+    if (sess_cache_unlock_shard(i) < 0) {
+      pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
+        ": error unlocking session cache shard %u: %s", i, strerror(errno));
+    }
+
+    shard = &(shards[i]);
+    listlen += shard->sh_listlen;
+    totals.nhits += shard->nhits;
+    totals.nmisses += shard->nmisses;
+    totals.nstored += shard->nstored;
+    totals.ndeleted += shard->ndeleted;
+    totals.nexpired += shard->nexpired;
+    totals.nerrors += shard->nerrors;
+    totals.nexceeded += shard->nexceeded;
+    if (shard->exceeded_maxsz > totals.exceeded_maxsz) {
+      totals.exceeded_maxsz = shard->exceeded_maxsz;
+    }
+    totals.ncontended += shard->ncontended;
+    totals.nrecovered += shard->nrecovered;
+  }
+
   statusf(arg, "%s", "Shared memory (shm) SSL session cache provided by "
     MOD_TLS_SHMCACHE_VERSION);
   statusf(arg, "%s", "");
@@ -1499,35 +1917,51 @@ static int sess_cache_status(tls_sess_cache_t *cache,
   } else {
     statusf(arg, "Unable to stat shared memory segment ID %d: %s",
       sesscache_shmid, strerror(xerrno));
-  } 
+  }
 
   statusf(arg, "%s", "");
   statusf(arg, "Max session cache size: %u", sesscache_data->sd_listsz);
-  statusf(arg, "Current session cache size: %u", sesscache_data->sd_listlen);
+  statusf(arg, "Current session cache size: %u", listlen);
   statusf(arg, "%s", "");
-  statusf(arg, "Cache lifetime hits: %u", sesscache_data->nhits);
-  statusf(arg, "Cache lifetime misses: %u", sesscache_data->nmisses);
+  statusf(arg, "Cache lifetime hits: %u", totals.nhits);
+  statusf(arg, "Cache lifetime misses: %u", totals.nmisses);
   statusf(arg, "%s", "");
-  statusf(arg, "Cache lifetime sessions stored: %u", sesscache_data->nstored);
-  statusf(arg, "Cache lifetime sessions deleted: %u", sesscache_data->ndeleted);
-  statusf(arg, "Cache lifetime sessions expired: %u", sesscache_data->nexpired);
+  statusf(arg, "Cache lifetime sessions stored: %u", totals.nstored);
+  statusf(arg, "Cache lifetime sessions deleted: %u", totals.ndeleted);
+  statusf(arg, "Cache lifetime sessions expired: %u", totals.nexpired);
   statusf(arg, "%s", "");
   statusf(arg, "Cache lifetime errors handling sessions in cache: %u",
-    sesscache_data->nerrors);
+    totals.nerrors);
   statusf(arg, "Cache lifetime sessions exceeding max entry size: %u",
-    sesscache_data->nexceeded);
-  if (sesscache_data->nexceeded > 0) {
+    totals.nexceeded);
+  if (totals.nexceeded > 0) {
     statusf(arg, "  Largest session exceeding max entry size: %u",
-      sesscache_data->exceeded_maxsz);
+      totals.exceeded_maxsz);
   }
 
-  if (flags & TLS_SESS_CACHE_STATUS_FL_SHOW_SESSIONS) {
-    register unsigned int i;
+  statusf(arg, "%s", "");
+#if defined(TLS_SHMCACHE_USE_ROBUST_MUTEX)
+  statusf(arg, "Cache shards: %u (locked using mutexes)", nshards);
+#else
+  statusf(arg, "Cache shards: %u (locked using fcntl(2))", nshards);
+#endif /* TLS_SHMCACHE_USE_ROBUST_MUTEX */
+  statusf(arg, "Cache lifetime contended shard locks: %u", totals.ncontended);
+  statusf(arg, "Cache lifetime recovered shard locks: %u", totals.nrecovered);
+
+  for (i = 0; i < nshards; i++) {
+    struct sesscache_shard *shard;
+
+    shard = &(shards[i]);
+    statusf(arg, "  Shard %u: %u/%u sessions, %u hits, %u misses, "
+      "%u contended locks", i, shard->sh_listlen, shard->sh_listsz,
+      shard->nhits, shard->nmisses, shard->ncontended);
+  }
 
+  if (flags & TLS_SESS_CACHE_STATUS_FL_SHOW_SESSIONS) {
     statusf(arg, "%s", "");
     statusf(arg, "%s", "Cached sessions:");
 
-    if (sesscache_data->sd_listlen == 0) {
+    if (listlen == 0) {
       statusf(arg, "%s", "  (none)");
     }
 
@@ -1541,108 +1975,33 @@ static int sess_cache_status(tls_sess_cache_t *cache,
      * of rolling our own printing function.
      */
 
-    for (i = 0; i < sesscache_data->sd_listsz; i++) {
-      struct sesscache_entry *entry;
-
-      pr_signals_handle();
-
-      entry = &(sesscache_data->sd_entries[i]);
-      if (entry->expires > 0) {
-        SSL_SESSION *sess;
-        TLS_D2I_SSL_SESSION_CONST unsigned char *ptr;
-        time_t ts;
-        int ssl_version;
-
-        ptr = entry->sess_data;
-        sess = d2i_SSL_SESSION(NULL, &ptr, entry->sess_datalen); 
-        if (sess == NULL) {
-          pr_log_pri(PR_LOG_NOTICE, MOD_TLS_SHMCACHE_VERSION
-            ": error retrieving session from session cache: %s",
-            shmcache_get_errors());
-          continue;
-        }
-
-        statusf(arg, "%s", "  -----BEGIN SSL SESSION PARAMETERS-----");
-
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-        /* XXX Directly accessing these fields cannot be a Good Thing. */
-        if (sess->session_id_length > 0) {
-          char *sess_id_str;
-
-          sess_id_str = pr_str_bin2hex(tmp_pool, sess->session_id,
-            sess->session_id_length, PR_STR_FL_HEX_USE_UC);
-
-          statusf(arg, "    Session ID: %s", sess_id_str);
-        }
-
-        if (sess->sid_ctx_length > 0) {
-          char *sid_ctx_str;
-
-          sid_ctx_str = pr_str_bin2hex(tmp_pool, sess->sid_ctx,
-            sess->sid_ctx_length, PR_STR_FL_HEX_USE_UC);
-
-          statusf(arg, "    Session ID Context: %s", sid_ctx_str);
-        }
-
-        ssl_version = sess->ssl_version;
-#else
-# if OPENSSL_VERSION_NUMBER >= 0x10100006L && \
-     !defined(HAVE_LIBRESSL)
-        ssl_version = SSL_SESSION_get_protocol_version(sess);
-# else
-        ssl_version = 0;
-# endif /* prior to OpenSSL-1.1.0-pre5 */
-#endif /* prior to OpenSSL-1.1.x */
-
-        switch (ssl_version) {
-          case SSL3_VERSION:
-            statusf(arg, "    Protocol: %s", "SSLv3");
-            break;
+    for (i = 0; i < nshards; i++) {
+      register unsigned int j;
 
-          case TLS1_VERSION:
-            statusf(arg, "    Protocol: %s", "TLSv1");
-            break;
+      if (sess_cache_lock_shard(i) < 0) {
+        pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
+          ": error locking session cache shard %u: %s", i, strerror(errno));
+        continue;
+      }
 
-#if defined(TLS1_1_VERSION)
-          case TLS1_1_VERSION:
-            statusf(arg, "    Protocol: %s", "TLSv1.1");
-            break;
-#endif /* TLS1_1_VERSION */
+      for (j = 0; j < sesscache_data->sd_shards[i].sh_listsz; j++) {
+        struct sesscache_entry *entry;
 
-#if defined(TLS1_2_VERSION)
-          case TLS1_2_VERSION:
-            statusf(arg, "    Protocol: %s", "TLSv1.2");
-            break;
-#endif /* TLS1_2_VERSION */
-
-#ifdef TLS1_3_VERSION
-          case TLS1_3_VERSION:
-            statusf(arg, "    Protocol: %s", "TLSv1.3");
-            break;
-#endif /* TLS1_3_VERSION */
+        pr_signals_handle();
 
-          default:
-            statusf(arg, "    Protocol: %s", "unknown");
+        entry = sess_cache_get_entry(i, j);
+        if (entry->expires > 0) {
+          sess_cache_status_sess(tmp_pool, entry, statusf, arg);
         }
+      }
 
-        ts = SSL_SESSION_get_time(sess);
-        statusf(arg, "    Started: %s", pr_strtime3(tmp_pool, ts, FALSE));
-        ts = entry->expires;
-        statusf(arg, "    Expires: %s (%u secs)",
-          pr_strtime3(tmp_pool, ts, FALSE), SSL_SESSION_get_timeout(sess));
-
-        SSL_SESSION_free(sess);
-        statusf(arg, "%s", "  -----END SSL SESSION PARAMETERS-----");
-        statusf(arg, "%s", "");
+      if (sess_cache_unlock_shard(i) < 0) {
+        pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
+          ": error unlocking session cache shard %u: %s", i, strerror(errno));
       }
     }
   }
 
-  if (shmcache_lock_shm(sesscache_fh, F_UNLCK) < 0) {
-    pr_log_debug(DEBUG1, MOD_TLS_SHMCACHE_VERSION
-      ": error unlocking shmcache: %s", strerror(errno));
-  }
-
   destroy_pool(tmp_pool);
   return 0;
 }
@@ -400,6 +400,51 @@ int pr_fs_copy_file2(const char *src, const char *dst, int flags,
   void (*progress_cb)(int));
 #define PR_FSIO_COPY_FILE_FL_NO_DELETE_ON_FAILURE	0x0001
 
+/* An entry found while walking a directory tree. */
+typedef struct fs_walk_ent_rec {
+  /* Pool for this entry; destroyed once the entry has been handled. */
+  pool *ent_pool;
+
+  /* The full path of this entry, and its name within its parent directory. */
+  const char *ent_path;
+  const char *ent_name;
+
+  /* The lstat(2) information for this entry. */
+  struct stat ent_st;
+
+  /* What this entry is, and how far below the starting directory it is. */
+  int ent_type;
+  unsigned int ent_depth;
+
+  /* Descriptor of the parent directory, or -1 if the walk is path-based. */
+  int ent_dirfd;
+
+} pr_fs_walk_ent_t;
+
+#define PR_FS_WALK_ENT_FILE		1
+#define PR_FS_WALK_ENT_DIR		2
+#define PR_FS_WALK_ENT_DIR_DONE		3
+
+/* Walk the directory tree rooted at the given path, invoking the callback
+ * for every entry below (but not including) that directory.  Directories
+ * are reported twice: as PR_FS_WALK_ENT_DIR before their contents, and as
+ * PR_FS_WALK_ENT_DIR_DONE after them.  Symlinks are reported, not followed.
+ *
+ * When no FSIO handlers are overriding the system defaults, the walk uses
+ * directory descriptors (openat(2), fstatat(2)), avoiding the FSIO path
+ * lookups for every entry; otherwise it uses the pr_fsio_* functions.
+ *
+ * If the callback returns -1, the walk stops, and -1 is returned (with the
+ * errno from the callback).
+ */
+int pr_fs_walk(pool *p, const char *path,
+  int (*cb)(pr_fs_walk_ent_t *ent, void *user_data), void *user_data);
+
+/* Remove the given walked entry, i.e. unlink a file, or remove a directory
+ * (once its contents have been removed).
+ */
+int pr_fs_walk_remove(pr_fs_walk_ent_t *ent);
+
 int pr_fs_setcwd(const char *);
 const char *pr_fs_getcwd(void);
 const char *pr_fs_getvwd(void);
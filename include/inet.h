@@ -169,6 +169,27 @@ conn_t *pr_inet_openrw(pool *, conn_t *, const pr_netaddr_t *, int, int, int,
 int pr_inet_generate_socket_event(const char *, server_rec *,
   const pr_netaddr_t *, int);
 
+/* Accept filters let modules reject a newly accepted control connection,
+ * based only on its addresses, in the daemon process, i.e. before a session
+ * process is forked for it.  The callback is given a conn_t whose local and
+ * remote addresses/ports are filled in; it returns -1 to reject the
+ * connection, zero otherwise.  Note that the callbacks run in the daemon
+ * process, and thus must not block.
+ */
+int pr_inet_register_accept_filter(module *m,
+  int (*cb)(pool *, conn_t *, void *), void *user_data);
+
+/* Unregisters the given callback for the given module.  A NULL module
+ * or callback matches any.
+ */
+int pr_inet_unregister_accept_filter(module *m,
+  int (*cb)(pool *, conn_t *, void *));
+
+/* Consults the registered accept filters for the connection on the given
+ * socket.  Returns -1, with errno set, if any filter rejects the connection.
+ */
+int pr_inet_check_accept_filters(int fd);
+
 void init_inet(void);
 
 #endif /* PR_INET_H */
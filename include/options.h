@@ -184,14 +184,34 @@
 # define PR_TUNABLE_SCOREBOARD_SCRUB_TIMER	30
 #endif
 
-/* Maximum number of attempted updates to the scoreboard during a
- * file transfer before an actual write is done.  This is to allow
- * an optimization where the scoreboard is not updated on every loop
- * through the transfer buffer.
+/* Number of slots in the table, shared by all sessions, of aggregate counts
+ * of the scoreboard entries (e.g. per client address, per user).  Each
+ * session uses up to 11 slots, fewer when its user, address or class is
+ * shared with other sessions.
  */
 
-#ifndef PR_TUNABLE_XFER_SCOREBOARD_UPDATES
-# define PR_TUNABLE_XFER_SCOREBOARD_UPDATES	10
+#ifndef PR_TUNABLE_SCOREBOARD_COUNTS
+# define PR_TUNABLE_SCOREBOARD_COUNTS		65536
+#endif
+
+/* Minimum interval, in milliseconds, between writes of the transfer
+ * progress to the scoreboard during a file transfer.  Progress between
+ * writes is kept only in the session's in-memory copy of its entry, so that
+ * the cost of keeping the scoreboard current depends on the transfer time,
+ * rather than on the number of buffers transferred.
+ */
+
+#ifndef PR_TUNABLE_XFER_SCOREBOARD_INTERVAL
+# define PR_TUNABLE_XFER_SCOREBOARD_INTERVAL	250
+#endif
+
+/* Number of buckets in the table shared by all sessions, for the
+ * SharedTransferRate limits.  Each "class" and "user" limit in use needs
+ * its own bucket.
+ */
+
+#ifndef PR_TUNABLE_XFER_SHARED_RATE_BUCKETS
+# define PR_TUNABLE_XFER_SHARED_RATE_BUCKETS	1024
 #endif
 
 #ifndef PR_TUNABLE_CALLER_DEPTH
@@ -121,6 +121,23 @@ typedef struct {
 #define PR_SCORE_XFER_ELAPSED	16
 #define PR_SCORE_PROTOCOL	17
 
+/* Scoreboard count types.  All but the PR_SCORE_COUNT_HOST, _USER and _CLASS
+ * counts are per server address (as in the PR_SCORE_SERVER_ADDR field).  The
+ * PR_SCORE_COUNT_AUTH* and PR_SCORE_COUNT_SERVER_USER* counts only include
+ * authenticated sessions.  Class names are compared case-insensitively.
+ */
+#define PR_SCORE_COUNT_SERVER		1
+#define PR_SCORE_COUNT_SERVER_HOST	2
+#define PR_SCORE_COUNT_SERVER_CLASS	3
+#define PR_SCORE_COUNT_AUTH		4
+#define PR_SCORE_COUNT_AUTH_HOST	5
+#define PR_SCORE_COUNT_AUTH_CLASS	6
+#define PR_SCORE_COUNT_SERVER_USER	7
+#define PR_SCORE_COUNT_SERVER_USER_HOST	8
+#define PR_SCORE_COUNT_HOST		9
+#define PR_SCORE_COUNT_USER		10
+#define PR_SCORE_COUNT_CLASS		11
+
 /* Scoreboard error values */
 #define PR_SCORE_ERR_BAD_MAGIC		-2
 #define PR_SCORE_ERR_OLDER_VERSION	-3
@@ -149,6 +166,30 @@ pr_scoreboard_entry_t *pr_scoreboard_entry_read(void);
 const char *pr_scoreboard_entry_get(int);
 int pr_scoreboard_entry_kill(pr_scoreboard_entry_t *, int);
 int pr_scoreboard_entry_update(pid_t, ...);
+
+/* Like pr_scoreboard_entry_update(), except that the changes are only made
+ * to the in-memory copy of the entry; they are written out to the scoreboard
+ * by the next pr_scoreboard_entry_update() or pr_scoreboard_entry_flush()
+ * call.  Useful for frequently changing values, such as transfer progress.
+ */
+int pr_scoreboard_entry_set(pid_t, ...);
+int pr_scoreboard_entry_flush(void);
+
+/* Maps the memory, shared by all session processes, holding the aggregate
+ * counts of the scoreboard entries.  Called by the daemon, before forking
+ * any sessions.
+ */
+int pr_scoreboard_counts_init(void);
+
+/* Looks up the number of scoreboard entries for the given PR_SCORE_COUNT_*
+ * type; the server address, client address, user and class arguments not
+ * used by that type may be NULL.  Returns -1 if the counts are not available
+ * (e.g. for "ServerType inetd"), in which case the caller needs to read
+ * the scoreboard entries instead.
+ */
+int pr_scoreboard_count_get(int type, const char *server_addr,
+  const char *client_addr, const char *user, const char *class_name,
+  unsigned int *count);
 int pr_scoreboard_entry_lock(int, int);
 
 #endif /* PR_SCOREBOARD_H */
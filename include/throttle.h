@@ -27,8 +27,27 @@
 #ifndef PR_THROTTLE_H
 #define PR_THROTTLE_H
 
+/* Scopes of the SharedTransferRate limits, i.e. which sessions draw from
+ * the same bucket.
+ */
+#define PR_THROTTLE_SCOPE_GLOBAL	1
+#define PR_THROTTLE_SCOPE_CLASS		2
+#define PR_THROTTLE_SCOPE_USER		3
+
 int pr_throttle_have_rate(void);
 void pr_throttle_init(cmd_rec *);
 void pr_throttle_pause(off_t, int);
 
+/* Returns the number of bytes to send at once, when pacing a throttled
+ * transfer which is sent in chunks (e.g. using sendfile(2)), or zero if
+ * no throttling is in effect.
+ */
+off_t pr_throttle_get_chunk_len(void);
+
+/* Maps the table of buckets used for SharedTransferRate limits.  This must
+ * be called in the daemon process, before any sessions are forked, so that
+ * all of the session processes share the same table.
+ */
+int pr_throttle_shared_init(void);
+
 #endif /* PR_THROTTLE_H */
@@ -61,6 +61,8 @@ static int saw_first_user_cmd = FALSE;
 static const char *timing_channel = "timing";
 
 static int auth_count_scoreboard(cmd_rec *, const char *);
+static int auth_get_scoreboard_counts(config_rec *, const char *,
+  const char *, long *, long *, long *, long *, long *);
 static int auth_scan_scoreboard(void);
 static int auth_sess_init(void);
 
@@ -1970,38 +1972,55 @@ static int auth_scan_scoreboard(void) {
     pr_netaddr_get_ipstr(session.c->local_addr), main_server->ServerPort);
   curr_server_addr[sizeof(curr_server_addr)-1] = '\0';
 
-  /* Determine how many users are currently connected */
-  if (pr_rewind_scoreboard() < 0) {
-    pr_log_pri(PR_LOG_NOTICE, "error rewinding scoreboard: %s",
-      strerror(errno));
-  }
+  /* Determine how many users are currently connected, preferably using
+   * the scoreboard counts.
+   */
+  if (pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER, curr_server_addr, NULL,
+        NULL, NULL, &cur) == 0 &&
+      pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_HOST, curr_server_addr,
+        client_addr, NULL, NULL, &hcur) == 0 &&
+      (session.conn_class == NULL ||
+       pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH_CLASS, curr_server_addr,
+         NULL, NULL, session.conn_class->cls_name, &ccur) == 0)) {
+    pr_trace_msg("auth", 17, "using scoreboard counts for '%s': "
+      "%u clients, %u from host, %u in class", curr_server_addr, cur, hcur,
+      ccur);
 
-  while ((score = pr_scoreboard_entry_read()) != NULL) {
-    pr_signals_handle();
+  } else {
+    cur = hcur = ccur = 0;
+
+    if (pr_rewind_scoreboard() < 0) {
+      pr_log_pri(PR_LOG_NOTICE, "error rewinding scoreboard: %s",
+        strerror(errno));
+    }
 
-    /* Make sure it matches our current server */
-    if (strcmp(score->sce_server_addr, curr_server_addr) == 0) {
-      cur++;
+    while ((score = pr_scoreboard_entry_read()) != NULL) {
+      pr_signals_handle();
 
-      if (strcmp(score->sce_client_addr, client_addr) == 0) {
-        hcur++;
-      }
+      /* Make sure it matches our current server */
+      if (strcmp(score->sce_server_addr, curr_server_addr) == 0) {
+        cur++;
 
-      /* Only count up authenticated clients, as per the documentation. */
-      if (strcmp(score->sce_user, "(none)") == 0) {
-        continue;
-      }
+        if (strcmp(score->sce_client_addr, client_addr) == 0) {
+          hcur++;
+        }
 
-      /* Note: the class member of the scoreboard entry will never be
-       * NULL.  At most, it may be the empty string.
-       */
-      if (session.conn_class != NULL &&
-          strcasecmp(score->sce_class, session.conn_class->cls_name) == 0) {
-        ccur++;
+        /* Only count up authenticated clients, as per the documentation. */
+        if (strcmp(score->sce_user, "(none)") == 0) {
+          continue;
+        }
+
+        /* Note: the class member of the scoreboard entry will never be
+         * NULL.  At most, it may be the empty string.
+         */
+        if (session.conn_class != NULL &&
+            strcasecmp(score->sce_class, session.conn_class->cls_name) == 0) {
+          ccur++;
+        }
       }
     }
+    pr_restore_scoreboard();
   }
-  pr_restore_scoreboard();
 
   key = "client-count";
   (void) pr_table_remove(session.notes, key, NULL);
@@ -2090,6 +2109,70 @@ static int have_client_limits(cmd_rec *cmd) {
   return FALSE;
 }
 
+/* Fills in the counts used by auth_count_scoreboard() from the scoreboard
+ * counts, if available; these match what reading each scoreboard entry
+ * would yield.
+ */
+static int auth_get_scoreboard_counts(config_rec *c, const char *user,
+    const char *server_addr, long *cur, long *hcur, long *ccur,
+    long *usersessions, long *hostsperuser) {
+  const char *client_addr;
+  unsigned int n = 0, nhost = 0, nclass = 0, nuser = 0, nuserhost = 0;
+
+  client_addr = pr_netaddr_get_ipstr(session.c->remote_addr);
+
+  if (c != NULL &&
+      c->config_type == CONF_ANON) {
+    /* Only the sessions of the anonymous user are counted. */
+    if (pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_USER, server_addr,
+          NULL, user, NULL, &nuser) < 0 ||
+        pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_USER_HOST, server_addr,
+          client_addr, user, NULL, &nuserhost) < 0) {
+      return -1;
+    }
+
+    n = nuser;
+    nhost = nuserhost;
+
+  } else if (c == NULL) {
+    if (pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH, server_addr, NULL, NULL,
+          NULL, &n) < 0 ||
+        pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH_HOST, server_addr,
+          client_addr, NULL, NULL, &nhost) < 0 ||
+        pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_USER, server_addr,
+          NULL, user, NULL, &nuser) < 0 ||
+        pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_USER_HOST, server_addr,
+          client_addr, user, NULL, &nuserhost) < 0) {
+      return -1;
+    }
+  }
+
+  /* As when reading each entry, only authenticated sessions count towards
+   * the class, except for anonymous logins.
+   */
+  if (session.conn_class != NULL &&
+      pr_scoreboard_count_get(c == NULL ? PR_SCORE_COUNT_AUTH_CLASS :
+        PR_SCORE_COUNT_SERVER_CLASS, server_addr, NULL, NULL,
+        session.conn_class->cls_name, &nclass) < 0) {
+    return -1;
+  }
+
+  *cur = n;
+  *hcur = nhost;
+  *ccur = nclass;
+  *usersessions = nuser;
+
+  /* Each of the user's sessions from a different host counts as another
+   * host.
+   */
+  *hostsperuser = 1 + (nuser - nuserhost);
+
+  pr_trace_msg("auth", 17, "using scoreboard counts for '%s': "
+    "%ld clients, %ld from host, %ld in class, %ld for user from %ld hosts",
+    server_addr, *cur, *hcur, *ccur, *usersessions, *hostsperuser);
+  return 0;
+}
+
 static int auth_count_scoreboard(cmd_rec *cmd, const char *user) {
   char *key;
   void *v;
@@ -2118,57 +2201,60 @@ static int auth_count_scoreboard(cmd_rec *cmd, const char *user) {
       pr_netaddr_get_ipstr(session.c->local_addr), main_server->ServerPort);
     curr_server_addr[sizeof(curr_server_addr)-1] = '\0';
 
-    if (pr_rewind_scoreboard() < 0) {
-      pr_log_pri(PR_LOG_NOTICE, "error rewinding scoreboard: %s",
-        strerror(errno));
-    }
+    if (auth_get_scoreboard_counts(c, user, curr_server_addr, &cur, &hcur,
+        &ccur, &usersessions, &hostsperuser) < 0) {
+      if (pr_rewind_scoreboard() < 0) {
+        pr_log_pri(PR_LOG_NOTICE, "error rewinding scoreboard: %s",
+          strerror(errno));
+      }
 
-    while ((score = pr_scoreboard_entry_read()) != NULL) {
-      unsigned char same_host = FALSE;
+      while ((score = pr_scoreboard_entry_read()) != NULL) {
+        unsigned char same_host = FALSE;
 
-      pr_signals_handle();
+        pr_signals_handle();
 
-      /* Make sure it matches our current server. */
-      if (strcmp(score->sce_server_addr, curr_server_addr) == 0) {
+        /* Make sure it matches our current server. */
+        if (strcmp(score->sce_server_addr, curr_server_addr) == 0) {
 
-        if ((c != NULL &&
-             c->config_type == CONF_ANON &&
-             strcmp(score->sce_user, user) == 0) ||
-            c == NULL) {
+          if ((c != NULL &&
+               c->config_type == CONF_ANON &&
+               strcmp(score->sce_user, user) == 0) ||
+              c == NULL) {
 
-          /* Only count authenticated clients, as per the documentation. */
-          if (strcmp(score->sce_user, "(none)") == 0) {
-            continue;
-          }
+            /* Only count authenticated clients, as per the documentation. */
+            if (strcmp(score->sce_user, "(none)") == 0) {
+              continue;
+            }
 
-          cur++;
+            cur++;
 
-          /* Count up sessions on a per-host basis. */
+            /* Count up sessions on a per-host basis. */
 
-          if (strcmp(score->sce_client_addr,
-              pr_netaddr_get_ipstr(session.c->remote_addr)) == 0) {
-            same_host = TRUE;
-            hcur++;
-          }
+            if (strcmp(score->sce_client_addr,
+                pr_netaddr_get_ipstr(session.c->remote_addr)) == 0) {
+              same_host = TRUE;
+              hcur++;
+            }
 
-          /* Take a per-user count of connections. */
-          if (strcmp(score->sce_user, user) == 0) {
-            usersessions++;
+            /* Take a per-user count of connections. */
+            if (strcmp(score->sce_user, user) == 0) {
+              usersessions++;
 
-            /* Count up unique hosts. */
-            if (same_host == FALSE) {
-              hostsperuser++;
+              /* Count up unique hosts. */
+              if (same_host == FALSE) {
+                hostsperuser++;
+              }
             }
           }
-        }
 
-        if (session.conn_class != NULL &&
-            strcasecmp(score->sce_class, session.conn_class->cls_name) == 0) {
-          ccur++;
+          if (session.conn_class != NULL &&
+              strcasecmp(score->sce_class, session.conn_class->cls_name) == 0) {
+            ccur++;
+          }
         }
       }
+      pr_restore_scoreboard();
     }
-    pr_restore_scoreboard();
     PRIVS_RELINQUISH
   }
 
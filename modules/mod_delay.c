@@ -100,19 +100,40 @@ extern xaset_t *server_list;
 
 module delay_module;
 
+/* Each set of values is kept twice: in the order in which they were added
+ * (so that the oldest can be dropped), and sorted (so that the median can be
+ * read directly, rather than selected anew for every command).
+ */
 struct delay_vals_rec {
   char dv_proto[16];
   unsigned int dv_nvals;
   long dv_vals[DELAY_NVALUES];
+  unsigned int dv_nsorted;
+  long dv_sorted[DELAY_NVALUES];
 };
 
+/* The rows are read without locking.  A session updating a row holds the
+ * row's fcntl(2) lock, and increments the row's sequence number before and
+ * after changing the row; readers use the sequence number to detect (and
+ * retry after) such concurrent changes.
+ */
 struct delay_rec {
   unsigned int d_sid;
   char d_addr[80];
   unsigned int d_port;
+  volatile unsigned int d_seqno;
   struct delay_vals_rec d_vals[DELAY_NPROTO];
 };
 
+#if defined(__GNUC__)
+# define DELAY_MEMORY_BARRIER()		__sync_synchronize()
+#else
+# define DELAY_MEMORY_BARRIER()
+#endif /* __GNUC__ */
+
+/* How many times to try reading a row without locking it. */
+#define DELAY_SEQLOCK_MAX_ATTEMPTS	100
+
 struct {
   int dt_enabled;
   const char *dt_path;
@@ -142,151 +163,131 @@ static unsigned long delay_user_min_delay = 0UL;
 static int delay_sess_init(void);
 static void delay_table_reset(void);
 
-#define delay_swap(a, b) \
-  tmp = (a); \
-  (a) = (b); \
-  (b) = tmp;
-
 static const char *trace_channel = "delay";
 
-static long delay_select_k(unsigned long k, array_header *values) {
-  unsigned long l, ir, tmp = 0;
-  long *elts = (long *) values->elts;
-  unsigned int nelts = values->nelts;
-
-  /* This is from "Numeric Recipes in C", Ch. 8.5, as the select()
-   * algorithm, an in-place sorting algorithm for finding the Kth
-   * element in an array, where all elements to the left of K are
-   * smaller than K, and all elements to the right are larger.
-   */
-
-  l = 1;
-  ir = values->nelts - 1;
-
-  while (TRUE) {
-    unsigned int i, j;
-    long p;
-    unsigned long mid;
-
-    pr_signals_handle();
-
-    if (ir <= l+1) {
-      if (ir == l+1 &&
-          elts[ir] < elts[l]) {
-        delay_swap(elts[l], elts[ir]);
-      }
-
-      return elts[k];
-    }
-
-    mid = (l + ir) >> 1;
+static struct delay_vals_rec *delay_get_vals(struct delay_rec *row,
+    const char *protocol) {
+  register unsigned int i;
 
-    delay_swap(elts[mid], elts[l+1]);
-    if (elts[l] > elts[ir]) {
-      delay_swap(elts[l], elts[ir]);
-    }
+  for (i = 0; i < DELAY_NPROTO; i++) {
+    struct delay_vals_rec *dv;
 
-    if (elts[l+1] > elts[ir]) {
-      delay_swap(elts[l+1], elts[ir]);
+    dv = &(row->d_vals[i]);
+    if (strcmp(dv->dv_proto, protocol) == 0) {
+      return dv;
     }
+  }
 
-    if (elts[l] > elts[l+1]) {
-      delay_swap(elts[l], elts[l+1]);
-    }
+  return NULL;
+}
 
-    i = l + 1;
-    j = ir;
-    p = elts[l+1];
+/* Returns the number of sorted values less than the given value. */
+static unsigned int delay_sorted_lower_bound(const long *vals,
+    unsigned int nvals, long val) {
+  unsigned int lo = 0, hi = nvals;
 
-    while (TRUE) {
-      pr_signals_handle();
+  while (lo < hi) {
+    unsigned int mid;
 
-      do {
-        i++;
-      } while (i < nelts && elts[i] < p);
+    mid = lo + ((hi - lo) / 2);
+    if (vals[mid] < val) {
+      lo = mid + 1;
 
-      do {
-        j--;
-      } while (elts[j] > p);
+    } else {
+      hi = mid;
+    }
+  }
 
-      if (j < i) {
-        break;
-      }
+  return lo;
+}
 
-      delay_swap(elts[i], elts[j]);
-    }
+static long delay_select_median(struct delay_vals_rec *dv, long interval) {
+  unsigned int nvals, pos, mid;
 
-    elts[l+1] = elts[j];
-    elts[j] = p;
+  /* The median is selected from the sorted values plus the current
+   * interval, i.e. the middle of nvals + 1 values.  Rather than merging the
+   * current interval into the sorted values, we find where it would go, and
+   * read the median value from either side of that position.
+   */
+  nvals = dv->dv_nsorted;
+  if (nvals > DELAY_NVALUES) {
+    /* Garbage in the DelayTable, or a concurrent update; either way, the
+     * caller will find out.
+     */
+    return -1;
+  }
 
-    if ((unsigned long) p >= k) {
-      ir = j - 1;
-    }
+  pos = delay_sorted_lower_bound(dv->dv_sorted, nvals, interval);
+  mid = nvals / 2;
 
-    if ((unsigned long) p <= k) {
-      l = i;
-    }
+  if (mid < pos) {
+    return dv->dv_sorted[mid];
+  }
 
-    if (l >= (nelts - 1) ||
-        ir >= nelts) {
-      break;
-    }
+  if (mid == pos) {
+    return interval;
   }
 
-  return -1;
+  return dv->dv_sorted[mid - 1];
 }
 
-static long delay_get_median(pool *p, unsigned int rownum, const char *protocol,
+static long delay_get_median(unsigned int rownum, const char *protocol,
     long interval) {
-  register unsigned int i;
+  register unsigned int attempt;
   struct delay_rec *row;
   struct delay_vals_rec *dv = NULL;
-  long *tab_vals = NULL, median;
-  array_header *list = make_array(p, 1, sizeof(long));
-  
+  long median = -1;
+
   /* Calculate the median value of the current command's recorded values,
    * taking the protocol (e.g. "ftp", "ftps", "ssh2") into account.
    *
    * When calculating the median, we use the current interval as well
    * as the recorded intervals in the table, giving us an odd number of
    * values.
-   *
-   * If the number of values in this row is less than the watermark
-   * value, we'll actually return the maximum value, rather than the
-   * median.  Below the watermark, the server is "cold" and has not
-   * yet accumulated enough data to make the median a useful value.
    */
 
   row = &((struct delay_rec *) delay_tab.dt_data)[rownum];
 
-  /* Find the list of delay values that match the given protocol. */
-  for (i = 0; i < DELAY_NPROTO; i++) {
-    dv = &(row->d_vals[i]);
-    if (strcmp(dv->dv_proto, protocol) == 0) {
-      tab_vals = dv->dv_vals;
+  for (attempt = 0; attempt < DELAY_SEQLOCK_MAX_ATTEMPTS; attempt++) {
+    unsigned int seqno;
+
+    seqno = row->d_seqno;
+    if (seqno % 2 != 0) {
+      /* Update in progress. */
+      continue;
+    }
+
+    DELAY_MEMORY_BARRIER();
+
+    /* Find the list of delay values that match the given protocol. */
+    dv = delay_get_vals(row, protocol);
+    if (dv != NULL) {
+      median = delay_select_median(dv, interval);
+
+    } else {
+      median = interval;
+    }
+
+    DELAY_MEMORY_BARRIER();
+
+    if (row->d_seqno == seqno) {
       break;
     }
+
+    median = -1;
   }
 
-  /* Start at the end of the row and work backward, as values are
-   * always added at the end of the row, shifting everything to the left.
-   */
-  if (tab_vals != NULL) {
-    for (i = 1; i < dv->dv_nvals; i++) {
-      /* Ignore any possible garbage (i.e. negative) values in the
-       * DelayTable.
-       */
-      if (tab_vals[DELAY_NVALUES - 1 - i] >= 0) {
-        *((long *) push_array(list)) = tab_vals[DELAY_NVALUES - 1 - i];
-      }
-    }
+  if (attempt == DELAY_SEQLOCK_MAX_ATTEMPTS) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to read DelayTable row %u without locking, ignoring",
+      rownum + 1);
+    return -1;
   }
-  *((long *) push_array(list)) = interval;
 
-  pr_trace_msg(trace_channel, 6, "selecting median interval from %d %s",
-    list->nelts, list->nelts != 1 ? "values" : "value");
+  pr_trace_msg(trace_channel, 6, "selecting median interval from %u %s",
+    (dv != NULL ? dv->dv_nsorted : 0) + 1,
+    dv != NULL && dv->dv_nsorted > 0 ? "values" : "value");
 
-  median = delay_select_k(((list->nelts + 1) / 2), list);
   if (median >= 0) {
 
     /* Enforce an additional restriction: no delays over a hard limit. */
@@ -522,18 +523,91 @@ static unsigned int delay_get_pass_rownum(unsigned int sid) {
   return r;
 }
 
+/* Rebuilds the row's sorted values from the values in the order in which
+ * they were added.
+ */
+static void delay_table_resort_row(struct delay_rec *row) {
+  register unsigned int i;
+
+  for (i = 0; i < DELAY_NPROTO; i++) {
+    register unsigned int j;
+    struct delay_vals_rec *dv;
+
+    dv = &(row->d_vals[i]);
+    if (dv->dv_nvals > DELAY_NVALUES) {
+      dv->dv_nvals = DELAY_NVALUES;
+    }
+
+    dv->dv_nsorted = 0;
+    for (j = 0; j < DELAY_NVALUES; j++) {
+      unsigned int pos;
+
+      if (dv->dv_vals[j] < 0) {
+        continue;
+      }
+
+      pos = delay_sorted_lower_bound(dv->dv_sorted, dv->dv_nsorted,
+        dv->dv_vals[j]);
+      memmove(&(dv->dv_sorted[pos+1]), &(dv->dv_sorted[pos]),
+        sizeof(long) * (dv->dv_nsorted - pos));
+      dv->dv_sorted[pos] = dv->dv_vals[j];
+      dv->dv_nsorted++;
+    }
+  }
+}
+
+/* Note that the caller is expected to hold the write lock for the row. */
 static void delay_table_add_interval(unsigned int rownum, const char *protocol,
     long interval) {
-  register unsigned int i;
   struct delay_rec *row;
   struct delay_vals_rec *dv = NULL;
+  long oldest;
 
   row = &((struct delay_rec *) delay_tab.dt_data)[rownum];
 
-  for (i = 0; i < DELAY_NPROTO; i++) {
-    dv = &(row->d_vals[i]);
-    if (strcmp(dv->dv_proto, protocol) == 0) {
-      break;
+  dv = delay_get_vals(row, protocol);
+  if (dv == NULL) {
+    return;
+  }
+
+  if (interval > DELAY_MAX_DELAY_USECS) {
+    /* Truncate the interval to the maximum allowed value. */
+    interval = DELAY_MAX_DELAY_USECS;
+  }
+
+  /* A writer which died while changing this row leaves its sequence number
+   * odd, and its values possibly half-changed.  Since we hold the row lock,
+   * no writer is active now; readers keep ignoring the row while we rebuild
+   * its sorted values, then we make the sequence number even again.
+   */
+  if (row->d_seqno % 2 != 0) {
+    pr_trace_msg(trace_channel, 3,
+      "repairing DelayTable row %u left mid-update", rownum + 1);
+    delay_table_resort_row(row);
+
+    DELAY_MEMORY_BARRIER();
+    row->d_seqno++;
+  }
+
+  row->d_seqno++;
+  DELAY_MEMORY_BARRIER();
+
+  /* Once the row is full, the oldest value drops out of the sorted values,
+   * too.
+   */
+  oldest = dv->dv_vals[0];
+  if (dv->dv_nvals == DELAY_NVALUES &&
+      oldest >= 0 &&
+      dv->dv_nsorted > 0 &&
+      dv->dv_nsorted <= DELAY_NVALUES) {
+    unsigned int pos;
+
+    pos = delay_sorted_lower_bound(dv->dv_sorted, dv->dv_nsorted, oldest);
+    if (pos < dv->dv_nsorted &&
+        dv->dv_sorted[pos] == oldest) {
+      memmove(&(dv->dv_sorted[pos]), &(dv->dv_sorted[pos+1]),
+        sizeof(long) * (dv->dv_nsorted - pos - 1));
+      dv->dv_nsorted--;
     }
   }
 
@@ -542,16 +616,29 @@ static void delay_table_add_interval(unsigned int rownum, const char *protocol,
     sizeof(long) * (DELAY_NVALUES - 1));
 
   /* Add the given value to the end. */
-
-  if (interval > DELAY_MAX_DELAY_USECS) {
-    /* Truncate the interval to the maximum allowed value. */
-    interval = DELAY_MAX_DELAY_USECS;
-  }
-
   dv->dv_vals[DELAY_NVALUES-1] = interval;
   if (dv->dv_nvals < DELAY_NVALUES) {
     dv->dv_nvals++;
   }
+
+  /* Ignore any possible garbage (i.e. negative) values. */
+  if (interval >= 0) {
+    unsigned int pos;
+
+    if (dv->dv_nsorted >= DELAY_NVALUES) {
+      /* Should not happen, but make room if it does. */
+      dv->dv_nsorted = DELAY_NVALUES - 1;
+    }
+
+    pos = delay_sorted_lower_bound(dv->dv_sorted, dv->dv_nsorted, interval);
+    memmove(&(dv->dv_sorted[pos+1]), &(dv->dv_sorted[pos]),
+      sizeof(long) * (dv->dv_nsorted - pos));
+    dv->dv_sorted[pos] = interval;
+    dv->dv_nsorted++;
+  }
+
+  DELAY_MEMORY_BARRIER();
+  row->d_seqno++;
 }
 
 static int delay_table_init(void) {
@@ -987,6 +1074,7 @@ static void delay_table_reset(void) {
     row->d_sid = s->sid;
     sstrncpy(row->d_addr, ip_str, sizeof(row->d_addr));
     row->d_port = s->ServerPort;
+    row->d_seqno = 0;
     memset(row->d_vals, 0, sizeof(row->d_vals));
 
     /* Initialize value subsets for "ftp", "ftps", and "ssh2". */
@@ -995,18 +1083,21 @@ static void delay_table_reset(void) {
     sstrcat(dv->dv_proto, "ftp", sizeof(dv->dv_proto));
     dv->dv_nvals = 0;
     memset(dv->dv_vals, -1, sizeof(dv->dv_vals));
+    dv->dv_nsorted = 0;
 
     dv = &(row->d_vals[1]);
     memset(dv->dv_proto, 0, sizeof(dv->dv_proto));
     sstrcat(dv->dv_proto, "ftps", sizeof(dv->dv_proto));
     dv->dv_nvals = 0;
     memset(dv->dv_vals, -1, sizeof(dv->dv_vals));
+    dv->dv_nsorted = 0;
 
     dv = &(row->d_vals[2]);
     memset(dv->dv_proto, 0, sizeof(dv->dv_proto));
     sstrcat(dv->dv_proto, "ssh2", sizeof(dv->dv_proto));
     dv->dv_nvals = 0;
     memset(dv->dv_vals, -1, sizeof(dv->dv_vals));
+    dv->dv_nsorted = 0;
 
     /* Row for PASS values */
     r = delay_get_pass_rownum(s->sid);
@@ -1014,6 +1105,7 @@ static void delay_table_reset(void) {
     row->d_sid = s->sid;
     sstrncpy(row->d_addr, ip_str, sizeof(row->d_addr));
     row->d_port = s->ServerPort;
+    row->d_seqno = 0;
     memset(row->d_vals, 0, sizeof(row->d_vals));
 
     dv = &(row->d_vals[0]);
@@ -1021,18 +1113,21 @@ static void delay_table_reset(void) {
     sstrcat(dv->dv_proto, "ftp", sizeof(dv->dv_proto));
     dv->dv_nvals = 0;
     memset(dv->dv_vals, -1, sizeof(dv->dv_vals));
+    dv->dv_nsorted = 0;
 
     dv = &(row->d_vals[1]);
     memset(dv->dv_proto, 0, sizeof(dv->dv_proto));
     sstrcat(dv->dv_proto, "ftps", sizeof(dv->dv_proto));
     dv->dv_nvals = 0;
     memset(dv->dv_vals, -1, sizeof(dv->dv_vals));
+    dv->dv_nsorted = 0;
 
     dv = &(row->d_vals[2]);
     memset(dv->dv_proto, 0, sizeof(dv->dv_proto));
     sstrcat(dv->dv_proto, "ssh2", sizeof(dv->dv_proto));
     dv->dv_nvals = 0;
     memset(dv->dv_vals, -1, sizeof(dv->dv_vals));
+    dv->dv_nsorted = 0;
   }
 }
 
@@ -1623,8 +1718,6 @@ MODRET delay_post_pass(cmd_rec *cmd) {
   memset(&tv, 0, sizeof(tv));
   gettimeofday(&tv, NULL);
 
-  delay_table_wlock(rownum);
-
   interval = (tv.tv_sec - delay_tv.tv_sec) * 1000000 +
     (tv.tv_usec - delay_tv.tv_usec);
   pr_trace_msg(trace_channel, 9,
@@ -1633,7 +1726,7 @@ MODRET delay_post_pass(cmd_rec *cmd) {
   proto = pr_session_get_protocol(0);
 
   /* Get the median interval value. */
-  median = delay_get_median(cmd->tmp_pool, rownum, proto, interval);
+  median = delay_get_median(rownum, proto, interval);
 
   /* Add the interval to the table. Only allow a single session to
    * add a portion of the cache size, to prevent a single client from
@@ -1641,7 +1734,11 @@ MODRET delay_post_pass(cmd_rec *cmd) {
    */
   if (delay_npass < (DELAY_NVALUES / DELAY_SESS_NVALUES)) {
     pr_trace_msg(trace_channel, 8, "adding %ld usecs to PASS row", interval);
-    delay_table_add_interval(rownum, proto, interval);
+    if (delay_table_wlock(rownum) == 0) {
+      delay_table_add_interval(rownum, proto, interval);
+      delay_table_unlock(rownum);
+    }
+
     delay_npass++;
 
   } else {
@@ -1651,19 +1748,17 @@ MODRET delay_post_pass(cmd_rec *cmd) {
     pr_event_generate("mod_delay.max-pass", session.c);
   }
 
-  /* Done with the table. */
-  delay_table_unlock(rownum);
-  if (delay_table_unload(FALSE) < 0) {
-    pr_log_pri(PR_LOG_WARNING, MOD_DELAY_VERSION
-      ": unable to unload DelayTable '%s' from memory: %s",
-      delay_tab.dt_path, strerror(errno));
-  }
-
-  /* If this is a POST_CMD phase, then close the table.  If the phase is
-   * POST_CMD_ERR, then leave the table open; the client may send another
-   * set of USER/PASS commands.
+  /* If this is a POST_CMD phase, then we are done with the table.  If the
+   * phase is POST_CMD_ERR, then leave the table open (and mapped); the client
+   * may send another set of USER/PASS commands.
    */
   if (session.curr_phase == POST_CMD) {
+    if (delay_table_unload(FALSE) < 0) {
+      pr_log_pri(PR_LOG_WARNING, MOD_DELAY_VERSION
+        ": unable to unload DelayTable '%s' from memory: %s",
+        delay_tab.dt_path, strerror(errno));
+    }
+
     (void) close(delay_tab.dt_fd);
     delay_tab.dt_fd = -1;
   }
@@ -1738,8 +1833,6 @@ MODRET delay_post_user(cmd_rec *cmd) {
   memset(&tv, 0, sizeof(tv));
   gettimeofday(&tv, NULL);
 
-  delay_table_wlock(rownum);
-
   interval = (tv.tv_sec - delay_tv.tv_sec) * 1000000 +
     (tv.tv_usec - delay_tv.tv_usec);
 
@@ -1759,7 +1852,7 @@ MODRET delay_post_user(cmd_rec *cmd) {
   proto = pr_session_get_protocol(0);
 
   /* Get the median interval value. */
-  median = delay_get_median(cmd->tmp_pool, rownum, proto, interval);
+  median = delay_get_median(rownum, proto, interval);
 
   /* Add the interval to the table. Only allow a single session to
    * add a portion of the cache size, to prevent a single client from
@@ -1767,7 +1860,11 @@ MODRET delay_post_user(cmd_rec *cmd) {
    */
   if (delay_nuser < (DELAY_NVALUES / DELAY_SESS_NVALUES)) {
     pr_trace_msg(trace_channel, 8, "adding %ld usecs to USER row", interval);
-    delay_table_add_interval(rownum, proto, interval);
+    if (delay_table_wlock(rownum) == 0) {
+      delay_table_add_interval(rownum, proto, interval);
+      delay_table_unlock(rownum);
+    }
+
     delay_nuser++;
 
   } else {
@@ -1777,13 +1874,7 @@ MODRET delay_post_user(cmd_rec *cmd) {
     pr_event_generate("mod_delay.max-user", session.c);
   }
 
-  /* Done with the table. */
-  delay_table_unlock(rownum);
-  if (delay_table_unload(FALSE) < 0) {
-    pr_log_pri(PR_LOG_WARNING, MOD_DELAY_VERSION
-      ": unable to unload DelayTable '%s' from memory: %s",
-      delay_tab.dt_path, strerror(errno));
-  }
+  /* Note that the table stays mapped into memory for the PASS command. */
 
   /* If the current interval is less than the median interval (and a valid
    * median interval was selected), we need to delay ourselves a little.
@@ -46,6 +46,7 @@
 
 extern module auth_module;
 extern pid_t mpid;
+extern xaset_t *server_list;
 
 /* Variables for this module */
 static pr_fh_t *retr_fh = NULL;
@@ -546,22 +547,42 @@ static int transmit_normal(pool *p, char *buf, size_t bufsz) {
 }
 
 #ifdef HAVE_SENDFILE
+/* Returns TRUE if the data connection is protected by TLS, but the record
+ * layer has been offloaded to the kernel (kTLS) for sending, i.e. plaintext
+ * written directly to the socket will be encrypted by the kernel.
+ */
+static int have_ktls_send(void) {
+  const void *v;
+
+  if (session.d == NULL ||
+      session.d->outstrm == NULL ||
+      session.d->outstrm->notes == NULL) {
+    return FALSE;
+  }
+
+  v = pr_table_get(session.d->outstrm->notes, "mod_tls.ktls-send", NULL);
+  if (v == NULL) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 static int transmit_sendfile(off_t data_len, off_t *data_offset,
-    pr_sendfile_t *sent_len) {
+    pr_sendfile_t *sent_len, size_t bufsz) {
   off_t send_len;
 
   /* We don't use sendfile() if:
-   * - We're using bandwidth throttling.
    * - We're transmitting an ASCII file.
-   * - We're using RFC2228 data channel protection
+   * - We're using RFC2228 data channel protection, unless that protection
+   *   is kernel TLS.
    * - We're using MODE Z compression
    * - There's no data left to transmit.
    * - UseSendfile is set to off.
    */
-  if (pr_throttle_have_rate() ||
-     !(session.xfer.file_size - data_len) ||
+  if (!(session.xfer.file_size - data_len) ||
      (session.sf_flags & (SF_ASCII|SF_ASCII_OVERRIDE)) ||
-     have_rfc2228_data || have_zmode ||
+     (have_rfc2228_data && !have_ktls_send()) || have_zmode ||
      !use_sendfile) {
 
     if (!xfer_logged_sendfile_decline_msg) {
@@ -569,10 +590,6 @@ static int transmit_sendfile(off_t data_len, off_t *data_offset,
         pr_log_debug(DEBUG10, "declining use of sendfile due to UseSendfile "
           "configuration setting");
 
-      } else if (pr_throttle_have_rate()) {
-        pr_log_debug(DEBUG10, "declining use of sendfile due to TransferRate "
-          "restrictions");
-    
       } else if (session.sf_flags & (SF_ASCII|SF_ASCII_OVERRIDE)) {
         pr_log_debug(DEBUG10, "declining use of sendfile for ASCII data");
 
@@ -595,7 +612,13 @@ static int transmit_sendfile(off_t data_len, off_t *data_offset,
     return 0;
   }
 
-  pr_log_debug(DEBUG10, "using sendfile capability for transmitting data");
+  if (have_rfc2228_data) {
+    pr_log_debug(DEBUG10, "using sendfile capability for transmitting data "
+      "over kernel TLS");
+
+  } else {
+    pr_log_debug(DEBUG10, "using sendfile capability for transmitting data");
+  }
 
   /* Determine how many bytes to send using sendfile(2).  By default,
    * we want to send all of the remaining bytes.
@@ -606,7 +629,7 @@ static int transmit_sendfile(off_t data_len, off_t *data_offset,
    */
 
   if (session.range_len > 0) {
-    send_len = session.range_len;
+    send_len = session.range_len - session.xfer.total_bytes;
 
   } else {
     send_len = session.xfer.file_size - data_len;
@@ -630,6 +653,24 @@ static int transmit_sendfile(off_t data_len, off_t *data_offset,
     }
   }
 
+  /* If throttling, send the data in chunks, so that the transfer can be
+   * paced (via pr_throttle_pause()) between them.
+   */
+  if (pr_throttle_have_rate()) {
+    off_t chunk_len;
+
+    chunk_len = pr_throttle_get_chunk_len();
+    if (chunk_len < (off_t) bufsz) {
+      chunk_len = bufsz;
+    }
+
+    if (send_len > chunk_len) {
+      pr_trace_msg(trace_channel, 19, "using sendfile with TransferRate "
+        "chunk length (%" PR_LU " bytes)", (pr_off_t) chunk_len);
+      send_len = chunk_len;
+    }
+  }
+
  retry:
   *sent_len = pr_data_sendfile(PR_FH_FD(retr_fh), data_offset, send_len);
 
@@ -702,7 +743,7 @@ static long transmit_data(pool *p, off_t data_len, off_t *data_offset,
   }
 
 #ifdef HAVE_SENDFILE
-  ret = transmit_sendfile(data_len, data_offset, &sent_len);
+  ret = transmit_sendfile(data_len, data_offset, &sent_len, bufsz);
   if (ret > 0) {
     /* sendfile() was used, so return the value of sent_len. */
     res = (long) sent_len;
@@ -2933,7 +2974,10 @@ MODRET xfer_retr(cmd_rec *cmd) {
     if ((nbytes_sent / cnt_steps) != cnt_next) {
       cnt_next = nbytes_sent / cnt_steps;
 
-      pr_scoreboard_entry_update(session.pid,
+      /* Written out to the scoreboard along with the rest of the transfer
+       * progress, by pr_throttle_pause().
+       */
+      pr_scoreboard_entry_set(session.pid,
         PR_SCORE_XFER_DONE, nbytes_sent,
         NULL);
     }
@@ -3874,32 +3918,16 @@ MODRET set_transferoptions(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
-/* usage: TransferRate cmds kbps[:free-bytes] ["user"|"group"|"class"
- *          expression]
+/* Returns the precedence for a TransferRate/SharedTransferRate config_rec,
+ * based on its configuration context.
  */
-MODRET set_transferrate(cmd_rec *cmd) {
-  config_rec *c = NULL;
-  char *tmp = NULL, *endp = NULL;
-  long double rate = 0.0;
-  off_t freebytes = 0;
+static unsigned int xfer_get_rate_precedence(cmd_rec *cmd) {
   unsigned int precedence = 0;
 
   int ctxt = (cmd->config && cmd->config->config_type != CONF_PARAM ?
      cmd->config->config_type : cmd->server->config_type ?
      cmd->server->config_type : CONF_ROOT);
 
-  /* Must have two or four parameters */
-  if (cmd->argc-1 != 2 &&
-      cmd->argc-1 != 4) {
-    CONF_ERROR(cmd, "wrong number of parameters");
-  }
-
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL|CONF_ANON|
-    CONF_DIR|CONF_DYNDIR);
-
-  /* Set the precedence for this config_rec based on its configuration
-   * context.
-   */
   if (ctxt & CONF_GLOBAL) {
     precedence = 1;
 
@@ -3921,6 +3949,102 @@ MODRET set_transferrate(cmd_rec *cmd) {
     precedence = 5;
   }
 
+  return precedence;
+}
+
+/* usage: SharedTransferRate cmds kbps[:burst-bytes] "global"|"class"|"user"
+ */
+MODRET set_sharedtransferrate(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  char *tmp = NULL, *endp = NULL;
+  long double rate = 0.0;
+  off_t burst = 0;
+  int scope;
+
+  CHECK_ARGS(cmd, 3);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL|CONF_ANON|CONF_DIR);
+
+  if (strcasecmp(cmd->argv[3], "global") == 0) {
+    scope = PR_THROTTLE_SCOPE_GLOBAL;
+
+  } else if (strcasecmp(cmd->argv[3], "class") == 0) {
+    scope = PR_THROTTLE_SCOPE_CLASS;
+
+  } else if (strcasecmp(cmd->argv[3], "user") == 0) {
+    scope = PR_THROTTLE_SCOPE_USER;
+
+  } else {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown scope requested: '",
+      cmd->argv[3], "'", NULL));
+  }
+
+  tmp = strchr(cmd->argv[2], ':');
+  if (tmp != NULL) {
+    *tmp = '\0';
+  }
+
+  rate = (long double) strtod(cmd->argv[2], &endp);
+  if (endp && *endp) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid number: '",
+      cmd->argv[2], "'", NULL));
+  }
+
+  if (rate <= 0.0) {
+    CONF_ERROR(cmd, "rate must be greater than zero");
+  }
+
+  /* Parse any 'burst-bytes' part */
+  if (tmp) {
+    cmd->argv[2] = ++tmp;
+
+    burst = strtoul(cmd->argv[2], &endp, 10);
+    if (endp && *endp) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid number: '",
+        cmd->argv[2], "'", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 5, NULL, NULL, NULL, NULL, NULL);
+
+  /* Parse the command list. */
+  if (xfer_parse_cmdlist(cmd->argv[0], c, cmd->argv[1]) < 0) {
+    CONF_ERROR(cmd, "error with command list");
+  }
+
+  c->argv[1] = pcalloc(c->pool, sizeof(long double));
+  *((long double *) c->argv[1]) = rate;
+  c->argv[2] = pcalloc(c->pool, sizeof(off_t));
+  *((off_t *) c->argv[2]) = burst;
+  c->argv[3] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[3]) = xfer_get_rate_precedence(cmd);
+  c->argv[4] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[4]) = scope;
+  c->flags |= CF_MERGEDOWN_MULTI;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: TransferRate cmds kbps[:free-bytes] ["user"|"group"|"class"
+ *          expression]
+ */
+MODRET set_transferrate(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  char *tmp = NULL, *endp = NULL;
+  long double rate = 0.0;
+  off_t freebytes = 0;
+  unsigned int precedence = 0;
+
+  /* Must have two or four parameters */
+  if (cmd->argc-1 != 2 &&
+      cmd->argc-1 != 4) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL|CONF_ANON|
+    CONF_DIR|CONF_DYNDIR);
+
+  precedence = xfer_get_rate_precedence(cmd);
+
   /* Check for a valid classifier. */
   if (cmd->argc-1 > 2) {
     if (strcasecmp(cmd->argv[3], "user") != 0 &&
@@ -4135,6 +4259,25 @@ static void xfer_exit_ev(const void *event_data, void *user_data) {
   }
 }
 
+static void xfer_postparse_ev(const void *event_data, void *user_data) {
+  server_rec *s;
+
+  /* If any SharedTransferRate is configured, map the shared buckets now,
+   * before any sessions are forked.
+   */
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    if (find_config(s->conf, CONF_PARAM, "SharedTransferRate",
+        TRUE) != NULL) {
+      if (pr_throttle_shared_init() < 0) {
+        pr_log_pri(PR_LOG_NOTICE,
+          "unable to map SharedTransferRate buckets: %s", strerror(errno));
+      }
+
+      break;
+    }
+  }
+}
+
 static void xfer_sess_reinit_ev(const void *event_data, void *user_data) {
   int res;
 
@@ -4237,6 +4380,8 @@ static int xfer_init(void) {
    */
   pr_feat_add(C_RANG " STREAM");
 
+  pr_event_register(&xfer_module, "core.postparse", xfer_postparse_ev, NULL);
+
   return 0;
 }
 
@@ -4325,6 +4470,7 @@ static conftable xfer_conftab[] = {
   { "TimeoutNoTransfer",	set_timeoutnoxfer,		NULL },
   { "TimeoutStalled",		set_timeoutstalled,		NULL },
   { "TransferOptions",		set_transferoptions,		NULL },
+  { "SharedTransferRate",	set_sharedtransferrate,		NULL },
   { "TransferRate",		set_transferrate,		NULL },
   { "UseSendfile",		set_usesendfile,		NULL },
 
@@ -35,10 +35,8 @@
  * rather than using strcmp(3).  For commands not in the list, strcmp(3)
  * can always be used as a fallback.
  *
- * A future improvement would be to sort the entries in the table so that
- * the most common commands appear earlier in the table, and make the
- * linear scan even shorter.  But I'd need to collect better metrics in
- * order to do that.
+ * Lookups by name go through the cmd_id_slots hash table below, rather than
+ * a linear scan of this list.
  */
 
 struct cmd_entry {
@@ -144,8 +142,70 @@ static struct cmd_entry smtp_ids[] = {
   { NULL,	0 }
 };
 
+/* Every known command name is 3 or 4 ASCII characters long, so a name can be
+ * packed, uppercased, into a single 32-bit key.  The keys are hashed into
+ * a small open-addressed table, built on first use; the multiplier was
+ * chosen so that the current cmd_ids[] list has no collisions, i.e. each
+ * lookup is a single probe.  Linear probing keeps the table correct should
+ * new commands ever collide.
+ */
+#define PR_CMD_ID_NSLOTS	256
+#define PR_CMD_ID_HASH_MULT	0x01003797U
+
+struct cmd_id_slot {
+  uint32_t key;
+  int cmd_id;
+};
+
+static struct cmd_id_slot cmd_id_slots[PR_CMD_ID_NSLOTS];
+static int cmd_id_slots_ready = FALSE;
+
 static const char *trace_channel = "command";
 
+static uint32_t cmd_id_key(const char *cmd_name, size_t cmd_namelen) {
+  register unsigned int i;
+  uint32_t key = 0;
+
+  for (i = 0; i < cmd_namelen; i++) {
+    unsigned char c;
+
+    c = (unsigned char) cmd_name[i];
+    if (c >= 'a' && c <= 'z') {
+      c -= ('a' - 'A');
+    }
+
+    key |= ((uint32_t) c) << (8 * i);
+  }
+
+  return key;
+}
+
+static unsigned int cmd_id_hash(uint32_t key) {
+  return (unsigned int) ((uint32_t) (key * PR_CMD_ID_HASH_MULT) >> 24) &
+    (PR_CMD_ID_NSLOTS - 1);
+}
+
+static void cmd_id_slots_init(void) {
+  register unsigned int i;
+
+  for (i = 1; cmd_ids[i].cmd_name != NULL; i++) {
+    uint32_t key;
+    unsigned int idx;
+
+    key = cmd_id_key(cmd_ids[i].cmd_name, cmd_ids[i].cmd_namelen);
+    idx = cmd_id_hash(key);
+
+    while (cmd_id_slots[idx].cmd_id != 0) {
+      idx = (idx + 1) & (PR_CMD_ID_NSLOTS - 1);
+    }
+
+    cmd_id_slots[idx].key = key;
+    cmd_id_slots[idx].cmd_id = i;
+  }
+
+  cmd_id_slots_ready = TRUE;
+}
+
 cmd_rec *pr_cmd_alloc(pool *p, unsigned int argc, ...) {
   pool *newpool = NULL;
   cmd_rec *cmd = NULL;
@@ -333,19 +393,25 @@ int pr_cmd_strcmp(cmd_rec *cmd, const char *cmd_name) {
 
 const char *pr_cmd_get_displayable_str(cmd_rec *cmd, size_t *str_len) {
   const char *res;
+  char *buf;
   unsigned int argc;
   void **argv;
   pool *p;
+  size_t buflen = 0, res_sz = 0;
 
   if (cmd == NULL) {
     errno = EINVAL;
     return NULL;
   }
 
-  res = pr_table_get(cmd->notes, "displayable-str", NULL);
+  /* The cached note is stored with its size (including the terminating NUL),
+   * so that repeated lookups, e.g. once per dispatch phase, need not rescan
+   * the string for its length.
+   */
+  res = pr_table_get(cmd->notes, "displayable-str", &res_sz);
   if (res != NULL) {
     if (str_len != NULL) {
-      *str_len = strlen(res);
+      *str_len = res_sz > 0 ? res_sz - 1 : strlen(res);
     }
 
     return res;
@@ -355,8 +421,6 @@ const char *pr_cmd_get_displayable_str(cmd_rec *cmd, size_t *str_len) {
   argv = cmd->argv;
   p = cmd->pool;
 
-  res = "";
-
   /* Check for "sensitive" commands. */
   if (pr_cmd_cmp(cmd, PR_CMD_PASS_ID) == 0 ||
       pr_cmd_cmp(cmd, PR_CMD_ADAT_ID) == 0) {
@@ -366,16 +430,52 @@ const char *pr_cmd_get_displayable_str(cmd_rec *cmd, size_t *str_len) {
 
   if (argc > 0) {
     register unsigned int i;
+    const char **words;
+    size_t *word_lens;
+    char *ptr;
+
+    /* Decode each word first, so that the displayable string can be
+     * assembled with a single allocation.
+     */
+    words = palloc(p, argc * sizeof(char *));
+    word_lens = palloc(p, argc * sizeof(size_t));
+
+    for (i = 0; i < argc; i++) {
+      words[i] = NULL;
+      word_lens[i] = 0;
+
+      if (argv[i] != NULL) {
+        words[i] = pr_fs_decode_path(p, argv[i]);
+      }
 
-    res = pstrcat(p, res, pr_fs_decode_path(p, argv[0]), NULL);
+      if (words[i] != NULL) {
+        word_lens[i] = strlen(words[i]);
+      }
 
-    for (i = 1; i < argc; i++) {
-      res = pstrcat(p, res, " ", pr_fs_decode_path(p, argv[i]), NULL);
+      buflen += word_lens[i];
     }
+
+    buflen += (argc - 1);
+    buf = ptr = palloc(p, buflen + 1);
+
+    for (i = 0; i < argc; i++) {
+      if (i > 0) {
+        *ptr++ = ' ';
+      }
+
+      if (word_lens[i] > 0) {
+        memcpy(ptr, words[i], word_lens[i]);
+        ptr += word_lens[i];
+      }
+    }
+
+    *ptr = '\0';
+
+  } else {
+    buf = pstrdup(p, "");
   }
 
-  if (pr_table_add(cmd->notes, pstrdup(cmd->pool, "displayable-str"),
-      pstrdup(cmd->pool, res), 0) < 0) {
+  if (pr_table_add(cmd->notes, "displayable-str", buf, buflen + 1) < 0) {
     if (errno != EEXIST) {
       pr_trace_msg(trace_channel, 4,
         "error setting 'displayable-str' command note: %s", strerror(errno));
@@ -383,49 +483,52 @@ const char *pr_cmd_get_displayable_str(cmd_rec *cmd, size_t *str_len) {
   }
 
   if (str_len != NULL) {
-    *str_len = strlen(res);
+    *str_len = buflen;
   }
 
-  return res;
+  return buf;
 }
 
 int pr_cmd_get_id(const char *cmd_name) {
-  register unsigned int i;
   size_t cmd_namelen;
-  char first_letter;
+  uint32_t key;
+  unsigned int idx;
 
   if (cmd_name == NULL) {
     errno = EINVAL;
     return -1;
   }
 
-  cmd_namelen = strlen(cmd_name);
-
   /* Take advantage of the fact that we know, a priori, that the shortest
    * command name in the list is 3 characters, and that the longest is 4
-   * characters.  No need to scan the list if we know that the given name
+   * characters.  No need to look any further if we know that the given name
    * is not within that length range.
    */
+  for (cmd_namelen = 0; cmd_namelen <= PR_CMD_MAX_NAMELEN; cmd_namelen++) {
+    if (cmd_name[cmd_namelen] == '\0') {
+      break;
+    }
+  }
+
   if (cmd_namelen < PR_CMD_MIN_NAMELEN ||
       cmd_namelen > PR_CMD_MAX_NAMELEN) {
     errno = ENOENT;
     return -1;
   }
 
-  first_letter = toupper((int) cmd_name[0]);
+  if (cmd_id_slots_ready == FALSE) {
+    cmd_id_slots_init();
+  }
 
-  for (i = 1; cmd_ids[i].cmd_name != NULL; i++) {
-    if (cmd_ids[i].cmd_namelen != cmd_namelen) {
-      continue;
-    }
+  key = cmd_id_key(cmd_name, cmd_namelen);
+  idx = cmd_id_hash(key);
 
-    if (cmd_ids[i].cmd_name[0] != first_letter) {
-      continue;
+  while (cmd_id_slots[idx].cmd_id != 0) {
+    if (cmd_id_slots[idx].key == key) {
+      return cmd_id_slots[idx].cmd_id;
     }
 
-    if (strcasecmp(cmd_ids[i].cmd_name, cmd_name) == 0) {
-      return i;
-    }
+    idx = (idx + 1) & (PR_CMD_ID_NSLOTS - 1);
   }
 
   errno = ENOENT;
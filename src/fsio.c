@@ -54,6 +54,10 @@
 # include <acl/libacl.h>
 #endif
 
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
 /* We will reset timers in the progress callback every Nth iteration of the
  * callback when copying a file.
  */
@@ -63,6 +67,20 @@ static size_t copy_iter_count = 0;
 # define COPY_PROGRESS_NTH_ITER       50000
 #endif
 
+/* Copies done in the kernel report progress in much larger chunks than our
+ * buffered copies do, thus we also reset the timers after every Nth byte.
+ */
+static off_t copy_byte_count = 0;
+
+#ifndef COPY_PROGRESS_NTH_BYTES
+# define COPY_PROGRESS_NTH_BYTES      (256 * 1024 * 1024)
+#endif
+
+/* How much data to ask copy_file_range(2) to copy per call. */
+#ifndef COPY_OFFLOAD_CHUNKSZ
+# define COPY_OFFLOAD_CHUNKSZ         (8 * 1024 * 1024)
+#endif
+
 /* For determining whether a file is on an NFS filesystem.  Note that
  * this value is Linux specific.  See Bug#3874 for details.
  */
@@ -167,13 +185,18 @@ static int chroot_allow_path(const char *path) {
 static void copy_progress_cb(int nwritten) {
   int res;
 
-  (void) nwritten;
-
   copy_iter_count++;
-  if ((copy_iter_count % COPY_PROGRESS_NTH_ITER) != 0) {
+  if (nwritten > 0) {
+    copy_byte_count += nwritten;
+  }
+
+  if ((copy_iter_count % COPY_PROGRESS_NTH_ITER) != 0 &&
+      copy_byte_count < COPY_PROGRESS_NTH_BYTES) {
     return;
   }
 
+  copy_byte_count = 0;
+
   /* Reset some of the Timeouts which might interfere, i.e. TimeoutIdle and
    * TimeoutNoDataTransfer.
    */
@@ -1793,6 +1816,89 @@ void pr_fs_clear_cache(void) {
   (void) pr_fs_clear_cache2(NULL);
 }
 
+/* Try to copy the source file to the destination without passing the data
+ * through userspace: first by cloning the file's extents (a "reflink", on
+ * filesystems such as Btrfs and XFS), then using copy_file_range(2).  Returns
+ * TRUE if the file was copied, FALSE otherwise.  On FALSE, the file offsets
+ * of both handles reflect the data copied so far, so the caller can simply
+ * finish the copy using read/write.
+ */
+static int fs_copy_file_offload(pr_fh_t *src_fh, struct stat *src_st,
+    pr_fh_t *dst_fh, struct stat *dst_st, void (*progress_cb)(int)) {
+
+  /* The data only bypasses the FSIO read/write callbacks when those are the
+   * system defaults, i.e. when no module needs to see the data.
+   */
+  if (src_fh->fh_fs == NULL ||
+      src_fh->fh_fs->read != sys_read ||
+      dst_fh->fh_fs == NULL ||
+      dst_fh->fh_fs->write != sys_write) {
+    return FALSE;
+  }
+
+  if (!S_ISREG(src_st->st_mode) ||
+      !S_ISREG(dst_st->st_mode)) {
+    return FALSE;
+  }
+
+#if defined(FICLONE)
+  if (ioctl(PR_FH_FD(dst_fh), FICLONE, PR_FH_FD(src_fh)) == 0) {
+    pr_trace_msg(trace_channel, 9, "cloned '%s' to '%s' (%" PR_LU " bytes)",
+      src_fh->fh_path, dst_fh->fh_path, (pr_off_t) src_st->st_size);
+    return TRUE;
+  }
+
+  pr_trace_msg(trace_channel, 14, "unable to clone '%s' to '%s': %s",
+    src_fh->fh_path, dst_fh->fh_path, strerror(errno));
+#endif /* FICLONE */
+
+#if defined(HAVE_COPY_FILE_RANGE)
+  while (TRUE) {
+    ssize_t res;
+
+    pr_signals_handle();
+
+    res = copy_file_range(PR_FH_FD(src_fh), NULL, PR_FH_FD(dst_fh), NULL,
+      COPY_OFFLOAD_CHUNKSZ, 0);
+    if (res < 0) {
+      int xerrno = errno;
+
+      if (xerrno == EINTR) {
+        continue;
+      }
+
+      /* Older kernels do not support copies across filesystems (EXDEV),
+       * and some filesystems do not support this at all.  Whatever the
+       * reason, the read/write copy will pick up where we left off, and
+       * report any real error.
+       */
+      pr_trace_msg(trace_channel, 14,
+        "unable to use copy_file_range(2) for '%s' to '%s': %s",
+        src_fh->fh_path, dst_fh->fh_path, strerror(xerrno));
+      return FALSE;
+    }
+
+    if (res == 0) {
+      break;
+    }
+
+    if (progress_cb != NULL) {
+      (progress_cb)((int) res);
+
+    } else {
+      copy_progress_cb((int) res);
+    }
+  }
+
+  pr_trace_msg(trace_channel, 9,
+    "copied '%s' to '%s' using copy_file_range(2)", src_fh->fh_path,
+    dst_fh->fh_path);
+  return TRUE;
+#else
+  return FALSE;
+#endif /* HAVE_COPY_FILE_RANGE */
+}
+
 /* FS functions proper */
 
 int pr_fs_copy_file2(const char *src, const char *dst, int flags,
@@ -1801,7 +1907,7 @@ int pr_fs_copy_file2(const char *src, const char *dst, int flags,
   struct stat src_st, dst_st;
   char *buf;
   size_t bufsz;
-  int dst_existed = FALSE, res;
+  int dst_existed = FALSE, offloaded = FALSE, res;
 #ifdef PR_USE_XATTR
   array_header *xattrs = NULL;
 #endif /* PR_USE_XATTR */
@@ -1813,6 +1919,7 @@ int pr_fs_copy_file2(const char *src, const char *dst, int flags,
   }
 
   copy_iter_count = 0;
+  copy_byte_count = 0;
 
   /* Use a nonblocking open() for the path; it could be a FIFO, and we don't
    * want to block forever if the other end of the FIFO is not running.
@@ -1959,7 +2066,11 @@ int pr_fs_copy_file2(const char *src, const char *dst, int flags,
   }
 #endif
 
-  while ((res = pr_fsio_read(src_fh, buf, bufsz)) > 0) {
+  offloaded = fs_copy_file_offload(src_fh, &src_st, dst_fh, &dst_st,
+    progress_cb);
+
+  while (offloaded == FALSE &&
+         (res = pr_fsio_read(src_fh, buf, bufsz)) > 0) {
     size_t datalen;
     off_t offset;
 
@@ -2184,6 +2295,319 @@ int pr_fs_copy_file(const char *src, const char *dst) {
   return pr_fs_copy_file2(src, dst, 0, NULL);
 }
 
+typedef int (*fs_walk_cb_t)(pr_fs_walk_ent_t *, void *);
+
+/* Returns TRUE if the given FS would use the system handlers for the
+ * operations done while walking a tree.
+ */
+static int fs_walk_is_sys(pr_fs_t *fs) {
+  if ((fs->lstat != NULL && fs->lstat != sys_lstat) ||
+      (fs->opendir != NULL && fs->opendir != sys_opendir) ||
+      (fs->readdir != NULL && fs->readdir != sys_readdir) ||
+      (fs->unlink != NULL && fs->unlink != sys_unlink) ||
+      (fs->rmdir != NULL && fs->rmdir != sys_rmdir)) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int fs_walk_use_dirfds(void) {
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_OPENAT) && defined(HAVE_UNLINKAT)
+  register unsigned int i;
+  pr_fs_t **fs_objs;
+
+  if (root_fs == NULL ||
+      fs_walk_is_sys(root_fs) == FALSE) {
+    return FALSE;
+  }
+
+  if (fs_map == NULL) {
+    return TRUE;
+  }
+
+  fs_objs = (pr_fs_t **) fs_map->elts;
+  for (i = 0; i < fs_map->nelts; i++) {
+    pr_fs_t *fs;
+
+    for (fs = fs_objs[i]; fs != NULL; fs = fs->fs_next) {
+      if (fs_walk_is_sys(fs) == FALSE) {
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+static int fs_walk_handle_ent(pr_fs_walk_ent_t *ent, fs_walk_cb_t cb,
+    void *user_data, int (*walk_dir)(pool *, int, const char *, unsigned int,
+    fs_walk_cb_t, void *)) {
+  int fd = -1, res, xerrno;
+
+  if (!S_ISDIR(ent->ent_st.st_mode)) {
+    ent->ent_type = PR_FS_WALK_ENT_FILE;
+    return (cb)(ent, user_data);
+  }
+
+  ent->ent_type = PR_FS_WALK_ENT_DIR;
+  res = (cb)(ent, user_data);
+  if (res < 0) {
+    return -1;
+  }
+
+#if defined(HAVE_OPENAT)
+  if (ent->ent_dirfd >= 0) {
+    int flags = O_RDONLY;
+
+# if defined(O_DIRECTORY)
+    flags |= O_DIRECTORY;
+# endif /* O_DIRECTORY */
+# if defined(O_NOFOLLOW)
+    flags |= O_NOFOLLOW;
+# endif /* O_NOFOLLOW */
+
+    fd = openat(ent->ent_dirfd, ent->ent_name, flags);
+    if (fd < 0) {
+      xerrno = errno;
+
+      pr_trace_msg(trace_channel, 3, "error opening directory '%s': %s",
+        ent->ent_path, strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+  }
+#endif /* HAVE_OPENAT */
+
+  res = (walk_dir)(ent->ent_pool, fd, ent->ent_path, ent->ent_depth + 1, cb,
+    user_data);
+  if (res < 0) {
+    return -1;
+  }
+
+  ent->ent_type = PR_FS_WALK_ENT_DIR_DONE;
+  return (cb)(ent, user_data);
+}
+
+/* Walk the directory using the pr_fsio_* functions. */
+static int fs_walk_dir_path(pool *p, int fd, const char *path,
+    unsigned int depth, fs_walk_cb_t cb, void *user_data) {
+  void *dirh;
+  struct dirent *dent;
+  int res = 0, xerrno = 0;
+
+  (void) fd;
+
+  dirh = pr_fsio_opendir(path);
+  if (dirh == NULL) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3, "error opening directory '%s': %s", path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  while ((dent = pr_fsio_readdir(dirh)) != NULL) {
+    pr_fs_walk_ent_t ent;
+
+    pr_signals_handle();
+
+    if (strcmp(dent->d_name, ".") == 0 ||
+        strcmp(dent->d_name, "..") == 0) {
+      continue;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    ent.ent_pool = make_sub_pool(p);
+    pr_pool_tag(ent.ent_pool, "FS walk entry pool");
+    ent.ent_path = pdircat(ent.ent_pool, path, dent->d_name, NULL);
+    ent.ent_name = pstrdup(ent.ent_pool, dent->d_name);
+    ent.ent_depth = depth;
+    ent.ent_dirfd = -1;
+
+    if (pr_fsio_lstat(ent.ent_path, &(ent.ent_st)) < 0) {
+      pr_trace_msg(trace_channel, 9, "unable to lstat '%s' (%s), skipping",
+        ent.ent_path, strerror(errno));
+      destroy_pool(ent.ent_pool);
+      continue;
+    }
+
+    res = fs_walk_handle_ent(&ent, cb, user_data, fs_walk_dir_path);
+    xerrno = errno;
+    destroy_pool(ent.ent_pool);
+
+    if (res < 0) {
+      break;
+    }
+  }
+
+  pr_fsio_closedir(dirh);
+
+  errno = xerrno;
+  return res < 0 ? -1 : 0;
+}
+
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_OPENAT) && defined(HAVE_UNLINKAT)
+/* Walk the directory, using the given directory descriptor (which is closed
+ * before returning).
+ */
+static int fs_walk_dir_fd(pool *p, int fd, const char *path,
+    unsigned int depth, fs_walk_cb_t cb, void *user_data) {
+  DIR *dh;
+  struct dirent *dent;
+  int dir_fd, res = 0, xerrno = 0;
+
+  dh = fdopendir(fd);
+  if (dh == NULL) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3, "error reading directory '%s': %s", path,
+      strerror(xerrno));
+    (void) close(fd);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  dir_fd = dirfd(dh);
+
+  while ((dent = readdir(dh)) != NULL) {
+    pr_fs_walk_ent_t ent;
+
+    pr_signals_handle();
+
+    if (strcmp(dent->d_name, ".") == 0 ||
+        strcmp(dent->d_name, "..") == 0) {
+      continue;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    ent.ent_pool = make_sub_pool(p);
+    pr_pool_tag(ent.ent_pool, "FS walk entry pool");
+    ent.ent_path = pdircat(ent.ent_pool, path, dent->d_name, NULL);
+    ent.ent_name = pstrdup(ent.ent_pool, dent->d_name);
+    ent.ent_depth = depth;
+    ent.ent_dirfd = dir_fd;
+
+    if (fstatat(dir_fd, ent.ent_name, &(ent.ent_st),
+        AT_SYMLINK_NOFOLLOW) < 0) {
+      pr_trace_msg(trace_channel, 9, "unable to lstat '%s' (%s), skipping",
+        ent.ent_path, strerror(errno));
+      destroy_pool(ent.ent_pool);
+      continue;
+    }
+
+    res = fs_walk_handle_ent(&ent, cb, user_data, fs_walk_dir_fd);
+    xerrno = errno;
+    destroy_pool(ent.ent_pool);
+
+    if (res < 0) {
+      break;
+    }
+  }
+
+  (void) closedir(dh);
+
+  errno = xerrno;
+  return res < 0 ? -1 : 0;
+}
+#endif /* HAVE_FDOPENDIR and friends */
+
+int pr_fs_walk(pool *p, const char *path,
+    int (*cb)(pr_fs_walk_ent_t *ent, void *user_data), void *user_data) {
+  pool *walk_pool;
+  int res, xerrno;
+
+  if (p == NULL ||
+      path == NULL ||
+      cb == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  walk_pool = make_sub_pool(p);
+  pr_pool_tag(walk_pool, "FS walk pool");
+
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_OPENAT) && defined(HAVE_UNLINKAT)
+  if (fs_walk_use_dirfds() == TRUE) {
+    int fd, flags = O_RDONLY;
+
+# if defined(O_DIRECTORY)
+    flags |= O_DIRECTORY;
+# endif /* O_DIRECTORY */
+
+    fd = open(path, flags);
+    if (fd < 0) {
+      xerrno = errno;
+      destroy_pool(walk_pool);
+
+      errno = xerrno;
+      return -1;
+    }
+
+    pr_trace_msg(trace_channel, 12, "walking '%s' using directory descriptors",
+      path);
+    res = fs_walk_dir_fd(walk_pool, fd, path, 0, cb, user_data);
+    xerrno = errno;
+
+    destroy_pool(walk_pool);
+    errno = xerrno;
+    return res;
+  }
+#endif /* HAVE_FDOPENDIR and friends */
+
+  pr_trace_msg(trace_channel, 12, "walking '%s' using FSIO paths", path);
+  res = fs_walk_dir_path(walk_pool, -1, path, 0, cb, user_data);
+  xerrno = errno;
+
+  destroy_pool(walk_pool);
+  errno = xerrno;
+  return res;
+}
+
+int pr_fs_walk_remove(pr_fs_walk_ent_t *ent) {
+  int res;
+
+  if (ent == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(HAVE_UNLINKAT)
+  if (ent->ent_dirfd >= 0) {
+    if (fsio_guard_chroot) {
+      res = chroot_allow_path(ent->ent_path);
+      if (res < 0) {
+        return -1;
+      }
+    }
+
+    res = unlinkat(ent->ent_dirfd, ent->ent_name,
+      S_ISDIR(ent->ent_st.st_mode) ? AT_REMOVEDIR : 0);
+    if (res == 0) {
+      pr_fs_clear_cache2(ent->ent_path);
+    }
+
+    return res;
+  }
+#endif /* HAVE_UNLINKAT */
+
+  if (S_ISDIR(ent->ent_st.st_mode)) {
+    return pr_fsio_rmdir(ent->ent_path);
+  }
+
+  return pr_fsio_unlink(ent->ent_path);
+}
+
 pr_fs_t *pr_register_fs(pool *p, const char *name, const char *path) {
   pr_fs_t *fs = NULL;
   int xerrno = 0;
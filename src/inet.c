@@ -50,6 +50,20 @@ static int inet_family = 0;
 
 static const char *trace_channel = "inet";
 
+/* Callbacks which the daemon process consults, for each newly accepted
+ * control connection, before forking a session process to handle it.
+ */
+struct accept_filter {
+  struct accept_filter *next;
+
+  module *module;
+  int (*cb)(pool *, conn_t *, void *);
+  void *user_data;
+};
+
+static pool *accept_filter_pool = NULL;
+static struct accept_filter *accept_filters = NULL;
+
 /* Called by others after running a number of pr_inet_* functions in order
  * to free up memory.
  */
@@ -1886,6 +1900,148 @@ int pr_inet_generate_socket_event(const char *event, server_rec *s,
   return 0;
 }
 
+int pr_inet_register_accept_filter(module *m,
+    int (*cb)(pool *, conn_t *, void *), void *user_data) {
+  struct accept_filter *af, *afi;
+
+  if (cb == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (afi = accept_filters; afi; afi = afi->next) {
+    if (afi->module == m &&
+        afi->cb == cb) {
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  if (accept_filter_pool == NULL) {
+    accept_filter_pool = make_sub_pool(permanent_pool);
+    pr_pool_tag(accept_filter_pool, "Accept Filter Pool");
+  }
+
+  pr_trace_msg(trace_channel, 3,
+    "module '%s' (%p) registering accept filter (at %p)",
+    m ? m->name : "(none)", m, cb);
+
+  af = pcalloc(accept_filter_pool, sizeof(struct accept_filter));
+  af->module = m;
+  af->cb = cb;
+  af->user_data = user_data;
+
+  /* Append, so that filters are consulted in registration order. */
+  if (accept_filters == NULL) {
+    accept_filters = af;
+
+  } else {
+    for (afi = accept_filters; afi->next; afi = afi->next);
+    afi->next = af;
+  }
+
+  return 0;
+}
+
+int pr_inet_unregister_accept_filter(module *m,
+    int (*cb)(pool *, conn_t *, void *)) {
+  struct accept_filter *af, *prev = NULL;
+  int unregistered = FALSE;
+
+  af = accept_filters;
+  while (af != NULL) {
+    struct accept_filter *next;
+
+    next = af->next;
+
+    if ((m == NULL || af->module == m) &&
+        (cb == NULL || af->cb == cb)) {
+      if (prev != NULL) {
+        prev->next = next;
+
+      } else {
+        accept_filters = next;
+      }
+
+      unregistered = TRUE;
+
+    } else {
+      prev = af;
+    }
+
+    af = next;
+  }
+
+  if (unregistered == FALSE) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (accept_filters == NULL &&
+      accept_filter_pool != NULL) {
+    destroy_pool(accept_filter_pool);
+    accept_filter_pool = NULL;
+  }
+
+  return 0;
+}
+
+int pr_inet_check_accept_filters(int fd) {
+  pool *tmp_pool;
+  conn_t *c;
+  struct accept_filter *af;
+  int res = 0, xerrno = 0;
+
+  if (fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (accept_filters == NULL) {
+    return 0;
+  }
+
+  tmp_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(tmp_pool, "Accept Filter check pool");
+
+  /* The filters only get the addresses of the connection; no streams are
+   * opened, and no server has been chosen for it yet.
+   */
+  c = pcalloc(tmp_pool, sizeof(conn_t));
+  c->pool = tmp_pool;
+  c->listen_fd = -1;
+  c->rfd = c->wfd = fd;
+
+  if (pr_inet_get_conn_info(c, fd) < 0) {
+    /* Let the session process deal with (and log) this. */
+    destroy_pool(tmp_pool);
+    return 0;
+  }
+
+  for (af = accept_filters; af; af = af->next) {
+    pr_signals_handle();
+
+    if (af->cb(tmp_pool, c, af->user_data) < 0) {
+      xerrno = errno;
+
+      pr_trace_msg(trace_channel, 8,
+        "connection from %s rejected by accept filter of module '%s'",
+        pr_netaddr_get_ipstr(c->remote_addr),
+        af->module ? af->module->name : "(none)");
+      res = -1;
+      break;
+    }
+  }
+
+  destroy_pool(tmp_pool);
+
+  if (res < 0) {
+    errno = xerrno ? xerrno : EACCES;
+  }
+
+  return res;
+}
+
 void init_inet(void) {
   struct protoent *pr = NULL;
 
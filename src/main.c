@@ -497,7 +497,10 @@ int pr_cmd_read(cmd_rec **res) {
   while (TRUE) {
     pr_signals_handle();
 
-    memset(cmd_buf, '\0', cmd_bufsz);
+    /* pr_netio_telnet_gets2() NUL-terminates whatever it reads; there is
+     * no need to clear the entire buffer for each command.
+     */
+    cmd_buf[0] = '\0';
 
     cmd_buflen = pr_netio_telnet_gets2(cmd_buf, cmd_bufsz, session.c->instrm,
       session.c->outstrm);
@@ -804,7 +807,7 @@ int pr_cmd_dispatch(cmd_rec *cmd) {
 
 static cmd_rec *make_ftp_cmd(pool *p, char *buf, size_t buflen, int flags) {
   register unsigned int i, j;
-  char *arg, *ptr, *wrd;
+  char *arg, *line, *ptr, *wrd;
   size_t arg_len;
   cmd_rec *cmd;
   pool *subpool;
@@ -821,26 +824,36 @@ static cmd_rec *make_ftp_cmd(pool *p, char *buf, size_t buflen, int flags) {
     return NULL;
   }
 
-  ptr = buf;
+  subpool = make_sub_pool(p);
+  pr_pool_tag(subpool, "make_ftp_cmd pool");
+
+  /* Copy the command line into the cmd_rec pool once; the words are then
+   * tokenized in place within that copy, and the argv array points directly
+   * into it, rather than duplicating each word separately.
+   */
+  line = palloc(subpool, buflen + 1);
+  memcpy(line, buf, buflen);
+  line[buflen] = '\0';
+
+  ptr = line;
   wrd = pr_str_get_word(&ptr, str_flags);
   if (wrd == NULL) {
     /* Nothing there...bail out. */
     pr_trace_msg("ctrl", 5, "command '%s' is empty, ignoring", buf);
+    destroy_pool(subpool);
     errno = ENOENT;
     return NULL;
   }
 
-  subpool = make_sub_pool(p);
-  pr_pool_tag(subpool, "make_ftp_cmd pool");
   cmd = pcalloc(subpool, sizeof(cmd_rec));
   cmd->pool = subpool;
   cmd->tmp_pool = NULL;
   cmd->stash_index = -1;
   cmd->stash_hash = 0;
 
-  tarr = make_array(cmd->pool, 2, sizeof(char *));
+  tarr = make_array(cmd->pool, 4, sizeof(char *));
 
-  *((char **) push_array(tarr)) = pstrdup(cmd->pool, wrd);
+  *((char **) push_array(tarr)) = wrd;
   cmd->argc++;
 
   /* Make a copy of the command argument; we need to scan through it,
@@ -854,21 +867,35 @@ static cmd_rec *make_ftp_cmd(pool *p, char *buf, size_t buflen, int flags) {
    * it does the proper handling of CRNUL sequences itself.
    */
   arg_len = buflen - strlen(wrd);
-  arg = pcalloc(cmd->pool, arg_len + 1);
+  if (ptr + arg_len > line + buflen + 1) {
+    /* A quoted command name consumes more of the line than its length. */
+    arg_len = (line + buflen + 1) - ptr;
+  }
 
-  for (i = 0, j = 0; i < arg_len; i++) {
-    pr_signals_handle();
-    if (i > 1 &&
-        ptr[i] == '\0' &&
-        ptr[i-1] == '\r') {
+  arg = palloc(cmd->pool, arg_len + 1);
 
-      /* Strip out the NUL by simply not copying it into the new buffer. */
-      have_crnul = TRUE;
-    } else {
-      arg[j++] = ptr[i];
+  /* A CR+NUL sequence needs a CR; most arguments have none, and can simply
+   * be copied as is.
+   */
+  if (memchr(ptr, '\r', arg_len) == NULL) {
+    memcpy(arg, ptr, arg_len);
+    j = arg_len;
+
+  } else {
+    for (i = 0, j = 0; i < arg_len; i++) {
+      if (i > 1 &&
+          ptr[i] == '\0' &&
+          ptr[i-1] == '\r') {
+
+        /* Strip out the NUL by simply not copying it into the new buffer. */
+        have_crnul = TRUE;
+      } else {
+        arg[j++] = ptr[i];
+      }
     }
   }
 
+  arg[j] = '\0';
   cmd->arg = arg;
 
   if (have_crnul) {
@@ -883,7 +910,7 @@ static cmd_rec *make_ftp_cmd(pool *p, char *buf, size_t buflen, int flags) {
 
   while ((wrd = pr_str_get_word(&ptr, str_flags)) != NULL) {
     pr_signals_handle();
-    *((char **) push_array(tarr)) = pstrdup(cmd->pool, wrd);
+    *((char **) push_array(tarr)) = wrd;
     cmd->argc++;
   }
 
@@ -1761,6 +1788,12 @@ static void daemon_loop(void) {
           max_connects, max_connect_interval);
         close(fd);
 
+      /* Give modules the chance to reject the connection, e.g. for banned
+       * clients, without the cost of forking a process for it.
+       */
+      } else if (pr_inet_check_accept_filters(fd) < 0) {
+        close(fd);
+
       /* Fork off a child to handle the connection. */
       } else {
         PR_DEVEL_CLOCK(fork_server(fd, listen_conn, no_forking));
@@ -1935,6 +1968,12 @@ static void standalone_main(void) {
   PRIVS_RELINQUISH
   pr_close_scoreboard(TRUE);
 
+  /* The scoreboard counts are shared with all of the session processes. */
+  if (pr_scoreboard_counts_init() < 0) {
+    pr_log_debug(DEBUG3, "unable to map scoreboard counts: %s",
+      strerror(errno));
+  }
+
   pr_event_generate("core.startup", NULL);
 
   init_bindings();
@@ -2186,6 +2225,8 @@ static void show_settings(void) {
   printf("    PR_TUNABLE_PATH_MAX = %u\n", PR_TUNABLE_PATH_MAX);
   printf("    PR_TUNABLE_SCOREBOARD_BUFFER_SIZE = %u\n",
     PR_TUNABLE_SCOREBOARD_BUFFER_SIZE);
+  printf("    PR_TUNABLE_SCOREBOARD_COUNTS = %u\n",
+    PR_TUNABLE_SCOREBOARD_COUNTS);
   printf("    PR_TUNABLE_SCOREBOARD_SCRUB_TIMER = %u\n",
     PR_TUNABLE_SCOREBOARD_SCRUB_TIMER);
   printf("    PR_TUNABLE_SELECT_TIMEOUT = %u\n", PR_TUNABLE_SELECT_TIMEOUT);
@@ -2195,8 +2236,8 @@ static void show_settings(void) {
   printf("    PR_TUNABLE_TIMEOUTLOGIN = %u\n", PR_TUNABLE_TIMEOUTLOGIN);
   printf("    PR_TUNABLE_TIMEOUTNOXFER = %u\n", PR_TUNABLE_TIMEOUTNOXFER);
   printf("    PR_TUNABLE_TIMEOUTSTALLED = %u\n", PR_TUNABLE_TIMEOUTSTALLED);
-  printf("    PR_TUNABLE_XFER_SCOREBOARD_UPDATES = %u\n\n",
-    PR_TUNABLE_XFER_SCOREBOARD_UPDATES);
+  printf("    PR_TUNABLE_XFER_SCOREBOARD_INTERVAL = %u\n\n",
+    PR_TUNABLE_XFER_SCOREBOARD_INTERVAL);
 }
 
 static struct option_help {
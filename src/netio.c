@@ -1671,6 +1671,47 @@ char *pr_netio_gets(char *buf, size_t buflen, pr_netio_stream_t *nstrm) {
 
 static int telnet_mode = 0;
 
+/* Returns the number of bytes at the start of the given data which need no
+ * Telnet processing, i.e. which can be copied as is: everything up to the
+ * first IAC (when handling IAC), or the LF of the first CRLF.  The scanning
+ * is done using memchr(3), which is typically vectorized, rather than
+ * byte by byte.
+ */
+static size_t telnet_plain_len(const char *data, size_t datalen,
+    int handle_iac) {
+  const char *lf, *start;
+  size_t len;
+
+  len = datalen;
+
+  if (handle_iac == TRUE) {
+    const char *iac;
+
+    iac = memchr(data, TELNET_IAC, len);
+    if (iac != NULL) {
+      len = iac - data;
+    }
+  }
+
+  /* A lone LF is not a line terminator; only one preceded by CR is. */
+  start = data + 1;
+  while (start < data + len) {
+    lf = memchr(start, '\n', len - (start - data));
+    if (lf == NULL) {
+      break;
+    }
+
+    if (*(lf - 1) == '\r') {
+      len = lf - data;
+      break;
+    }
+
+    start = lf + 1;
+  }
+
+  return len;
+}
+
 int pr_netio_telnet_gets2(char *buf, size_t bufsz,
     pr_netio_stream_t *in_nstrm, pr_netio_stream_t *out_nstrm) {
   char *bp = buf;
@@ -1733,10 +1774,29 @@ int pr_netio_telnet_gets2(char *buf, size_t bufsz,
     while (buflen > 0 &&
            toread > 0 &&
            (*pbuf->current != '\n' ||
-            (*pbuf->current == '\n' && *(pbuf->current - 1) != '\r')) &&
-           toread--) {
+            (*pbuf->current == '\n' && *(pbuf->current - 1) != '\r'))) {
       pr_signals_handle();
 
+      /* Outside of a Telnet sequence, copy any run of plain data in bulk. */
+      if (telnet_mode == 0 ||
+          handle_iac == FALSE) {
+        size_t plainlen;
+
+        plainlen = telnet_plain_len(pbuf->current,
+          (size_t) toread < buflen ? (size_t) toread : buflen, handle_iac);
+        if (plainlen > 0) {
+          memcpy(bp, pbuf->current, plainlen);
+          bp += plainlen;
+          buflen -= plainlen;
+
+          pbuf->current += plainlen;
+          pbuf->remaining += plainlen;
+          toread -= plainlen;
+          continue;
+        }
+      }
+
+      toread--;
       cp = *pbuf->current++;
       pbuf->remaining++;
 
@@ -27,6 +27,10 @@
 #include "conf.h"
 #include "privs.h"
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
 /* From src/dirtree.c */
 extern char ServerType;
 
@@ -43,11 +47,51 @@ static off_t current_pos = 0;
 static pr_scoreboard_header_t header;
 static pr_scoreboard_entry_t entry;
 static int have_entry = FALSE;
+
+/* Set when the in-memory copy of our entry has changes not yet written out
+ * to the scoreboard.
+ */
+static int entry_pending = FALSE;
 static struct flock entry_lock;
 
 static unsigned char scoreboard_read_locked = FALSE;
 static unsigned char scoreboard_write_locked = FALSE;
 
+/* Aggregate counts of the scoreboard entries (e.g. per client address, or per
+ * user) live in memory shared by all session processes, mapped by the daemon
+ * before forking.  These allow limits such as MaxClientsPerHost to be checked
+ * without reading every entry in the scoreboard.
+ *
+ * The counts derived from an entry are only changed while holding the
+ * scoreboard mutex, along with the entry fields they are derived from; and
+ * they are rebuilt from the scoreboard itself whenever it is scrubbed.  Any
+ * drift (e.g. from a session killed at just the wrong moment) thus only lasts
+ * until the next scrub.
+ */
+struct scoreboard_count {
+  /* Hash of the count's type and key; zero for an unused slot. */
+  uint64_t key;
+  unsigned int count;
+};
+
+struct scoreboard_counts {
+  /* Set when a key could not be added for lack of free slots; the counts
+   * are then not used until they are next rebuilt.
+   */
+  unsigned int overflow;
+  unsigned int nslots;
+  struct scoreboard_count *slots;
+};
+
+/* The number of PR_SCORE_COUNT_* types, i.e. of counts per entry. */
+#define SCOREBOARD_COUNT_NTYPES		11
+
+static struct scoreboard_counts *scoreboard_counts = NULL;
+
+/* The count keys to which the last written copy of our entry contributes. */
+static uint64_t entry_count_keys[SCOREBOARD_COUNT_NTYPES];
+static unsigned int entry_count_nkeys = 0;
+
 /* Max number of attempts for lock requests */
 #define SCOREBOARD_MAX_LOCK_ATTEMPTS	10
 
@@ -380,6 +424,250 @@ static int write_entry(int fd) {
   return 0;
 }
 
+/* Count keys are hashes (FNV-1a) of the count type and those of the entry
+ * fields relevant to that type.  Class names are case-folded, as they are
+ * compared case-insensitively.
+ */
+#define SCOREBOARD_COUNT_FL_SERVER	0x01
+#define SCOREBOARD_COUNT_FL_HOST	0x02
+#define SCOREBOARD_COUNT_FL_USER	0x04
+#define SCOREBOARD_COUNT_FL_CLASS	0x08
+
+static const unsigned int scoreboard_count_fields[SCOREBOARD_COUNT_NTYPES+1] = {
+  0,
+  SCOREBOARD_COUNT_FL_SERVER,
+  SCOREBOARD_COUNT_FL_SERVER|SCOREBOARD_COUNT_FL_HOST,
+  SCOREBOARD_COUNT_FL_SERVER|SCOREBOARD_COUNT_FL_CLASS,
+  SCOREBOARD_COUNT_FL_SERVER,
+  SCOREBOARD_COUNT_FL_SERVER|SCOREBOARD_COUNT_FL_HOST,
+  SCOREBOARD_COUNT_FL_SERVER|SCOREBOARD_COUNT_FL_CLASS,
+  SCOREBOARD_COUNT_FL_SERVER|SCOREBOARD_COUNT_FL_USER,
+  SCOREBOARD_COUNT_FL_SERVER|SCOREBOARD_COUNT_FL_USER|SCOREBOARD_COUNT_FL_HOST,
+  SCOREBOARD_COUNT_FL_HOST,
+  SCOREBOARD_COUNT_FL_USER,
+  SCOREBOARD_COUNT_FL_CLASS
+};
+
+static uint64_t count_key_add(uint64_t h, const char *str, int fold) {
+  if (str != NULL) {
+    for (; *str; str++) {
+      unsigned char c;
+
+      c = (unsigned char) *str;
+      if (fold) {
+        c = tolower((int) c);
+      }
+
+      h ^= c;
+      h *= 0x100000001b3ULL;
+    }
+  }
+
+  /* Include the terminating NUL, so that e.g. "ab" + "c" and "a" + "bc"
+   * differ.
+   */
+  h ^= 0;
+  h *= 0x100000001b3ULL;
+
+  return h;
+}
+
+static uint64_t count_key(int type, const char *server_addr,
+    const char *client_addr, const char *user, const char *class_name) {
+  unsigned int fields;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  fields = scoreboard_count_fields[type];
+
+  h ^= (unsigned char) type;
+  h *= 0x100000001b3ULL;
+
+  h = count_key_add(h,
+    (fields & SCOREBOARD_COUNT_FL_SERVER) ? server_addr : NULL, FALSE);
+  h = count_key_add(h,
+    (fields & SCOREBOARD_COUNT_FL_HOST) ? client_addr : NULL, FALSE);
+  h = count_key_add(h,
+    (fields & SCOREBOARD_COUNT_FL_USER) ? user : NULL, FALSE);
+  h = count_key_add(h,
+    (fields & SCOREBOARD_COUNT_FL_CLASS) ? class_name : NULL, TRUE);
+
+  /* Zero marks an unused slot. */
+  return h != 0 ? h : 1;
+}
+
+/* Fills in the keys of the counts to which the given entry contributes,
+ * returning the number of keys.
+ */
+static unsigned int count_entry_keys(const pr_scoreboard_entry_t *sce,
+    uint64_t *keys) {
+  unsigned int nkeys = 0;
+  int type;
+
+  if (sce->sce_pid == 0) {
+    return 0;
+  }
+
+  for (type = 1; type <= SCOREBOARD_COUNT_NTYPES; type++) {
+    switch (type) {
+      case PR_SCORE_COUNT_AUTH:
+      case PR_SCORE_COUNT_AUTH_HOST:
+      case PR_SCORE_COUNT_AUTH_CLASS:
+      case PR_SCORE_COUNT_SERVER_USER:
+      case PR_SCORE_COUNT_SERVER_USER_HOST:
+        /* Only authenticated sessions count here. */
+        if (strcmp(sce->sce_user, "(none)") == 0) {
+          continue;
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    keys[nkeys++] = count_key(type, sce->sce_server_addr,
+      sce->sce_client_addr, sce->sce_user, sce->sce_class);
+  }
+
+  return nkeys;
+}
+
+static struct scoreboard_count *count_lookup(struct scoreboard_count *slots,
+    unsigned int nslots, unsigned int *overflow, uint64_t key, int create) {
+  register unsigned int i;
+  unsigned int idx;
+
+  idx = (unsigned int) (key % nslots);
+
+  for (i = 0; i < nslots; i++) {
+    struct scoreboard_count *slot;
+
+    slot = &(slots[(idx + i) % nslots]);
+    if (slot->key == key) {
+      return slot;
+    }
+
+    if (slot->key == 0) {
+      if (create == FALSE) {
+        return NULL;
+      }
+
+      slot->key = key;
+      slot->count = 0;
+      return slot;
+    }
+  }
+
+  if (create) {
+    *overflow = TRUE;
+  }
+
+  return NULL;
+}
+
+/* Frees the given slot, moving any later slots of the same probe sequence
+ * back into the gap, so that lookups need no tombstones.
+ */
+static void count_remove(struct scoreboard_count *slots, unsigned int nslots,
+    struct scoreboard_count *slot) {
+  unsigned int gap, idx;
+
+  gap = idx = (unsigned int) (slot - slots);
+  slots[gap].key = 0;
+  slots[gap].count = 0;
+
+  while (TRUE) {
+    unsigned int home;
+
+    idx = (idx + 1) % nslots;
+    if (slots[idx].key == 0) {
+      break;
+    }
+
+    /* The slot can move into the gap unless its home lies cyclically after
+     * the gap, up to the slot itself.
+     */
+    home = (unsigned int) (slots[idx].key % nslots);
+    if (gap <= idx ?
+        (home > gap && home <= idx) :
+        (home > gap || home <= idx)) {
+      continue;
+    }
+
+    slots[gap] = slots[idx];
+    slots[idx].key = 0;
+    slots[idx].count = 0;
+    gap = idx;
+  }
+}
+
+static void count_adjust(struct scoreboard_count *slots, unsigned int nslots,
+    unsigned int *overflow, const uint64_t *keys, unsigned int nkeys,
+    int incr) {
+  register unsigned int i;
+
+  for (i = 0; i < nkeys; i++) {
+    struct scoreboard_count *slot;
+
+    slot = count_lookup(slots, nslots, overflow, keys[i], incr);
+    if (slot == NULL) {
+      continue;
+    }
+
+    if (incr) {
+      slot->count++;
+
+    } else if (slot->count > 1) {
+      slot->count--;
+
+    } else {
+      /* Keys no longer counting any sessions give up their slots, lest the
+       * table fill up with them.
+       */
+      count_remove(slots, nslots, slot);
+    }
+  }
+}
+
+/* Brings the shared counts up to date with the just-written copy of our
+ * entry.  Must be called while holding the scoreboard write lock.
+ */
+static void count_entry_sync(void) {
+  uint64_t keys[SCOREBOARD_COUNT_NTYPES];
+  unsigned int nkeys;
+
+  if (scoreboard_counts == NULL) {
+    return;
+  }
+
+  nkeys = count_entry_keys(&entry, keys);
+
+  count_adjust(scoreboard_counts->slots, scoreboard_counts->nslots,
+    &(scoreboard_counts->overflow), entry_count_keys, entry_count_nkeys, FALSE);
+  count_adjust(scoreboard_counts->slots, scoreboard_counts->nslots,
+    &(scoreboard_counts->overflow), keys, nkeys, TRUE);
+
+  memcpy(entry_count_keys, keys, sizeof(keys));
+  entry_count_nkeys = nkeys;
+}
+
+/* Do the counts derived from our entry differ from those last written? */
+static int count_entry_changed(void) {
+  uint64_t keys[SCOREBOARD_COUNT_NTYPES];
+  unsigned int nkeys;
+
+  if (scoreboard_counts == NULL) {
+    return FALSE;
+  }
+
+  nkeys = count_entry_keys(&entry, keys);
+  if (nkeys != entry_count_nkeys ||
+      memcmp(keys, entry_count_keys, nkeys * sizeof(uint64_t)) != 0) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
 /* Public routines */
 
 int pr_close_scoreboard(int keep_mutex) {
@@ -881,6 +1169,10 @@ int pr_scoreboard_entry_add(void) {
 
   } else {
     have_entry = TRUE;
+    entry_pending = FALSE;
+
+    entry_count_nkeys = 0;
+    count_entry_sync();
   }
 
   pr_signals_unblock();
@@ -918,13 +1210,18 @@ int pr_scoreboard_entry_del(unsigned char verbose) {
    */
   wlock_scoreboard();
 
-  if (write_entry(scoreboard_fd) < 0 &&
-      verbose) {
-    pr_log_pri(PR_LOG_NOTICE, "error deleting scoreboard entry: %s",
-      strerror(errno));
+  if (write_entry(scoreboard_fd) < 0) {
+    if (verbose) {
+      pr_log_pri(PR_LOG_NOTICE, "error deleting scoreboard entry: %s",
+        strerror(errno));
+    }
+
+  } else {
+    count_entry_sync();
   }
 
   have_entry = FALSE;
+  entry_pending = FALSE;
   unlock_scoreboard();
   unlock_entry(scoreboard_fd);
 
@@ -1143,29 +1440,13 @@ ascii:
 #endif /* !PR_USE_NLS */
 }
 
-int pr_scoreboard_entry_update(pid_t pid, ...) {
-  va_list ap;
+/* Applies the given list of tag/value pairs to the in-memory copy of our
+ * entry, without writing it out.
+ */
+static int set_entry(va_list ap) {
   char *tmp = NULL;
   int entry_tag = 0;
 
-  if (scoreboard_engine == FALSE) {
-    return 0;
-  }
-
-  if (scoreboard_fd < 0) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  if (!have_entry) {
-    errno = EPERM;
-    return -1;
-  }
-
-  pr_trace_msg(trace_channel, 3, "updating scoreboard entry");
-
-  va_start(ap, pid);
-
   while ((entry_tag = va_arg(ap, int)) != 0) {
     pr_signals_handle();
 
@@ -1340,26 +1621,235 @@ int pr_scoreboard_entry_update(pid_t pid, ...) {
         break;
 
       default:
-        va_end(ap);
         errno = ENOENT;
         return -1;
     }
   }
 
+  entry_pending = TRUE;
+  return 0;
+}
+
+int pr_scoreboard_entry_set(pid_t pid, ...) {
+  va_list ap;
+  int res;
+
+  if (scoreboard_engine == FALSE) {
+    return 0;
+  }
+
+  if (scoreboard_fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!have_entry) {
+    errno = EPERM;
+    return -1;
+  }
+
+  va_start(ap, pid);
+  res = set_entry(ap);
   va_end(ap);
 
+  return res;
+}
+
+int pr_scoreboard_entry_flush(void) {
+  int counts_locked = FALSE;
+
+  if (scoreboard_engine == FALSE) {
+    return 0;
+  }
+
+  if (scoreboard_fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!have_entry) {
+    errno = EPERM;
+    return -1;
+  }
+
+  if (entry_pending == FALSE) {
+    return 0;
+  }
+
+  /* If the fields from which the scoreboard counts are derived have changed,
+   * the counts are changed along with the entry, under the scoreboard mutex.
+   * Should that lock fail, the counts catch up on a later write.
+   */
+  if (count_entry_changed() == TRUE &&
+      scoreboard_read_locked == FALSE &&
+      scoreboard_write_locked == FALSE &&
+      wlock_scoreboard() == 0) {
+    counts_locked = TRUE;
+  }
+
   /* Write-lock this entry */
   wlock_entry(scoreboard_fd);
   if (write_entry(scoreboard_fd) < 0) {
     pr_log_pri(PR_LOG_NOTICE, "error writing scoreboard entry: %s",
       strerror(errno));
+
+  } else {
+    entry_pending = FALSE;
+
+    if (counts_locked) {
+      count_entry_sync();
+    }
   }
   unlock_entry(scoreboard_fd);
 
+  if (counts_locked) {
+    unlock_scoreboard();
+  }
+
+  return 0;
+}
+
+int pr_scoreboard_entry_update(pid_t pid, ...) {
+  va_list ap;
+  int res;
+
+  if (scoreboard_engine == FALSE) {
+    return 0;
+  }
+
+  if (scoreboard_fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!have_entry) {
+    errno = EPERM;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 3, "updating scoreboard entry");
+
+  va_start(ap, pid);
+  res = set_entry(ap);
+  va_end(ap);
+
+  if (res < 0) {
+    return -1;
+  }
+
+  (void) pr_scoreboard_entry_flush();
+
   pr_trace_msg(trace_channel, 3, "finished updating scoreboard entry");
   return 0;
 }
 
+int pr_scoreboard_counts_init(void) {
+  struct scoreboard_counts *counts;
+  size_t tabsz;
+  void *tab;
+  int flags;
+
+  if (scoreboard_counts != NULL) {
+    /* Already mapped; the same counts are used across restarts, as is the
+     * scoreboard.
+     */
+    return 0;
+  }
+
+  if (scoreboard_engine == FALSE) {
+    errno = EPERM;
+    return -1;
+  }
+
+  flags = MAP_SHARED;
+#if defined(MAP_ANONYMOUS)
+  flags |= MAP_ANONYMOUS;
+#elif defined(MAP_ANON)
+  flags |= MAP_ANON;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+
+  tabsz = sizeof(struct scoreboard_counts) +
+    (PR_TUNABLE_SCOREBOARD_COUNTS * sizeof(struct scoreboard_count));
+  tab = mmap(NULL, tabsz, PROT_READ|PROT_WRITE, flags, -1, 0);
+  if (tab == MAP_FAILED) {
+    return -1;
+  }
+
+  memset(tab, 0, tabsz);
+
+  counts = tab;
+  counts->nslots = PR_TUNABLE_SCOREBOARD_COUNTS;
+  counts->slots = (struct scoreboard_count *) (counts + 1);
+  scoreboard_counts = counts;
+
+  pr_trace_msg(trace_channel, 7, "mapped %u shared scoreboard count slots",
+    counts->nslots);
+  return 0;
+}
+
+int pr_scoreboard_count_get(int type, const char *server_addr,
+    const char *client_addr, const char *user, const char *class_name,
+    unsigned int *count) {
+  struct scoreboard_count *slot;
+  unsigned int fields;
+  int locked = FALSE, xerrno = 0;
+
+  if (type < 1 ||
+      type > SCOREBOARD_COUNT_NTYPES ||
+      count == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fields = scoreboard_count_fields[type];
+  if (((fields & SCOREBOARD_COUNT_FL_SERVER) && server_addr == NULL) ||
+      ((fields & SCOREBOARD_COUNT_FL_HOST) && client_addr == NULL) ||
+      ((fields & SCOREBOARD_COUNT_FL_USER) && user == NULL) ||
+      ((fields & SCOREBOARD_COUNT_FL_CLASS) && class_name == NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (scoreboard_engine == FALSE ||
+      scoreboard_counts == NULL) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  if (scoreboard_read_locked == FALSE &&
+      scoreboard_write_locked == FALSE) {
+    if (rlock_scoreboard() < 0) {
+      return -1;
+    }
+
+    locked = TRUE;
+  }
+
+  if (scoreboard_counts->overflow) {
+    xerrno = ENOSPC;
+
+  } else {
+    slot = count_lookup(scoreboard_counts->slots, scoreboard_counts->nslots,
+      NULL, count_key(type, server_addr, client_addr, user, class_name),
+      FALSE);
+    *count = slot != NULL ? slot->count : 0;
+  }
+
+  if (locked) {
+    unlock_scoreboard();
+  }
+
+  if (xerrno != 0) {
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
 /* Validate the PID in a scoreboard entry.  A PID can be invalid in a couple
  * of ways:
  *
@@ -1397,6 +1887,9 @@ int pr_scoreboard_scrub(void) {
   off_t curr_offset = 0;
   pid_t curr_pgrp = 0;
   pr_scoreboard_entry_t sce;
+  struct scoreboard_count *count_slots = NULL;
+  unsigned int count_overflow = FALSE;
+  int count_complete = TRUE;
 
   if (scoreboard_engine == FALSE) {
     return 0;
@@ -1451,6 +1944,14 @@ int pr_scoreboard_scrub(void) {
   }
 
   entry_lock.l_start = curr_offset;
+
+  /* While scrubbing, rebuild the scoreboard counts from the valid entries.
+   * No counts change while we hold the scoreboard write lock.
+   */
+  if (scoreboard_counts != NULL) {
+    count_slots = calloc(scoreboard_counts->nslots,
+      sizeof(struct scoreboard_count));
+  }
  
   PRIVS_ROOT
 
@@ -1462,6 +1963,8 @@ int pr_scoreboard_scrub(void) {
      * If another process has it locked, then it is presumed to be valid.
      */
     if (wlock_entry(fd) < 0) {
+      count_complete = FALSE;
+
       /* Seek to the next entry/slot.  If it fails for any reason, just
        * be done with the scrubbing.
        */
@@ -1546,6 +2049,14 @@ int pr_scoreboard_scrub(void) {
               res, (unsigned long) sizeof(sce));
           }
         }
+
+      } else if (count_slots != NULL) {
+        uint64_t keys[SCOREBOARD_COUNT_NTYPES];
+        unsigned int nkeys;
+
+        nkeys = count_entry_keys(&sce, keys);
+        count_adjust(count_slots, scoreboard_counts->nslots, &count_overflow,
+          keys, nkeys, TRUE);
       }
 
       /* Unlock the slot, and move to the next one. */
@@ -1563,6 +2074,18 @@ int pr_scoreboard_scrub(void) {
 
   PRIVS_RELINQUISH
 
+  if (count_slots != NULL) {
+    if (count_complete == TRUE) {
+      memcpy(scoreboard_counts->slots, count_slots,
+        scoreboard_counts->nslots * sizeof(struct scoreboard_count));
+      scoreboard_counts->overflow = count_overflow;
+
+      pr_trace_msg(trace_channel, 9, "%s", "rebuilt scoreboard counts");
+    }
+
+    free(count_slots);
+  }
+
   /* Release the scoreboard. */
   unlock_scoreboard();
 
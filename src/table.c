@@ -217,24 +217,12 @@ static void tab_key_free(pr_table_t *tab, pr_table_key_t *k) {
   /* Clear everything from the given key. */
   memset(k, 0, sizeof(pr_table_key_t));
 
-  /* Add this key to the table's free list. */
-  if (tab->free_keys) {
-    pr_table_key_t *i = tab->free_keys;
-
-    /* Scan to the end of the list. */
-    while (i->next != NULL) {
-      if (!handling_signal) {
-        pr_signals_handle();
-      }
-
-      i = i->next;
-    }
-
-    i->next = k;
-
-  } else {
-    tab->free_keys = k;
-  }
+  /* Add this key to the head of the table's free list; the order of the
+   * free list does not matter, and scanning to its end would make every
+   * removal from a large table O(n).
+   */
+  k->next = tab->free_keys;
+  tab->free_keys = k;
 }
 
 /* Table entry management
@@ -262,24 +250,9 @@ static void tab_entry_free(pr_table_t *tab, pr_table_entry_t *e) {
   /* Clear everything from the given entry. */
   memset(e, 0, sizeof(pr_table_entry_t));
 
-  /* Add this entry to the table's free list. */
-  if (tab->free_ents) {
-    pr_table_entry_t *i = tab->free_ents;
-
-    /* Scan to the end of the list. */
-    while (i->next != NULL) {
-      if (!handling_signal) {
-        pr_signals_handle();
-      }
-
-      i = i->next;
-    }
-
-    i->next = e;
- 
-  } else {
-    tab->free_ents = e;
-  }
+  /* Add this entry to the head of the table's free list. */
+  e->next = tab->free_ents;
+  tab->free_ents = e;
 }
 
 static void tab_entry_insert(pr_table_t *tab, pr_table_entry_t *e) {
@@ -26,11 +26,78 @@
 
 #include "conf.h"
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
 /* Transfer rate variables */
 static long double xfer_rate_kbps = 0.0, xfer_rate_bps = 0.0;
 static off_t xfer_rate_freebytes = 0.0;
 static int have_xfer_rate = FALSE;
-static unsigned int xfer_rate_scoreboard_updates = 0;
+
+/* Elapsed transfer time, in millisecs, at which the transfer progress was
+ * last written out to the scoreboard; -1 if not yet written.  This is not
+ * reset by pr_throttle_init(), which mod_sftp calls for every READ/WRITE
+ * request; a new transfer shows up as an elapsed time going backwards.
+ */
+static long xfer_rate_scoreboard_last = -1;
+
+/* SharedTransferRate limits are enforced using buckets which live in memory
+ * shared by all session processes, mapped by the daemon before forking.
+ *
+ * Each bucket is a single "theoretical arrival time" (TAT), i.e. the time at
+ * which the bucket will have paid off all of the bytes drawn from it so far,
+ * at its rate (the GCRA formulation of a token bucket).  A session drawing
+ * N bytes advances the TAT by N/rate, using compare-and-swap; it then waits
+ * until the TAT, less the allowed burst.  Thus sessions sharing a bucket
+ * divide its rate among themselves, and a bucket left idle by one session
+ * is immediately available to the others.
+ */
+struct xfer_rate_bucket {
+  /* Hash of the bucket's scope key; zero for an unused bucket. */
+  volatile uint64_t key;
+
+  /* Theoretical arrival time, in microseconds since the epoch. */
+  volatile uint64_t tat;
+};
+
+struct xfer_rate_shared {
+  int scope;
+  long double bps;
+  off_t burst;
+  struct xfer_rate_bucket *bucket;
+
+  /* The scope key for which the bucket was claimed, and its hash. */
+  char key[512];
+  uint64_t key_hash;
+};
+
+#define XFER_RATE_SHARED_NSCOPES	3
+
+/* When pacing a transfer sent in chunks (e.g. using sendfile(2)), each
+ * chunk holds this many milliseconds' worth of data, at the lowest
+ * applicable rate.
+ */
+#define XFER_RATE_CHUNK_MSECS		100
+
+/* Buckets idle for this long (in microseconds) may be reused for other
+ * scope keys.  This also bounds the wait caused by a clock jumping
+ * backwards.
+ */
+#define XFER_RATE_SHARED_IDLE_USECS	(3600 * 1000000ULL)
+
+static struct xfer_rate_bucket *xfer_rate_buckets = NULL;
+static unsigned int xfer_rate_nbuckets = 0;
+static struct xfer_rate_shared xfer_rate_shared[XFER_RATE_SHARED_NSCOPES];
+static unsigned int xfer_rate_nshared = 0;
+
+/* The number of bytes of the current transfer already drawn from the
+ * shared buckets, and the start time identifying that transfer.
+ */
+static off_t xfer_rate_shared_len = 0;
+static struct timeval xfer_rate_shared_start;
+
+static const char *trace_channel = "throttle";
 
 /* Very similar to the {block,unblock}_signals() function, this masks most
  * of the same signals -- except for TERM.  This allows a throttling process
@@ -86,13 +153,409 @@ static long xfer_rate_since(struct timeval *then) {
     ((now.tv_usec - then->tv_usec) / 1000L));
 }
 
+/* Records the transfer progress in our scoreboard entry.  To keep the cost
+ * of this bounded by time, rather than by the number of buffers transferred,
+ * the entry is only written out once every PR_TUNABLE_XFER_SCOREBOARD_INTERVAL
+ * millisecs, and when the transfer ends; otherwise, only the in-memory copy
+ * of the entry is changed.
+ */
+static void xfer_rate_scoreboard_update(off_t xferlen, long elapsed,
+    int xfer_ending) {
+
+  if (xfer_ending == FALSE &&
+      xfer_rate_scoreboard_last >= 0 &&
+      elapsed >= xfer_rate_scoreboard_last &&
+      (elapsed - xfer_rate_scoreboard_last) <
+        PR_TUNABLE_XFER_SCOREBOARD_INTERVAL) {
+    pr_scoreboard_entry_set(session.pid,
+      PR_SCORE_XFER_LEN, xferlen,
+      PR_SCORE_XFER_ELAPSED, (unsigned long) elapsed,
+      NULL);
+    return;
+  }
+
+  pr_scoreboard_entry_update(session.pid,
+    PR_SCORE_XFER_LEN, xferlen,
+    PR_SCORE_XFER_ELAPSED, (unsigned long) elapsed,
+    NULL);
+  xfer_rate_scoreboard_last = elapsed;
+}
+
+static uint64_t xfer_rate_now_usecs(void) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (((uint64_t) now.tv_sec * 1000000ULL) + now.tv_usec);
+}
+
+static const char *xfer_rate_scope_text(int scope) {
+  switch (scope) {
+    case PR_THROTTLE_SCOPE_GLOBAL:
+      return "global";
+
+    case PR_THROTTLE_SCOPE_CLASS:
+      return "class";
+
+    case PR_THROTTLE_SCOPE_USER:
+      return "user";
+  }
+
+  return "unknown";
+}
+
+/* FNV-1a, 64-bit. */
+static uint64_t xfer_rate_hash(const char *key) {
+  const unsigned char *ptr;
+  uint64_t h = 14695981039346656037ULL;
+
+  for (ptr = (const unsigned char *) key; *ptr; ptr++) {
+    h ^= *ptr;
+    h *= 1099511628211ULL;
+  }
+
+  /* Zero marks an unused bucket. */
+  if (h == 0) {
+    h = 1;
+  }
+
+  return h;
+}
+
+/* Find the bucket for the given scope key, claiming an unused (or long idle)
+ * bucket for it if necessary.
+ */
+static struct xfer_rate_bucket *xfer_rate_get_bucket(const char *key) {
+#if defined(__GNUC__)
+  register unsigned int i;
+  uint64_t h, now;
+  unsigned int start;
+
+  h = xfer_rate_hash(key);
+  start = (unsigned int) (h % xfer_rate_nbuckets);
+  now = xfer_rate_now_usecs();
+
+  for (i = 0; i < xfer_rate_nbuckets; i++) {
+    struct xfer_rate_bucket *bucket;
+    uint64_t curr_key, tat;
+
+    bucket = &(xfer_rate_buckets[(start + i) % xfer_rate_nbuckets]);
+
+    curr_key = bucket->key;
+    if (curr_key == h) {
+      return bucket;
+    }
+
+    if (curr_key == 0) {
+      if (__sync_bool_compare_and_swap(&(bucket->key), 0, h) ||
+          bucket->key == h) {
+        return bucket;
+      }
+
+      continue;
+    }
+
+    tat = bucket->tat;
+    if (tat + XFER_RATE_SHARED_IDLE_USECS < now &&
+        __sync_bool_compare_and_swap(&(bucket->key), curr_key, h)) {
+      pr_trace_msg(trace_channel, 9, "reusing idle bucket for '%s'", key);
+      return bucket;
+    }
+  }
+
+  errno = ENOSPC;
+#else
+  errno = ENOSYS;
+#endif /* __GNUC__ */
+
+  return NULL;
+}
+
+/* Draw the given number of bytes from the shared bucket, returning the
+ * number of microseconds to wait before sending (more of) them.
+ */
+static uint64_t xfer_rate_bucket_draw(struct xfer_rate_shared *shared,
+    off_t len) {
+  uint64_t now, incr, tolerance, old_tat, tat, new_tat = 0;
+
+  /* A bucket left idle for long enough (e.g. by a stalled transfer) may
+   * have been reused by another session for a different key; if so, find
+   * (or claim) a bucket for our key again.
+   */
+  if (shared->bucket->key != shared->key_hash) {
+    struct xfer_rate_bucket *bucket;
+
+    pr_trace_msg(trace_channel, 9, "bucket for '%s' reused for another key, "
+      "looking it up again", shared->key);
+
+    bucket = xfer_rate_get_bucket(shared->key);
+    if (bucket == NULL) {
+      pr_trace_msg(trace_channel, 3, "unable to find bucket for '%s': %s",
+        shared->key, strerror(errno));
+      return 0;
+    }
+
+    shared->bucket = bucket;
+  }
+
+  now = xfer_rate_now_usecs();
+  incr = (uint64_t) ((len * 1000000.0) / shared->bps);
+  tolerance = (uint64_t) ((shared->burst * 1000000.0) / shared->bps);
+
+#if defined(__GNUC__)
+  do {
+    old_tat = tat = shared->bucket->tat;
+
+    /* An idle bucket starts over from now, without credit for the idle
+     * time beyond the burst.
+     */
+    if (tat < now ||
+        tat > now + XFER_RATE_SHARED_IDLE_USECS) {
+      tat = now;
+    }
+
+    new_tat = tat + incr;
+
+  } while (!__sync_bool_compare_and_swap(&(shared->bucket->tat), old_tat,
+    new_tat));
+#endif /* __GNUC__ */
+
+  if (new_tat > now + tolerance) {
+    return new_tat - now - tolerance;
+  }
+
+  return 0;
+}
+
+int pr_throttle_shared_init(void) {
+  size_t tabsz;
+  void *tab;
+  int flags;
+
+  if (xfer_rate_buckets != NULL) {
+    /* Already mapped; the same table is used across restarts. */
+    return 0;
+  }
+
+#if !defined(__GNUC__)
+  errno = ENOSYS;
+  return -1;
+#endif /* __GNUC__ */
+
+  flags = MAP_SHARED;
+#if defined(MAP_ANONYMOUS)
+  flags |= MAP_ANONYMOUS;
+#elif defined(MAP_ANON)
+  flags |= MAP_ANON;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+
+  tabsz = PR_TUNABLE_XFER_SHARED_RATE_BUCKETS * sizeof(struct xfer_rate_bucket);
+  tab = mmap(NULL, tabsz, PROT_READ|PROT_WRITE, flags, -1, 0);
+  if (tab == MAP_FAILED) {
+    return -1;
+  }
+
+  memset(tab, 0, tabsz);
+  xfer_rate_buckets = tab;
+  xfer_rate_nbuckets = PR_TUNABLE_XFER_SHARED_RATE_BUCKETS;
+
+  pr_trace_msg(trace_channel, 7, "mapped %u shared transfer rate buckets",
+    xfer_rate_nbuckets);
+  return 0;
+}
+
+/* Does the given TransferRate/SharedTransferRate apply to the command? */
+static int xfer_rate_cmd_matches(config_rec *c, cmd_rec *cmd) {
+  char **cmdlist = (char **) c->argv[0];
+  char *xfer_cmd = NULL;
+
+  /* Note: this could be made more efficient by using bitmasks rather than
+   * string comparisons.
+   */
+  for (xfer_cmd = *cmdlist; xfer_cmd; xfer_cmd = *(cmdlist++)) {
+    if (strcasecmp(xfer_cmd, cmd->argv[0]) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static void xfer_rate_shared_init(cmd_rec *cmd) {
+  register unsigned int i;
+  config_rec *c, *scope_configs[XFER_RATE_SHARED_NSCOPES];
+  unsigned int precedences[XFER_RATE_SHARED_NSCOPES];
+
+  xfer_rate_nshared = 0;
+  memset(scope_configs, 0, sizeof(scope_configs));
+  memset(precedences, 0, sizeof(precedences));
+
+  /* As for TransferRate, use the matching SharedTransferRate with the highest
+   * precedence, for each scope.
+   */
+  c = find_config(CURRENT_CONF, CONF_PARAM, "SharedTransferRate", FALSE);
+  while (c != NULL) {
+    int scope;
+    unsigned int precedence;
+
+    pr_signals_handle();
+
+    if (xfer_rate_cmd_matches(c, cmd) == TRUE) {
+      scope = *((int *) c->argv[4]);
+      precedence = *((unsigned int *) c->argv[3]);
+
+      if (scope >= 1 &&
+          scope <= XFER_RATE_SHARED_NSCOPES &&
+          precedence > precedences[scope-1]) {
+        precedences[scope-1] = precedence;
+        scope_configs[scope-1] = c;
+      }
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SharedTransferRate", FALSE);
+  }
+
+  for (i = 0; i < XFER_RATE_SHARED_NSCOPES; i++) {
+    int scope;
+    char key[512];
+    struct xfer_rate_bucket *bucket;
+    struct xfer_rate_shared *shared;
+
+    c = scope_configs[i];
+    if (c == NULL) {
+      continue;
+    }
+
+    if (xfer_rate_buckets == NULL) {
+      pr_log_debug(DEBUG3, "SharedTransferRate ignored: shared buckets "
+        "not available");
+      return;
+    }
+
+    scope = i + 1;
+    memset(key, '\0', sizeof(key));
+
+    switch (scope) {
+      case PR_THROTTLE_SCOPE_GLOBAL:
+        sstrncpy(key, "global", sizeof(key));
+        break;
+
+      case PR_THROTTLE_SCOPE_CLASS:
+        if (session.conn_class != NULL) {
+          pr_snprintf(key, sizeof(key)-1, "class:%s",
+            session.conn_class->cls_name);
+        }
+        break;
+
+      case PR_THROTTLE_SCOPE_USER:
+        if (session.user != NULL) {
+          pr_snprintf(key, sizeof(key)-1, "user:%s", session.user);
+        }
+        break;
+    }
+
+    if (*key == '\0') {
+      continue;
+    }
+
+    /* Sessions configured with different limits for the same scope (e.g. in
+     * different vhosts) must not charge one bucket at different rates, so
+     * the limit is part of the key.
+     */
+    pr_snprintf(key + strlen(key), sizeof(key) - strlen(key) - 1,
+      ":%.3Lf:%" PR_LU, *((long double *) c->argv[1]),
+      (pr_off_t) *((off_t *) c->argv[2]));
+
+    bucket = xfer_rate_get_bucket(key);
+    if (bucket == NULL) {
+      pr_log_debug(DEBUG3, "unable to use %s SharedTransferRate for '%s': %s",
+        xfer_rate_scope_text(scope), key, strerror(errno));
+      continue;
+    }
+
+    shared = &(xfer_rate_shared[xfer_rate_nshared++]);
+    shared->scope = scope;
+    shared->bps = *((long double *) c->argv[1]) * 1024.0;
+    shared->burst = *((off_t *) c->argv[2]);
+    shared->bucket = bucket;
+    sstrncpy(shared->key, key, sizeof(shared->key));
+    shared->key_hash = xfer_rate_hash(key);
+
+    pr_log_debug(DEBUG3, "SharedTransferRate (%.3Lf KB/s, %" PR_LU
+      " bytes burst) in effect for '%s'", *((long double *) c->argv[1]),
+      (pr_off_t) shared->burst, key);
+  }
+}
+
+/* Draw the bytes transferred since the last call from all of the shared
+ * buckets, returning the number of milliseconds to wait.
+ */
+static long xfer_rate_shared_draw(off_t xferlen) {
+  register unsigned int i;
+  off_t len;
+  uint64_t wait_usecs = 0;
+
+  /* Note that the given length is cumulative for the current transfer (or,
+   * for SFTP, an offset into the file).
+   */
+  if (session.xfer.start_time.tv_sec != xfer_rate_shared_start.tv_sec ||
+      session.xfer.start_time.tv_usec != xfer_rate_shared_start.tv_usec ||
+      xferlen < xfer_rate_shared_len) {
+    memcpy(&xfer_rate_shared_start, &(session.xfer.start_time),
+      sizeof(struct timeval));
+    xfer_rate_shared_len = 0;
+  }
+
+  len = xferlen - xfer_rate_shared_len;
+  xfer_rate_shared_len = xferlen;
+
+  if (len <= 0) {
+    return 0;
+  }
+
+  for (i = 0; i < xfer_rate_nshared; i++) {
+    uint64_t usecs;
+
+    usecs = xfer_rate_bucket_draw(&(xfer_rate_shared[i]), len);
+    if (usecs > wait_usecs) {
+      wait_usecs = usecs;
+    }
+  }
+
+  return (long) (wait_usecs / 1000);
+}
+
 int pr_throttle_have_rate(void) {
-  return have_xfer_rate;
+  if (have_xfer_rate ||
+      xfer_rate_nshared > 0) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+off_t pr_throttle_get_chunk_len(void) {
+  register unsigned int i;
+  long double bps = 0.0;
+
+  if (have_xfer_rate) {
+    bps = xfer_rate_bps;
+  }
+
+  for (i = 0; i < xfer_rate_nshared; i++) {
+    if (bps == 0.0 ||
+        xfer_rate_shared[i].bps < bps) {
+      bps = xfer_rate_shared[i].bps;
+    }
+  }
+
+  return (off_t) ((bps * XFER_RATE_CHUNK_MSECS) / 1000);
 }
 
 void pr_throttle_init(cmd_rec *cmd) {
   config_rec *c = NULL;
-  char *xfer_cmd = NULL;
   unsigned char have_user_rate = FALSE, have_group_rate = FALSE,
     have_class_rate = FALSE;
   unsigned int precedence = 0;
@@ -100,7 +563,6 @@ void pr_throttle_init(cmd_rec *cmd) {
   /* Make sure the variables are (re)initialized */
   xfer_rate_kbps = xfer_rate_bps = 0.0;
   xfer_rate_freebytes = 0;
-  xfer_rate_scoreboard_updates = 0;
   have_xfer_rate = FALSE;
 
   c = find_config(CURRENT_CONF, CONF_PARAM, "TransferRate", FALSE);
@@ -111,24 +573,12 @@ void pr_throttle_init(cmd_rec *cmd) {
    * found config_recs.
    */
   while (c) {
-    char **cmdlist = (char **) c->argv[0];
-    int matched_cmd = FALSE;
-
     pr_signals_handle();
 
-    /* Does this TransferRate apply to the current command?  Note: this
-     * could be made more efficient by using bitmasks rather than string
-     * comparisons.
+    /* Does this TransferRate apply to the current command?  No -- continue
+     * on to the next TransferRate.
      */
-    for (xfer_cmd = *cmdlist; xfer_cmd; xfer_cmd = *(cmdlist++)) {
-      if (strcasecmp(xfer_cmd, cmd->argv[0]) == 0) {
-        matched_cmd = TRUE;
-        break;
-      }
-    }
-
-    /* No -- continue on to the next TransferRate. */
-    if (!matched_cmd) {
+    if (xfer_rate_cmd_matches(c, cmd) == FALSE) {
       c = find_config_next(c, c->next, CONF_PARAM, "TransferRate", FALSE);
       continue;
     }
@@ -207,10 +657,12 @@ void pr_throttle_init(cmd_rec *cmd) {
      */
     xfer_rate_bps = xfer_rate_kbps * 1024.0;
   }
+
+  xfer_rate_shared_init(cmd);
 }
 
 void pr_throttle_pause(off_t xferlen, int xfer_ending) {
-  long ideal = 0, elapsed = 0;
+  long ideal = 0, elapsed = 0, shared_delay = 0;
   off_t orig_xferlen = xferlen;
 
   if (XFER_ABORTED) {
@@ -221,25 +673,22 @@ void pr_throttle_pause(off_t xferlen, int xfer_ending) {
   elapsed = xfer_rate_since(&session.xfer.start_time);
 
   /* Perform no throttling if no throttling has been configured. */
-  if (!have_xfer_rate) {
-    xfer_rate_scoreboard_updates++;
-
-    if (xfer_ending ||
-        xfer_rate_scoreboard_updates % PR_TUNABLE_XFER_SCOREBOARD_UPDATES == 0) {
-      /* Update the scoreboard. */
-      pr_scoreboard_entry_update(session.pid,
-        PR_SCORE_XFER_LEN, orig_xferlen,
-        PR_SCORE_XFER_ELAPSED, (unsigned long) elapsed,
-        NULL);
-
-      xfer_rate_scoreboard_updates = 0;
-    }
-
+  if (!have_xfer_rate &&
+      xfer_rate_nshared == 0) {
+    xfer_rate_scoreboard_update(orig_xferlen, elapsed, xfer_ending);
     return;
   }
 
+  /* The shared buckets are drawn from regardless of any per-session
+   * freebytes.
+   */
+  if (xfer_rate_nshared > 0) {
+    shared_delay = xfer_rate_shared_draw(orig_xferlen);
+  }
+
   /* Give credit for any configured freebytes. */
-  if (xferlen > 0 &&
+  if (have_xfer_rate &&
+      xferlen > 0 &&
       xfer_rate_freebytes > 0) {
 
     if (xferlen > xfer_rate_freebytes) {
@@ -248,28 +697,29 @@ void pr_throttle_pause(off_t xferlen, int xfer_ending) {
        */
       xferlen -= xfer_rate_freebytes;
 
-    } else {
-      xfer_rate_scoreboard_updates++;
+    } else if (shared_delay > 0) {
+      /* Only the shared buckets need throttling. */
+      xferlen = 0;
 
+    } else {
       /* The number of bytes transferred is less than the freebytes.  Just
        * update the scoreboard -- no throttling needed.
        */
-
-      if (xfer_ending ||
-          xfer_rate_scoreboard_updates % PR_TUNABLE_XFER_SCOREBOARD_UPDATES == 0) {
-        pr_scoreboard_entry_update(session.pid,
-          PR_SCORE_XFER_LEN, orig_xferlen,
-          PR_SCORE_XFER_ELAPSED, (unsigned long) elapsed,
-          NULL);
-
-        xfer_rate_scoreboard_updates = 0;
-      }
-
+      xfer_rate_scoreboard_update(orig_xferlen, elapsed, xfer_ending);
       return;
     }
   }
 
-  ideal = xferlen * 1000L / xfer_rate_bps;
+  if (have_xfer_rate) {
+    ideal = xferlen * 1000L / xfer_rate_bps;
+  }
+
+  /* Wait for the shared buckets, if they need a longer wait than the
+   * per-session rate.
+   */
+  if (elapsed + shared_delay > ideal) {
+    ideal = elapsed + shared_delay;
+  }
 
   if (ideal > elapsed) {
     struct timeval tv;
@@ -312,16 +762,10 @@ void pr_throttle_pause(off_t xferlen, int xfer_ending) {
     pr_signals_handle();
 
     /* Update the scoreboard. */
-    pr_scoreboard_entry_update(session.pid,
-      PR_SCORE_XFER_LEN, orig_xferlen,
-      PR_SCORE_XFER_ELAPSED, (unsigned long) ideal,
-      NULL);
+    xfer_rate_scoreboard_update(orig_xferlen, ideal, xfer_ending);
 
   } else {
     /* Update the scoreboard. */
-    pr_scoreboard_entry_update(session.pid,
-      PR_SCORE_XFER_LEN, orig_xferlen,
-      PR_SCORE_XFER_ELAPSED, (unsigned long) elapsed,
-      NULL);
+    xfer_rate_scoreboard_update(orig_xferlen, elapsed, xfer_ending);
   }
 }
@@ -315,6 +315,24 @@ START_TEST (cmd_get_id_test) {
   res = pr_cmd_get_id("RnTo");
   fail_unless(res == PR_CMD_RNTO_ID, "Expected cmd ID %d for 'RnTo', got %d",
     PR_CMD_RNTO_ID, res);
+
+  /* Unknown names of a known command length, and names which differ from
+   * a known command only in non-letters, should not match.
+   */
+  res = pr_cmd_get_id("XYZZ");
+  fail_unless(res == -1, "Failed to handle unknown command 'XYZZ'");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = pr_cmd_get_id("US\305R");
+  fail_unless(res == -1, "Failed to handle unknown command 'US\\305R'");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = pr_cmd_get_id("USERS");
+  fail_unless(res == -1, "Failed to handle unknown command 'USERS'");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
 }
 END_TEST
 
@@ -477,6 +495,14 @@ START_TEST (cmd_get_displayable_str_test) {
   fail_unless(len == 13, "Expected len 13, got %lu", (unsigned long) len);
   fail_unless(strcmp(res, ok) == 0, "Expected '%s', got '%s'", ok, res);
 
+  /* The cached string should report the same length. */
+  mark_point();
+  len = 0;
+  res = pr_cmd_get_displayable_str(cmd, &len);
+  fail_unless(res != NULL, "Expected displayable string, got null");
+  fail_unless(len == 13, "Expected len 13, got %lu", (unsigned long) len);
+  fail_unless(strcmp(res, ok) == 0, "Expected '%s', got '%s'", ok, res);
+
   mark_point();
   cmd = pr_cmd_alloc(p, 2, C_ADAT, "bar baz quxx");
   res = pr_cmd_get_displayable_str(cmd, &len);
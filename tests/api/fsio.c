@@ -3974,6 +3974,165 @@ START_TEST (fs_copy_file2_test) {
 }
 END_TEST
 
+START_TEST (fs_copy_file2_large_test) {
+  register unsigned int i;
+  int res;
+  char *src_path, *dst_path, buf[8192];
+  struct stat st;
+  pr_fh_t *fh;
+
+  /* Copy a file large enough to need several copy chunks, on top of an
+   * existing larger destination file, and make sure that the result is
+   * identical, whichever copy method was used.
+   */
+  src_path = (char *) fsio_copy_src_path;
+  dst_path = (char *) fsio_copy_dst_path;
+
+  (void) unlink(src_path);
+  (void) unlink(dst_path);
+
+  fh = pr_fsio_open(dst_path, O_CREAT|O_EXCL|O_WRONLY);
+  fail_unless(fh != NULL, "Failed to open '%s': %s", dst_path, strerror(errno));
+
+  memset(buf, 'X', sizeof(buf));
+  for (i = 0; i < 2048; i++) {
+    res = pr_fsio_write(fh, buf, sizeof(buf));
+    fail_unless(res == sizeof(buf), "Failed to write to '%s': %s", dst_path,
+      strerror(errno));
+  }
+
+  res = pr_fsio_close(fh);
+  fail_unless(res == 0, "Failed to close '%s': %s", dst_path, strerror(errno));
+
+  fh = pr_fsio_open(src_path, O_CREAT|O_EXCL|O_WRONLY);
+  fail_unless(fh != NULL, "Failed to open '%s': %s", src_path, strerror(errno));
+
+  for (i = 0; i < 1536; i++) {
+    memset(buf, 'a' + (i % 26), sizeof(buf));
+    res = pr_fsio_write(fh, buf, sizeof(buf));
+    fail_unless(res == sizeof(buf), "Failed to write to '%s': %s", src_path,
+      strerror(errno));
+  }
+
+  res = pr_fsio_close(fh);
+  fail_unless(res == 0, "Failed to close '%s': %s", src_path, strerror(errno));
+
+  mark_point();
+  res = pr_fs_copy_file2(src_path, dst_path, 0, NULL);
+  fail_unless(res == 0, "Failed to copy file: %s", strerror(errno));
+
+  res = stat(dst_path, &st);
+  fail_unless(res == 0, "Failed to stat '%s': %s", dst_path, strerror(errno));
+  fail_unless(st.st_size == (off_t) (1536 * sizeof(buf)),
+    "Expected size %lu, got %lu", (unsigned long) (1536 * sizeof(buf)),
+    (unsigned long) st.st_size);
+
+  fh = pr_fsio_open(dst_path, O_RDONLY);
+  fail_unless(fh != NULL, "Failed to open '%s': %s", dst_path, strerror(errno));
+
+  for (i = 0; i < 1536; i++) {
+    res = pr_fsio_read(fh, buf, sizeof(buf));
+    fail_unless(res == sizeof(buf), "Failed to read from '%s': %s", dst_path,
+      strerror(errno));
+    fail_unless(buf[0] == 'a' + (i % 26) &&
+      buf[sizeof(buf)-1] == 'a' + (i % 26),
+      "Unexpected data in block %u of '%s'", i, dst_path);
+  }
+
+  (void) pr_fsio_close(fh);
+  (void) pr_fsio_unlink(src_path);
+  (void) pr_fsio_unlink(dst_path);
+}
+END_TEST
+
+static unsigned int walk_nfiles = 0, walk_ndirs = 0, walk_ndirs_done = 0;
+
+static int walk_cb(pr_fs_walk_ent_t *ent, void *user_data) {
+  switch (ent->ent_type) {
+    case PR_FS_WALK_ENT_FILE:
+      walk_nfiles++;
+      break;
+
+    case PR_FS_WALK_ENT_DIR:
+      walk_ndirs++;
+      return 0;
+
+    case PR_FS_WALK_ENT_DIR_DONE:
+      walk_ndirs_done++;
+      break;
+  }
+
+  if (user_data != NULL) {
+    return pr_fs_walk_remove(ent);
+  }
+
+  return 0;
+}
+
+START_TEST (fs_walk_test) {
+  int res;
+  char *path;
+
+  res = pr_fs_walk(NULL, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = pr_fs_walk(p, fsio_testdir_path, walk_cb, NULL);
+  fail_unless(res < 0, "Failed to handle nonexistent directory");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = mkdir(fsio_testdir_path, 0755);
+  fail_unless(res == 0, "Failed to create '%s': %s", fsio_testdir_path,
+    strerror(errno));
+
+  path = pdircat(p, fsio_testdir_path, "a", NULL);
+  res = mkdir(path, 0755);
+  fail_unless(res == 0, "Failed to create '%s': %s", path, strerror(errno));
+
+  path = pdircat(p, fsio_testdir_path, "a", "b", NULL);
+  res = mkdir(path, 0755);
+  fail_unless(res == 0, "Failed to create '%s': %s", path, strerror(errno));
+
+  path = pdircat(p, fsio_testdir_path, "file1", NULL);
+  res = creat(path, 0644);
+  fail_unless(res >= 0, "Failed to create '%s': %s", path, strerror(errno));
+  (void) close(res);
+
+  path = pdircat(p, fsio_testdir_path, "a", "b", "file2", NULL);
+  res = creat(path, 0644);
+  fail_unless(res >= 0, "Failed to create '%s': %s", path, strerror(errno));
+  (void) close(res);
+
+  /* Symlinks are reported, not followed. */
+  path = pdircat(p, fsio_testdir_path, "a", "link", NULL);
+  res = symlink("/tmp", path);
+  fail_unless(res == 0, "Failed to create '%s': %s", path, strerror(errno));
+
+  walk_nfiles = walk_ndirs = walk_ndirs_done = 0;
+
+  mark_point();
+  res = pr_fs_walk(p, fsio_testdir_path, walk_cb, NULL);
+  fail_unless(res == 0, "Failed to walk '%s': %s", fsio_testdir_path,
+    strerror(errno));
+  fail_unless(walk_nfiles == 3, "Expected 3 files, got %u", walk_nfiles);
+  fail_unless(walk_ndirs == 2, "Expected 2 dirs, got %u", walk_ndirs);
+  fail_unless(walk_ndirs_done == 2, "Expected 2 dirs done, got %u",
+    walk_ndirs_done);
+
+  /* Now remove everything under the directory as we walk it. */
+  mark_point();
+  res = pr_fs_walk(p, fsio_testdir_path, walk_cb, "remove");
+  fail_unless(res == 0, "Failed to walk '%s': %s", fsio_testdir_path,
+    strerror(errno));
+
+  res = rmdir(fsio_testdir_path);
+  fail_unless(res == 0, "Failed to remove emptied '%s': %s",
+    fsio_testdir_path, strerror(errno));
+}
+END_TEST
+
 START_TEST (fs_interpolate_test) {
   int res;
   char buf[PR_TUNABLE_PATH_MAX], *path;
@@ -5222,6 +5381,8 @@ Suite *tests_get_fsio_suite(void) {
   tcase_add_test(testcase, fs_glob_test);
   tcase_add_test(testcase, fs_copy_file_test);
   tcase_add_test(testcase, fs_copy_file2_test);
+  tcase_add_test(testcase, fs_copy_file2_large_test);
+  tcase_add_test(testcase, fs_walk_test);
   tcase_add_test(testcase, fs_interpolate_test);
   tcase_add_test(testcase, fs_resolve_partial_test);
   tcase_add_test(testcase, fs_resolve_path_test);
@@ -1058,6 +1058,62 @@ START_TEST (inet_generate_socket_event_test) {
 }
 END_TEST
 
+static unsigned int accept_filter_count = 0;
+
+static int accept_filter_cb(pool *cb_pool, conn_t *c, void *user_data) {
+  accept_filter_count++;
+
+  errno = EACCES;
+  return -1;
+}
+
+START_TEST (inet_accept_filter_test) {
+  int fd, res;
+
+  res = pr_inet_register_accept_filter(NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null callback");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = pr_inet_unregister_accept_filter(NULL, accept_filter_cb);
+  fail_unless(res < 0, "Unregistered unknown accept filter unexpectedly");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = pr_inet_check_accept_filters(-1);
+  fail_unless(res < 0, "Failed to handle bad fd");
+  fail_unless(errno == EBADF, "Expected EBADF (%d), got %s (%d)", EBADF,
+    strerror(errno), errno);
+
+  res = pr_inet_register_accept_filter(NULL, accept_filter_cb, NULL);
+  fail_unless(res == 0, "Failed to register accept filter: %s",
+    strerror(errno));
+
+  res = pr_inet_register_accept_filter(NULL, accept_filter_cb, NULL);
+  fail_unless(res < 0, "Registered duplicate accept filter unexpectedly");
+  fail_unless(errno == EEXIST, "Expected EEXIST (%d), got %s (%d)", EEXIST,
+    strerror(errno), errno);
+
+  /* Filters are not consulted for fds whose addresses cannot be had. */
+  fd = devnull_fd();
+  if (fd < 0) {
+    return;
+  }
+
+  accept_filter_count = 0;
+  res = pr_inet_check_accept_filters(fd);
+  fail_unless(res == 0, "Failed to check accept filters: %s",
+    strerror(errno));
+  fail_unless(accept_filter_count == 0,
+    "Expected no accept filter calls, got %u", accept_filter_count);
+  (void) close(fd);
+
+  res = pr_inet_unregister_accept_filter(NULL, accept_filter_cb);
+  fail_unless(res == 0, "Failed to unregister accept filter: %s",
+    strerror(errno));
+}
+END_TEST
+
 Suite *tests_get_inet_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -1090,6 +1146,7 @@ Suite *tests_get_inet_suite(void) {
   tcase_add_test(testcase, inet_conn_info_test);
   tcase_add_test(testcase, inet_openrw_test);
   tcase_add_test(testcase, inet_generate_socket_event_test);
+  tcase_add_test(testcase, inet_accept_filter_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
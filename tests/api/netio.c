@@ -1317,6 +1317,67 @@ START_TEST (netio_telnet_gets2_single_line_lf_test) {
 }
 END_TEST
 
+START_TEST (netio_telnet_gets2_multi_line_iac_test) {
+  int res;
+  char buf[256], *cmd, *first_cmd, *second_cmd, *third_cmd;
+  pr_netio_stream_t *in, *out;
+  pr_buffer_t *pbuf;
+  int len, xerrno;
+
+  in = pr_netio_open(p, PR_NETIO_STRM_CTRL, -1, PR_NETIO_IO_RD);
+  out = pr_netio_open(p, PR_NETIO_STRM_CTRL, -1, PR_NETIO_IO_WR);
+
+  /* Plain runs, bare LFs, and escaped IACs, all within one read buffer. */
+  cmd = "NOOP\r\nSIZE a\nb\r\nSI\377\377ZE foo\r\n";
+  first_cmd = "NOOP\n";
+  second_cmd = "SIZE a\nb\n";
+  third_cmd = "SI\377ZE foo\n";
+
+  pr_netio_buffer_alloc(in);
+  pbuf = in->strm_buf;
+  len = snprintf(pbuf->buf, pbuf->buflen-1, "%s", cmd);
+  pbuf->remaining = pbuf->buflen - len;
+  pbuf->current = pbuf->buf;
+
+  buf[sizeof(buf)-1] = '\0';
+
+  res = pr_netio_telnet_gets2(buf, sizeof(buf)-1, in, out);
+  xerrno = errno;
+
+  fail_unless(res > 0, "Failed to get string from stream: (%d) %s",
+    xerrno, strerror(xerrno));
+  fail_unless(strcmp(buf, first_cmd) == 0, "Expected string '%s', got '%s'",
+    first_cmd, buf);
+  fail_unless((size_t) res == strlen(first_cmd), "Expected length %lu, got %d",
+    (unsigned long) strlen(first_cmd), res);
+
+  memset(buf, '\0', sizeof(buf));
+  res = pr_netio_telnet_gets2(buf, sizeof(buf)-1, in, out);
+  xerrno = errno;
+
+  fail_unless(res > 0, "Failed to get string from stream: (%d) %s",
+    xerrno, strerror(xerrno));
+  fail_unless(strcmp(buf, second_cmd) == 0, "Expected string '%s', got '%s'",
+    second_cmd, buf);
+
+  memset(buf, '\0', sizeof(buf));
+  res = pr_netio_telnet_gets2(buf, sizeof(buf)-1, in, out);
+  xerrno = errno;
+
+  fail_unless(res > 0, "Failed to get string from stream: (%d) %s",
+    xerrno, strerror(xerrno));
+  fail_unless(strcmp(buf, third_cmd) == 0, "Expected string '%s', got '%s'",
+    third_cmd, buf);
+
+  fail_unless(pbuf->remaining == (size_t) xfer_bufsz,
+    "Expected %d remaining bytes, got %lu", xfer_bufsz,
+    (unsigned long) pbuf->remaining);
+
+  pr_netio_close(in);
+  pr_netio_close(out);
+}
+END_TEST
+
 static int netio_close_cb(pr_netio_stream_t *nstrm) {
   return 0;
 }
@@ -2404,6 +2465,7 @@ Suite *tests_get_netio_suite(void) {
   tcase_add_test(testcase, netio_telnet_gets2_single_line_test);
   tcase_add_test(testcase, netio_telnet_gets2_single_line_crnul_test);
   tcase_add_test(testcase, netio_telnet_gets2_single_line_lf_test);
+  tcase_add_test(testcase, netio_telnet_gets2_multi_line_iac_test);
 
   tcase_add_test(testcase, netio_read_test);
   tcase_add_test(testcase, netio_gets_test);
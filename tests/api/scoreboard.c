@@ -1017,6 +1017,218 @@ START_TEST (scoreboard_entry_update_test) {
 }
 END_TEST
 
+START_TEST (scoreboard_entry_set_flush_test) {
+  int res;
+  pid_t pid = getpid();
+  off_t len;
+  pr_scoreboard_entry_t *score;
+
+  res = mkdir(test_dir, 0775);
+  fail_unless(res == 0, "Failed to create directory '%s': %s", test_dir,
+    strerror(errno));
+
+  res = chmod(test_dir, 0775);
+  fail_unless(res == 0, "Failed to set perms on '%s' to 0775': %s", test_dir,
+    strerror(errno));
+
+  res = pr_set_scoreboard(test_file);
+  fail_unless(res == 0, "Failed to set scoreboard to '%s': %s", test_file,
+    strerror(errno));
+
+  res = pr_scoreboard_entry_set(pid, 0);
+  fail_unless(res < 0, "Unexpectedly set scoreboard entry");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = pr_scoreboard_entry_flush();
+  fail_unless(res < 0, "Unexpectedly flushed scoreboard entry");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = pr_open_scoreboard(O_RDWR);
+  fail_unless(res == 0, "Failed to open scoreboard: %s", strerror(errno));
+
+  res = pr_scoreboard_entry_set(pid, 0);
+  fail_unless(res < 0, "Unexpectedly set scoreboard entry");
+  fail_unless(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  res = pr_scoreboard_entry_add();
+  fail_unless(res == 0, "Failed to add entry to scoreboard: %s",
+    strerror(errno));
+
+  res = pr_scoreboard_entry_set(pid, -1);
+  fail_unless(res < 0, "Unexpectedly set scoreboard entry");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  len = 7;
+  res = pr_scoreboard_entry_set(pid, PR_SCORE_XFER_DONE, len, NULL);
+  fail_unless(res == 0, "Failed to set PR_SCORE_XFER_DONE: %s",
+    strerror(errno));
+
+  /* The change should not yet be visible in the scoreboard itself. */
+  res = pr_rewind_scoreboard();
+  fail_unless(res == 0, "Failed to rewind scoreboard: %s", strerror(errno));
+
+  score = pr_scoreboard_entry_read();
+  fail_unless(score != NULL, "Failed to read scoreboard entry: %s",
+    strerror(errno));
+  fail_unless(score->sce_xfer_done == 0, "Expected 0, got %" PR_LU,
+    (pr_off_t) score->sce_xfer_done);
+
+  res = pr_scoreboard_entry_flush();
+  fail_unless(res == 0, "Failed to flush scoreboard entry: %s",
+    strerror(errno));
+
+  res = pr_rewind_scoreboard();
+  fail_unless(res == 0, "Failed to rewind scoreboard: %s", strerror(errno));
+
+  score = pr_scoreboard_entry_read();
+  fail_unless(score != NULL, "Failed to read scoreboard entry: %s",
+    strerror(errno));
+  fail_unless(score->sce_xfer_done == 7, "Expected 7, got %" PR_LU,
+    (pr_off_t) score->sce_xfer_done);
+
+  /* Nothing pending, so this should be a no-op. */
+  res = pr_scoreboard_entry_flush();
+  fail_unless(res == 0, "Failed to flush scoreboard entry: %s",
+    strerror(errno));
+
+  (void) unlink(test_mutex);
+  (void) unlink(test_file);
+  (void) rmdir(test_dir);
+}
+END_TEST
+
+START_TEST (scoreboard_counts_test) {
+  int res;
+  unsigned int count = 0;
+  pid_t pid = getpid();
+  const pr_netaddr_t *addr;
+  const char *server_addr = "127.0.0.1:21";
+
+  res = pr_scoreboard_count_get(0, NULL, NULL, NULL, NULL, &count);
+  fail_unless(res < 0, "Failed to handle invalid type");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_HOST, server_addr, NULL,
+    NULL, NULL, &count);
+  fail_unless(res < 0, "Failed to handle null client address");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER, server_addr, NULL,
+    NULL, NULL, &count);
+  fail_unless(res < 0, "Unexpectedly got count without mapped counts");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  res = mkdir(test_dir, 0775);
+  fail_unless(res == 0, "Failed to create directory '%s': %s", test_dir,
+    strerror(errno));
+
+  res = chmod(test_dir, 0775);
+  fail_unless(res == 0, "Failed to set perms on '%s' to 0775': %s", test_dir,
+    strerror(errno));
+
+  res = pr_set_scoreboard(test_file);
+  fail_unless(res == 0, "Failed to set scoreboard to '%s': %s", test_file,
+    strerror(errno));
+
+  res = pr_open_scoreboard(O_RDWR);
+  fail_unless(res == 0, "Failed to open scoreboard: %s", strerror(errno));
+
+  res = pr_scoreboard_counts_init();
+  fail_unless(res == 0, "Failed to map scoreboard counts: %s",
+    strerror(errno));
+
+  res = pr_scoreboard_entry_add();
+  fail_unless(res == 0, "Failed to add entry to scoreboard: %s",
+    strerror(errno));
+
+  addr = pr_netaddr_get_addr(p, "127.0.0.1", NULL);
+  fail_unless(addr != NULL, "Failed to resolve '127.0.0.1': %s",
+    strerror(errno));
+
+  res = pr_scoreboard_entry_update(pid,
+    PR_SCORE_USER, "(none)",
+    PR_SCORE_SERVER_ADDR, addr, 21,
+    PR_SCORE_CLIENT_ADDR, addr,
+    PR_SCORE_CLASS, "Local",
+    NULL);
+  fail_unless(res == 0, "Failed to update scoreboard entry: %s",
+    strerror(errno));
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_HOST, server_addr,
+    "127.0.0.1", NULL, NULL, &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 1, "Expected 1, got %u", count);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_CLASS, NULL, NULL, NULL,
+    "local", &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 1, "Expected 1, got %u", count);
+
+  /* Unauthenticated sessions are not counted here. */
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH, server_addr, NULL, NULL,
+    NULL, &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 0, "Expected 0, got %u", count);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH_CLASS, server_addr, NULL,
+    NULL, "local", &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 0, "Expected 0, got %u", count);
+
+  res = pr_scoreboard_entry_update(pid, PR_SCORE_USER, "foo", NULL);
+  fail_unless(res == 0, "Failed to update PR_SCORE_USER: %s", strerror(errno));
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH_CLASS, server_addr, NULL,
+    NULL, "local", &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 1, "Expected 1, got %u", count);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_AUTH, server_addr, NULL, NULL,
+    NULL, &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 1, "Expected 1, got %u", count);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_USER_HOST, server_addr,
+    "127.0.0.1", "foo", NULL, &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 1, "Expected 1, got %u", count);
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_USER, NULL, NULL, "bar", NULL,
+    &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 0, "Expected 0, got %u", count);
+
+  /* Rebuilding the counts from the scoreboard should not change them. */
+  res = pr_scoreboard_scrub();
+  fail_unless(res == 0, "Failed to scrub scoreboard: %s", strerror(errno));
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER_USER, server_addr,
+    NULL, "foo", NULL, &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 1, "Expected 1, got %u", count);
+
+  res = pr_scoreboard_entry_del(FALSE);
+  fail_unless(res == 0, "Failed to delete entry from scoreboard: %s",
+    strerror(errno));
+
+  res = pr_scoreboard_count_get(PR_SCORE_COUNT_SERVER, server_addr, NULL,
+    NULL, NULL, &count);
+  fail_unless(res == 0, "Failed to get count: %s", strerror(errno));
+  fail_unless(count == 0, "Expected 0, got %u", count);
+
+  (void) unlink(test_mutex);
+  (void) unlink(test_file);
+  (void) rmdir(test_dir);
+}
+END_TEST
+
 START_TEST (scoreboard_entry_kill_test) {
   int res;
   pr_scoreboard_entry_t sce;
@@ -1201,6 +1413,8 @@ Suite *tests_get_scoreboard_suite(void) {
   tcase_add_test(testcase, scoreboard_entry_read_test);
   tcase_add_test(testcase, scoreboard_entry_get_test);
   tcase_add_test(testcase, scoreboard_entry_update_test);
+  tcase_add_test(testcase, scoreboard_entry_set_flush_test);
+  tcase_add_test(testcase, scoreboard_counts_test);
   tcase_add_test(testcase, scoreboard_entry_kill_test);
   tcase_add_test(testcase, scoreboard_entry_lock_test);
   tcase_add_test(testcase, scoreboard_disabled_test);
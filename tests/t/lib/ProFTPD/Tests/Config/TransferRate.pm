@@ -28,6 +28,16 @@ my $TESTS = {
 
   # XXX Need tests for the free bytes parts
 
+  transferrate_retr_sendfile_ok => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  sharedtransferrate_retr_global_ok => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
 };
 
 sub new {
@@ -353,4 +363,294 @@ sub transferrate_stor_ok {
   unlink($log_file);
 }
 
+sub sharedtransferrate_retr_global_ok {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'config');
+
+  my $test_file = File::Spec->rel2abs("$tmpdir/test.txt");
+  if (open(my $fh, "> $test_file")) {
+    print $fh "ABCDefgh" x 1024, "\n";
+
+    unless (close($fh)) {
+      die("Can't write $test_file: $!");
+    }
+
+  } else {
+    die("Can't open $test_file: $!");
+  }
+
+  my $timeout_idle = 20;
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'throttle:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    TimeoutIdle => $timeout_idle,
+
+    # 2 KB/sec, shared by all sessions
+    SharedTransferRate => 'RETR 2 global',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client1 = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client1->login($setup->{user}, $setup->{passwd});
+
+      my $client2 = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client2->login($setup->{user}, $setup->{passwd});
+
+      my $xfer_start = [gettimeofday()];
+
+      my $conn1 = $client1->retr_raw('test.txt');
+      unless ($conn1) {
+        die("RETR failed: " . $client1->response_code() . " " .
+          $client1->response_msg());
+      }
+
+      my $conn2 = $client2->retr_raw('test.txt');
+      unless ($conn2) {
+        die("RETR failed: " . $client2->response_code() . " " .
+          $client2->response_msg());
+      }
+
+      my ($buf1, $buf2, $tmp) = ('', '');
+
+      while ($conn1->read($tmp, 8192, 30)) {
+        $buf1 .= $tmp;
+      }
+      $conn1->close();
+
+      while ($conn2->read($tmp, 8192, 30)) {
+        $buf2 .= $tmp;
+      }
+      $conn2->close();
+
+      my $xfer_elapsed = tv_interval($xfer_start);
+
+      foreach my $client ($client1, $client2) {
+        my $resp_code = $client->response_code();
+        my $resp_msg = $client->response_msg();
+        $client->quit();
+
+        my $expected = 226;
+        $self->assert($expected == $resp_code,
+          test_msg("Expected $expected, got $resp_code"));
+      }
+
+      my $expected = 8193;
+      foreach my $buflen (length($buf1), length($buf2)) {
+        $self->assert($expected == $buflen,
+          test_msg("Expected $expected, got $buflen"));
+      }
+
+      # We configured a SharedTransferRate of 2 KB/sec, and retrieved 16 KB
+      # in total; thus make sure that the transfers took more than 7 secs,
+      # even though each session alone would be allowed 2 KB/sec.
+      $self->assert($xfer_elapsed > 7,
+        test_msg("Expected > 7 secs, got $xfer_elapsed"));
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh, $timeout_idle + 3) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  test_cleanup($setup->{log_file}, $ex);
+}
+
+sub transferrate_retr_sendfile_ok {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'config');
+
+  my $test_file = File::Spec->rel2abs("$tmpdir/test.txt");
+  if (open(my $fh, "> $test_file")) {
+    print $fh "ABCDefgh" x 131072;
+
+    unless (close($fh)) {
+      die("Can't write $test_file: $!");
+    }
+
+  } else {
+    die("Can't open $test_file: $!");
+  }
+
+  my $timeout_idle = 20;
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'xfer:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    TimeoutIdle => $timeout_idle,
+
+    # 256 KB/sec
+    TransferRate => 'RETR 256',
+    UseSendfile => 'on',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->type('binary');
+
+      my $conn = $client->retr_raw('test.txt');
+      unless ($conn) {
+        die("RETR failed: " . $client->response_code() . " " .
+          $client->response_msg());
+      }
+
+      my $buf = '';
+      my $tmp;
+
+      my $xfer_start = [gettimeofday()];
+
+      while ($conn->read($tmp, 8192, 30)) {
+        $buf .= $tmp;
+      }
+      $conn->close();
+
+      my $xfer_elapsed = tv_interval($xfer_start);
+
+      my $resp_code = $client->response_code();
+      my $resp_msg = $client->response_msg();
+
+      $client->quit();
+
+      my $expected;
+
+      $expected = 226;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected $expected, got $resp_code"));
+
+      $expected = 1048576;
+      my $buflen = length($buf);
+      $self->assert($expected == $buflen,
+        test_msg("Expected $expected, got $buflen"));
+
+      # We configured a TransferRate of 256 KB/sec, and retrieved 1 MB;
+      # thus make sure that the transfer time is more than 3 secs.
+      $self->assert($xfer_elapsed > 3,
+        test_msg("Expected > 3 secs, got $xfer_elapsed"));
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh, $timeout_idle + 3) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    if (open(my $fh, "< $setup->{log_file}")) {
+      my $chunked = 0;
+
+      while (my $line = <$fh>) {
+        if ($line =~ /<xfer:19>: using sendfile with TransferRate chunk length/) {
+          $chunked = 1;
+          last;
+        }
+      }
+
+      close($fh);
+
+      $self->assert($chunked,
+        test_msg("Did not see expected sendfile chunk TraceLog message"));
+
+    } else {
+      die("Can't read $setup->{log_file}: $!");
+    }
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup->{log_file}, $ex);
+}
+
 1;
@@ -84,6 +84,11 @@ my $TESTS = {
     test_class => [qw(bug forking)],
   },
 
+  deflate_retr_incompressible_adaptive_level => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
 };
 
 sub new {
@@ -2349,4 +2354,206 @@ sub deflate_netio_close_bad_cmd_sequence_bug3828 {
   unlink($log_file);
 }
 
+sub deflate_retr_incompressible_adaptive_level {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/deflate.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/deflate.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/deflate.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/deflate.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/deflate.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  # Random data does not compress; mod_deflate should notice this, and send
+  # it using stored blocks.
+  my $test_file = File::Spec->rel2abs("$tmpdir/test.bin");
+  if (open(my $fh, "> $test_file")) {
+    binmode($fh);
+    print $fh pack('C*', map { int(rand(256)) } 1..262144);
+    unless (close($fh)) {
+      die("Can't write $test_file: $!");
+    }
+
+  } else {
+    die("Can't open $test_file: $!");
+  }
+
+  # Calculate the MD5 checksum of this file, for comparison with the
+  # downloaded file.
+  my $ctx = Digest::MD5->new();
+  my $expected_md5;
+
+  if (open(my $fh, "< $test_file")) {
+    binmode($fh);
+    $ctx->addfile($fh);
+    $expected_md5 = $ctx->hexdigest();
+    close($fh);
+
+  } else {
+    die("Can't read $test_file: $!");
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    TimeoutLinger => 1,
+
+    TraceLog => $log_file,
+    Trace => 'deflate:20',
+
+    IfModules => {
+      'mod_deflate.c' => {
+        DeflateEngine => 'on',
+        DeflateLog => $log_file,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+
+      $client->login($user, $passwd);
+      $client->mode('Z');
+
+      my $conn = $client->retr_raw('test.bin');
+      unless ($conn) {
+        die("RETR test.bin failed: " . $client->response_code() . " " .
+          $client->response_msg());
+      }
+
+      my $buf;
+      my $data;
+      while ($conn->read($data, 32768, 30)) {
+        $buf .= $data;
+      }
+
+      my $inflated = uncompress($buf);
+
+      # Calculate the MD5 checksum of the downloaded data
+      $ctx->reset();
+      my $md5;
+
+      $ctx->add($inflated);
+      $md5 = $ctx->hexdigest();
+
+      $self->assert($expected_md5 eq $md5,
+        test_msg("Expected '$expected_md5', got '$md5'"));
+
+      $conn->close();
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  eval {
+    $self->assert_child_ok($pid);
+  };
+  if ($@) {
+    $ex = $@ unless $ex;
+  }
+
+  eval {
+    if (open(my $fh, "< $log_file")) {
+      my $ok = 0;
+
+      while (my $line = <$fh>) {
+        chomp($line);
+
+        if ($line =~ /changed compression level from 7 to 0 after 0 bytes/) {
+          $ok = 1;
+          last;
+        }
+      }
+
+      close($fh);
+
+      $self->assert($ok,
+        test_msg("Did not see expected compression level change"));
+
+    } else {
+      die("Can't read $log_file: $!");
+    }
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
 1;
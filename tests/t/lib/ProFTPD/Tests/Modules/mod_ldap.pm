@@ -118,6 +118,11 @@ my $TESTS = {
     test_class => [qw(forking)],
   },
 
+  ldap_cache => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
 };
 
 sub new {
@@ -1640,4 +1645,178 @@ sub ldap_default_auth_scheme {
   unlink($log_file);
 }
 
+sub ldap_cache {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/ldap.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/ldap.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/ldap.scoreboard");
+
+  my $log_file = File::Spec->rel2abs('tests.log');
+
+  my $server = $ENV{LDAP_SERVER} ? $ENV{LDAP_SERVER} : 'localhost';
+  my $bind_dn = $ENV{LDAP_BIND_DN};
+  my $bind_pass = $ENV{LDAP_BIND_PASS};
+  my $ldap_base = $ENV{LDAP_USER_BASE};
+  my $user = 'proftpdtest' . int(rand(4294967296));
+  my $passwd = 'foobar';
+  my $uid = 1000;
+  my $gid = 1000;
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+
+  my $ld = Net::LDAP->new([$server]);
+  $self->assert($ld);
+  $self->assert($ld->bind($bind_dn, password => $bind_pass));
+
+  my $entry = Net::LDAP::Entry->new("uid=$user,$ldap_base");
+  $entry->delete();
+  my $msg = $entry->update($ld);
+  if ($msg->is_error()) {
+    $self->annotate($msg->error());
+  }
+  $self->assert(!$msg->is_error() || $msg->code() == LDAP_NO_SUCH_OBJECT);
+
+  $entry = Net::LDAP::Entry->new(
+    "uid=$user,$ldap_base",
+    objectClass => ['posixAccount', 'account'],
+    uid => $user,
+    userPassword => crypt($passwd,
+      join '', ('.', '/', 0 .. 9, 'A' .. 'Z', 'a' .. 'z')[rand 64, rand 64]),
+    uidNumber => $uid,
+    gidNumber => $gid,
+    homeDirectory => $home_dir,
+    cn => 'ProFTPD Test',
+  );
+  $msg = $entry->update($ld);
+  $self->assert(!$msg->is_error());
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'auth:10 ldap:20',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_ldap.c' => {
+        LDAPServer => $server,
+        LDAPBindDN => "$bind_dn $bind_pass",
+        LDAPUsers => "$ldap_base (uid=%u)",
+        LDAPCache => 'on ttl 60 negative-ttl 10',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my ($resp_code, $resp_msg);
+      $resp_code = $client->response_code();
+      $resp_msg = $client->response_msg();
+
+      my $expected;
+
+      $expected = 230;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected $expected, got $resp_code"));
+
+      $expected = "User $user logged in";
+      $self->assert($expected eq $resp_msg,
+        test_msg("Expected '$expected', got '$resp_msg'"));
+
+      # Listing the home directory resolves the owner's UID to a name; that
+      # lookup should be answered from the cache.
+      $client->list();
+      $client->list();
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  # The user was looked up by name at login, which caches the user by UID as
+  # well; the later lookups by UID should have hit the cache.
+  if (open(my $fh, "< $log_file")) {
+    my $cache_hits = 0;
+
+    while (my $line = <$fh>) {
+      chomp($line);
+
+      if ($line =~ /cache hit for 'U:$uid'/) {
+        $cache_hits++;
+      }
+    }
+
+    close($fh);
+
+    $self->assert($cache_hits > 0,
+      test_msg("Expected cache hits for UID $uid, got none"));
+
+  } else {
+    die("Can't read $log_file: $!");
+  }
+
+  unlink($log_file);
+}
+
 1;
@@ -32,6 +32,11 @@ my $TESTS = {
     test_class => [qw(forking)],
   },
 
+  site_misc_rmdir_symlinked_dir => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
   site_misc_symlink_ok => {
     order => ++$order,
     test_class => [qw(forking)],
@@ -519,6 +524,182 @@ sub site_misc_rmdir_ok {
   unlink($log_file);
 }
 
+sub site_misc_rmdir_symlinked_dir {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/site.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/site.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/site.scoreboard");
+
+  my $log_file = File::Spec->rel2abs('tests.log');
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/site.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/site.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/foo/bar/baz");
+  mkpath($sub_dir);
+
+  my $test_dirs = [
+    File::Spec->rel2abs("$tmpdir/foo"),
+    File::Spec->rel2abs("$tmpdir/foo/bar"),
+    $sub_dir,
+  ];
+
+  # A symlink to a directory outside of the tree being removed; the link
+  # itself should be removed, but not the directory it points to.
+  my $other_dir = File::Spec->rel2abs("$tmpdir/other");
+  mkpath($other_dir);
+
+  my $other_file = File::Spec->rel2abs("$tmpdir/other/keep.txt");
+  if (open(my $fh, "> $other_file")) {
+    print $fh "Keep\n";
+
+    unless (close($fh)) {
+      die("Can't write $other_file: $!");
+    }
+
+  } else {
+    die("Can't open $other_file: $!");
+  }
+
+  my $test_symlink = File::Spec->rel2abs("$tmpdir/foo/bar/other");
+  unless (symlink($other_dir, $test_symlink)) {
+    die("Can't symlink $test_symlink to $other_dir: $!");
+  }
+
+  my $test_file = File::Spec->rel2abs("$tmpdir/foo/bar/quxx.txt");
+  if (open(my $fh, "> $test_file")) {
+    print $fh "Quzz\n";
+
+    unless (close($fh)) {
+      die("Can't write $test_file: $!");
+    }
+
+  } else {
+    die("Can't open $test_file: $!");
+  }
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, 'ftpd', $gid, $user);
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my ($resp_code, $resp_msg);
+      ($resp_code, $resp_msg) = $client->site('RMDIR', 'foo');
+
+      my $expected;
+
+      $expected = 200;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected $expected, got $resp_code"));
+
+      $expected = "SITE RMDIR command successful";
+      $self->assert($expected eq $resp_msg,
+        test_msg("Expected '$expected', got '$resp_msg'"));
+
+      # Make sure that the test file is gone, along with all of the
+      # test dirs.
+      if (-f $test_file) {
+        die("File $test_file exists, should be deleted");
+      }
+
+      foreach my $test_dir (@$test_dirs) {
+        if (-d $test_dir) {
+          die("Directory $test_dir exists, should be deleted");
+        }
+      }
+
+      if (-l $test_symlink) {
+        die("Symlink $test_symlink exists, should be deleted");
+      }
+
+      unless (-f $other_file) {
+        die("File $other_file does not exist, should not be deleted");
+      }
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
 sub site_misc_symlink_ok {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
@@ -72,6 +72,11 @@ my $TESTS = {
     test_class => [qw(forking)],
   },
 
+  statcache_ctrls_info_stats_flushed_on_exit => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
 };
 
 sub new {
@@ -82,6 +87,28 @@ sub list_tests {
   return testsuite_get_runnable_tests($TESTS);
 }
 
+sub ftpdctl {
+  my $sock_file = shift;
+  my $ctrl_cmd = shift;
+
+  my $ftpdctl_bin;
+  if ($ENV{PROFTPD_TEST_PATH}) {
+    $ftpdctl_bin = "$ENV{PROFTPD_TEST_PATH}/ftpdctl";
+
+  } else {
+    $ftpdctl_bin = '../ftpdctl';
+  }
+
+  my $cmd = "$ftpdctl_bin -s $sock_file $ctrl_cmd";
+
+  if ($ENV{TEST_VERBOSE}) {
+    print STDERR "Executing ftpdctl: $cmd\n";
+  }
+
+  my @lines = `$cmd`;
+  return \@lines;
+}
+
 sub statcache_file {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
@@ -2567,4 +2594,98 @@ sub statcache_config_capacity {
   unlink($log_file);
 }
 
+sub statcache_ctrls_info_stats_flushed_on_exit {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statcache');
+
+  my $test_file = File::Spec->rel2abs("$setup->{home_dir}/test.txt");
+  if (open(my $fh, "> $test_file")) {
+    print $fh "Hello, World!\n";
+    unless (close($fh)) {
+      die("Can't write $test_file: $!");
+    }
+
+  } else {
+    die("Can't open $test_file: $!");
+  }
+
+  my $statcache_tab = File::Spec->rel2abs("$tmpdir/statcache.tab");
+  my $ctrls_sock = File::Spec->rel2abs("$tmpdir/ctrls.sock");
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statcache:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+
+    IfModules => {
+      'mod_ctrls.c' => {
+        ControlsEngine => 'on',
+        ControlsLog => $setup->{log_file},
+        ControlsSocket => $ctrls_sock,
+        ControlsACLs => "all allow user *",
+        ControlsSocketACL => "allow user *",
+      },
+
+      'mod_statcache.c' => {
+        StatCacheEngine => 'on',
+        StatCacheTable => $statcache_tab,
+        StatCacheControlsACLs => "all allow user *",
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  my $ex;
+
+  # Start server
+  server_start($setup->{config_file});
+  sleep(1);
+
+  eval {
+    my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+    $client->login($setup->{user}, $setup->{passwd});
+
+    # Far fewer lookups than a session batches up before updating the
+    # shared stats; those updates should happen when the session ends.
+    $client->mlst('test.txt');
+    $client->mlst('test.txt');
+    $client->quit();
+
+    # Give the session process time to exit.
+    sleep(1);
+
+    my $lines = ftpdctl($ctrls_sock, 'statcache info');
+
+    my $hits;
+    foreach my $line (@$lines) {
+      if ($line =~ /hits (\d+), misses (\d+)/) {
+        $hits = $1;
+        last;
+      }
+    }
+
+    $self->assert(defined($hits),
+      test_msg("Expected statcache info, got: " . join('', @$lines)));
+    $self->assert($hits > 0, test_msg("Expected hits > 0, got $hits"));
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  server_stop($setup->{pid_file});
+  test_cleanup($setup->{log_file}, $ex);
+}
+
 1;
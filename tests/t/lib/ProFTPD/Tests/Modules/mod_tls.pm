@@ -5,6 +5,7 @@ use base qw(ProFTPD::TestSuite::Child);
 use strict;
 
 use Carp;
+use File::Compare;
 use File::Copy;
 use File::Path qw(mkpath);
 use File::Spec;
@@ -245,6 +246,26 @@ my $TESTS = {
     test_class => [qw(forking)],
   },
 
+  tls_retr_ktls_sendfile => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  tls_list_coalesced_writes => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  tls_retr_ascii_coalesced_writes => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  tls_retr_abor_coalesced_writes => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
   tls_required_on_feat_allowed_bug3420 => {
     order => ++$order,
     test_class => [qw(bug forking)],
@@ -489,6 +510,11 @@ my $TESTS = {
     test_class => [qw(bug forking inprogress)],
   },
 
+  tls_session_tickets_shared_keys => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
   tls_restart_protected_certs_bug4260 => {
     order => ++$order,
     test_class => [qw(bug forking)],
@@ -7239,52 +7265,37 @@ sub tls_retr_empty_file {
   unlink($log_file);
 }
 
-sub tls_required_on_feat_allowed_bug3420 {
+sub tls_retr_ktls_sendfile {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'tls');
 
-  my $config_file = "$tmpdir/tls.conf";
-  my $pid_file = File::Spec->rel2abs("$tmpdir/tls.pid");
-  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/tls.scoreboard");
-
-  my $log_file = test_get_logfile();
-
-  my $auth_user_file = File::Spec->rel2abs("$tmpdir/tls.passwd");
-  my $auth_group_file = File::Spec->rel2abs("$tmpdir/tls.group");
-
-  my $user = 'proftpd';
-  my $passwd = 'test';
-  my $group = 'ftpd';
-  my $home_dir = File::Spec->rel2abs($tmpdir);
-  my $uid = 500;
-  my $gid = 500;
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
 
-  # Make sure that, if we're running as root, that the home directory has
-  # permissions/privs set for the account we create
-  if ($< == 0) {
-    unless (chmod(0755, $home_dir)) {
-      die("Can't set perms on $home_dir to 0755: $!");
+  my $src_file = File::Spec->rel2abs("$tmpdir/src.txt");
+  if (open(my $fh, "> $src_file")) {
+    print $fh "ABCDefgh" x (1024 * 128);
+    unless (close($fh)) {
+      die("Can't write $src_file: $!");
     }
 
-    unless (chown($uid, $gid, $home_dir)) {
-      die("Can't set owner of $home_dir to $uid/$gid: $!");
-    }
+  } else {
+    die("Can't open $src_file: $!");
   }
 
-  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
-    '/bin/bash');
-  auth_group_write($auth_group_file, $group, $gid, $user);
-
-  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
-  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
+  my $dst_file = File::Spec->rel2abs("$tmpdir/dst.txt");
 
   my $config = {
-    PidFile => $pid_file,
-    ScoreboardFile => $scoreboard_file,
-    SystemLog => $log_file,
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'tls:20',
 
-    AuthUserFile => $auth_user_file,
-    AuthGroupFile => $auth_group_file,
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    UseSendfile => 'on',
 
     IfModules => {
       'mod_delay.c' => {
@@ -7293,15 +7304,17 @@ sub tls_required_on_feat_allowed_bug3420 {
 
       'mod_tls.c' => {
         TLSEngine => 'on',
-        TLSLog => $log_file,
+        TLSLog => $setup->{log_file},
         TLSRequired => 'on',
         TLSRSACertificateFile => $cert_file,
         TLSCACertificateFile => $ca_file,
+        TLSOptions => 'NoSessionReuseRequired EnableKTLS',
       },
     },
   };
 
-  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
 
   # Open pipes, for use between the parent and child processes.  Specifically,
   # the child will indicate when it's done with its test by writing a message
@@ -7323,18 +7336,40 @@ sub tls_required_on_feat_allowed_bug3420 {
       # Give the server a chance to start up
       sleep(2);
 
-      # We use a non-FTPS client here, to make sure that we can at least
-      # get the FEAT data, as per Bug#3420.
+      my $client = Net::FTPSSL->new('127.0.0.1',
+        Encryption => 'E',
+        Port => $port,
+      );
 
-      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
-      $client->feat();
+      unless ($client) {
+        die("Can't connect to FTPS server: " . IO::Socket::SSL::errstr());
+      }
 
-      my $resp_msgs = $client->response_msgs();
-      my $count = scalar(@$resp_msgs);
-      $self->assert($count > 0,
-        test_msg("Expected > 0, got $count"));
-    };
+      unless ($client->login($setup->{user}, $setup->{passwd})) {
+        die("Can't login: " . $client->last_message());
+      }
 
+      unless ($client->binary()) {
+        die("Can't set transfer mode to binary: " . $client->last_message());
+      }
+
+      # Whether or not the kernel supports kTLS, the downloaded data must
+      # match, byte for byte.
+      unless ($client->get($src_file, $dst_file)) {
+        die("Can't download '$src_file' to '$dst_file': " .
+          $client->last_message());
+      }
+
+      $client->quit();
+
+      my $expected = -s $src_file;
+      my $size = -s $dst_file;
+      $self->assert($expected == $size,
+        test_msg("Expected size $expected, got $size"));
+
+      $self->assert(compare($src_file, $dst_file) == 0,
+        test_msg("Downloaded file does not match source file"));
+    };
     if ($@) {
       $ex = $@;
     }
@@ -7343,7 +7378,7 @@ sub tls_required_on_feat_allowed_bug3420 {
     $wfh->flush();
 
   } else {
-    eval { server_wait($config_file, $rfh) };
+    eval { server_wait($setup->{config_file}, $rfh) };
     if ($@) {
       warn($@);
       exit 1;
@@ -7353,74 +7388,45 @@ sub tls_required_on_feat_allowed_bug3420 {
   }
 
   # Stop server
-  server_stop($pid_file);
-
+  server_stop($setup->{pid_file});
   $self->assert_child_ok($pid);
 
-  if ($ex) {
-    test_append_logfile($log_file, $ex);
-    unlink($log_file);
-
-    die($ex);
-  }
-
-  unlink($log_file);
+  test_cleanup($setup->{log_file}, $ex);
 }
 
-sub tls_implicit_ssl_bug3437 {
+sub tls_list_coalesced_writes {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'tls');
 
-  my $config_file = "$tmpdir/tls.conf";
-  my $pid_file = File::Spec->rel2abs("$tmpdir/tls.pid");
-  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/tls.scoreboard");
-
-  my $log_file = test_get_logfile();
-
-  my $auth_user_file = File::Spec->rel2abs("$tmpdir/tls.passwd");
-  my $auth_group_file = File::Spec->rel2abs("$tmpdir/tls.group");
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
 
-  my $user = 'proftpd';
-  my $passwd = 'test';
-  my $group = 'ftpd';
-  my $home_dir = File::Spec->rel2abs($tmpdir);
-  my $uid = 500;
-  my $gid = 500;
+  # Many directory entries means many small writes from mod_ls, which
+  # should be coalesced into full TLS records.
+  my $test_dir = File::Spec->rel2abs("$tmpdir/test.d");
+  mkpath($test_dir);
 
-  # Make sure that, if we're running as root, that the home directory has
-  # permissions/privs set for the account we create
-  if ($< == 0) {
-    unless (chmod(0755, $home_dir)) {
-      die("Can't set perms on $home_dir to 0755: $!");
-    }
+  my $file_count = 2000;
+  for (my $i = 0; $i < $file_count; $i++) {
+    my $test_file = File::Spec->rel2abs("$test_dir/test_file_$i.txt");
+    if (open(my $fh, "> $test_file")) {
+      close($fh);
 
-    unless (chown($uid, $gid, $home_dir)) {
-      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    } else {
+      die("Can't open $test_file: $!");
     }
   }
 
-  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
-    '/bin/bash');
-  auth_group_write($auth_group_file, $group, $gid, $user);
-
-  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
-  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
-
   my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'tls:20',
 
-    # The stupid Net::FTPSSL client requires port 990 when implicit
-    # FTPS is used, regardless of the port we pass to the constructor.
-    # (What kind of client API does not allow the port to be changed??)
-    Port => 990,
-
-    PidFile => $pid_file,
-    ScoreboardFile => $scoreboard_file,
-    SystemLog => $log_file,
-    TraceLog => $log_file,
-    Trace => 'DEFAULT:10',
-
-    AuthUserFile => $auth_user_file,
-    AuthGroupFile => $auth_group_file,
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
 
     IfModules => {
       'mod_delay.c' => {
@@ -7429,16 +7435,17 @@ sub tls_implicit_ssl_bug3437 {
 
       'mod_tls.c' => {
         TLSEngine => 'on',
-        TLSLog => $log_file,
-        TLSRequired => 'off',
-        TLSOptions => 'UseImplicitSSL',
+        TLSLog => $setup->{log_file},
+        TLSRequired => 'on',
         TLSRSACertificateFile => $cert_file,
         TLSCACertificateFile => $ca_file,
+        TLSOptions => 'NoSessionReuseRequired',
       },
     },
   };
 
-  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
 
   # Open pipes, for use between the parent and child processes.  Specifically,
   # the child will indicate when it's done with its test by writing a message
@@ -7460,32 +7467,39 @@ sub tls_implicit_ssl_bug3437 {
       # Give the server a chance to start up
       sleep(2);
 
-      my $client_opts = {
-        Encryption => 'I',
+      my $client = Net::FTPSSL->new('127.0.0.1',
+        Encryption => 'E',
         Port => $port,
-      };
-
-      if ($ENV{TEST_VERBOSE}) {
-        $client_opts->{Debug} = 1;
-      }
-
-      my $client = Net::FTPSSL->new('127.0.0.1', %$client_opts);
+      );
 
       unless ($client) {
         die("Can't connect to FTPS server: " . IO::Socket::SSL::errstr());
       }
 
-      unless ($client->login($user, $passwd)) {
+      unless ($client->login($setup->{user}, $setup->{passwd})) {
         die("Can't login: " . $client->last_message());
       }
 
-      unless ($client->ccc('P')) {
-        die("CCC failed: " . $client->last_message());
+      my $res = $client->nlst('test.d');
+      unless ($res) {
+        die("NLST failed: " . $client->last_message());
+      }
+
+      my $count = scalar(@$res);
+      $self->assert($count == $file_count,
+        test_msg("Expected $file_count names, got $count"));
+
+      $res = $client->list('test.d');
+      unless ($res) {
+        die("LIST failed: " . $client->last_message());
       }
 
+      $count = scalar(@$res);
+      $self->assert($count >= $file_count,
+        test_msg("Expected at least $file_count lines, got $count"));
+
       $client->quit();
     };
-
     if ($@) {
       $ex = $@;
     }
@@ -7494,7 +7508,7 @@ sub tls_implicit_ssl_bug3437 {
     $wfh->flush();
 
   } else {
-    eval { server_wait($config_file, $rfh) };
+    eval { server_wait($setup->{config_file}, $rfh) };
     if ($@) {
       warn($@);
       exit 1;
@@ -7504,35 +7518,688 @@ sub tls_implicit_ssl_bug3437 {
   }
 
   # Stop server
-  server_stop($pid_file);
-
+  server_stop($setup->{pid_file});
   $self->assert_child_ok($pid);
 
-  if ($ex) {
-    test_append_logfile($log_file, $ex);
-    unlink($log_file);
+  eval {
+    # Any coalesced data was flushed, and the write statistics were logged,
+    # for each data connection.
+    if (open(my $fh, "< $setup->{log_file}")) {
+      my $nstats = 0;
 
-    die($ex);
+      while (my $line = <$fh>) {
+        chomp($line);
+
+        if ($line =~ /data connection TLS write stats: (\d+) bytes, (\d+) netio writes, (\d+) SSL writes/) {
+          my ($nbytes, $netio_writes, $ssl_writes) = ($1, $2, $3);
+
+          $self->assert($nbytes > 0,
+            test_msg("Expected bytes written, got $nbytes"));
+          $nstats++;
+        }
+      }
+
+      close($fh);
+
+      $self->assert($nstats == 2,
+        test_msg("Expected 2 write stats lines, got $nstats"));
+
+    } else {
+      die("Can't read $setup->{log_file}: $!");
+    }
+  };
+  if ($@) {
+    $ex = $@;
   }
 
-  unlink($log_file);
+  test_cleanup($setup->{log_file}, $ex);
 }
 
-sub tls_ccc_list_bug3465 {
+sub tls_retr_ascii_coalesced_writes {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'tls');
 
-  my $config_file = "$tmpdir/tls.conf";
-  my $pid_file = File::Spec->rel2abs("$tmpdir/tls.pid");
-  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/tls.scoreboard");
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
 
-  my $log_file = test_get_logfile();
+  # ASCII mode translation produces many small writes; lines of varying
+  # length make those writes straddle TLS record boundaries.
+  my $line_count = 50000;
+  my $src_file = File::Spec->rel2abs("$tmpdir/src.txt");
+  if (open(my $fh, "> $src_file")) {
+    for (my $i = 0; $i < $line_count; $i++) {
+      print $fh "line $i " . ("x" x ($i % 73)) . "\n";
+    }
 
-  my $auth_user_file = File::Spec->rel2abs("$tmpdir/tls.passwd");
-  my $auth_group_file = File::Spec->rel2abs("$tmpdir/tls.group");
+    unless (close($fh)) {
+      die("Can't write $src_file: $!");
+    }
 
-  my $user = 'proftpd';
-  my $passwd = 'test';
+  } else {
+    die("Can't open $src_file: $!");
+  }
+
+  my $dst_file = File::Spec->rel2abs("$tmpdir/dst.txt");
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'tls:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_tls.c' => {
+        TLSEngine => 'on',
+        TLSLog => $setup->{log_file},
+        TLSRequired => 'on',
+        TLSRSACertificateFile => $cert_file,
+        TLSCACertificateFile => $ca_file,
+        TLSOptions => 'NoSessionReuseRequired',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  require Net::FTPSSL;
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      # Give the server a chance to start up
+      sleep(2);
+
+      my $client = Net::FTPSSL->new('127.0.0.1',
+        Encryption => 'E',
+        Port => $port,
+      );
+
+      unless ($client) {
+        die("Can't connect to FTPS server: " . IO::Socket::SSL::errstr());
+      }
+
+      unless ($client->login($setup->{user}, $setup->{passwd})) {
+        die("Can't login: " . $client->last_message());
+      }
+
+      unless ($client->ascii()) {
+        die("Can't set transfer mode to ASCII: " . $client->last_message());
+      }
+
+      unless ($client->get($src_file, $dst_file)) {
+        die("Can't download '$src_file' to '$dst_file': " .
+          $client->last_message());
+      }
+
+      $client->quit();
+
+      # Every line, including the last, must have arrived; none may have
+      # been left behind in the coalescing buffer.
+      my $count = 0;
+      if (open(my $fh, "< $dst_file")) {
+        while (my $line = <$fh>) {
+          $count++;
+        }
+
+        close($fh);
+
+      } else {
+        die("Can't read $dst_file: $!");
+      }
+
+      $self->assert($count == $line_count,
+        test_msg("Expected $line_count lines, got $count"));
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  test_cleanup($setup->{log_file}, $ex);
+}
+
+sub tls_retr_abor_coalesced_writes {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'tls');
+
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
+
+  my $src_file = File::Spec->rel2abs("$tmpdir/src.txt");
+  if (open(my $fh, "> $src_file")) {
+    print $fh "ABCDefgh" x (1024 * 1024 * 4);
+    unless (close($fh)) {
+      die("Can't write $src_file: $!");
+    }
+
+  } else {
+    die("Can't open $src_file: $!");
+  }
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'tls:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_tls.c' => {
+        TLSEngine => 'on',
+        TLSLog => $setup->{log_file},
+        TLSRequired => 'on',
+        TLSRSACertificateFile => $cert_file,
+        TLSCACertificateFile => $ca_file,
+        TLSOptions => 'NoSessionReuseRequired',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  require IO::Socket::SSL;
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      # Give the server a chance to start up
+      sleep(2);
+
+      my $ssl_opts = {
+        SSL_verify_mode => IO::Socket::SSL::SSL_VERIFY_NONE(),
+      };
+
+      my $client = IO::Socket::INET->new(
+        PeerHost => '127.0.0.1',
+        PeerPort => $port,
+        Proto => 'tcp',
+        Type => SOCK_STREAM,
+        Timeout => 10
+      );
+      unless ($client) {
+        die("Can't connect to 127.0.0.1:$port: $!");
+      }
+
+      # Read the banner
+      my $resp = <$client>;
+
+      $client->print("AUTH TLS\r\n");
+      $client->flush();
+      $resp = <$client>;
+
+      my $expected = "234 AUTH TLS successful\r\n";
+      unless ($expected eq $resp) {
+        die("Expected response '$expected', got '$resp'");
+      }
+
+      unless (IO::Socket::SSL->start_SSL($client, $ssl_opts)) {
+        die("Failed SSL handshake: " . IO::Socket::SSL::errstr());
+      }
+
+      foreach my $cmd ("USER $setup->{user}", "PASS $setup->{passwd}",
+          "PBSZ 0", "PROT P", "TYPE I") {
+        $client->print("$cmd\r\n");
+        $client->flush();
+
+        $resp = <$client>;
+        unless ($resp =~ /^2|^3/) {
+          die("Unexpected response to '$cmd': $resp");
+        }
+      }
+
+      $client->print("PASV\r\n");
+      $client->flush();
+      $resp = <$client>;
+      unless ($resp =~ /\((\d+),(\d+),(\d+),(\d+),(\d+),(\d+)\)/) {
+        die("Unexpected PASV response: $resp");
+      }
+      my $data_port = ($5 * 256) + $6;
+
+      my $data = IO::Socket::INET->new(
+        PeerHost => '127.0.0.1',
+        PeerPort => $data_port,
+        Proto => 'tcp',
+        Type => SOCK_STREAM,
+        Timeout => 10
+      );
+      unless ($data) {
+        die("Can't connect to 127.0.0.1:$data_port: $!");
+      }
+
+      $client->print("RETR $src_file\r\n");
+      $client->flush();
+      $resp = <$client>;
+      unless ($resp =~ /^150/) {
+        die("Unexpected RETR response: $resp");
+      }
+
+      unless (IO::Socket::SSL->start_SSL($data, $ssl_opts)) {
+        die("Failed data SSL handshake: " . IO::Socket::SSL::errstr());
+      }
+
+      # Read part of the file, then abort the transfer.
+      my $buf;
+      my $nread = $data->sysread($buf, 32768);
+      unless ($nread > 0) {
+        die("Failed to read data: $!");
+      }
+
+      $client->print("ABOR\r\n");
+      $client->flush();
+
+      # We expect both a 426 (for the aborted transfer) and a 226 (for the
+      # ABOR), in either order.
+      my $saw_426 = 0;
+      my $saw_226 = 0;
+      while (!($saw_426 && $saw_226)) {
+        $resp = <$client>;
+        unless (defined($resp)) {
+          last;
+        }
+
+        if ($resp =~ /^426 /) {
+          $saw_426 = 1;
+
+        } elsif ($resp =~ /^226 /) {
+          $saw_226 = 1;
+        }
+      }
+
+      $data->close(SSL_fast_shutdown => 1);
+
+      $self->assert($saw_426, test_msg("Did not see expected 426 response"));
+      $self->assert($saw_226, test_msg("Did not see expected 226 response"));
+
+      # The control connection must still be usable.
+      $client->print("NOOP\r\n");
+      $client->flush();
+      $resp = <$client>;
+
+      $expected = "200 NOOP command successful\r\n";
+      $self->assert($expected eq $resp,
+        test_msg("Expected response '$expected', got '$resp'"));
+
+      $client->print("QUIT\r\n");
+      $client->flush();
+      $client->close();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  test_cleanup($setup->{log_file}, $ex);
+}
+
+sub tls_required_on_feat_allowed_bug3420 {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/tls.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/tls.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/tls.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/tls.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/tls.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_tls.c' => {
+        TLSEngine => 'on',
+        TLSLog => $log_file,
+        TLSRequired => 'on',
+        TLSRSACertificateFile => $cert_file,
+        TLSCACertificateFile => $ca_file,
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  require Net::FTPSSL;
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      # Give the server a chance to start up
+      sleep(2);
+
+      # We use a non-FTPS client here, to make sure that we can at least
+      # get the FEAT data, as per Bug#3420.
+
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->feat();
+
+      my $resp_msgs = $client->response_msgs();
+      my $count = scalar(@$resp_msgs);
+      $self->assert($count > 0,
+        test_msg("Expected > 0, got $count"));
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub tls_implicit_ssl_bug3437 {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/tls.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/tls.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/tls.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/tls.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/tls.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
+
+  my $config = {
+
+    # The stupid Net::FTPSSL client requires port 990 when implicit
+    # FTPS is used, regardless of the port we pass to the constructor.
+    # (What kind of client API does not allow the port to be changed??)
+    Port => 990,
+
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_tls.c' => {
+        TLSEngine => 'on',
+        TLSLog => $log_file,
+        TLSRequired => 'off',
+        TLSOptions => 'UseImplicitSSL',
+        TLSRSACertificateFile => $cert_file,
+        TLSCACertificateFile => $ca_file,
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  require Net::FTPSSL;
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      # Give the server a chance to start up
+      sleep(2);
+
+      my $client_opts = {
+        Encryption => 'I',
+        Port => $port,
+      };
+
+      if ($ENV{TEST_VERBOSE}) {
+        $client_opts->{Debug} = 1;
+      }
+
+      my $client = Net::FTPSSL->new('127.0.0.1', %$client_opts);
+
+      unless ($client) {
+        die("Can't connect to FTPS server: " . IO::Socket::SSL::errstr());
+      }
+
+      unless ($client->login($user, $passwd)) {
+        die("Can't login: " . $client->last_message());
+      }
+
+      unless ($client->ccc('P')) {
+        die("CCC failed: " . $client->last_message());
+      }
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub tls_ccc_list_bug3465 {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/tls.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/tls.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/tls.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/tls.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/tls.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
   my $group = 'ftpd';
   my $home_dir = File::Spec->rel2abs($tmpdir);
   my $uid = 500;
@@ -13657,6 +14324,52 @@ sub starttls_ftp {
   $client->close();
 }
 
+# Like starttls_ftp, but returns whether the TLS session was resumed.
+sub starttls_ftp_session_reused {
+  my $port = shift;
+  my $ssl_opts = shift;
+
+  my $client = IO::Socket::INET->new(
+    PeerHost => '127.0.0.1',
+    PeerPort => $port,
+    Proto => 'tcp',
+    Type => SOCK_STREAM,
+    Timeout => 10
+  );
+  unless ($client) {
+    croak("Can't connect to 127.0.0.1:$port: $!");
+  }
+
+  # Read the banner
+  my $banner = <$client>;
+
+  # Send the AUTH command
+  $client->print("AUTH TLS\r\n");
+  $client->flush();
+
+  # Read the AUTH response
+  my $resp = <$client>;
+
+  my $expected = "234 AUTH TLS successful\r\n";
+  unless ($expected eq $resp) {
+    croak(test_msg("Expected response '$expected', got '$resp'"));
+  }
+
+  my $res = IO::Socket::SSL->start_SSL($client, $ssl_opts);
+  unless ($res) {
+    croak("Failed SSL handshake: " . IO::Socket::SSL::errstr());
+  }
+
+  my $reused = $client->get_session_reused();
+
+  $client->print("QUIT\r\n");
+  $client->flush();
+  $resp = <$client>;
+
+  $client->close();
+  return $reused;
+}
+
 sub tls_stapling_on_bug4175 {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
@@ -13856,6 +14569,106 @@ sub tls_session_tickets_on_bug4176 {
   test_cleanup($setup->{log_file}, $ex);
 }
 
+sub tls_session_tickets_shared_keys {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'tls');
+
+  my $cert_file = File::Spec->rel2abs('t/etc/modules/mod_tls/server-cert.pem');
+  my $ca_file = File::Spec->rel2abs('t/etc/modules/mod_tls/ca-cert.pem');
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'tls:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_tls.c' => {
+        TLSEngine => 'on',
+        TLSLog => $setup->{log_file},
+        TLSRequired => 'on',
+        TLSRSACertificateFile => $cert_file,
+        TLSCACertificateFile => $ca_file,
+        TLSSessionTickets => 'on',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  require IO::Socket::INET;
+  require IO::Socket::SSL;
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      # Give the server a chance to start up
+      sleep(2);
+
+      # The ticket issued by the first session process must be accepted by
+      # a second session process, using the keys shared by the daemon.
+      # TLSv1.2 is used, so that the ticket is part of the handshake.
+      my $ssl_opts = {
+        SSL_verify_mode => IO::Socket::SSL::SSL_VERIFY_NONE(),
+        SSL_version => 'TLSv1_2',
+        SSL_session_cache => IO::Socket::SSL::Session_Cache->new(4),
+        SSL_session_key => "127.0.0.1:$port",
+      };
+
+      my $reused = starttls_ftp_session_reused($port, $ssl_opts);
+      $self->assert(!$reused,
+        test_msg("First session unexpectedly resumed a session"));
+
+      $reused = starttls_ftp_session_reused($port, $ssl_opts);
+      $self->assert($reused,
+        test_msg("Second session did not resume using session ticket"));
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  test_cleanup($setup->{log_file}, $ex);
+}
+
 sub tls_restart_protected_certs_bug4260 {
   my $self = shift;
   my $tmpdir = $self->{tmpdir};
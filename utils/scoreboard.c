@@ -33,6 +33,15 @@ static pr_scoreboard_header_t util_header;
 
 static unsigned char util_scoreboard_read_locked = FALSE;
 
+/* Entries are read from the scoreboard in batches, under a single read lock,
+ * rather than with a lock, read(2) and unlock for each entry; this keeps
+ * e.g. ftptop refreshes cheap, even with many thousands of sessions.
+ */
+#define UTIL_SCOREBOARD_READ_BATCH	256
+
+static pr_scoreboard_entry_t util_scan_entries[UTIL_SCOREBOARD_READ_BATCH];
+static unsigned int util_scan_nentries = 0, util_scan_idx = 0;
+
 /* Internal routines
  */
 
@@ -128,6 +137,7 @@ int util_close_scoreboard(void) {
   (void) close(util_scoreboard_fd);
   util_scoreboard_fd = -1;
 
+  util_scan_nentries = util_scan_idx = 0;
   return 0;
 }
 
@@ -161,6 +171,8 @@ int util_open_scoreboard(int flags) {
     return -1;
   }
 
+  util_scan_nentries = util_scan_idx = 0;
+
   /* Check the header of this scoreboard file. */
   res = read_scoreboard_header(&util_header);
   if (res < 0)
@@ -217,48 +229,66 @@ time_t util_scoreboard_get_daemon_uptime(void) {
 
 pr_scoreboard_entry_t *util_scoreboard_entry_read(void) {
   static pr_scoreboard_entry_t scan_entry;
-  int res = 0;
 
   if (util_scoreboard_fd < 0) {
     errno = EINVAL;
     return NULL;
   }
 
-  /* Make sure the scoreboard file is read-locked. */
-  if (!util_scoreboard_read_locked)
-    rlock_scoreboard();
+  while (TRUE) {
+    int res = 0, xerrno;
+    size_t partial;
 
-  memset(&scan_entry, '\0', sizeof(scan_entry));
+    /* Return the next in-use entry of the current batch, if any. */
+    while (util_scan_idx < util_scan_nentries) {
+      pr_scoreboard_entry_t *score;
 
-  /* NOTE: use readv(2)? */
-  errno = 0;
-  while (scan_entry.sce_pid == 0) {
-    while ((res = read(util_scoreboard_fd, &scan_entry,
-        sizeof(scan_entry))) <= 0) {
+      score = &(util_scan_entries[util_scan_idx++]);
+      if (score->sce_pid) {
+        memcpy(&scan_entry, score, sizeof(scan_entry));
+        return &scan_entry;
+      }
+    }
 
-      if (res < 0 &&
-          errno == EINTR) {
-        continue;
- 
-      } else {
-        unlock_scoreboard();
+    /* Read the next batch of entries. */
+    util_scan_nentries = util_scan_idx = 0;
 
-        if (errno) {
-          fprintf(stdout, "error reading scoreboard entry: %s\n",
-            strerror(errno));
-        }
+    if (!util_scoreboard_read_locked)
+      rlock_scoreboard();
 
-        return NULL;
-      }
+    errno = 0;
+    while ((res = read(util_scoreboard_fd, util_scan_entries,
+        sizeof(util_scan_entries))) < 0) {
+      if (errno != EINTR)
+        break;
     }
+    xerrno = errno;
 
-    if (scan_entry.sce_pid) {
-      unlock_scoreboard();
-      return &scan_entry;
+    /* Leave any trailing partial entry to be read with the next batch. */
+    if (res > 0) {
+      partial = res % sizeof(pr_scoreboard_entry_t);
+      if (partial > 0)
+        (void) lseek(util_scoreboard_fd, -((off_t) partial), SEEK_CUR);
     }
+
+    unlock_scoreboard();
+
+    if (res <= 0) {
+      if (res < 0) {
+        fprintf(stdout, "error reading scoreboard entry: %s\n",
+          strerror(xerrno));
+      }
+
+      errno = xerrno;
+      return NULL;
+    }
+
+    util_scan_nentries = res / sizeof(pr_scoreboard_entry_t);
+    if (util_scan_nentries == 0)
+      return NULL;
   }
 
-  unlock_scoreboard();
+  /* Not reached. */
   return NULL;
 }
 